@@ -0,0 +1,361 @@
+/* bgfree.c - Background free of large objects
+ *
+ * Releasing a value costs time proportional to the number of allocations
+ * it is made of: deleting a sorted set of millions of members walks the
+ * whole skiplist and the dictionary, and blocks every client while doing
+ * it. Yet once the last reference is gone nobody can reach the value
+ * anymore, so the work can be done by another thread.
+ *
+ * Only the callers that ask for it free in the background, like the
+ * lazyfree-lazy-* options and UNLINK or FLUSHALL ASYNC do: decrRefCount()
+ * always releases synchronously, so eviction and expiry keep seeing the
+ * memory they free. bgfreeDecrRefCount() asks objectFreeEffort() how many
+ * allocations the value is made of, and when the effort is greater than
+ * the threshold it hands the object to bgfreeObject() instead of releasing
+ * it. The same works for the tables of a whole database: bgfreeEmptyDict()
+ * moves them to a new dict, leaving the old one empty and ready to be used
+ * again, and queues the new one, so FLUSHDB returns in constant time.
+ *
+ * The memory of the queued jobs is still allocated until the thread gets to
+ * them: freeMemoryIfNeeded() must subtract bgfreePendingBytes() from the
+ * used memory, otherwise it keeps evicting keys until the thread catches
+ * up.
+ *
+ * The queue is a lock free stack: producers push jobs with a compare and
+ * swap, and the free thread takes the whole stack at once with an atomic
+ * exchange, reversing it to release the jobs in the order they arrived.
+ * A mutex and a condition variable are only used when the free thread has
+ * nothing to do and goes to sleep, so queueing a job never takes a lock
+ * while the thread is busy.
+ *
+ * The jobs are released by calling decrRefCount() and dictRelease() from
+ * the free thread, that recognizes itself and never queues the objects
+ * found inside the value, releasing them synchronously. The thread is
+ * started by the first job.
+ *
+ * The counters of the pending and released jobs, and the time the thread
+ * spends releasing them, are exported to INFO with bgfreeCatStats().
+ */
+
+#include "server.h"
+#include "bgfree.h"
+
+#define BGFREE_JOB_OBJECT 0
+#define BGFREE_JOB_DICT 1
+
+// 队列中的一个释放任务
+typedef struct bgfreeJob {
+    int kind;                   /* BGFREE_JOB_OBJECT or BGFREE_JOB_DICT. */
+    void *ptr;
+    size_t bytes;               /* Estimated memory released by the job. */
+    long long ctime;            /* When the job was queued, in usec. */
+    struct bgfreeJob *next;
+} bgfreeJob;
+
+static size_t bgfree_threshold = BGFREE_DEFAULT_THRESHOLD;
+static bgfreeJob *bgfree_head;          /* Lock free stack of the jobs. */
+static int bgfree_sleeping;             /* The free thread waits on 'wakeup'. */
+static pthread_t bgfree_thread;
+static pthread_once_t bgfree_start_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t bgfree_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bgfree_wakeup = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t bgfree_drained = PTHREAD_COND_INITIALIZER;
+static __thread int bgfree_in_thread;   /* Set only in the free thread. */
+
+/* Updated with atomic operations, the time counters are only written by
+ * the free thread. */
+static bgfreeStats bgfree_stats;
+
+/* Objects with a free effort greater than 'effort' are released in the
+ * background, 0 releases everything synchronously. */
+void bgfreeSetThreshold(size_t effort) {
+    bgfree_threshold = effort;
+}
+
+size_t bgfreeGetThreshold(void) {
+    return bgfree_threshold;
+}
+
+/* Return 1 if the caller is the free thread, that releases the objects
+ * found inside a value synchronously. */
+int bgfreeIsFreeThread(void) {
+    return bgfree_in_thread;
+}
+
+static void bgfreeRelease(bgfreeJob *job) {
+    if (job->kind == BGFREE_JOB_OBJECT)
+        decrRefCount(job->ptr);
+    else
+        dictRelease(job->ptr);
+}
+
+static void *bgfreeThreadMain(void *arg) {
+    UNUSED(arg);
+    bgfree_in_thread = 1;
+
+    while(1) {
+        bgfreeJob *jobs, *job, *prev = NULL;
+
+        jobs = __atomic_exchange_n(&bgfree_head,NULL,__ATOMIC_ACQUIRE);
+        if (jobs == NULL) {
+            /* The producers read 'bgfree_sleeping' after pushing, and we
+             * read the stack after setting it, so at least one of the two
+             * sees the other and the wakeup can't be lost. */
+            // 没有任务就睡眠，生产者看到睡眠标志才会加锁唤醒
+            pthread_mutex_lock(&bgfree_lock);
+            __atomic_store_n(&bgfree_sleeping,1,__ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&bgfree_head,__ATOMIC_SEQ_CST) == NULL)
+                pthread_cond_wait(&bgfree_wakeup,&bgfree_lock);
+            __atomic_store_n(&bgfree_sleeping,0,__ATOMIC_SEQ_CST);
+            pthread_mutex_unlock(&bgfree_lock);
+            continue;
+        }
+
+        /* The stack holds the newest job first. */
+        // 反转链表，按入队顺序释放
+        while(jobs) {
+            bgfreeJob *next = jobs->next;
+            jobs->next = prev;
+            prev = jobs;
+            jobs = next;
+        }
+        while((job = prev) != NULL) {
+            long long start = ustime(), elapsed;
+
+            prev = job->next;
+            if (start-job->ctime > bgfree_stats.max_lag_us)
+                __atomic_store_n(&bgfree_stats.max_lag_us,start-job->ctime,
+                                 __ATOMIC_RELAXED);
+            bgfreeRelease(job);
+            elapsed = ustime()-start;
+            __atomic_add_fetch(&bgfree_stats.busy_us,elapsed,__ATOMIC_RELAXED);
+            if (elapsed > bgfree_stats.max_us)
+                __atomic_store_n(&bgfree_stats.max_us,elapsed,__ATOMIC_RELAXED);
+            __atomic_add_fetch(&bgfree_stats.freed_objects,1,__ATOMIC_RELAXED);
+            __atomic_add_fetch(&bgfree_stats.freed_bytes,job->bytes,
+                               __ATOMIC_RELAXED);
+            __atomic_sub_fetch(&bgfree_stats.pending_bytes,job->bytes,
+                               __ATOMIC_RELAXED);
+            if (__atomic_sub_fetch(&bgfree_stats.pending_objects,1,
+                                   __ATOMIC_ACQ_REL) == 0)
+            {
+                pthread_mutex_lock(&bgfree_lock);
+                pthread_cond_broadcast(&bgfree_drained);
+                pthread_mutex_unlock(&bgfree_lock);
+            }
+            zfree(job);
+        }
+    }
+    return NULL;
+}
+
+static void bgfreeStart(void) {
+    if (pthread_create(&bgfree_thread,NULL,bgfreeThreadMain,NULL) != 0) {
+        serverLog(LL_WARNING,"Fatal: Can't initialize the background free thread.");
+        exit(1);
+    }
+}
+
+static void bgfreePush(int kind, void *ptr, size_t bytes) {
+    bgfreeJob *job = zmalloc(sizeof(*job));
+
+    job->kind = kind;
+    job->ptr = ptr;
+    job->bytes = bytes;
+    job->ctime = ustime();
+    pthread_once(&bgfree_start_once,bgfreeStart);
+
+    __atomic_add_fetch(&bgfree_stats.pending_objects,1,__ATOMIC_RELAXED);
+    __atomic_add_fetch(&bgfree_stats.pending_bytes,bytes,__ATOMIC_RELAXED);
+    job->next = __atomic_load_n(&bgfree_head,__ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&bgfree_head,&job->next,job,1,
+                                        __ATOMIC_SEQ_CST,__ATOMIC_RELAXED));
+
+    if (__atomic_load_n(&bgfree_sleeping,__ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&bgfree_lock);
+        pthread_cond_signal(&bgfree_wakeup);
+        pthread_mutex_unlock(&bgfree_lock);
+    }
+}
+
+/* Queue the object 'o', whose last reference the caller is dropping, if
+ * its free effort is greater than the threshold. Returns 1 if the object
+ * was queued, 0 if the caller should release it. The bytes are estimated
+ * from a single element, so that queueing costs about the same for every
+ * size of the value. */
+// 释放代价大的对象交给后台线程，返回 1表示已经入队
+int bgfreeObject(robj *o, size_t effort) {
+    if (bgfree_threshold == 0 || effort <= bgfree_threshold ||
+        bgfree_in_thread) return 0;
+    bgfreePush(BGFREE_JOB_OBJECT,o,objectComputeSize(o,1));
+    return 1;
+}
+
+/* Drop a reference to 'o' like decrRefCount(), releasing the value in the
+ * background if it was the last one and the value is large. Modules may
+ * not expect their free callback to run in another thread. */
+// 减少引用计数，最后一个引用并且释放代价大时交给后台线程释放
+void bgfreeDecrRefCount(robj *o) {
+    if (o->refcount == 1 && o->type != OBJ_STRING &&
+        o->type != OBJ_MODULE && bgfreeObject(o,objectFreeEffort(o))) return;
+    decrRefCount(o);
+}
+
+/* Queue the dict 'd', that nobody can reach anymore, to be released with
+ * dictRelease(). 'bytes' is only used by the counters. */
+void bgfreeDict(dict *d, size_t bytes) {
+    bgfreePush(BGFREE_JOB_DICT,d,bytes);
+}
+
+/* Empty the dict 'd', releasing the entries in the background when they
+ * are more than the threshold, like FLUSHDB ASYNC does. The dict can be
+ * used again as soon as the function returns. Returns 1 if the entries
+ * were queued, 0 if they were released synchronously. */
+// 清空 dict，元素多的时候把两张表转移到新的 dict中交给后台线程释放
+int bgfreeEmptyDict(dict *d) {
+    dict *old;
+    size_t bytes;
+
+    if (bgfree_threshold == 0 || dictSize(d) <= bgfree_threshold ||
+        bgfree_in_thread)
+    {
+        dictEmpty(d,NULL);
+        return 0;
+    }
+    /* Only the tables and the entries are counted, not the values. */
+    bytes = (dictSlots(d)*sizeof(dictEntry*)) + (dictSize(d)*sizeof(dictEntry));
+    old = dictDetachTables(d);
+    bgfreeDict(old,bytes);
+    return 1;
+}
+
+/* Bytes of the queued jobs, still allocated until the thread releases
+ * them. */
+size_t bgfreePendingBytes(void) {
+    return __atomic_load_n(&bgfree_stats.pending_bytes,__ATOMIC_RELAXED);
+}
+
+void bgfreeGetStats(bgfreeStats *stats) {
+    stats->pending_objects = __atomic_load_n(&bgfree_stats.pending_objects,
+                                             __ATOMIC_RELAXED);
+    stats->pending_bytes = __atomic_load_n(&bgfree_stats.pending_bytes,
+                                           __ATOMIC_RELAXED);
+    stats->freed_objects = __atomic_load_n(&bgfree_stats.freed_objects,
+                                           __ATOMIC_RELAXED);
+    stats->freed_bytes = __atomic_load_n(&bgfree_stats.freed_bytes,
+                                         __ATOMIC_RELAXED);
+    stats->busy_us = __atomic_load_n(&bgfree_stats.busy_us,__ATOMIC_RELAXED);
+    stats->max_us = __atomic_load_n(&bgfree_stats.max_us,__ATOMIC_RELAXED);
+    stats->max_lag_us = __atomic_load_n(&bgfree_stats.max_lag_us,
+                                        __ATOMIC_RELAXED);
+}
+
+/* Append the counters to 's' in the INFO format. */
+sds bgfreeCatStats(sds s) {
+    bgfreeStats stats;
+
+    bgfreeGetStats(&stats);
+    return sdscatprintf(s,
+        "bgfree_threshold:%zu\r\n"
+        "bgfree_pending_objects:%llu\r\n"
+        "bgfree_pending_bytes:%llu\r\n"
+        "bgfree_freed_objects:%llu\r\n"
+        "bgfree_freed_bytes:%llu\r\n"
+        "bgfree_busy_ms:%lld\r\n"
+        "bgfree_max_job_ms:%lld\r\n"
+        "bgfree_max_lag_ms:%lld\r\n",
+        bgfree_threshold,
+        stats.pending_objects, stats.pending_bytes,
+        stats.freed_objects, stats.freed_bytes,
+        stats.busy_us/1000, stats.max_us/1000, stats.max_lag_us/1000);
+}
+
+/* Block until every queued job is released. Used at shutdown and by the
+ * tests. */
+void bgfreeDrain(void) {
+    pthread_mutex_lock(&bgfree_lock);
+    while (__atomic_load_n(&bgfree_stats.pending_objects,__ATOMIC_ACQUIRE))
+        pthread_cond_wait(&bgfree_drained,&bgfree_lock);
+    pthread_mutex_unlock(&bgfree_lock);
+}
+
+#ifdef REDIS_TEST
+#include <assert.h>
+
+static robj *bgfreeTestSet(long count) {
+    robj *set = createSetObject();
+    long j;
+
+    for (j = 0; j < count; j++) {
+        sds ele = sdscatprintf(sdsempty(),"member:%ld",j);
+        setTypeAdd(set,ele);
+        sdsfree(ele);
+    }
+    return set;
+}
+
+int bgfreeTest(int argc, char *argv[]) {
+    long count = 1000000, j;
+    long long start, elapsed;
+    bgfreeStats stats;
+    robj *o;
+    dict *d;
+    sds info;
+
+    UNUSED(argc);
+    UNUSED(argv);
+
+    /* Small objects are released synchronously. */
+    o = bgfreeTestSet(10);
+    assert(objectFreeEffort(o) <= bgfreeGetThreshold());
+    bgfreeDecrRefCount(o);
+    bgfreeGetStats(&stats);
+    assert(stats.pending_objects == 0 && stats.freed_objects == 0);
+
+    /* decrRefCount() never frees in the background. */
+    o = bgfreeTestSet(1000);
+    decrRefCount(o);
+    assert(bgfreePendingBytes() == 0);
+    bgfreeGetStats(&stats);
+    assert(stats.pending_objects == 0 && stats.freed_objects == 0);
+
+    /* Large ones are queued, and the caller only pays for the push. */
+    for (j = 0; j < 2; j++) {
+        bgfreeSetThreshold(j ? BGFREE_DEFAULT_THRESHOLD : 0);
+        o = bgfreeTestSet(count);
+        assert(objectFreeEffort(o) == (size_t)count);
+        start = ustime();
+        bgfreeDecrRefCount(o);
+        elapsed = ustime()-start;
+        printf("Release a set of %ld members %s: %lld usec\n",
+            count, j ? "in the background" : "synchronously", elapsed);
+    }
+    bgfreeDrain();
+    bgfreeGetStats(&stats);
+    assert(stats.pending_objects == 0 && stats.pending_bytes == 0);
+    assert(stats.freed_objects == 1 && stats.freed_bytes > 0);
+
+    /* Empty a keyspace: the dict can be used again right away, and the
+     * values inside it are released by the free thread itself. */
+    d = dictCreate(&dbDictType,NULL);
+    for (j = 0; j < count; j++) {
+        sds key = sdscatprintf(sdsempty(),"key:%ld",j);
+        robj *val = j % 1000 ? createStringObjectFromLongLong(j*1000) :
+                               bgfreeTestSet(100);
+        dictAdd(d,key,val);
+    }
+    assert(bgfreeEmptyDict(d) == 1);
+    assert(dictSize(d) == 0 && dictSlots(d) == 0);
+    dictAdd(d,sdsnew("key:after"),createStringObjectFromLongLong(1));
+    assert(dictSize(d) == 1);
+    bgfreeDrain();
+    bgfreeGetStats(&stats);
+    assert(stats.pending_objects == 0 && stats.freed_objects == 2);
+    dictRelease(d);
+
+    info = bgfreeCatStats(sdsempty());
+    printf("%s",info);
+    sdsfree(info);
+    return 0;
+}
+#endif
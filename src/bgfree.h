@@ -0,0 +1,48 @@
+/* bgfree.h - Background free of large objects, see bgfree.c for the
+ * details. */
+
+#ifndef __BGFREE_H
+#define __BGFREE_H
+
+#include <stddef.h>
+#include "sds.h"
+
+struct redisObject;
+struct dict;
+
+/* Objects whose free effort, as returned by objectFreeEffort(), is greater
+ * than this are released by the background thread when the caller asks for
+ * it with bgfreeDecrRefCount(). */
+// 释放代价超过这个值的对象交给后台线程释放
+#define BGFREE_DEFAULT_THRESHOLD 64
+
+/* Counters of the background free thread. 'pending' are the jobs queued
+ * and not released yet, 'freed' the ones released since the start. The
+ * byte counts are the estimates taken when the job was queued. */
+typedef struct bgfreeStats {
+    unsigned long long pending_objects;
+    unsigned long long pending_bytes;
+    unsigned long long freed_objects;
+    unsigned long long freed_bytes;
+    long long busy_us;          /* Time spent releasing jobs. */
+    long long max_us;           /* Slowest job. */
+    long long max_lag_us;       /* Longest time a job waited in the queue. */
+} bgfreeStats;
+
+void bgfreeSetThreshold(size_t effort);
+size_t bgfreeGetThreshold(void);
+int bgfreeIsFreeThread(void);
+int bgfreeObject(struct redisObject *o, size_t effort);
+void bgfreeDecrRefCount(struct redisObject *o);
+size_t bgfreePendingBytes(void);
+void bgfreeDict(struct dict *d, size_t bytes);
+int bgfreeEmptyDict(struct dict *d);
+void bgfreeGetStats(bgfreeStats *stats);
+sds bgfreeCatStats(sds s);
+void bgfreeDrain(void);
+
+#ifdef REDIS_TEST
+int bgfreeTest(int argc, char *argv[]);
+#endif
+
+#endif /* __BGFREE_H */
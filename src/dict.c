@@ -42,9 +42,13 @@
 #include <stdarg.h>
 #include <limits.h>
 #include <sys/time.h>
+#include <pthread.h>
 
 #include "dict.h"
+#include "sds.h"
 #include "zmalloc.h"
+#include "slab.h"
+#include "dsstats.h"
 #ifndef DICT_BENCHMARK_MAIN
 #include "redisassert.h"
 #else
@@ -62,12 +66,40 @@
 static int dict_can_resize = 1;
 static unsigned int dict_force_resize_ratio = 5;
 
+/* Number of buckets moved by every lookup or update while a dict is
+ * rehashing, see dictSetRehashStepBudget(). */
+static int dict_rehash_step_budget = 1;
+
+// rehash的统计信息，所有的 dict共用
+static dictRehashStats dict_rehash_stats;
+
+/* Entries of the dict types with 'slabEntries' set come from the slab
+ * allocator, that avoids fragmenting the memory when they are churned. */
+#define dictAllocEntry(d, size) ((d)->type->slabEntries ? \
+    slabAlloc(size) : zmalloc(size))
+/* Release the key, the value and the entry 'he'. The size of the entry is
+ * taken first, since it depends on the key when the key is embedded. */
+#define dictFreeEntry(d, he) do { \
+    size_t _size = (d)->type->slabEntries ? dictEntryMemUsage((d),(he)) : 0; \
+    dictFreeKey((d),(he)); \
+    dictFreeVal((d),(he)); \
+    if ((d)->type->slabEntries) slabFree((he),_size); \
+    else zfree(he); \
+} while(0)
+
 /* -------------------------- private prototypes ---------------------------- */
 
 static int _dictExpandIfNeeded(dict *ht);
 static unsigned long _dictNextPower(unsigned long size);
 static long _dictKeyIndex(dict *ht, const void *key, uint64_t hash, dictEntry **existing);
 static int _dictInit(dict *ht, dictType *type, void *privDataPtr);
+static unsigned long _dictOpenSize(unsigned long size);
+static long _dictOpenFind(dict *d, dictht *ht, const void *key, uint64_t hash);
+static long _dictOpenFreeSlot(dictht *ht, uint64_t hash);
+static void _dictOpenSet(dictht *ht, long idx, dictEntry *de, uint64_t hash);
+static void _dictOpenClear(dictht *ht, long idx);
+static void _dictReset(dictht *ht);
+static dictht *_dictOpenMakeRoom(dict *d);
 
 /* -------------------------- hash functions -------------------------------- */
 
@@ -95,6 +127,320 @@ uint64_t dictGenCaseHashFunction(const unsigned char *buf, int len) {
     return siphash_nocase(buf,len,dict_hash_function_seed);
 }
 
+/* Fast hash functions, for the tables whose keys are never chosen by the
+ * clients (temporary results, internal indexes, integer keys...): SipHash
+ * is what makes hash flooding impossible, and the keyspace and the values
+ * of the data types must keep using it. A dictType selects one of these by
+ * using dictSdsFastHash() or dictIntegerKeyHash() as its hashFunction, or
+ * by calling dictFastHashFunction() from its own.
+ *
+ * dictFastHashFunction() is keyed with the same seed of SipHash. Its
+ * kernel is chosen at compile time, like the probe kernel in dict.h, and
+ * inlined: the same key hashes differently with every kernel, so it could
+ * not change while dicts using it exist anyway. */
+
+static const uint64_t dict_wyhash_secret[4] = {
+    0xa0761d6478bd642fULL, 0xe7037ed1a0b428dbULL,
+    0x8ebc6af09c88c6e3ULL, 0x589965cc75374cc3ULL
+};
+
+/* The 128 bits product of 'a' and 'b', returned in 'a' (low) and 'b'. */
+static inline void _dictMul128(uint64_t *a, uint64_t *b) {
+#ifdef __SIZEOF_INT128__
+    __uint128_t r = *a;
+    r *= *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+#else
+    uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+    uint64_t rh = ha*hb, rm0 = ha*lb, rm1 = hb*la, rl = la*lb;
+    uint64_t t = rl + (rm0 << 32), c = t < rl, lo = t + (rm1 << 32);
+
+    c += lo < t;
+    *a = lo;
+    *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+static inline uint64_t _dictWyMix(uint64_t a, uint64_t b) {
+    _dictMul128(&a,&b);
+    return a ^ b;
+}
+
+static inline uint64_t _dictRead64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v,p,sizeof(v));
+    return v;
+}
+
+static inline uint64_t _dictRead32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v,p,sizeof(v));
+    return v;
+}
+
+// wyhash，只用到 64位乘法，适合所有的 CPU
+static inline uint64_t _dictHashWy(const unsigned char *p, size_t len, uint64_t seed) {
+    const uint64_t *s = dict_wyhash_secret;
+    uint64_t a, b;
+
+    seed ^= _dictWyMix(seed^s[0],s[1]);
+    if (len <= 16) {
+        if (len >= 4) {
+            a = (_dictRead32(p) << 32) | _dictRead32(p+((len>>3)<<2));
+            b = (_dictRead32(p+len-4) << 32) | _dictRead32(p+len-4-((len>>3)<<2));
+        } else if (len > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len>>1] << 8) | p[len-1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+
+        if (i > 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = _dictWyMix(_dictRead64(p)^s[1],_dictRead64(p+8)^seed);
+                see1 = _dictWyMix(_dictRead64(p+16)^s[2],_dictRead64(p+24)^see1);
+                see2 = _dictWyMix(_dictRead64(p+32)^s[3],_dictRead64(p+40)^see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = _dictWyMix(_dictRead64(p)^s[1],_dictRead64(p+8)^seed);
+            i -= 16;
+            p += 16;
+        }
+        a = _dictRead64(p+i-16);
+        b = _dictRead64(p+i-8);
+    }
+    a ^= s[1];
+    b ^= seed;
+    _dictMul128(&a,&b);
+    return _dictWyMix(a^s[0]^len,b^s[1]);
+}
+
+/* AES-NI only pays off on keys of a few hundred bytes and is slower on the
+ * short ones, so wyhash is the default: the AES kernel is used by x86-64
+ * builds with USE_AESNI_HASH that target AES (-maes, or a -march that
+ * has it). */
+#if defined(USE_AESNI_HASH) && defined(__x86_64__) && defined(__AES__)
+#include <wmmintrin.h>
+#define HAVE_DICT_AESNI 1
+
+/* Every 16 bytes block is mixed into the state with one AES round keyed
+ * by the seed, then two more rounds spread the last block over the whole
+ * state. The length is part of the initial state, so keys that only
+ * differ by trailing zeroes don't collide. */
+// 每 16个字节做一轮 AES加密混合到状态中
+static inline uint64_t _dictHashAesni(const unsigned char *p, size_t len, uint64_t seed) {
+    __m128i key = _mm_set_epi64x((long long)dict_wyhash_secret[0],(long long)seed);
+    __m128i state = _mm_set_epi64x((long long)(seed^len),
+                                   (long long)dict_wyhash_secret[1]);
+    __m128i tail = _mm_setzero_si128();
+
+    while (len > 16) {
+        state = _mm_aesenc_si128(_mm_xor_si128(state,
+                    _mm_loadu_si128((const __m128i*)p)),key);
+        p += 16;
+        len -= 16;
+    }
+    memcpy(&tail,p,len);
+    state = _mm_aesenc_si128(_mm_xor_si128(state,tail),key);
+    state = _mm_aesenc_si128(state,key);
+    state = _mm_aesenc_si128(state,key);
+    return (uint64_t)_mm_cvtsi128_si64(state) ^
+           (uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(state,state));
+}
+
+#define DICT_FAST_HASH_KERNEL "aesni"
+#define _dictFastHash _dictHashAesni
+#else
+#define DICT_FAST_HASH_KERNEL "wyhash"
+#define _dictFastHash _dictHashWy
+#endif
+
+// 返回编译时选择的 fast hash kernel的名字
+const char *dictGetFastHashKernel(void) {
+    return DICT_FAST_HASH_KERNEL;
+}
+
+static inline uint64_t _dictFastHashSeed(void) {
+    return _dictRead64(dict_hash_function_seed) ^
+           _dictRead64(dict_hash_function_seed+8);
+}
+
+uint64_t dictFastHashFunction(const void *key, int len) {
+    return _dictFastHash(key,len,_dictFastHashSeed());
+}
+
+/* Hash an integer keyed with the seed, the way wyhash hashes a single 64
+ * bits word: the integer and the seed are multiplied into 128 bits and the
+ * halves mixed again. Unlike xoring the seed into a fixed mixer, that only
+ * relabels the outputs, the seed changes which integers collide. */
+// 整数 key的哈希，和种子做 128位乘法后再混合一次，种子真正参与了哈希
+uint64_t dictIntHashFunction(uint64_t key) {
+    const uint64_t *s = dict_wyhash_secret;
+    uint64_t a = key ^ s[0], b = _dictFastHashSeed() ^ s[1];
+
+    _dictMul128(&a,&b);
+    return _dictWyMix(a^s[0],b^s[1]);
+}
+
+/* hashFunction methods for a dictType with sds keys, and with integer keys
+ * stored in the key pointer. */
+uint64_t dictSdsFastHash(const void *key) {
+    return dictFastHashFunction(key,sdslen((const sds)key));
+}
+
+uint64_t dictIntegerKeyHash(const void *key) {
+    return dictIntHashFunction((uint64_t)(uintptr_t)key);
+}
+
+/* ------------------------- open addressing engine ------------------------- */
+
+/* The layout of the control bytes is described in dict.h. */
+
+// 返回编译时选择的 probe kernel的名字
+const char *dictGetProbeKernel(void) {
+    return DICT_PROBE_KERNEL;
+}
+
+// 计算能容纳 size个元素的 slot个数，装载因子不超过 7/8
+static unsigned long _dictOpenSize(unsigned long size) {
+    unsigned long realsize = _dictNextPower(size + size/7 + 1);
+
+    if (realsize < DICT_GROUP_SIZE) realsize = DICT_GROUP_SIZE;
+    return realsize;
+}
+
+/* Search 'key' in the table 'ht', returning the index of its slot or -1
+ * if the key is not there. */
+// 从 home group开始逐个 group查找，只有控制字节相同才比较 key
+static long _dictOpenFind(dict *d, dictht *ht, const void *key, uint64_t hash) {
+    unsigned long gmask, g, probes;
+    unsigned char tag = DICT_CTRL_TAG(hash);
+
+    if (ht->size == 0) return -1;
+    gmask = dictOpenGroupMask(ht);
+    g = hash & gmask;
+    for (probes = 0; probes <= gmask; probes++) {
+        const unsigned char *group = dictOpenGroup(ht->ctrl,g);
+        unsigned int match = dictGroupMatch(group,tag);
+
+        while (match) {
+            long idx = g * DICT_GROUP_SIZE + __builtin_ctz(match);
+            dictEntry *he = ht->table[idx];
+
+            if (key==he->key || dictCompareKeys(d, key, he->key))
+                return idx;
+            match &= match - 1;
+        }
+        // 有空的 slot说明后面不会再有这个 key了
+        if (dictGroupHasEmpty(group)) return -1;
+        g = (g + 1) & gmask;
+    }
+    return -1;
+}
+
+/* Return the first EMPTY or DELETED slot in the probe sequence of 'hash',
+ * or -1 if the table is full. */
+static long _dictOpenFreeSlot(dictht *ht, uint64_t hash) {
+    unsigned long gmask, g, probes;
+
+    if (ht->size == 0) return -1;
+    gmask = dictOpenGroupMask(ht);
+    g = hash & gmask;
+    for (probes = 0; probes <= gmask; probes++) {
+        unsigned int free = dictGroupMatchFree(dictOpenGroup(ht->ctrl,g));
+
+        if (free) return g * DICT_GROUP_SIZE + __builtin_ctz(free);
+        g = (g + 1) & gmask;
+    }
+    return -1;
+}
+
+// 把 entry放进 idx对应的 slot，并设置控制字节
+static void _dictOpenSet(dictht *ht, long idx, dictEntry *de, uint64_t hash) {
+    if (ht->ctrl[idx] == DICT_CTRL_DELETED) ht->deleted--;
+    ht->ctrl[idx] = DICT_CTRL_TAG(hash);
+    ht->table[idx] = de;
+    ht->used++;
+}
+
+/* Release the slot 'idx'. If its group still has an EMPTY slot no probe
+ * sequence ever went past it, so the slot can be made EMPTY again, otherwise
+ * a tombstone is left so that lookups keep walking to the next groups. */
+static void _dictOpenClear(dictht *ht, long idx) {
+    const unsigned char *group = ht->ctrl + (idx & ~(long)(DICT_GROUP_SIZE-1));
+
+    if (dictGroupHasEmpty(group)) {
+        ht->ctrl[idx] = DICT_CTRL_EMPTY;
+    } else {
+        ht->ctrl[idx] = DICT_CTRL_DELETED;
+        ht->deleted++;
+    }
+    ht->table[idx] = NULL;
+    ht->used--;
+}
+
+/* Move every entry of 'ht' into a new table of 'size' slots. */
+// 把 ht中的元素重新放进一张更大的表
+static void _dictOpenGrow(dict *d, dictht *ht, unsigned long size) {
+    dictht n;
+    unsigned long idx;
+
+    _dictReset(&n);
+    n.size = _dictOpenSize(size);
+    n.sizemask = n.size-1;
+    n.table = zcalloc(n.size*sizeof(dictEntry*));
+    n.ctrl = zmalloc(n.size);
+    memset(n.ctrl,DICT_CTRL_EMPTY,n.size);
+    for (idx = 0; idx < ht->size; idx++) {
+        dictEntry *de = ht->table[idx];
+        uint64_t h;
+
+        if (de == NULL) continue;
+        h = dictHashKey(d, de->key);
+        _dictOpenSet(&n,_dictOpenFreeSlot(&n,h),de,h);
+    }
+    zfree(ht->table);
+    zfree(ht->ctrl);
+    *ht = n;
+}
+
+/* Return the table a new key goes to, making room in it if needed. While
+ * rehashing new keys go to ht[1], that must also keep room for the entries
+ * of ht[0] still to move. When it is about to run out of it the rehashing
+ * is finished at once, so that the dict can grow again.
+ *
+ * Safe iterators forbid moving entries, and growing ht[1] in place would
+ * make an iterator walking it return some elements twice or miss some. So
+ * while there are safe iterators ht[1], that is sized for twice the keys
+ * the dict had when the rehashing started, is just probed past its load
+ * factor, and _dictRehash() grows it once the iterators are gone. A table
+ * with no free slot left at all can't take the key without breaking the
+ * iterators, and that is asserted. */
+// 保证新 key有地方放：rehash中新表快满时，先完成 rehash再扩容；
+// 有安全迭代器时不能移动 entry，只能继续使用新表中剩下的 slot
+static dictht *_dictOpenMakeRoom(dict *d) {
+    dictht *ht = &d->ht[1];
+
+    if (!dictIsRehashing(d)) return &d->ht[0];
+    if ((ht->used + ht->deleted + d->ht[0].used + 1)*16 < ht->size*15)
+        return ht;
+    if (d->iterators == 0) {
+        while (dictRehash(d,100));
+        _dictExpandIfNeeded(d);
+        return &d->ht[dictIsRehashing(d) ? 1 : 0];
+    }
+    assert(ht->used < ht->size);
+    return ht;
+}
+
 /* ----------------------------- API implementation ------------------------- */
 
 
@@ -106,6 +452,8 @@ static void _dictReset(dictht *ht)
     ht->size = 0;
     ht->sizemask = 0;
     ht->used = 0;
+    ht->ctrl = NULL;
+    ht->deleted = 0;
 }
 
 // 创建一个 dict，然后调用 _dictInit初始化数据
@@ -157,16 +505,21 @@ int dictExpand(dict *d, unsigned long size)
 
     dictht n;
     // 找到 大于等于 size的最小的 2的幂次
-    unsigned long realsize = _dictNextPower(size);
+    unsigned long realsize = dictIsOpen(d) ? _dictOpenSize(size) :
+                                             _dictNextPower(size);
 
-    // 相同进行 rehash无意义
-    if (realsize == d->ht[0].size) return DICT_ERR;
+    // 相同进行 rehash无意义，除非是为了清理开放寻址表中的墓碑
+    if (realsize == d->ht[0].size && d->ht[0].deleted == 0) return DICT_ERR;
 
     // 初始化一些参数设置
+    _dictReset(&n);
     n.size = realsize;
     n.sizemask = realsize-1;
     n.table = zcalloc(realsize*sizeof(dictEntry*));
-    n.used = 0;
+    if (dictIsOpen(d)) {
+        n.ctrl = zmalloc(realsize);
+        memset(n.ctrl,DICT_CTRL_EMPTY,realsize);
+    }
 
     /* Is this the first initialization? If so it's not really a rehashing
      * we just set the first hash table so that it can accept keys. */
@@ -178,6 +531,7 @@ int dictExpand(dict *d, unsigned long size)
     d->ht[1] = n;
     // 准备开始将数据转移
     d->rehashidx = 0;
+    dict_rehash_stats.started++;
     return DICT_OK;
 }
 
@@ -195,11 +549,43 @@ int dictExpand(dict *d, unsigned long size)
  * 为什么扩容之后不直接否复制过来呢？因为数据量很大时，当时就复制
  * 会话费很长时间，所以分开来进行赋值
  */
-int dictRehash(dict *d, int n) {
+static int _dictRehash(dict *d, int n) {
     int empty_visits = n*10; /* Max number of empty buckets to visit. */
-    if (!dictIsRehashing(d)) return 0;
 
-    while(n-- && d->ht[0].used != 0) {
+    // 开放寻址表每一步迁移一个 group，rehashidx依然是 slot的下标
+    while(dictIsOpen(d) && n-- && d->ht[0].used != 0) {
+        unsigned long idx, end = d->rehashidx + DICT_GROUP_SIZE;
+        int moved = 0;
+
+        assert(d->ht[0].size > (unsigned long)d->rehashidx);
+        /* Keys added under safe iterators may have left ht[1] without room
+         * for the rest of ht[0], see _dictOpenMakeRoom(). */
+        // 安全迭代器期间新表可能已经放不下旧表剩下的 entry，先扩大新表
+        if ((d->ht[1].used + d->ht[1].deleted + d->ht[0].used)*16 >=
+            d->ht[1].size*15)
+        {
+            if (d->iterators) return 1;
+            _dictOpenGrow(d,&d->ht[1],(d->ht[1].used + d->ht[0].used)*2);
+        }
+        for (idx = d->rehashidx; idx < end; idx++) {
+            dictEntry *de = d->ht[0].table[idx];
+            uint64_t h;
+
+            if (de == NULL) continue;
+            h = dictHashKey(d, de->key);
+            _dictOpenSet(&d->ht[1],_dictOpenFreeSlot(&d->ht[1],h),de,h);
+            _dictOpenClear(&d->ht[0],idx);
+            moved++;
+        }
+        d->rehashidx = end;
+        if (moved) {
+            dict_rehash_stats.buckets++;
+            dict_rehash_stats.entries += moved;
+        }
+        if (!moved && --empty_visits == 0) break;
+    }
+
+    while(!dictIsOpen(d) && n-- && d->ht[0].used != 0) {
         dictEntry *de, *nextde;
 
         assert(d->ht[0].size > (unsigned long)d->rehashidx);
@@ -225,19 +611,23 @@ int dictRehash(dict *d, int n) {
             d->ht[1].table[h] = de;
             d->ht[0].used--;
             d->ht[1].used++;
+            dict_rehash_stats.entries++;
             de = nextde;
         }
         d->ht[0].table[d->rehashidx] = NULL;
         d->rehashidx++;
+        dict_rehash_stats.buckets++;
     }
 
     // 如果 rehash已完成了，就将 ht[0]指向 rehash过后的 ht[1]
     // 一句话， ht[0]始终作为当前使用的，ht[1]始终作为 rehash备用的
     if (d->ht[0].used == 0) {
         zfree(d->ht[0].table);
+        zfree(d->ht[0].ctrl);
         d->ht[0] = d->ht[1];
         _dictReset(&d->ht[1]);
         d->rehashidx = -1;
+        dict_rehash_stats.completed++;
         return 0;
     }
 
@@ -245,6 +635,17 @@ int dictRehash(dict *d, int n) {
     return 1;
 }
 
+/* dictRehash() proper, timed in the DSSTATS_REHASH_STEP histogram. */
+int dictRehash(dict *d, int n) {
+    int retval;
+
+    if (!dictIsRehashing(d)) return 0;
+    dsstatsTimerStart(start);
+    retval = _dictRehash(d,n);
+    dsstatsTimerEnd(DSSTATS_REHASH_STEP,start);
+    return retval;
+}
+
 // 获取当前时间
 long long timeInMilliseconds(void) {
     struct timeval tv;
@@ -253,19 +654,50 @@ long long timeInMilliseconds(void) {
     return (((long long)tv.tv_sec)*1000)+(tv.tv_usec/1000);
 }
 
+// 获取当前时间，微秒
+static long long timeInMicroseconds(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv,NULL);
+    return (((long long)tv.tv_sec)*1000000)+tv.tv_usec;
+}
+
 /* Rehash for an amount of time between ms milliseconds and ms+1 milliseconds */
 // 将 rehash的子过程控制在给定 ms内
 int dictRehashMilliseconds(dict *d, int ms) {
-    long long start = timeInMilliseconds();
+    long long start = timeInMicroseconds();
     int rehashes = 0;
 
     while(dictRehash(d,100)) {
         rehashes += 100;
-        if (timeInMilliseconds()-start > ms) break;
+        if (timeInMicroseconds()-start > (long long)ms*1000) break;
     }
+    dict_rehash_stats.cron_calls++;
+    dict_rehash_stats.cron_us += timeInMicroseconds()-start;
     return rehashes;
 }
 
+/* Set how many buckets every lookup or update moves while the dict is
+ * rehashing. A bigger budget finishes the rehashing sooner, so both tables
+ * stay allocated for less time, at the cost of a slower single operation.
+ * The budget is clamped to be at least 1. */
+void dictSetRehashStepBudget(int steps) {
+    dict_rehash_step_budget = steps < 1 ? 1 : steps;
+}
+
+int dictGetRehashStepBudget(void) {
+    return dict_rehash_step_budget;
+}
+
+// 获取与重置 rehash的统计信息
+void dictGetRehashStats(dictRehashStats *stats) {
+    *stats = dict_rehash_stats;
+}
+
+void dictResetRehashStats(void) {
+    memset(&dict_rehash_stats,0,sizeof(dict_rehash_stats));
+}
+
 /* This function performs just a step of rehashing, and only if there are
  * no safe iterators bound to our hash table. When we have iterators in the
  * middle of a rehashing we can't mess with the two hash tables otherwise
@@ -278,9 +710,48 @@ int dictRehashMilliseconds(dict *d, int ms) {
  * 因为两种不同的迭代和修改操作可能会弄乱字典。*/
 static void _dictRehashStep(dict *d) {
     // 不安全的迭代器
-    if (d->iterators == 0) dictRehash(d,1);
+    if (d->iterators == 0) {
+        dict_rehash_stats.foreground_steps++;
+        dictRehash(d,dict_rehash_step_budget);
+    }
+}
+
+/* Exported for the typed lookups of dicttyped.h, that do the same rehashing
+ * step of the generic API. */
+void dictRehashStep(dict *d) {
+    _dictRehashStep(d);
+}
+
+
+/* Copy the sds 'key' right after 'entry', saving an allocation and a pointer
+ * chase on every lookup. This takes ownership of 'key' like dictSetKey()
+ * does: unless the type has a keyDup method the key given to the dict is
+ * owned by it, so it is released right away, like dictFreeKey() would do
+ * when the entry is deleted. Callers must not use 'key' afterwards, but
+ * dictGetKey() of the entry. */
+// 把短 key复制到 dictEntry后面，传进来的 key如果归 dict所有就直接释放，之后不能再使用
+static void dictEmbedAndFreeKey(dict *d, dictEntry *entry, void *key,
+                                size_t len) {
+    struct sdshdr8 *sh = (void*)(entry+1);
+
+    sh->len = len;
+    sh->alloc = len;
+    sh->flags = DICT_EMBEDDED_KEY_FLAGS;
+    memcpy(sh->buf,key,len);
+    sh->buf[len] = '\0';
+    entry->key = sh->buf;
+    if (!d->type->keyDup && d->type->keyDestructor)
+        d->type->keyDestructor(d->privdata,key);
 }
 
+/* Return the bytes allocated for the entry 'de' of 'd'. That includes the
+ * key when it is embedded, the keys allocated on their own are not
+ * counted. */
+size_t dictEntryMemUsage(dict *d, const dictEntry *de) {
+    if (dictIsKeyEmbedded(d,de))
+        return sizeof(dictEntry)+sizeof(struct sdshdr8)+sdslen(de->key)+1;
+    return sizeof(dictEntry);
+}
 
 // 添加一个条目 dictEntry
 int dictAdd(dict *d, void *key, void *val)
@@ -309,33 +780,76 @@ int dictAdd(dict *d, void *key, void *val)
  * with the existing entry if existing is not NULL.
  *
  * If key was added, the hash entry is returned to be manipulated by the caller.
+ * When the type has 'embedKeys' set and no keyDup method, a short key is
+ * copied into the entry and released, so the caller must use dictGetKey()
+ * of the entry instead of 'key' from then on.
  */
+/* Link a new entry for 'key' at 'index' of the table new keys go to, as
+ * returned by _dictKeyIndex(). */
+static dictEntry *_dictInsertAt(dict *d, long index, void *key, uint64_t hash) {
+    dictEntry *entry;
+    dictht *ht;
+    size_t keylen = 0;
+    int embed = 0;
+
+    // 如果正在 rehash，那么新创建的元素就直接创建在 ht[1]上
+    ht = dictIsRehashing(d) ? &d->ht[1] : &d->ht[0];
+    if (d->type->embedKeys && (keylen = sdslen(key)) <= DICT_EMBED_KEY_MAX) {
+        embed = 1;
+        entry = dictAllocEntry(d,sizeof(dictEntry)+sizeof(struct sdshdr8)+keylen+1);
+    } else {
+        entry = dictAllocEntry(d,sizeof(dictEntry));
+    }
+    if (dictIsOpen(d)) {
+        // 开放寻址每个 slot只放一个 entry，不使用 next
+        entry->next = NULL;
+        _dictOpenSet(ht,index,entry,hash);
+    } else {
+        // 头插法创建，因为新创建的元素很可能会被再次访问，而且访问频率可能更高
+        entry->next = ht->table[index];
+        ht->table[index] = entry;
+        ht->used++;
+    }
+
+    /* Set the hash entry fields. */
+    if (embed) {
+        dictEmbedAndFreeKey(d, entry, key, keylen);
+    } else {
+        dictSetKey(d, entry, key);
+    }
+    return entry;
+}
+
 // 创建一个包含指定 key的 dictEntry
 dictEntry *dictAddRaw(dict *d, void *key, dictEntry **existing)
 {
     long index;
-    dictEntry *entry;
-    dictht *ht;
+    uint64_t hash;
 
     // rehash的过程充斥在每次对 dict的操作上
     if (dictIsRehashing(d)) _dictRehashStep(d);
 
     // 如果该元素已经存在的话就返回 -1
-    if ((index = _dictKeyIndex(d, key, dictHashKey(d,key), existing)) == -1)
+    hash = dictHashKey(d,key);
+    if ((index = _dictKeyIndex(d, key, hash, existing)) == -1)
         return NULL;
+    return _dictInsertAt(d, index, key, hash);
+}
 
+/* Add 'key', that the caller knows is not in the dict, with the given hash:
+ * nothing is compared, so no dictType callback but keyDup is called. Returns
+ * NULL only if the table can't be expanded, like dictAddRaw(). */
+// 插入一个确定不存在的 key，不需要再查找一次
+dictEntry *dictInsertWithHash(dict *d, void *key, uint64_t hash) {
+    long index;
 
-    // 如果正在 rehash，那么新创建的元素就直接创建在 ht[1]上
-    ht = dictIsRehashing(d) ? &d->ht[1] : &d->ht[0];
-    // 头插法创建，因为新创建的元素很可能会被再次访问，而且访问频率可能更高
-    entry = zmalloc(sizeof(*entry));
-    entry->next = ht->table[index];
-    ht->table[index] = entry;
-    ht->used++;
-
-    /* Set the hash entry fields. */
-    dictSetKey(d, entry, key);
-    return entry;
+    if (_dictExpandIfNeeded(d) == DICT_ERR) return NULL;
+    if (dictIsOpen(d)) {
+        index = _dictOpenFreeSlot(_dictOpenMakeRoom(d), hash);
+    } else {
+        index = hash & d->ht[dictIsRehashing(d) ? 1 : 0].sizemask;
+    }
+    return _dictInsertAt(d, index, key, hash);
 }
 
 /* Add or Overwrite:
@@ -390,6 +904,20 @@ static dictEntry *dictGenericDelete(dict *d, const void *key, int nofree) {
     h = dictHashKey(d, key);
 
     for (table = 0; table <= 1; table++) {
+        if (dictIsOpen(d)) {
+            long slot = _dictOpenFind(d, &d->ht[table], key, h);
+
+            if (slot != -1) {
+                he = d->ht[table].table[slot];
+                _dictOpenClear(&d->ht[table],slot);
+                if (!nofree) {
+                    dictFreeEntry(d, he);
+                }
+                return he;
+            }
+            if (!dictIsRehashing(d)) break;
+            continue;
+        }
         // 计算下标
         idx = h & d->ht[table].sizemask;
         he = d->ht[table].table[idx];
@@ -403,9 +931,7 @@ static dictEntry *dictGenericDelete(dict *d, const void *key, int nofree) {
                 else
                     d->ht[table].table[idx] = he->next;
                 if (!nofree) {
-                    dictFreeKey(d, he);
-                    dictFreeVal(d, he);
-                    zfree(he);
+                    dictFreeEntry(d, he);
                 }
                 d->ht[table].used--;
                 return he;
@@ -418,6 +944,53 @@ static dictEntry *dictGenericDelete(dict *d, const void *key, int nofree) {
     return NULL; /* not found */
 }
 
+/* Unlink the entry 'he', whose key has the given hash, without releasing
+ * it. The entry is found by address, so no dictType callback is called.
+ * Returns 'he', or NULL if it is not in the dict. */
+// 按地址摘下一个已经找到的 dictEntry，不需要再比较 key
+dictEntry *dictUnlinkEntry(dict *d, dictEntry *he, uint64_t hash) {
+    int table;
+
+    for (table = 0; table <= 1; table++) {
+        dictht *ht = &d->ht[table];
+
+        if (ht->size == 0) {
+            if (!dictIsRehashing(d)) break;
+            continue;
+        }
+        if (dictIsOpen(d)) {
+            unsigned long gmask = dictOpenGroupMask(ht), g = hash & gmask;
+            unsigned long probes, slot;
+
+            for (probes = 0; probes <= gmask; probes++) {
+                for (slot = g*DICT_GROUP_SIZE;
+                     slot < (g+1)*DICT_GROUP_SIZE; slot++)
+                {
+                    if (ht->table[slot] == he) {
+                        _dictOpenClear(ht,slot);
+                        return he;
+                    }
+                }
+                if (dictGroupHasEmpty(dictOpenGroup(ht->ctrl,g))) break;
+                g = (g + 1) & gmask;
+            }
+        } else {
+            dictEntry **ref = &ht->table[hash & ht->sizemask];
+
+            while (*ref) {
+                if (*ref == he) {
+                    *ref = he->next;
+                    ht->used--;
+                    return he;
+                }
+                ref = &(*ref)->next;
+            }
+        }
+        if (!dictIsRehashing(d)) break;
+    }
+    return NULL;
+}
+
 /* Remove an element, returning DICT_OK on success or DICT_ERR if the
  * element was not found. */
 int dictDelete(dict *ht, const void *key) {
@@ -454,9 +1027,7 @@ dictEntry *dictUnlink(dict *ht, const void *key) {
 // 将摘下来的 dictEntry释放掉
 void dictFreeUnlinkedEntry(dict *d, dictEntry *he) {
     if (he == NULL) return;
-    dictFreeKey(d, he);
-    dictFreeVal(d, he);
-    zfree(he);
+    dictFreeEntry(d, he);
 }
 
 /* Destroy an entire dictionary */
@@ -474,14 +1045,13 @@ int _dictClear(dict *d, dictht *ht, void(callback)(void *)) {
         // 将 bucket释放掉
         while(he) {
             nextHe = he->next;
-            dictFreeKey(d, he);
-            dictFreeVal(d, he);
-            zfree(he);
+            dictFreeEntry(d, he);
             ht->used--;
             he = nextHe;
         }
     }
     zfree(ht->table);
+    zfree(ht->ctrl);
     _dictReset(ht);
     return DICT_OK;
 }
@@ -495,16 +1065,19 @@ void dictRelease(dict *d)
 }
 
 // 寻找指定的 key，两张表一起找，代码比较容易，不加注释了
-dictEntry *dictFind(dict *d, const void *key)
+/* Lookup 'key' given its hash 'h', without doing any rehashing step. */
+static dictEntry *_dictFindWithHash(dict *d, const void *key, uint64_t h)
 {
     dictEntry *he;
-    uint64_t h, idx, table;
+    uint64_t idx, table;
 
-    if (d->ht[0].used + d->ht[1].used == 0) return NULL; /* dict is empty */
-    // 将 rehash的过程分摊到各个操作上
-    if (dictIsRehashing(d)) _dictRehashStep(d);
-    h = dictHashKey(d, key);
     for (table = 0; table <= 1; table++) {
+        if (dictIsOpen(d)) {
+            long slot = _dictOpenFind(d, &d->ht[table], key, h);
+            if (slot != -1) return d->ht[table].table[slot];
+            if (!dictIsRehashing(d)) return NULL;
+            continue;
+        }
         idx = h & d->ht[table].sizemask;
         he = d->ht[table].table[idx];
         while(he) {
@@ -517,6 +1090,87 @@ dictEntry *dictFind(dict *d, const void *key)
     return NULL;
 }
 
+dictEntry *dictFind(dict *d, const void *key)
+{
+    if (d->ht[0].used + d->ht[1].used == 0) return NULL; /* dict is empty */
+    // 将 rehash的过程分摊到各个操作上
+    if (dictIsRehashing(d)) _dictRehashStep(d);
+    return _dictFindWithHash(d, key, dictHashKey(d, key));
+}
+
+/* Prefetch the bucket (or the control bytes and slots of the home group)
+ * where an element with hash 'h' lives in every table of the dict. */
+static void _dictPrefetchBuckets(dict *d, uint64_t h) {
+    int table;
+
+    for (table = 0; table <= (dictIsRehashing(d) ? 1 : 0); table++) {
+        dictht *ht = &d->ht[table];
+
+        if (ht->size == 0) continue;
+        if (dictIsOpen(d)) {
+            unsigned long g = h & dictOpenGroupMask(ht);
+            __builtin_prefetch(dictOpenGroup(ht->ctrl,g));
+            __builtin_prefetch(&ht->table[g*DICT_GROUP_SIZE]);
+        } else {
+            __builtin_prefetch(&ht->table[h & ht->sizemask]);
+        }
+    }
+}
+
+/* Prefetch the first entry that may hold an element with hash 'h', its
+ * bucket must have been prefetched already. */
+static void _dictPrefetchEntries(dict *d, uint64_t h) {
+    int table;
+
+    for (table = 0; table <= (dictIsRehashing(d) ? 1 : 0); table++) {
+        dictht *ht = &d->ht[table];
+        dictEntry *he = NULL;
+
+        if (ht->size == 0) continue;
+        if (dictIsOpen(d)) {
+            unsigned long g = h & dictOpenGroupMask(ht);
+            unsigned int match = dictGroupMatch(dictOpenGroup(ht->ctrl,g),
+                                                 DICT_CTRL_TAG(h));
+            if (match)
+                he = ht->table[g*DICT_GROUP_SIZE + __builtin_ctz(match)];
+        } else {
+            he = ht->table[h & ht->sizemask];
+        }
+        if (he) __builtin_prefetch(he);
+    }
+}
+
+/* Lookup 'count' keys at once, storing in des[j] the entry of keys[j], or
+ * NULL if the key is not in the dict. This is the same as calling dictFind()
+ * for every key, but the keys are processed DICT_FIND_BATCH at a time in
+ * stages (hash every key and prefetch its bucket, then prefetch the entries,
+ * then compare) so that the cache misses of the different keys overlap
+ * instead of being paid one after the other. */
+void dictFindBatch(dict *d, const void **keys, dictEntry **des,
+                   unsigned long count)
+{
+    uint64_t hashes[DICT_FIND_BATCH];
+    unsigned long j, k, n;
+
+    for (j = 0; j < count; j += n) {
+        n = count-j < DICT_FIND_BATCH ? count-j : DICT_FIND_BATCH;
+        if (dictSize(d) == 0) {
+            for (k = 0; k < n; k++) des[j+k] = NULL;
+            continue;
+        }
+        // 一批只做一次 rehash的步骤
+        if (dictIsRehashing(d)) _dictRehashStep(d);
+        for (k = 0; k < n; k++) {
+            hashes[k] = dictHashKey(d, keys[j+k]);
+            _dictPrefetchBuckets(d, hashes[k]);
+        }
+        for (k = 0; k < n; k++)
+            _dictPrefetchEntries(d, hashes[k]);
+        for (k = 0; k < n; k++)
+            des[j+k] = _dictFindWithHash(d, keys[j+k], hashes[k]);
+    }
+}
+
 // 就是 get方法，先获取 key所在的 dictEntry，然后再获取对应的 value，没有就返回 NULL
 void *dictFetchValue(dict *d, const void *key) {
     dictEntry *he;
@@ -718,7 +1372,18 @@ dictEntry *dictGetRandomKey(dict *d)
  * at producing N elements. */
 // 尝试获取 count个条目，因为字典里可能并没有那么多的条目，或者考虑到效率，获取多少次还是
 // 没有获取到那么多的话我就停止
-unsigned int dictGetSomeKeys(dict *d, dictEntry **des, unsigned int count) {
+/* Walk the buckets starting at '*cursor', an index of the larger table,
+ * storing into 'des' the entries found, until 'count' are collected or
+ * count*10 buckets are visited. With 'jump' set a long enough run of empty
+ * buckets moves the walk to a random position, as dictGetSomeKeys() does,
+ * otherwise the buckets are always visited in order. On return '*cursor' is
+ * the bucket where the next walk should start and '*visited' is increased
+ * by the number of buckets looked at. */
+// dictGetSomeKeys()和 dictSampleRun()共用的遍历过程
+static unsigned int _dictSampleBuckets(dict *d, unsigned long *cursor,
+                                       dictEntry **des, unsigned int count,
+                                       int jump, unsigned long *visited)
+{
     unsigned long j; /* internal hash table id, 0 or 1. */
     unsigned long tables; /* 1 or 2 tables? */
     unsigned long stored = 0, maxsizemask;
@@ -743,9 +1408,10 @@ unsigned int dictGetSomeKeys(dict *d, dictEntry **des, unsigned int count) {
     if (tables > 1 && maxsizemask < d->ht[1].sizemask)
         maxsizemask = d->ht[1].sizemask;
 
-    unsigned long i = random() & maxsizemask;
+    unsigned long i = *cursor & maxsizemask;
     unsigned long emptylen = 0; /* Continuous empty entries so far. */
     while(stored < count && maxsteps--) {
+        if (visited) (*visited)++;
         // 从两个表中均匀的获取
         for (j = 0; j < tables; j++) {
             
@@ -768,7 +1434,7 @@ unsigned int dictGetSomeKeys(dict *d, dictEntry **des, unsigned int count) {
             // 就是说多次都是定位到空的 bucket，这就说明这一段连续的可能都为空，这个时候最好重新进行 hash计算
             if (he == NULL) {
                 emptylen++;
-                if (emptylen >= 5 && emptylen > count) {
+                if (jump && emptylen >= 5 && emptylen > count) {
                     i = random() & maxsizemask;
                     emptylen = 0;
                 }
@@ -782,16 +1448,47 @@ unsigned int dictGetSomeKeys(dict *d, dictEntry **des, unsigned int count) {
                     des++;
                     he = he->next;
                     stored++;
-                    if (stored == count) return stored;
+                    if (stored == count) {
+                        *cursor = (i+1) & maxsizemask;
+                        return stored;
+                    }
                 }
             }
         }
         // 接着下一个 bucket寻找
         i = (i+1) & maxsizemask;
     }
+    *cursor = i;
     return stored;
 }
 
+unsigned int dictGetSomeKeys(dict *d, dictEntry **des, unsigned int count) {
+    unsigned long cursor = random();
+
+    return _dictSampleBuckets(d,&cursor,des,count,1,NULL);
+}
+
+/* Sample up to 'count' entries walking consecutive buckets from '*cursor',
+ * that is updated to the bucket following the last one visited, so that
+ * calling the function again with the same cursor continues the walk and
+ * eventually sweeps the whole table. Unlike dictGetSomeKeys() it never
+ * jumps to a random bucket in the middle of a walk: entries that are
+ * adjacent in the table are often adjacent in memory as well, and memory
+ * is read in order, which is cheaper than the cache misses of random probes
+ * when the caller samples often, like the eviction pool of evictpool.c.
+ * The cursor can be any value, it is reduced modulo the table size, so a
+ * caller wanting a walk from a random position just passes random().
+ *
+ * When 'visited' is not NULL it is increased by the number of buckets
+ * looked at, the cost of the sample. */
+// 从 cursor开始连续地采样，cursor会被更新，下次调用接着往后走
+unsigned int dictSampleRun(dict *d, unsigned long *cursor, dictEntry **des,
+                           unsigned int count, unsigned long *visited)
+{
+    if (dictSize(d) == 0) return 0;
+    return _dictSampleBuckets(d,cursor,des,count,0,visited);
+}
+
 /* Function to reverse bits. Algorithm from:
  * http://graphics.stanford.edu/~seander/bithacks.html#ReverseParallel */
 // 反转给定值的比特位
@@ -888,35 +1585,98 @@ static unsigned long rev(unsigned long v) {
  *    we are sure we don't miss keys moving during rehashing.
  * 3) The reverse cursor is somewhat hard to understand at first, but this
  *    comment is supposed to help.
+ *
+ * OPEN ADDRESSING TABLES
+ *
+ * With the open addressing engine the cursor indexes groups instead of
+ * buckets: the home group of a key is Hash(key) & (GROUPS-1), so everything
+ * said above still applies. Since a key may sit in a group after its home
+ * group, visiting a group means walking its probe sequence up to the first
+ * group with an EMPTY slot and emitting only the keys that live there.
  */
-unsigned long dictScan(dict *d,
-                       unsigned long v,
-                       dictScanFunction *fn,
-                       dictScanBucketFunction* bucketfn,
-                       void *privdata)
+
+/* Emit every element whose home bucket (or home group for open addressing
+ * tables) is 'idx', and whose hash has the lower bits 'shard' & 'smask',
+ * see dictScanShard(). Only tables smaller than the shards need to hash the
+ * keys to check it: in the others 'idx' already implies the shard. */
+static void _dictScanBucket(dict *d, dictht *ht, unsigned long idx,
+                            unsigned long smask, unsigned long shard,
+                            dictScanFunction *fn,
+                            dictScanBucketFunction *bucketfn,
+                            void *privdata)
 {
-    dictht *t0, *t1;
     const dictEntry *de, *next;
-    unsigned long m0, m1;
 
-    if (dictSize(d) == 0) return 0;
+    if (dictIsOpen(d)) {
+        unsigned long gmask = dictOpenGroupMask(ht), g = idx, probes;
+        unsigned long fmask = gmask | smask, filter = idx | shard;
 
-    if (!dictIsRehashing(d)) {
-        t0 = &(d->ht[0]);
-        m0 = t0->sizemask;
+        for (probes = 0; probes <= gmask; probes++) {
+            unsigned long slot = g * DICT_GROUP_SIZE, end;
 
-        /* Emit entries at cursor */
-        if (bucketfn) bucketfn(privdata, &t0->table[v & m0]);
-        de = t0->table[v & m0];
+            for (end = slot + DICT_GROUP_SIZE; slot < end; slot++) {
+                if (ht->table[slot] == NULL) continue;
+                if ((dictHashKey(d, ht->table[slot]->key) & fmask) != filter)
+                    continue;
+                if (bucketfn) bucketfn(privdata, &ht->table[slot]);
+                fn(privdata, ht->table[slot]);
+            }
+            if (dictGroupHasEmpty(dictOpenGroup(ht->ctrl,g))) break;
+            g = (g + 1) & gmask;
+        }
+        return;
+    }
+
+    /* A bucket shared by several shards is passed to 'bucketfn' only by
+     * the lowest of them. */
+    if (smask > ht->sizemask) {
+        if (bucketfn && shard == idx) bucketfn(privdata, &ht->table[idx]);
+        de = ht->table[idx];
         while (de) {
             next = de->next;
-            fn(privdata, de);
+            if ((dictHashKey(d, de->key) & smask) == shard) fn(privdata, de);
             de = next;
         }
+        return;
+    }
+
+    if (bucketfn) bucketfn(privdata, &ht->table[idx]);
+    de = ht->table[idx];
+    while (de) {
+        next = de->next;
+        fn(privdata, de);
+        de = next;
+    }
+}
+
+/* The scan of dictScan() and dictScanShard(): 'v' is the reverse cursor of
+ * the table made of the buckets of the shard, whose index is the cursor
+ * followed by the 'sbits' bits of the shard. */
+static unsigned long _dictScan(dict *d, unsigned long v,
+                               unsigned long shard, int sbits,
+                               dictScanFunction *fn,
+                               dictScanBucketFunction *bucketfn,
+                               void *privdata)
+{
+    dictht *t0, *t1;
+    unsigned long m0, m1, smask = (1UL << sbits) - 1;
+
+    if (dictSize(d) == 0) return 0;
+
+/* The index in a table of mask 'm' of the bucket at cursor 'v'. */
+#define _dictScanIndex(v,m) ((((v) << sbits) | shard) & (m))
+
+    if (!dictIsRehashing(d)) {
+        t0 = &(d->ht[0]);
+        m0 = dictIsOpen(d) ? dictOpenGroupMask(t0) : t0->sizemask;
+
+        /* Emit entries at cursor */
+        _dictScanBucket(d, t0, _dictScanIndex(v,m0), smask, shard,
+                        fn, bucketfn, privdata);
 
         /* Set unmasked bits so incrementing the reversed cursor
          * operates on the masked bits */
-        v |= ~m0;
+        v |= ~(m0 >> sbits);
 
         /* Increment the reverse cursor */
         v = rev(v);
@@ -933,43 +1693,133 @@ unsigned long dictScan(dict *d,
             t1 = &d->ht[0];
         }
 
-        m0 = t0->sizemask;
-        m1 = t1->sizemask;
+        m0 = dictIsOpen(d) ? dictOpenGroupMask(t0) : t0->sizemask;
+        m1 = dictIsOpen(d) ? dictOpenGroupMask(t1) : t1->sizemask;
 
         /* Emit entries at cursor */
-        if (bucketfn) bucketfn(privdata, &t0->table[v & m0]);
-        de = t0->table[v & m0];
-        while (de) {
-            next = de->next;
-            fn(privdata, de);
-            de = next;
-        }
+        _dictScanBucket(d, t0, _dictScanIndex(v,m0), smask, shard,
+                        fn, bucketfn, privdata);
 
         /* Iterate over indices in larger table that are the expansion
          * of the index pointed to by the cursor in the smaller table */
         do {
             /* Emit entries at cursor */
-            if (bucketfn) bucketfn(privdata, &t1->table[v & m1]);
-            de = t1->table[v & m1];
-            while (de) {
-                next = de->next;
-                fn(privdata, de);
-                de = next;
-            }
+            _dictScanBucket(d, t1, _dictScanIndex(v,m1), smask, shard,
+                            fn, bucketfn, privdata);
 
             /* Increment the reverse cursor not covered by the smaller mask.*/
-            v |= ~m1;
+            v |= ~(m1 >> sbits);
             v = rev(v);
             v++;
             v = rev(v);
 
             /* Continue while bits covered by mask difference is non-zero */
-        } while (v & (m0 ^ m1));
+        } while (v & ((m0 ^ m1) >> sbits));
     }
+#undef _dictScanIndex
 
     return v;
 }
 
+unsigned long dictScan(dict *d,
+                       unsigned long v,
+                       dictScanFunction *fn,
+                       dictScanBucketFunction* bucketfn,
+                       void *privdata)
+{
+    return _dictScan(d, v, 0, 0, fn, bucketfn, privdata);
+}
+
+/* Scan one of 'shards' disjoint partitions of the dict, 'shards' being a
+ * power of two up to DICT_SCAN_MAX_SHARDS. The cursor works exactly like
+ * the one of dictScan(), starting and ending at 0, and every shard has its
+ * own: scanning all the shards returns every element, with the guarantees
+ * of dictScan(), and an element is only ever returned by one shard.
+ *
+ * The shard of an element is given by the lower bits of its hash, that
+ * are also the lower bits of its bucket: the cursor of a shard is the same
+ * reverse cursor of dictScan() over the remaining bits of the bucket
+ * index, so it survives resizing and rehashing the same way. In the tables
+ * that have fewer buckets than the shards every bucket holds elements of
+ * several shards, and the keys are hashed to pick those of the shard.
+ *
+ * This allows several clients, or dictScanParallel(), to scan parts of the
+ * same dict at the same time. Returns 0 without scanning anything if the
+ * arguments are not valid. */
+// 按 hash的低位把 dict分成 shards个不相交的部分，每个部分有自己的游标
+unsigned long dictScanShard(dict *d,
+                            unsigned long v,
+                            unsigned long shard,
+                            unsigned long shards,
+                            dictScanFunction *fn,
+                            dictScanBucketFunction *bucketfn,
+                            void *privdata)
+{
+    int sbits = 0;
+
+    if (shards == 0 || shards > DICT_SCAN_MAX_SHARDS ||
+        (shards & (shards-1)) || shard >= shards) return 0;
+    while ((1UL << sbits) < shards) sbits++;
+    return _dictScan(d, v, shard, sbits, fn, bucketfn, privdata);
+}
+
+typedef struct dictScanWorker {
+    dict *d;
+    unsigned long shards;
+    unsigned long *next;        /* Next shard to scan, taken atomically. */
+    dictScanFunction *fn;
+    void *privdata;
+    pthread_t tid;
+} dictScanWorker;
+
+static void *_dictScanWorkerMain(void *arg) {
+    dictScanWorker *w = arg;
+    unsigned long shard;
+
+    while ((shard = __atomic_fetch_add(w->next,1,__ATOMIC_RELAXED)) < w->shards) {
+        unsigned long v = 0;
+        do {
+            v = dictScanShard(w->d,v,shard,w->shards,w->fn,NULL,w->privdata);
+        } while (v);
+    }
+    return NULL;
+}
+
+/* Scan the whole dict with 'threads' threads, that take the 'shards' shards
+ * one after the other. 'fn' is called by the thread j with privdata[j]. The
+ * dict must not be used by anyone else until the function returns, not even
+ * for lookups, that perform rehashing steps: this is meant for dicts nobody
+ * else can see, such as the keyspace of a forked child. Since nothing moves
+ * during the scan, every element is returned exactly once. */
+// 多个线程并行扫描不会被修改的 dict，每个线程依次领取一个 shard扫描完
+int dictScanParallel(dict *d, int threads, unsigned long shards,
+                     dictScanFunction *fn, void **privdata)
+{
+    dictScanWorker *workers;
+    unsigned long next = 0;
+    int j, started;
+
+    if (threads <= 0 || shards == 0 || shards > DICT_SCAN_MAX_SHARDS ||
+        (shards & (shards-1))) return DICT_ERR;
+    workers = zmalloc(sizeof(*workers)*threads);
+    for (j = 0; j < threads; j++) {
+        workers[j].d = d;
+        workers[j].shards = shards;
+        workers[j].next = &next;
+        workers[j].fn = fn;
+        workers[j].privdata = privdata[j];
+    }
+    /* The calling thread is the first worker. */
+    for (started = 1; started < threads; started++) {
+        if (pthread_create(&workers[started].tid,NULL,_dictScanWorkerMain,
+                           &workers[started]) != 0) break;
+    }
+    _dictScanWorkerMain(&workers[0]);
+    for (j = 1; j < started; j++) pthread_join(workers[j].tid,NULL);
+    zfree(workers);
+    return DICT_OK;
+}
+
 /* ------------------------- private functions ------------------------------ */
 
 /* Expand the hash table if needed */
@@ -981,6 +1831,20 @@ static int _dictExpandIfNeeded(dict *d)
     // 空表初始化为 4个大小的 table
     if (d->ht[0].size == 0) return dictExpand(d, DICT_HT_INITIAL_SIZE);
 
+    /* Open addressing tables can't hold more elements than slots, so they
+     * grow (or get rid of tombstones) once 7/8 of the slots are taken, and
+     * even when resizing is disabled once 15/16 of them are. */
+    if (dictIsOpen(d)) {
+        unsigned long taken = d->ht[0].used + d->ht[0].deleted;
+
+        if (taken*8 >= d->ht[0].size*7 &&
+            (dict_can_resize || taken*16 >= d->ht[0].size*15))
+        {
+            return dictExpand(d, d->ht[0].used*2);
+        }
+        return DICT_OK;
+    }
+
     
     // 扩容的条件，就是使用空间超过阈值，或者使用的超过了分配的 bucket大小，进行 2倍扩容
     if (d->ht[0].used >= d->ht[0].size &&
@@ -1023,6 +1887,18 @@ static long _dictKeyIndex(dict *d, const void *key, uint64_t hash, dictEntry **e
     /* Expand the hash table if needed */
     if (_dictExpandIfNeeded(d) == DICT_ERR)
         return -1;
+    if (dictIsOpen(d)) {
+        for (table = 0; table <= 1; table++) {
+            long slot = _dictOpenFind(d, &d->ht[table], key, hash);
+
+            if (slot != -1) {
+                if (existing) *existing = d->ht[table].table[slot];
+                return -1;
+            }
+            if (!dictIsRehashing(d)) break;
+        }
+        return _dictOpenFreeSlot(_dictOpenMakeRoom(d), hash);
+    }
     for (table = 0; table <= 1; table++) {
         // 定位到对应的 bucket中
         idx = hash & d->ht[table].sizemask;
@@ -1050,6 +1926,23 @@ void dictEmpty(dict *d, void(callback)(void*)) {
     d->iterators = 0;
 }
 
+/* Move the tables of 'd' to a new dict with the same type, that is
+ * returned, leaving 'd' empty as after dictEmpty(). This is how the
+ * entries are released in the background without touching them while the
+ * caller keeps using 'd'. */
+// 把两张表转移到一个新的 dict中，原来的 dict变成空的，可以继续使用
+dict *dictDetachTables(dict *d) {
+    dict *old = zmalloc(sizeof(*old));
+
+    *old = *d;
+    old->iterators = 0;
+    _dictReset(&d->ht[0]);
+    _dictReset(&d->ht[1]);
+    d->rehashidx = -1;
+    d->iterators = 0;
+    return old;
+}
+
 // 可以扩容
 void dictEnableResize(void) {
     dict_can_resize = 1;
@@ -1077,6 +1970,24 @@ dictEntry **dictFindEntryRefByPtrAndHash(dict *d, const void *oldptr, uint64_t h
 
     if (d->ht[0].used + d->ht[1].used == 0) return NULL; /* dict is empty */
     for (table = 0; table <= 1; table++) {
+        if (dictIsOpen(d) && d->ht[table].size) {
+            dictht *ht = &d->ht[table];
+            unsigned long gmask = dictOpenGroupMask(ht), g = hash & gmask;
+            unsigned long probes, slot;
+
+            for (probes = 0; probes <= gmask; probes++) {
+                for (slot = g*DICT_GROUP_SIZE;
+                     slot < (g+1)*DICT_GROUP_SIZE; slot++)
+                {
+                    if (ht->table[slot] && ht->table[slot]->key == oldptr)
+                        return &ht->table[slot];
+                }
+                if (dictGroupHasEmpty(dictOpenGroup(ht->ctrl,g))) break;
+                g = (g + 1) & gmask;
+            }
+            if (!dictIsRehashing(d)) return NULL;
+            continue;
+        }
         idx = hash & d->ht[table].sizemask;
         heref = &d->ht[table].table[idx];
         he = *heref;
@@ -1106,6 +2017,20 @@ size_t _dictGetStatsHt(char *buf, size_t bufsize, dictht *ht, int tableid) {
             "No stats available for empty dictionaries\n");
     }
 
+    // 开放寻址表没有链表，只输出装载情况
+    if (ht->ctrl) {
+        l += snprintf(buf+l,bufsize-l,
+            "Hash table %d stats (%s, open addressing):\n"
+            " table size: %ld\n"
+            " number of elements: %ld\n"
+            " tombstones: %ld\n"
+            " load factor: %.02f\n",
+            tableid, (tableid == 0) ? "main hash table" : "rehashing target",
+            ht->size, ht->used, ht->deleted, (float)ht->used/ht->size);
+        if (bufsize) buf[bufsize-1] = '\0';
+        return strlen(buf);
+    }
+
     /* Compute stats. */
     for (i = 0; i < DICT_STATS_VECTLEN; i++) clvector[i] = 0;
     for (i = 0; i < ht->size; i++) {
@@ -1165,7 +2090,14 @@ void dictGetStats(char *buf, size_t bufsize, dict *d) {
     buf += l;
     bufsize -= l;
     if (dictIsRehashing(d) && bufsize > 0) {
-        _dictGetStatsHt(buf,bufsize,&d->ht[1],1);
+        l = _dictGetStatsHt(buf,bufsize,&d->ht[1],1);
+        buf += l;
+        bufsize -= l;
+    }
+    if (dictIsRehashing(d) && bufsize > 0) {
+        snprintf(buf,bufsize,
+            "Rehashing: %ld of %ld buckets done, %ld elements left\n",
+            d->rehashidx, d->ht[0].size, d->ht[0].used);
     }
     /* Make sure there is a NULL term at the end. */
     if (orig_bufsize) orig_buf[orig_bufsize-1] = '\0';
@@ -1176,6 +2108,7 @@ void dictGetStats(char *buf, size_t bufsize, dict *d) {
 #ifdef DICT_BENCHMARK_MAIN
 
 #include "sds.h"
+#include "dicttyped.h"
 
 uint64_t hashCallback(const void *key) {
     return dictGenHashFunction((unsigned char*)key, sdslen((char*)key));
@@ -1206,24 +2139,392 @@ dictType BenchmarkDictType = {
     NULL
 };
 
+dictType BenchmarkEmbedDictType = {
+    hashCallback,
+    NULL,
+    NULL,
+    compareCallback,
+    freeCallback,
+    NULL,
+    DICT_ENGINE_CHAINED,
+    0,
+    1
+};
+
+dictType BenchmarkFastHashDictType = {
+    dictSdsFastHash,
+    NULL,
+    NULL,
+    compareCallback,
+    freeCallback,
+    NULL
+};
+
+dictType BenchmarkOpenDictType = {
+    hashCallback,
+    NULL,
+    NULL,
+    compareCallback,
+    freeCallback,
+    NULL,
+    DICT_ENGINE_OPEN
+};
+
+/* The same table, with the key callbacks inlined. */
+static inline uint64_t benchmarkKeyHash(sds key) {
+    return dictGenHashFunction((unsigned char*)key, sdslen(key));
+}
+
+static inline int benchmarkKeyEqual(sds key1, sds key2) {
+    size_t l1 = sdslen(key1);
+    return l1 == sdslen(key2) && memcmp(key1, key2, l1) == 0;
+}
+
+DICT_DEFINE_TYPED(benchmarkDict, sds, void*, val, benchmarkKeyHash, benchmarkKeyEqual)
+
+/* A set of integers stored in the key pointers. */
+static inline uint64_t benchmarkIntHash(int64_t v) {
+    return dictIntHashFunction((uint64_t)v);
+}
+
+static inline int benchmarkIntEqual(int64_t a, int64_t b) {
+    return a == b;
+}
+
+DICT_DEFINE_TYPED(benchmarkIntSet, int64_t, void*, val, benchmarkIntHash, benchmarkIntEqual)
+
+dictType BenchmarkIntSetType = {
+    dictIntegerKeyHash,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL
+};
+
+void scanCallback(void *privdata, const dictEntry *de) {
+    long *seen = privdata;
+    seen[(long)dictGetVal(de)]++;
+}
+
+void countCallback(void *privdata, const dictEntry *de) {
+    long *count = privdata;
+    DICT_NOTUSED(de);
+    (*count)++;
+}
+
+/* Scan 'dict' one shard after the other, returning in 'seen' how many
+ * times every element was returned. If 'resize' is set the table is grown
+ * in the middle of the scan, and the rehashing is left half done. */
+void scanShards(dict *dict, unsigned long shards, long *seen, int resize) {
+    unsigned long shard, cursor, steps = 0;
+
+    for (shard = 0; shard < shards; shard++) {
+        cursor = 0;
+        do {
+            cursor = dictScanShard(dict,cursor,shard,shards,scanCallback,
+                                   NULL,seen);
+            if (resize && ++steps == 500) {
+                dictExpand(dict,dictSize(dict)*4);
+                dictRehash(dict,dictSlots(dict)/8);
+            }
+        } while(cursor);
+    }
+    while (dictIsRehashing(dict)) dictRehash(dict,100);
+}
+
+/* Insert keys in a loop while the dict is rehashing, either with a safe
+ * iterator stopping the rehashing or with dictInsertWithHash(), that does
+ * no rehashing step: no key must ever be refused. Under a safe iterator an
+ * open addressing dict can only use the free slots of the new table, and
+ * the iterator must still return every key it started with exactly once. */
+void testInsertWhileRehashing(dictType *type, long count) {
+    int mode;
+
+    /* Mode 0 uses the generic API under a safe iterator, mode 1 the raw
+     * insert, mode 2 the typed AddRaw of dicttyped.h under a safe iterator,
+     * the way zsetConvert() fills the dict of a sorted set. */
+    // 三种插入方式都不能在 rehash 途中失败
+    for (mode = 0; mode < 3; mode++) {
+        dict *d;
+        dictIterator *iter = NULL;
+        dictEntry *de;
+        char seen[1000];
+        long j, end = count;
+
+        /* The typed functions hash like BenchmarkDictType. */
+        if (mode == 2 && type->hashFunction != hashCallback) break;
+        d = dictCreate(type,NULL);
+
+        for (j = 0; j < 1000; j++)
+            assert(dictAdd(d,sdsfromlonglong(j),(void*)j) == DICT_OK);
+        while (dictIsRehashing(d)) dictRehash(d,100);
+        assert(dictExpand(d,4000) == DICT_OK && dictIsRehashing(d));
+        memset(seen,0,sizeof(seen));
+        if (mode != 1) {
+            iter = dictGetSafeIterator(d);
+            assert((de = dictNext(iter)) != NULL);
+            seen[(long)dictGetVal(de)]++;
+            if (dictIsOpen(d)) end = 8000;
+        }
+        for (j = 1000; j < end; j++) {
+            sds key = sdsfromlonglong(j);
+
+            if (mode == 1) {
+                assert(dictInsertWithHash(d,key,dictHashKey(d,key)) != NULL);
+            } else if (mode == 2) {
+                dictEntry *de = benchmarkDictAddRaw(d,key,NULL);
+                assert(de != NULL);
+                benchmarkDictSetVal(de,(void*)j);
+            } else if (j % 3 == 0) {
+                assert(dictAdd(d,key,(void*)j) == DICT_OK);
+            } else if (j % 3 == 1) {
+                assert(dictReplace(d,key,(void*)j) == 1);
+            } else {
+                dictEntry *de = dictAddOrFind(d,key);
+                assert(de != NULL);
+                dictSetVal(d,de,(void*)j);
+            }
+        }
+        if (iter) {
+            while ((de = dictNext(iter)) != NULL)
+                if ((long)dictGetVal(de) < 1000) seen[(long)dictGetVal(de)]++;
+            dictReleaseIterator(iter);
+            for (j = 0; j < 1000; j++) assert(seen[j] == 1);
+        }
+        assert((long)dictSize(d) == end);
+        for (j = 0; j < end; j++) {
+            sds key = sdsfromlonglong(j);
+            dictEntry *de = dictFind(d,key);
+
+            assert(de != NULL);
+            if (mode != 1) assert(dictGetVal(de) == (void*)j);
+            sdsfree(key);
+        }
+        dictRelease(d);
+    }
+}
+
 #define start_benchmark() start = timeInMilliseconds()
 #define end_benchmark(msg) do { \
     elapsed = timeInMilliseconds()-start; \
     printf(msg ": %ld items in %lld ms\n", count, elapsed); \
 } while(0);
 
-/* dict-benchmark [count] */
+/* Run the generic probe kernel and the one compiled in, over a random
+ * array of control bytes, then do lookups against 'dict' if it is an open
+ * addressing one. */
+void benchmarkProbeKernels(dict *dict, long count) {
+    long j, k, groups = 4096;
+    long long start, elapsed;
+    unsigned char *ctrl = zmalloc(groups*DICT_GROUP_SIZE);
+    unsigned long matches;
+
+    for (j = 0; j < groups*DICT_GROUP_SIZE; j++) ctrl[j] = rand() & 0xff;
+    for (k = 0; k < 2; k++) {
+        matches = 0;
+        start = timeInMilliseconds();
+        for (j = 0; j < count*16; j++) {
+            const unsigned char *group = ctrl+(j%groups)*DICT_GROUP_SIZE;
+
+            if (k == 0) {
+                matches += __builtin_popcount(dictGroupMatchGeneric(group,j&0x7f));
+                matches += __builtin_popcount(dictGroupMatchFreeGeneric(group));
+            } else {
+                matches += __builtin_popcount(dictGroupMatch(group,j&0x7f));
+                matches += __builtin_popcount(dictGroupMatchFree(group));
+            }
+        }
+        elapsed = timeInMilliseconds()-start;
+        printf("Probe kernel %s: %ld groups in %lld ms (%lu matches)\n",
+            k == 0 ? "generic" : DICT_PROBE_KERNEL, count*16, elapsed, matches);
+    }
+    for (j = 0; j < groups; j++) {
+        const unsigned char *group = ctrl+j*DICT_GROUP_SIZE;
+
+        assert(dictGroupMatch(group,j&0x7f) == dictGroupMatchGeneric(group,j&0x7f));
+        assert(dictGroupMatchFree(group) == dictGroupMatchFreeGeneric(group));
+    }
+
+    if (dictIsOpen(dict)) {
+        start = timeInMilliseconds();
+        for (j = 0; j < count; j++) {
+            sds key = sdsfromlonglong(rand() % count);
+            dictEntry *de = dictFind(dict,key);
+            assert(de != NULL);
+            key[0] = 'X';
+            de = dictFind(dict,key);
+            assert(de == NULL);
+            sdsfree(key);
+        }
+        elapsed = timeInMilliseconds()-start;
+        printf("Lookups with kernel %s: %ld items in %lld ms\n",
+            DICT_PROBE_KERNEL, count, elapsed);
+    }
+    zfree(ctrl);
+}
+
+/* Fill a set of integers with the generic and the typed API, checking that
+ * they agree, then compare their lookups. */
+void benchmarkTypedIntSet(int engine, long count) {
+    dictType type = BenchmarkIntSetType;
+    dict *generic, *typed;
+    long long start, elapsed;
+    long j, found;
+
+    type.engine = engine;
+    generic = dictCreate(&type,NULL);
+    typed = dictCreate(&type,NULL);
+    for (j = 0; j < count; j++) {
+        int64_t v = (int64_t)j*7919;
+        assert(dictAdd(generic,(void*)(uintptr_t)v,NULL) == DICT_OK);
+        assert(benchmarkIntSetAdd(typed,v,NULL) == DICT_OK);
+        assert(benchmarkIntSetAdd(typed,v,NULL) == DICT_ERR);
+    }
+    assert(dictSize(generic) == dictSize(typed));
+
+    start_benchmark();
+    for (j = 0, found = 0; j < count; j++)
+        found += dictFind(generic,(void*)(uintptr_t)((rand()%(count*2))*7919)) != NULL;
+    end_benchmark("Int set random access (generic)");
+    start_benchmark();
+    for (j = 0, found = 0; j < count; j++)
+        found += benchmarkIntSetFind(typed,(rand()%(count*2))*7919) != NULL;
+    end_benchmark("Int set random access (typed)");
+
+    /* Remove half of the elements from both, interleaving with lookups. */
+    for (j = 0; j < count; j += 2) {
+        int64_t v = (int64_t)j*7919;
+        assert(dictDelete(generic,(void*)(uintptr_t)v) == DICT_OK);
+        assert(benchmarkIntSetDelete(typed,v) == DICT_OK);
+        assert(benchmarkIntSetDelete(typed,v) == DICT_ERR);
+    }
+    for (j = 0; j < count; j++) {
+        int64_t v = (int64_t)j*7919;
+        assert((dictFind(generic,(void*)(uintptr_t)v) != NULL) ==
+               (benchmarkIntSetFind(typed,v) != NULL));
+        assert((benchmarkIntSetFind(typed,v) != NULL) == (j & 1));
+    }
+    dictRelease(generic);
+    dictRelease(typed);
+}
+
+/* The fast hash kernels compiled in, the one used by dictFastHashFunction()
+ * being the last one. */
+typedef struct benchmarkHashKernel {
+    const char *name;
+    uint64_t (*hash)(const unsigned char *p, size_t len, uint64_t seed);
+} benchmarkHashKernel;
+
+static benchmarkHashKernel benchmarkHashKernels[] = {
+    {"wyhash",_dictHashWy},
+#ifdef HAVE_DICT_AESNI
+    {"aesni",_dictHashAesni},
+#endif
+    {NULL,NULL}
+};
+
+/* Hash with the fast hash kernel 'k', or with SipHash if it is NULL. */
+static uint64_t benchmarkHash(benchmarkHashKernel *k, const void *key, size_t len) {
+    if (k == NULL) return dictGenHashFunction(key,len);
+    return k->hash(key,len,_dictFastHashSeed());
+}
+
+/* Time SipHash against the fast hash kernels compiled in for
+ * a few key lengths, then check how evenly every function spreads keys that
+ * only differ by a counter over the buckets of a table, and how many output
+ * bits change on average when a single input bit is flipped. */
+void benchmarkHashFunctions(long count) {
+    size_t lens[] = {4, 8, 16, 32, 64, 256}, l;
+    unsigned char buf[256+64];
+    unsigned long buckets = 1 << 16, *load = zmalloc(sizeof(*load)*buckets);
+    long long start, elapsed;
+    uint64_t acc = 0;
+    benchmarkHashKernel *k;
+    long j, ki;
+
+    assert(!strcmp(dictGetFastHashKernel(),DICT_FAST_HASH_KERNEL));
+    assert(dictFastHashFunction("key",3) ==
+           _dictFastHash((const unsigned char*)"key",3,_dictFastHashSeed()));
+
+    for (j = 0; j < (long)sizeof(buf); j++) buf[j] = rand() & 0xff;
+    for (l = 0; l < sizeof(lens)/sizeof(lens[0]); l++) {
+        start = timeInMilliseconds();
+        for (j = 0; j < count; j++)
+            acc ^= dictGenHashFunction(buf+(j&63),lens[l]);
+        elapsed = timeInMilliseconds()-start;
+        printf("Hash %zu bytes with siphash: %ld keys in %lld ms\n",
+            lens[l], count, elapsed);
+        for (k = benchmarkHashKernels; k->name; k++) {
+            start = timeInMilliseconds();
+            for (j = 0; j < count; j++)
+                acc ^= k->hash(buf+(j&63),lens[l],_dictFastHashSeed());
+            elapsed = timeInMilliseconds()-start;
+            printf("Hash %zu bytes with %s: %ld keys in %lld ms\n",
+                lens[l], k->name, count, elapsed);
+        }
+    }
+    start = timeInMilliseconds();
+    for (j = 0; j < count; j++) acc ^= dictIntHashFunction(j);
+    elapsed = timeInMilliseconds()-start;
+    printf("Hash integers keyed: %ld keys in %lld ms (%llx)\n",
+        count, elapsed, (unsigned long long)acc);
+
+    for (ki = -1; ki < 0 || benchmarkHashKernels[ki].name; ki++) {
+        unsigned long max = 0, flips = 0, trials = 0;
+        int bit;
+
+        k = ki < 0 ? NULL : &benchmarkHashKernels[ki];
+        memset(load,0,sizeof(*load)*buckets);
+        for (j = 0; j < (long)buckets*8; j++) {
+            char key[32];
+            int len = snprintf(key,sizeof(key),"key:%ld",j);
+            uint64_t h = benchmarkHash(k,key,len);
+            if (++load[h & (buckets-1)] > max) max = load[h & (buckets-1)];
+        }
+        for (l = 0; l < sizeof(lens)/sizeof(lens[0]); l++) {
+            unsigned char key[256];
+
+            memcpy(key,buf,lens[l]);
+            for (bit = 0; bit < (int)lens[l]*8; bit++) {
+                uint64_t h1 = benchmarkHash(k,key,lens[l]), h2;
+
+                key[bit/8] ^= 1 << (bit%8);
+                h2 = benchmarkHash(k,key,lens[l]);
+                key[bit/8] ^= 1 << (bit%8);
+                flips += __builtin_popcountll(h1^h2);
+                trials++;
+            }
+        }
+        printf("Quality of %s: max bucket load %lu (average 8), "
+               "%.2f output bits flipped per input bit\n",
+            k ? k->name : "siphash", max, (double)flips/trials);
+        assert(max < 32);
+        assert((double)flips/trials > 30 && (double)flips/trials < 34);
+    }
+    zfree(load);
+}
+
+/* dict-benchmark [count] [chained|open|embed|fasthash] */
 int main(int argc, char **argv) {
     long j;
     long long start, elapsed;
-    dict *dict = dictCreate(&BenchmarkDictType,NULL);
+    dict *dict;
     long count = 0;
 
-    if (argc == 2) {
+    if (argc >= 2) {
         count = strtol(argv[1],NULL,10);
     } else {
         count = 5000000;
     }
+    if (argc >= 3 && !strcmp(argv[2],"open"))
+        dict = dictCreate(&BenchmarkOpenDictType,NULL);
+    else if (argc >= 3 && !strcmp(argv[2],"embed"))
+        dict = dictCreate(&BenchmarkEmbedDictType,NULL);
+    else if (argc >= 3 && !strcmp(argv[2],"fasthash"))
+        dict = dictCreate(&BenchmarkFastHashDictType,NULL);
+    else
+        dict = dictCreate(&BenchmarkDictType,NULL);
 
     start_benchmark();
     for (j = 0; j < count; j++) {
@@ -1232,11 +2533,21 @@ int main(int argc, char **argv) {
     }
     end_benchmark("Inserting");
     assert((long)dictSize(dict) == count);
+    printf("Memory used: %.1f bytes per item\n",
+        (double)zmalloc_used_memory()/count);
 
     /* Wait for rehashing. */
     while (dictIsRehashing(dict)) {
         dictRehashMilliseconds(dict,100);
     }
+    {
+        dictRehashStats rs;
+        dictGetRehashStats(&rs);
+        printf("Rehashing: %llu started, %llu completed, %llu buckets and "
+               "%llu entries moved, %llu foreground steps\n",
+               rs.started, rs.completed, rs.buckets, rs.entries,
+               rs.foreground_steps);
+    }
 
     start_benchmark();
     for (j = 0; j < count; j++) {
@@ -1265,6 +2576,21 @@ int main(int argc, char **argv) {
     }
     end_benchmark("Random access of existing elements");
 
+    start_benchmark();
+    for (j = 0; j < count; j += DICT_FIND_BATCH) {
+        sds keys[DICT_FIND_BATCH];
+        dictEntry *des[DICT_FIND_BATCH];
+        long k, n = count-j < DICT_FIND_BATCH ? count-j : DICT_FIND_BATCH;
+
+        for (k = 0; k < n; k++) keys[k] = sdsfromlonglong(rand() % count);
+        dictFindBatch(dict,(const void**)keys,des,n);
+        for (k = 0; k < n; k++) {
+            assert(des[k] != NULL);
+            sdsfree(keys[k]);
+        }
+    }
+    end_benchmark("Batched random access of existing elements");
+
     start_benchmark();
     for (j = 0; j < count; j++) {
         sds key = sdsfromlonglong(rand() % count);
@@ -1275,6 +2601,100 @@ int main(int argc, char **argv) {
     }
     end_benchmark("Accessing missing");
 
+    /* The typed lookups hash like BenchmarkDictType. */
+    if (dict->type->hashFunction == hashCallback) {
+        start_benchmark();
+        for (j = 0; j < count; j++) {
+            sds key = sdsfromlonglong(rand() % count);
+            dictEntry *de = benchmarkDictFind(dict,key);
+            assert(de != NULL);
+            sdsfree(key);
+        }
+        end_benchmark("Random access of existing elements (typed)");
+
+        for (j = 0; j < count; j += 7) {
+            sds key = sdsfromlonglong(j);
+            assert(benchmarkDictGetVal(benchmarkDictFind(dict,key)) == (void*)j);
+            key[0] = 'X';
+            assert(benchmarkDictFind(dict,key) == NULL);
+            sdsfree(key);
+        }
+    }
+
+    start_benchmark();
+    testInsertWhileRehashing(dict->type,count < 100000 ? 100000 : count);
+    end_benchmark("Inserting while rehashing");
+
+    benchmarkTypedIntSet(dict->type->engine,count);
+    benchmarkHashFunctions(count);
+    benchmarkProbeKernels(dict,count);
+
+    /* Every element must be returned at least once by a full scan, even
+     * if the table is resized in the middle of it. */
+    start_benchmark();
+    {
+        long *seen = zcalloc(sizeof(long)*(count+count/2+1));
+        unsigned long cursor = 0, steps = 0;
+        do {
+            cursor = dictScan(dict,cursor,scanCallback,NULL,seen);
+            if (++steps == 1000) {
+                for (j = count; j < count+count/2+1; j++)
+                    dictAdd(dict,sdscatlen(sdsfromlonglong(j),"-",1),(void*)j);
+                while (dictIsRehashing(dict)) dictRehash(dict,100);
+            }
+        } while(cursor);
+        for (j = 0; j < count; j++) assert(seen[j] > 0);
+        zfree(seen);
+    }
+    end_benchmark("Scanning while resizing");
+
+    /* Every shard returns its own elements only, so without resizing every
+     * element is returned exactly once, even with more shards than buckets. */
+    start_benchmark();
+    {
+        unsigned long shards[] = {1, 16, 1024}, k;
+        long total = count+count/2+1;
+        long *seen = zmalloc(sizeof(long)*total);
+        struct dict *small = dictCreate(dict->type,NULL);
+
+        for (k = 0; k < sizeof(shards)/sizeof(shards[0]); k++) {
+            memset(seen,0,sizeof(long)*total);
+            scanShards(dict,shards[k],seen,0);
+            for (j = 0; j < total; j++) assert(seen[j] == 1);
+            memset(seen,0,sizeof(long)*total);
+            scanShards(dict,shards[k],seen,1);
+            for (j = 0; j < total; j++) assert(seen[j] > 0);
+        }
+        for (j = 0; j < 3; j++)
+            dictAdd(small,sdsfromlonglong(j),(void*)j);
+        memset(seen,0,sizeof(long)*total);
+        scanShards(small,64,seen,0);
+        for (j = 0; j < 3; j++) assert(seen[j] == 1);
+        assert(dictScanShard(small,0,3,6,scanCallback,NULL,seen) == 0);
+        dictRelease(small);
+        zfree(seen);
+    }
+    end_benchmark("Scanning by shards");
+
+    {
+        int threads[] = {1, 2, 4, 8}, k, t;
+
+        for (k = 0; k < (int)(sizeof(threads)/sizeof(threads[0])); k++) {
+            long counts[8] = {0}, sum = 0;
+            void *privdata[8];
+
+            for (t = 0; t < threads[k]; t++) privdata[t] = &counts[t];
+            start = timeInMilliseconds();
+            assert(dictScanParallel(dict,threads[k],256,countCallback,
+                                    privdata) == DICT_OK);
+            elapsed = timeInMilliseconds()-start;
+            for (t = 0; t < threads[k]; t++) sum += counts[t];
+            assert(sum == (long)dictSize(dict));
+            printf("Parallel scan with %d threads: %ld items in %lld ms\n",
+                threads[k], sum, elapsed);
+        }
+    }
+
     start_benchmark();
     for (j = 0; j < count; j++) {
         sds key = sdsfromlonglong(j);
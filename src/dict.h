@@ -68,8 +68,21 @@ typedef struct dictType {
     int (*keyCompare)(void *privdata, const void *key1, const void *key2);
     void (*keyDestructor)(void *privdata, void *key);
     void (*valDestructor)(void *privdata, void *obj);
+    // 哈希表的实现方式，默认(0)是拉链法，DICT_ENGINE_OPEN 是开放寻址
+    int engine;
+    // 非 0时 dictEntry从 slab分配器中分配，见 slab.c
+    int slabEntries;
+    // 非 0时 key必须是 sds，短 key直接存放在 dictEntry后面，见 dictAddRaw()
+    // 没有 keyDup时添加成功后传入的短 key会被释放，调用者只能使用 dictGetKey()
+    int embedKeys;
 } dictType;
 
+/* Hash table engines, selected per dictType. The open addressing engine keeps
+ * a control byte per slot (empty, deleted or 7 bits of the hash) so that a
+ * lookup only touches the entries whose fingerprint matches. */
+#define DICT_ENGINE_CHAINED 0
+#define DICT_ENGINE_OPEN 1
+
 
 // hashtable结构体，每个 dict存两个 dictht，用于 rehash，将一个转到另一个
 typedef struct dictht {
@@ -81,6 +94,10 @@ typedef struct dictht {
     unsigned long sizemask;
     // 已经使用过的大小，rehash的时候有用
     unsigned long used;
+    // 开放寻址时每个 slot的控制字节，拉链法时为 NULL
+    unsigned char *ctrl;
+    // 开放寻址时被标记为删除(墓碑)的 slot个数
+    unsigned long deleted;
 } dictht;
 
 // 字典实现
@@ -110,12 +127,136 @@ typedef struct dictIterator {
     long long fingerprint;
 } dictIterator;
 
+/* Incremental rehashing counters, shared by all the dictionaries. */
+typedef struct dictRehashStats {
+    unsigned long long started;          /* Rehashings started. */
+    unsigned long long completed;        /* Rehashings completed. */
+    unsigned long long buckets;          /* Non empty buckets moved. */
+    unsigned long long entries;          /* Entries moved. */
+    unsigned long long foreground_steps; /* Steps done by lookups/updates. */
+    unsigned long long cron_calls;       /* dictRehashMilliseconds() calls. */
+    unsigned long long cron_us;          /* Time spent in those calls. */
+} dictRehashStats;
+
 typedef void (dictScanFunction)(void *privdata, const dictEntry *de);
 typedef void (dictScanBucketFunction)(void *privdata, dictEntry **bucketref);
 
 /* This is the initial size of every hash table */
 #define DICT_HT_INITIAL_SIZE     4
 
+/* Max number of keys dictFindBatch() has in flight at the same time. */
+#define DICT_FIND_BATCH 16
+
+/* Max number of partitions of dictScanShard(). */
+#define DICT_SCAN_MAX_SHARDS 65536
+
+/* Open addressing tables are split in groups of slots, a probe always
+ * inspects a whole group, and the table size is a multiple of it. */
+#define DICT_GROUP_SIZE 16
+
+/* Every slot of an open addressing table has a control byte: EMPTY, DELETED
+ * (a tombstone left by a removal) or, when the slot is in use, the 7 higher
+ * bits of the hash of the key. The home group of a key is given by the lower
+ * bits of its hash, exactly like the bucket index of the chained table, so
+ * that dictScan() can keep its guarantees across a resize. When the home
+ * group is full the key goes into the next group, and lookups stop at the
+ * first group that has an EMPTY slot. */
+#define DICT_CTRL_EMPTY ((unsigned char)0x80)
+#define DICT_CTRL_DELETED ((unsigned char)0xFE)
+#define DICT_CTRL_TAG(hash) ((unsigned char)((hash) >> 57))
+#define DICT_CTRL_IS_FREE(c) ((c) & 0x80)
+
+#define dictOpenGroupMask(ht) (((ht)->size / DICT_GROUP_SIZE) - 1)
+#define dictOpenGroup(ctrl, g) ((ctrl) + (g) * DICT_GROUP_SIZE)
+
+/* Probe kernels. A kernel compares the 16 control bytes of a group at once:
+ * dictGroupMatch() returns a bitmap with a bit set for every slot whose
+ * control byte is 'tag', dictGroupMatchFree() the bitmap of the EMPTY or
+ * DELETED slots. The kernel is chosen at compile time, so that probes are
+ * inlined: SSE2 when the compiler targets it (always on x86_64), NEON on
+ * ARM, and otherwise the generic one, that is always compiled so that the
+ * dict benchmark can compare them. */
+// 一次比较一个 group的 16个控制字节，编译期选择实现
+static inline unsigned int dictGroupMatchGeneric(const unsigned char *group,
+                                                 unsigned char tag)
+{
+    unsigned int mask = 0;
+    int j;
+
+    for (j = 0; j < DICT_GROUP_SIZE; j++)
+        if (group[j] == tag) mask |= 1u << j;
+    return mask;
+}
+
+static inline unsigned int dictGroupMatchFreeGeneric(const unsigned char *group) {
+    unsigned int mask = 0;
+    int j;
+
+    for (j = 0; j < DICT_GROUP_SIZE; j++)
+        if (DICT_CTRL_IS_FREE(group[j])) mask |= 1u << j;
+    return mask;
+}
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define DICT_PROBE_KERNEL "sse2"
+
+static inline unsigned int dictGroupMatch(const unsigned char *group,
+                                          unsigned char tag)
+{
+    __m128i ctrl = _mm_loadu_si128((const __m128i*)group);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl,_mm_set1_epi8((char)tag)));
+}
+
+static inline unsigned int dictGroupMatchFree(const unsigned char *group) {
+    /* EMPTY and DELETED are the only control bytes with the high bit set. */
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+}
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define DICT_PROBE_KERNEL "neon"
+
+/* NEON has no movemask: narrow every byte of the comparison to a nibble,
+ * then turn the nibbles back into one bit per slot. */
+static inline unsigned int dictNeonMask(uint8x16_t cmp) {
+    uint64_t nibbles = vget_lane_u64(vreinterpret_u64_u8(
+        vshrn_n_u16(vreinterpretq_u16_u8(cmp),4)),0);
+    unsigned int mask = 0;
+
+    nibbles &= 0x1111111111111111ULL;
+    while (nibbles) {
+        mask |= 1u << (__builtin_ctzll(nibbles) / 4);
+        nibbles &= nibbles - 1;
+    }
+    return mask;
+}
+
+static inline unsigned int dictGroupMatch(const unsigned char *group,
+                                          unsigned char tag)
+{
+    return dictNeonMask(vceqq_u8(vld1q_u8(group),vdupq_n_u8(tag)));
+}
+
+static inline unsigned int dictGroupMatchFree(const unsigned char *group) {
+    return dictNeonMask(vtstq_u8(vld1q_u8(group),vdupq_n_u8(0x80)));
+}
+#else
+#define DICT_PROBE_KERNEL "generic"
+#define dictGroupMatch dictGroupMatchGeneric
+#define dictGroupMatchFree dictGroupMatchFreeGeneric
+#endif
+
+#define dictGroupHasEmpty(group) \
+    (dictGroupMatch((group),DICT_CTRL_EMPTY) != 0)
+
+/* Dict types with 'embedKeys' set copy the sds keys of at most this many
+ * bytes in the same allocation of their dictEntry, see dictAddRaw(). */
+#define DICT_EMBED_KEY_MAX 32
+
+/* Flags byte of an embedded key: SDS_TYPE_8 plus the first of the bits sds
+ * never sets, so that it can't be mistaken for a key allocated alone. */
+#define DICT_EMBEDDED_KEY_FLAGS (1|(1<<3))
+
 /* ------------------------------- Macros ------------------------------------*/
 #define dictFreeVal(d, entry) \
     if ((d)->type->valDestructor) \
@@ -137,8 +278,12 @@ typedef void (dictScanBucketFunction)(void *privdata, dictEntry **bucketref);
 #define dictSetDoubleVal(entry, _val_) \
     do { (entry)->v.d = _val_; } while(0)
 
+#define dictIsKeyEmbedded(d, entry) \
+    ((d)->type->embedKeys && \
+     ((unsigned char*)(entry)->key)[-1] == DICT_EMBEDDED_KEY_FLAGS)
+
 #define dictFreeKey(d, entry) \
-    if ((d)->type->keyDestructor) \
+    if ((d)->type->keyDestructor && !dictIsKeyEmbedded(d, entry)) \
         (d)->type->keyDestructor((d)->privdata, (entry)->key)
 
 #define dictSetKey(d, entry, _key_) do { \
@@ -162,6 +307,7 @@ typedef void (dictScanBucketFunction)(void *privdata, dictEntry **bucketref);
 #define dictSlots(d) ((d)->ht[0].size+(d)->ht[1].size)
 #define dictSize(d) ((d)->ht[0].used+(d)->ht[1].used)
 #define dictIsRehashing(d) ((d)->rehashidx != -1)
+#define dictIsOpen(d) ((d)->type->engine == DICT_ENGINE_OPEN)
 
 /* API */
 dict *dictCreate(dictType *type, void *privDataPtr);
@@ -172,9 +318,12 @@ dictEntry *dictAddOrFind(dict *d, void *key);
 int dictReplace(dict *d, void *key, void *val);
 int dictDelete(dict *d, const void *key);
 dictEntry *dictUnlink(dict *ht, const void *key);
+dictEntry *dictInsertWithHash(dict *d, void *key, uint64_t hash);
+dictEntry *dictUnlinkEntry(dict *d, dictEntry *he, uint64_t hash);
 void dictFreeUnlinkedEntry(dict *d, dictEntry *he);
 void dictRelease(dict *d);
 dictEntry * dictFind(dict *d, const void *key);
+void dictFindBatch(dict *d, const void **keys, dictEntry **des, unsigned long count);
 void *dictFetchValue(dict *d, const void *key);
 int dictResize(dict *d);
 dictIterator *dictGetIterator(dict *d);
@@ -183,19 +332,36 @@ dictEntry *dictNext(dictIterator *iter);
 void dictReleaseIterator(dictIterator *iter);
 dictEntry *dictGetRandomKey(dict *d);
 unsigned int dictGetSomeKeys(dict *d, dictEntry **des, unsigned int count);
+unsigned int dictSampleRun(dict *d, unsigned long *cursor, dictEntry **des,
+                           unsigned int count, unsigned long *visited);
 void dictGetStats(char *buf, size_t bufsize, dict *d);
+size_t dictEntryMemUsage(dict *d, const dictEntry *de);
 uint64_t dictGenHashFunction(const void *key, int len);
 uint64_t dictGenCaseHashFunction(const unsigned char *buf, int len);
+uint64_t dictFastHashFunction(const void *key, int len);
+uint64_t dictIntHashFunction(uint64_t key);
+uint64_t dictSdsFastHash(const void *key);
+uint64_t dictIntegerKeyHash(const void *key);
+const char *dictGetFastHashKernel(void);
 void dictEmpty(dict *d, void(callback)(void*));
+dict *dictDetachTables(dict *d);
 void dictEnableResize(void);
 void dictDisableResize(void);
 int dictRehash(dict *d, int n);
+void dictRehashStep(dict *d);
 int dictRehashMilliseconds(dict *d, int ms);
+void dictSetRehashStepBudget(int steps);
+int dictGetRehashStepBudget(void);
+void dictGetRehashStats(dictRehashStats *stats);
+void dictResetRehashStats(void);
 void dictSetHashFunctionSeed(uint8_t *seed);
 uint8_t *dictGetHashFunctionSeed(void);
 unsigned long dictScan(dict *d, unsigned long v, dictScanFunction *fn, dictScanBucketFunction *bucketfn, void *privdata);
+unsigned long dictScanShard(dict *d, unsigned long v, unsigned long shard, unsigned long shards, dictScanFunction *fn, dictScanBucketFunction *bucketfn, void *privdata);
+int dictScanParallel(dict *d, int threads, unsigned long shards, dictScanFunction *fn, void **privdata);
 uint64_t dictGetHash(dict *d, const void *key);
 dictEntry **dictFindEntryRefByPtrAndHash(dict *d, const void *oldptr, uint64_t hash);
+const char *dictGetProbeKernel(void);
 
 /* Hash table types */
 extern dictType dictTypeHeapStringCopyKey;
@@ -0,0 +1,678 @@
+/* dsbench.c - Benchmarks of the core data structures
+ *
+ * The tests of the single modules measure what they happen to measure, in
+ * their own units, so their numbers can't be compared from a change to the
+ * next one. This is a single benchmark of dict (both engines), ziplist,
+ * quicklist, intset, skiplist and sds, that runs the same operations for
+ * every size class and access distribution and prints one CSV line per run:
+ *
+ *   structure,op,size,dist,ops,ns_per_op,allocs_per_op,bytes_per_elem
+ *
+ * The operations are:
+ *
+ *   insert   add 'size' elements in random order (appends for sds).
+ *   lookup   find elements picked with the distribution (by position for
+ *            quicklist, that is what LINDEX does).
+ *   range    find an element picked with the distribution, then read the
+ *            DSBENCH_RANGE elements after it.
+ *   iterate  visit all the elements in order.
+ *   delete   remove all the elements in random order.
+ *
+ * The distribution is "uniform" or "zipfian" (theta 0.99, as in YCSB), with
+ * the hot elements scattered over the structure. bytes_per_elem is the
+ * memory used by the structure after the inserts divided by 'size', and
+ * allocs_per_op is -1 if the allocator can't count the allocations (only
+ * jemalloc does). Random numbers come from a fixed seed, so two runs do the
+ * same work. "dict" and "dict_open" hash the keys with SipHash, as the
+ * keyspace does, "dict_fasthash" and "dict_open_fasthash" are the same runs
+ * with dictSdsFastHash().
+ *
+ * Run it as "redis-server test dsbench [options]":
+ *
+ *   --sizes <n,n,...>   size classes (default 16,128,1024,8192,65536).
+ *   --ops <n>           lookups and ranges per run (default 100000).
+ *   --only <name>       run a single structure.
+ *   --quick             small sizes and few ops, to check it works.
+ *
+ * Linear structures (ziplist, intset) skip the sizes above DSBENCH_MAX_LINEAR,
+ * and the ziplist does fewer lookups on the big sizes since each one scans
+ * the list, so that a run takes about the same time whatever the size.
+ */
+
+#ifdef REDIS_TEST
+
+#include "server.h"
+#include "ziplist.h"
+#include "intset.h"
+#include "dsbench.h"
+
+#include <assert.h>
+#include <math.h>
+
+#define DSBENCH_UNIFORM 0
+#define DSBENCH_ZIPFIAN 1
+#define DSBENCH_RANGE 10
+#define DSBENCH_MAX_LINEAR 8192
+#define DSBENCH_MAX_SIZES 16
+/* Elements visited by the lookups of a linear structure in a run. */
+#define DSBENCH_LINEAR_BUDGET 20000000
+#define DSBENCH_ZIPF_THETA 0.99
+
+static const char *dsbench_dist_names[] = {"uniform", "zipfian"};
+
+/* State of a single run: a structure at a size class with a distribution. */
+typedef struct dsbenchRun {
+    const char *name;       /* Structure, first column of the output. */
+    unsigned long size;     /* Elements in the structure. */
+    int dist;               /* DSBENCH_UNIFORM or DSBENCH_ZIPFIAN. */
+    unsigned long *perm;    /* Random permutation of 0..size-1. */
+    unsigned long *access;  /* Elements picked with the distribution. */
+    unsigned long nops;     /* Length of 'access'. */
+    double bytes_per_elem;  /* Set after the inserts. */
+    uint64_t start;         /* Of the operation being timed. */
+    long long allocs;
+} dsbenchRun;
+
+/* ----------------------------- Utilities ---------------------------------- */
+
+static uint64_t dsbench_rand_state;
+
+/* xorshift64*, to not depend on the state of rand() of the caller. */
+static uint64_t dsbenchRand(void) {
+    dsbench_rand_state ^= dsbench_rand_state >> 12;
+    dsbench_rand_state ^= dsbench_rand_state << 25;
+    dsbench_rand_state ^= dsbench_rand_state >> 27;
+    return dsbench_rand_state * 2685821657736338717ULL;
+}
+
+static double dsbenchRandDouble(void) {
+    return (dsbenchRand() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Allocations done so far, or -1 if the allocator doesn't tell. */
+static long long dsbenchAllocations(void) {
+#if defined(USE_JEMALLOC)
+    uint64_t epoch = 1, small, large;
+    size_t sz = sizeof(epoch);
+    char name[64];
+
+    /* The counts of the thread cache are merged when it's flushed. */
+    je_mallctl("thread.tcache.flush", NULL, NULL, NULL, 0);
+    je_mallctl("epoch", &epoch, &sz, &epoch, sz);
+    sz = sizeof(small);
+    snprintf(name,sizeof(name),"stats.arenas.%d.small.nrequests",
+        MALLCTL_ARENAS_ALL);
+    if (je_mallctl(name, &small, &sz, NULL, 0)) return -1;
+    snprintf(name,sizeof(name),"stats.arenas.%d.large.nrequests",
+        MALLCTL_ARENAS_ALL);
+    if (je_mallctl(name, &large, &sz, NULL, 0)) return -1;
+    return (long long)(small + large);
+#else
+    return -1;
+#endif
+}
+
+/* Fill 'access' with 'count' positions in 0..n-1 following 'dist'. The
+ * zipfian ranks are mapped through 'perm', so that the hot elements are
+ * not the first ones inserted. */
+// zipfian 的生成方法来自 Gray 等人的论文，和 YCSB 的一样
+static void dsbenchGenAccess(unsigned long *access, unsigned long count,
+                             unsigned long n, int dist,
+                             const unsigned long *perm) {
+    double zetan = 0, zeta2, alpha, eta;
+    unsigned long j, rank;
+
+    if (dist == DSBENCH_UNIFORM) {
+        for (j = 0; j < count; j++) access[j] = dsbenchRand() % n;
+        return;
+    }
+    for (j = 1; j <= n; j++) zetan += 1 / pow((double)j,DSBENCH_ZIPF_THETA);
+    zeta2 = 1 + 1 / pow(2,DSBENCH_ZIPF_THETA);
+    alpha = 1 / (1 - DSBENCH_ZIPF_THETA);
+    eta = (1 - pow(2.0/n,1 - DSBENCH_ZIPF_THETA)) / (1 - zeta2/zetan);
+    for (j = 0; j < count; j++) {
+        double u = dsbenchRandDouble(), uz = u * zetan;
+
+        if (uz < 1) rank = 0;
+        else if (uz < zeta2) rank = 1;
+        else rank = (unsigned long)(n * pow(eta*u - eta + 1,alpha));
+        if (rank >= n) rank = n-1;
+        access[j] = perm[rank];
+    }
+}
+
+/* Format of the elements, 15 bytes each so that they are not integers. */
+static int dsbenchElement(char *buf, unsigned long id) {
+    return snprintf(buf,32,"ele:%011lu",id);
+}
+
+static sds dsbenchElementSds(unsigned long id) {
+    char buf[32];
+    int len = dsbenchElement(buf,id);
+    return sdsnewlen(buf,len);
+}
+
+/* Elements 0..n-1 as sds strings, for the structures that keep sds. */
+static sds *dsbenchElements(unsigned long n) {
+    sds *ele = zmalloc(sizeof(sds)*n);
+    unsigned long j;
+
+    for (j = 0; j < n; j++) ele[j] = dsbenchElementSds(j);
+    return ele;
+}
+
+static void dsbenchFreeElements(sds *ele, unsigned long n) {
+    unsigned long j;
+
+    for (j = 0; j < n; j++) sdsfree(ele[j]);
+    zfree(ele);
+}
+
+/* Lookups of a linear structure cost 'size' each, keep their total work
+ * within DSBENCH_LINEAR_BUDGET. */
+static unsigned long dsbenchLinearOps(dsbenchRun *run) {
+    unsigned long ops = DSBENCH_LINEAR_BUDGET / run->size;
+    if (ops > run->nops) ops = run->nops;
+    return ops ? ops : 1;
+}
+
+static void dsbenchBegin(dsbenchRun *run) {
+    run->allocs = dsbenchAllocations();
+    run->start = dsstatsNanotime();
+}
+
+/* Stop the clock and print the result of 'op', 'ops' operations. */
+static void dsbenchEnd(dsbenchRun *run, const char *op, unsigned long ops) {
+    uint64_t elapsed = dsstatsNanotime() - run->start;
+    long long allocs = dsbenchAllocations();
+    double allocs_per_op = -1;
+
+    if (allocs != -1 && run->allocs != -1)
+        allocs_per_op = (double)(allocs - run->allocs) / ops;
+    printf("%s,%s,%lu,%s,%lu,%.2f,%.3f,%.2f\n",
+        run->name, op, run->size, dsbench_dist_names[run->dist], ops,
+        (double)elapsed / ops, allocs_per_op, run->bytes_per_elem);
+    fflush(stdout);
+}
+
+/* Called at the end of the inserts, so that every line has the value. */
+static void dsbenchSetBytes(dsbenchRun *run, size_t before) {
+    run->bytes_per_elem = (double)(zmalloc_used_memory() - before) / run->size;
+}
+
+/* -------------------------------- dict ------------------------------------ */
+
+static int dsbenchSdsCompare(void *privdata, const void *key1,
+                             const void *key2) {
+    size_t l1 = sdslen((sds)key1);
+    UNUSED(privdata);
+
+    return l1 == sdslen((sds)key2) && memcmp(key1,key2,l1) == 0;
+}
+
+static void dsbenchSdsDestructor(void *privdata, void *val) {
+    UNUSED(privdata);
+    sdsfree(val);
+}
+
+/* The dict types hash with SipHash like the keyspace does, the "fasthash"
+ * variants with dictSdsFastHash(), to see what the hash function costs. */
+static dictType dsbenchDictType = {
+    dictSdsHash,
+    NULL,
+    NULL,
+    dsbenchSdsCompare,
+    dsbenchSdsDestructor,
+    NULL
+};
+
+static dictType dsbenchOpenDictType = {
+    dictSdsHash,
+    NULL,
+    NULL,
+    dsbenchSdsCompare,
+    dsbenchSdsDestructor,
+    NULL,
+    DICT_ENGINE_OPEN
+};
+
+static dictType dsbenchFastDictType = {
+    dictSdsFastHash,
+    NULL,
+    NULL,
+    dsbenchSdsCompare,
+    dsbenchSdsDestructor,
+    NULL
+};
+
+static dictType dsbenchOpenFastDictType = {
+    dictSdsFastHash,
+    NULL,
+    NULL,
+    dsbenchSdsCompare,
+    dsbenchSdsDestructor,
+    NULL,
+    DICT_ENGINE_OPEN
+};
+
+static void dsbenchDict(dsbenchRun *run, dictType *type) {
+    sds *ele = zmalloc(sizeof(sds)*run->size);
+    sds *probe = dsbenchElements(run->size);
+    size_t before = zmalloc_used_memory();
+    dict *d = dictCreate(type,NULL);
+    dictIterator *di;
+    dictEntry *de;
+    unsigned long j, count = 0;
+
+    /* The dict owns the keys it is given, they are part of its memory. */
+    for (j = 0; j < run->size; j++) ele[j] = dsbenchElementSds(j);
+    dsbenchBegin(run);
+    for (j = 0; j < run->size; j++)
+        dictAdd(d,ele[run->perm[j]],NULL);
+    dsbenchSetBytes(run,before);
+    dsbenchEnd(run,"insert",run->size);
+    zfree(ele);
+
+    dsbenchBegin(run);
+    for (j = 0; j < run->nops; j++)
+        count += dictFind(d,probe[run->access[j]]) != NULL;
+    dsbenchEnd(run,"lookup",run->nops);
+    assert(count == run->nops);
+
+    count = 0;
+    dsbenchBegin(run);
+    di = dictGetIterator(d);
+    while ((de = dictNext(di)) != NULL) count++;
+    dictReleaseIterator(di);
+    dsbenchEnd(run,"iterate",run->size);
+    assert(count == run->size);
+
+    dsbenchBegin(run);
+    for (j = 0; j < run->size; j++)
+        dictDelete(d,probe[run->perm[j]]);
+    dsbenchEnd(run,"delete",run->size);
+    assert(dictSize(d) == 0);
+
+    dictRelease(d);
+    dsbenchFreeElements(probe,run->size);
+}
+
+static void dsbenchDictChained(dsbenchRun *run) {
+    dsbenchDict(run,&dsbenchDictType);
+}
+
+static void dsbenchDictOpen(dsbenchRun *run) {
+    dsbenchDict(run,&dsbenchOpenDictType);
+}
+
+static void dsbenchDictFast(dsbenchRun *run) {
+    dsbenchDict(run,&dsbenchFastDictType);
+}
+
+static void dsbenchDictOpenFast(dsbenchRun *run) {
+    dsbenchDict(run,&dsbenchOpenFastDictType);
+}
+
+/* ------------------------------- ziplist ---------------------------------- */
+
+static void dsbenchZiplist(dsbenchRun *run) {
+    size_t before = zmalloc_used_memory();
+    unsigned char *zl = ziplistNew(), *p, *sval;
+    unsigned int slen;
+    long long lval;
+    unsigned long j, k, ops, count = 0;
+    char buf[32];
+    int len;
+
+    dsbenchBegin(run);
+    for (j = 0; j < run->size; j++) {
+        len = dsbenchElement(buf,run->perm[j]);
+        zl = ziplistPush(zl,(unsigned char*)buf,len,ZIPLIST_TAIL);
+    }
+    dsbenchSetBytes(run,before);
+    dsbenchEnd(run,"insert",run->size);
+
+    /* Lookups by value, as HGET and ZSCORE do on small objects. */
+    ops = dsbenchLinearOps(run);
+    dsbenchBegin(run);
+    for (j = 0; j < ops; j++) {
+        len = dsbenchElement(buf,run->access[j]);
+        p = ziplistFind(ziplistIndex(zl,ZIPLIST_HEAD),(unsigned char*)buf,
+                        len,0);
+        count += p != NULL;
+    }
+    dsbenchEnd(run,"lookup",ops);
+    assert(count == ops);
+
+    dsbenchBegin(run);
+    for (j = 0; j < ops; j++) {
+        p = ziplistIndex(zl,(int)run->access[j]);
+        for (k = 0; p && k < DSBENCH_RANGE; k++) {
+            ziplistGet(p,&sval,&slen,&lval);
+            p = ziplistNext(zl,p);
+        }
+    }
+    dsbenchEnd(run,"range",ops);
+
+    count = 0;
+    dsbenchBegin(run);
+    p = ziplistIndex(zl,ZIPLIST_HEAD);
+    while (p) {
+        ziplistGet(p,&sval,&slen,&lval);
+        p = ziplistNext(zl,p);
+        count++;
+    }
+    dsbenchEnd(run,"iterate",run->size);
+    assert(count == run->size);
+
+    dsbenchBegin(run);
+    for (j = run->size; j > 0; j--)
+        zl = ziplistDeleteRange(zl,(int)(run->perm[j-1] % j),1);
+    dsbenchEnd(run,"delete",run->size);
+    assert(ziplistLen(zl) == 0);
+    zfree(zl);
+}
+
+/* ------------------------------ quicklist --------------------------------- */
+
+static void dsbenchQuicklist(dsbenchRun *run) {
+    size_t before = zmalloc_used_memory();
+    quicklist *ql = quicklistNew(-2,0);
+    quicklistIter *iter;
+    quicklistEntry entry;
+    unsigned long j, k, count = 0;
+    char buf[32];
+    int len;
+
+    dsbenchBegin(run);
+    for (j = 0; j < run->size; j++) {
+        len = dsbenchElement(buf,run->perm[j]);
+        quicklistPushTail(ql,buf,len);
+    }
+    dsbenchSetBytes(run,before);
+    dsbenchEnd(run,"insert",run->size);
+
+    dsbenchBegin(run);
+    for (j = 0; j < run->nops; j++)
+        count += quicklistIndex(ql,run->access[j],&entry);
+    dsbenchEnd(run,"lookup",run->nops);
+    assert(count == run->nops);
+
+    dsbenchBegin(run);
+    for (j = 0; j < run->nops; j++) {
+        iter = quicklistGetIteratorAtIdx(ql,AL_START_HEAD,run->access[j]);
+        for (k = 0; k < DSBENCH_RANGE && quicklistNext(iter,&entry); k++);
+        quicklistReleaseIterator(iter);
+    }
+    dsbenchEnd(run,"range",run->nops);
+
+    count = 0;
+    dsbenchBegin(run);
+    iter = quicklistGetIterator(ql,AL_START_HEAD);
+    while (quicklistNext(iter,&entry)) count++;
+    quicklistReleaseIterator(iter);
+    dsbenchEnd(run,"iterate",run->size);
+    assert(count == run->size);
+
+    dsbenchBegin(run);
+    for (j = run->size; j > 0; j--)
+        quicklistDelRange(ql,(long)(run->perm[j-1] % j),1);
+    dsbenchEnd(run,"delete",run->size);
+    assert(quicklistCount(ql) == 0);
+    quicklistRelease(ql);
+}
+
+/* ------------------------------- intset ----------------------------------- */
+
+/* Spread the values so that they need 32 bits on the big sizes. */
+#define dsbenchIntsetValue(id) ((int64_t)(id)*7)
+
+static void dsbenchIntset(dsbenchRun *run) {
+    size_t before = zmalloc_used_memory();
+    intset *is = intsetNew();
+    unsigned long j, k, count = 0;
+    int64_t v;
+    int success;
+
+    dsbenchBegin(run);
+    for (j = 0; j < run->size; j++)
+        is = intsetAdd(is,dsbenchIntsetValue(run->perm[j]),NULL);
+    dsbenchSetBytes(run,before);
+    dsbenchEnd(run,"insert",run->size);
+
+    /* Lookups are a binary search, but the inserts and deletes move the
+     * tail of the array. */
+    dsbenchBegin(run);
+    for (j = 0; j < run->nops; j++)
+        count += intsetFind(is,dsbenchIntsetValue(run->access[j]));
+    dsbenchEnd(run,"lookup",run->nops);
+    assert(count == run->nops);
+
+    dsbenchBegin(run);
+    for (j = 0; j < run->nops; j++) {
+        for (k = 0; k < DSBENCH_RANGE; k++)
+            if (!intsetGet(is,(uint32_t)(run->access[j]+k),&v)) break;
+    }
+    dsbenchEnd(run,"range",run->nops);
+
+    count = 0;
+    dsbenchBegin(run);
+    for (j = 0; intsetGet(is,(uint32_t)j,&v); j++) count++;
+    dsbenchEnd(run,"iterate",run->size);
+    assert(count == run->size);
+
+    dsbenchBegin(run);
+    for (j = 0; j < run->size; j++)
+        is = intsetRemove(is,dsbenchIntsetValue(run->perm[j]),&success);
+    dsbenchEnd(run,"delete",run->size);
+    assert(intsetLen(is) == 0);
+    zfree(is);
+}
+
+/* ------------------------------ skiplist ---------------------------------- */
+
+static void dsbenchSkiplist(dsbenchRun *run) {
+    sds *ele = zmalloc(sizeof(sds)*run->size);
+    sds *probe = dsbenchElements(run->size);
+    zskiplist *zsl = zslCreate();
+    zskiplistNode *x;
+    zrangespec range;
+    unsigned long j, k, count = 0;
+
+    /* The skiplist owns the elements it is given. */
+    for (j = 0; j < run->size; j++) ele[j] = dsbenchElementSds(j);
+    dsbenchBegin(run);
+    for (j = 0; j < run->size; j++)
+        zslInsert(zsl,(double)run->perm[j],ele[run->perm[j]]);
+    /* The nodes come from slab pages that outlive the skiplist, so the
+     * allocator sees pages and not nodes: use the count of the skiplist. */
+    run->bytes_per_elem = (double)zsl->bytes / run->size;
+    dsbenchEnd(run,"insert",run->size);
+    zfree(ele);
+
+    dsbenchBegin(run);
+    for (j = 0; j < run->nops; j++) {
+        unsigned long id = run->access[j];
+        count += zslGetRank(zsl,(double)id,probe[id]) != 0;
+    }
+    dsbenchEnd(run,"lookup",run->nops);
+    assert(count == run->nops);
+
+    range.minex = range.maxex = 0;
+    dsbenchBegin(run);
+    for (j = 0; j < run->nops; j++) {
+        range.min = (double)run->access[j];
+        range.max = range.min + DSBENCH_RANGE - 1;
+        x = zslFirstInRange(zsl,&range);
+        for (k = 0; x && k < DSBENCH_RANGE; k++) x = x->level[0].forward;
+    }
+    dsbenchEnd(run,"range",run->nops);
+
+    count = 0;
+    dsbenchBegin(run);
+    for (x = zsl->header->level[0].forward; x; x = x->level[0].forward)
+        count++;
+    dsbenchEnd(run,"iterate",run->size);
+    assert(count == run->size);
+
+    dsbenchBegin(run);
+    for (j = 0; j < run->size; j++) {
+        unsigned long id = run->perm[j];
+        zslDelete(zsl,(double)id,probe[id],NULL);
+    }
+    dsbenchEnd(run,"delete",run->size);
+    assert(zsl->length == 0);
+
+    zslFree(zsl);
+    dsbenchFreeElements(probe,run->size);
+}
+
+/* --------------------------------- sds ------------------------------------ */
+
+/* For sds the size class is the length of the string in bytes. */
+static void dsbenchSds(dsbenchRun *run) {
+    size_t before = zmalloc_used_memory();
+    sds s = sdsempty(), copy, *strings;
+    unsigned long j, count = 0, n = 1000, ops = run->nops / 10;
+
+    /* Appends one byte at a time, as a client query buffer grows. */
+    dsbenchBegin(run);
+    for (j = 0; j < run->size; j++) s = sdscatlen(s,"x",1);
+    dsbenchSetBytes(run,before);
+    dsbenchEnd(run,"insert",run->size);
+
+    /* Comparison with an equal string, the core of every key lookup. */
+    copy = sdsdup(s);
+    dsbenchBegin(run);
+    for (j = 0; j < run->nops; j++) count += sdscmp(s,copy) == 0;
+    dsbenchEnd(run,"lookup",run->nops);
+    assert(count == run->nops);
+    sdsfree(copy);
+
+    /* A copy trimmed to its second quarter, as GETRANGE does. */
+    if (ops == 0) ops = 1;
+    dsbenchBegin(run);
+    for (j = 0; j < ops; j++) {
+        copy = sdsdup(s);
+        sdsrange(copy,run->size/4,run->size/2);
+        sdsfree(copy);
+    }
+    dsbenchEnd(run,"range",ops);
+
+    strings = zmalloc(sizeof(sds)*n);
+    for (j = 0; j < n; j++) strings[j] = sdsdup(s);
+    dsbenchBegin(run);
+    for (j = 0; j < n; j++) sdsfree(strings[j]);
+    dsbenchEnd(run,"delete",n);
+    zfree(strings);
+    sdsfree(s);
+}
+
+/* ------------------------------- Runner ----------------------------------- */
+
+typedef struct dsbenchStructure {
+    const char *name;
+    void (*run)(dsbenchRun *run);
+    unsigned long max_size;     /* Bigger size classes are skipped. */
+    int dists;                  /* Distributions that make a difference. */
+} dsbenchStructure;
+
+static dsbenchStructure dsbenchStructures[] = {
+    {"dict", dsbenchDictChained, ULONG_MAX, 2},
+    {"dict_open", dsbenchDictOpen, ULONG_MAX, 2},
+    {"dict_fasthash", dsbenchDictFast, ULONG_MAX, 2},
+    {"dict_open_fasthash", dsbenchDictOpenFast, ULONG_MAX, 2},
+    {"ziplist", dsbenchZiplist, DSBENCH_MAX_LINEAR, 2},
+    {"quicklist", dsbenchQuicklist, ULONG_MAX, 2},
+    {"intset", dsbenchIntset, DSBENCH_MAX_LINEAR, 2},
+    {"skiplist", dsbenchSkiplist, ULONG_MAX, 2},
+    {"sds", dsbenchSds, ULONG_MAX, 1},
+    {NULL, NULL, 0, 0}
+};
+
+/* Parse a comma separated list of sizes into 'sizes', returning how many
+ * there are, or 0 on a syntax error. */
+static int dsbenchParseSizes(const char *list, unsigned long *sizes) {
+    int count = 0, len, j;
+    sds *parts = sdssplitlen(list,strlen(list),",",1,&len);
+    long long v;
+
+    for (j = 0; j < len && count < DSBENCH_MAX_SIZES; j++) {
+        if (!string2ll(parts[j],sdslen(parts[j]),&v) || v <= 0) {
+            count = 0;
+            break;
+        }
+        sizes[count++] = (unsigned long)v;
+    }
+    sdsfreesplitres(parts,len);
+    return count;
+}
+
+/* The options follow "redis-server test dsbench". */
+int dsbenchTest(int argc, char *argv[]) {
+    unsigned long sizes[DSBENCH_MAX_SIZES] = {16,128,1024,8192,65536};
+    unsigned long nops = 100000, j;
+    int nsizes = 5, i, dist;
+    const char *only = NULL;
+    dsbenchStructure *st;
+    dsbenchRun run;
+
+    for (i = 3; i < argc; i++) {
+        int moreargs = i+1 < argc;
+
+        if (!strcasecmp(argv[i],"--sizes") && moreargs) {
+            nsizes = dsbenchParseSizes(argv[++i],sizes);
+            if (nsizes == 0) {
+                fprintf(stderr,"Invalid --sizes '%s'\n",argv[i]);
+                return 1;
+            }
+        } else if (!strcasecmp(argv[i],"--ops") && moreargs) {
+            nops = strtoul(argv[++i],NULL,10);
+            if (nops == 0) nops = 1;
+        } else if (!strcasecmp(argv[i],"--only") && moreargs) {
+            only = argv[++i];
+        } else if (!strcasecmp(argv[i],"--quick")) {
+            sizes[0] = 16; sizes[1] = 1024;
+            nsizes = 2;
+            nops = 1000;
+        } else {
+            fprintf(stderr,"Unknown dsbench option '%s'\n",argv[i]);
+            return 1;
+        }
+    }
+
+    printf("structure,op,size,dist,ops,ns_per_op,allocs_per_op,"
+           "bytes_per_elem\n");
+    for (st = dsbenchStructures; st->name; st++) {
+        if (only && strcasecmp(only,st->name)) continue;
+        for (i = 0; i < nsizes; i++) {
+            if (sizes[i] > st->max_size) continue;
+            for (dist = 0; dist < st->dists; dist++) {
+                memset(&run,0,sizeof(run));
+                dsbench_rand_state = 0x9e3779b97f4a7c15ULL;
+                run.name = st->name;
+                run.size = sizes[i];
+                run.dist = dist;
+                run.nops = nops;
+
+                /* Fisher-Yates shuffle of the elements. */
+                run.perm = zmalloc(sizeof(unsigned long)*run.size);
+                for (j = 0; j < run.size; j++) run.perm[j] = j;
+                for (j = run.size; j > 1; j--) {
+                    unsigned long k = dsbenchRand() % j, tmp = run.perm[j-1];
+                    run.perm[j-1] = run.perm[k];
+                    run.perm[k] = tmp;
+                }
+                run.access = zmalloc(sizeof(unsigned long)*run.nops);
+                dsbenchGenAccess(run.access,run.nops,run.size,dist,run.perm);
+
+                st->run(&run);
+                zfree(run.perm);
+                zfree(run.access);
+            }
+        }
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,247 @@
+/* dsstats.c - Histograms and counters of the data structures internals
+ *
+ * A latency spike of a command can come from work hidden inside a data
+ * structure: a long cascade update of a ziplist, a slow rehashing step, a
+ * sorted set converted to another encoding, or quicklist nodes compressed
+ * and decompressed over and over. The slow log only tells which command
+ * was slow, so the hot points of the data structures record here what
+ * they did, in histograms for the values whose distribution matters (times,
+ * lengths) and in counters for the totals (bytes).
+ *
+ * Histograms are in the spirit of HDR histograms: a value is bucketed by
+ * its highest set bit and the DSSTATS_SUB_BITS bits after it, so that the
+ * error of a percentile is bounded by a fraction of the value itself, for
+ * any value from 0 to 2^64-1, with a fixed array of DSSTATS_BUCKETS
+ * buckets. Recording a value is a few atomic increments, since a few of
+ * the instrumented paths can also run in other threads.
+ *
+ * Everything is off by default: each hot point first checks the global
+ * flag with dsstatsEnabled(), so the cost while disabled is one predicted
+ * branch. Define DSSTATS_DISABLED to compile the instrumentation out. The
+ * stats are reported in INFO format by dsstatsCatInfo(), that MEMORY
+ * DSSTATS uses.
+ */
+
+#include "fmacros.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "dsstats.h"
+
+int dsstats_enabled = 0;
+
+static dsstatsHistogram dsstats_hist[DSSTATS_HISTOGRAMS];
+static uint64_t dsstats_counters[DSSTATS_COUNTERS];
+
+static const char *dsstats_hist_names[DSSTATS_HISTOGRAMS] = {
+    "rehash_step_ns",
+    "ziplist_cascade_entries",
+    "zset_convert_ns",
+    "quicklist_compress_ns",
+    "quicklist_decompress_ns",
+    "skiplist_search_nodes"
+};
+
+static const char *dsstats_counter_names[DSSTATS_COUNTERS] = {
+    "quicklist_compress_bytes_in",
+    "quicklist_compress_bytes_out",
+    "quicklist_compress_failed",
+    "quicklist_decompress_bytes",
+    "zset_convert_up",
+    "zset_convert_down"
+};
+
+void dsstatsSetEnabled(int enabled) {
+    dsstats_enabled = enabled != 0;
+}
+
+uint64_t dsstatsNanotime(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec*1000000000+ts.tv_nsec;
+}
+
+/* Bucket of 'value': values below 2^DSSTATS_SUB_BITS have a bucket each,
+ * the others are grouped by their highest bit and the bits after it. */
+// 高位所在的位置决定组，紧随其后的几位决定组内的桶
+static int dsstatsBucket(uint64_t value) {
+    int msb;
+
+    if (value < (1 << DSSTATS_SUB_BITS)) return (int)value;
+    msb = 63 - __builtin_clzll(value);
+    return ((msb - DSSTATS_SUB_BITS + 1) << DSSTATS_SUB_BITS) |
+           (int)((value >> (msb - DSSTATS_SUB_BITS)) &
+                 ((1 << DSSTATS_SUB_BITS) - 1));
+}
+
+/* Highest value that falls in the bucket 'idx'. */
+static uint64_t dsstatsBucketMax(int idx) {
+    int group = idx >> DSSTATS_SUB_BITS;
+    uint64_t sub = idx & ((1 << DSSTATS_SUB_BITS) - 1), low;
+
+    if (group == 0) return idx;
+    low = ((1ULL << DSSTATS_SUB_BITS) | sub) << (group - 1);
+    return low + ((1ULL << (group - 1)) - 1);
+}
+
+void dsstatsRecord(int hist, uint64_t value) {
+    dsstatsHistogram *h = &dsstats_hist[hist];
+    uint64_t cur;
+
+    __atomic_add_fetch(&h->buckets[dsstatsBucket(value)],1,__ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->sum,value,__ATOMIC_RELAXED);
+    /* The first value sets the min, see dsstatsReset(). */
+    if (__atomic_add_fetch(&h->count,1,__ATOMIC_RELAXED) == 1) {
+        __atomic_store_n(&h->min,value,__ATOMIC_RELAXED);
+    } else {
+        cur = __atomic_load_n(&h->min,__ATOMIC_RELAXED);
+        while (value < cur &&
+               !__atomic_compare_exchange_n(&h->min,&cur,value,1,
+                   __ATOMIC_RELAXED,__ATOMIC_RELAXED));
+    }
+    cur = __atomic_load_n(&h->max,__ATOMIC_RELAXED);
+    while (value > cur &&
+           !__atomic_compare_exchange_n(&h->max,&cur,value,1,
+               __ATOMIC_RELAXED,__ATOMIC_RELAXED));
+}
+
+void dsstatsIncr(int counter, uint64_t delta) {
+    __atomic_add_fetch(&dsstats_counters[counter],delta,__ATOMIC_RELAXED);
+}
+
+/* Copy the histogram 'hist' into 'h'. The copy is not atomic as a whole,
+ * values recorded meanwhile may be only partially reflected. */
+void dsstatsGetHistogram(int hist, dsstatsHistogram *h) {
+    dsstatsHistogram *src = &dsstats_hist[hist];
+    int j;
+
+    h->count = __atomic_load_n(&src->count,__ATOMIC_RELAXED);
+    h->sum = __atomic_load_n(&src->sum,__ATOMIC_RELAXED);
+    h->min = __atomic_load_n(&src->min,__ATOMIC_RELAXED);
+    h->max = __atomic_load_n(&src->max,__ATOMIC_RELAXED);
+    for (j = 0; j < DSSTATS_BUCKETS; j++)
+        h->buckets[j] = __atomic_load_n(&src->buckets[j],__ATOMIC_RELAXED);
+}
+
+/* Value below which 'p' percent of the recorded values are, rounded up to
+ * the highest value of its bucket and never beyond the max. */
+uint64_t dsstatsPercentile(const dsstatsHistogram *h, double p) {
+    uint64_t total = 0, rank, seen = 0, max;
+    int j;
+
+    for (j = 0; j < DSSTATS_BUCKETS; j++) total += h->buckets[j];
+    if (total == 0) return 0;
+    rank = (uint64_t)(p / 100 * total + 0.5);
+    if (rank == 0) rank = 1;
+    if (rank > total) rank = total;
+    for (j = 0; j < DSSTATS_BUCKETS; j++) {
+        seen += h->buckets[j];
+        if (seen >= rank) break;
+    }
+    max = dsstatsBucketMax(j);
+    return max < h->max ? max : h->max;
+}
+
+uint64_t dsstatsGetCounter(int counter) {
+    return __atomic_load_n(&dsstats_counters[counter],__ATOMIC_RELAXED);
+}
+
+void dsstatsReset(void) {
+    memset(dsstats_hist,0,sizeof(dsstats_hist));
+    memset(dsstats_counters,0,sizeof(dsstats_counters));
+}
+
+/* Append the stats in the INFO format: one line per histogram with its
+ * count, average, min, some percentiles and max, and one per counter. */
+sds dsstatsCatInfo(sds s) {
+    dsstatsHistogram h;
+    int j;
+
+    s = sdscatprintf(s,"dsstats_enabled:%d\r\n",dsstats_enabled);
+    for (j = 0; j < DSSTATS_HISTOGRAMS; j++) {
+        dsstatsGetHistogram(j,&h);
+        s = sdscatprintf(s,
+            "%s:count=%llu,avg=%.2f,min=%llu,p50=%llu,p90=%llu,p99=%llu,"
+            "p999=%llu,max=%llu\r\n",
+            dsstats_hist_names[j],
+            (unsigned long long)h.count,
+            h.count ? (double)h.sum/h.count : 0,
+            (unsigned long long)h.min,
+            (unsigned long long)dsstatsPercentile(&h,50),
+            (unsigned long long)dsstatsPercentile(&h,90),
+            (unsigned long long)dsstatsPercentile(&h,99),
+            (unsigned long long)dsstatsPercentile(&h,99.9),
+            (unsigned long long)h.max);
+    }
+    for (j = 0; j < DSSTATS_COUNTERS; j++)
+        s = sdscatprintf(s,"%s:%llu\r\n",dsstats_counter_names[j],
+            (unsigned long long)dsstatsGetCounter(j));
+    return s;
+}
+
+#ifdef REDIS_TEST
+#include <assert.h>
+#include <stdlib.h>
+
+int dsstatsTest(int argc, char *argv[]) {
+    dsstatsHistogram h;
+    uint64_t v, p;
+    int j;
+
+    (void)argc; (void)argv;
+
+    printf("Buckets are contiguous and cover every value: ");
+    for (j = 0; j < DSSTATS_BUCKETS-1; j++) {
+        assert(dsstatsBucket(dsstatsBucketMax(j)) == j);
+        assert(dsstatsBucket(dsstatsBucketMax(j)+1) == j+1);
+    }
+    assert(dsstatsBucketMax(DSSTATS_BUCKETS-1) == UINT64_MAX);
+    assert(dsstatsBucket(UINT64_MAX) == DSSTATS_BUCKETS-1);
+    printf("ok\n");
+
+    printf("Percentiles are within the bucket precision: ");
+    dsstatsReset();
+    for (v = 1; v <= 100000; v++) dsstatsRecord(DSSTATS_REHASH_STEP,v);
+    dsstatsGetHistogram(DSSTATS_REHASH_STEP,&h);
+    assert(h.count == 100000 && h.min == 1 && h.max == 100000);
+    assert(h.sum == 100000ULL*100001/2);
+    p = dsstatsPercentile(&h,50);
+    assert(p >= 50000 && p <= 50000 + 50000/8);
+    p = dsstatsPercentile(&h,99);
+    assert(p >= 99000 && p <= 99000 + 99000/8);
+    assert(dsstatsPercentile(&h,100) == 100000);
+    printf("ok\n");
+
+    printf("Counters, reset and the INFO output: ");
+    dsstatsIncr(DSSTATS_QL_COMPRESS_IN,100);
+    dsstatsIncr(DSSTATS_QL_COMPRESS_IN,23);
+    assert(dsstatsGetCounter(DSSTATS_QL_COMPRESS_IN) == 123);
+    sds info = dsstatsCatInfo(sdsempty());
+    assert(strstr(info,"rehash_step_ns:count=100000,") != NULL);
+    assert(strstr(info,"quicklist_compress_bytes_in:123\r\n") != NULL);
+    sdsfree(info);
+    dsstatsReset();
+    dsstatsGetHistogram(DSSTATS_REHASH_STEP,&h);
+    assert(h.count == 0 && dsstatsPercentile(&h,50) == 0);
+    assert(dsstatsGetCounter(DSSTATS_QL_COMPRESS_IN) == 0);
+    printf("ok\n");
+
+    printf("Timing a section only when enabled: ");
+    {
+        dsstatsTimerStart(off);
+        dsstatsTimerEnd(DSSTATS_ZSET_CONVERT,off);
+        dsstatsSetEnabled(1);
+        dsstatsTimerStart(on);
+        dsstatsTimerEnd(DSSTATS_ZSET_CONVERT,on);
+        dsstatsSetEnabled(0);
+    }
+    dsstatsGetHistogram(DSSTATS_ZSET_CONVERT,&h);
+    assert(h.count == 1);
+    dsstatsReset();
+    printf("ok\n");
+    return 0;
+}
+#endif
@@ -0,0 +1,74 @@
+/* dsstats.h - Histograms and counters of the data structures internals, see
+ * dsstats.c for the details. */
+
+#ifndef __DSSTATS_H
+#define __DSSTATS_H
+
+#include <stdint.h>
+#include "sds.h"
+
+/* Histograms. Times are in nanoseconds. */
+#define DSSTATS_REHASH_STEP 0       /* Time of a dictRehash() call. */
+#define DSSTATS_CASCADE_UPDATE 1    /* Entries resized by a ziplist cascade. */
+#define DSSTATS_ZSET_CONVERT 2      /* Time of a zsetConvert() call. */
+#define DSSTATS_QL_COMPRESS 3       /* Time to compress a quicklist node. */
+#define DSSTATS_QL_DECOMPRESS 4     /* Time to decompress a quicklist node. */
+#define DSSTATS_ZSL_SEARCH 5        /* Nodes visited by a skiplist search. */
+#define DSSTATS_HISTOGRAMS 6
+
+/* Counters. */
+#define DSSTATS_QL_COMPRESS_IN 0    /* Bytes given to the codecs. */
+#define DSSTATS_QL_COMPRESS_OUT 1   /* Bytes they produced. */
+#define DSSTATS_QL_COMPRESS_FAILED 2 /* Nodes left uncompressed. */
+#define DSSTATS_QL_DECOMPRESS_OUT 3 /* Bytes decompressed. */
+#define DSSTATS_ZSET_CONVERT_UP 4   /* Listpack to skiplist or B+tree. */
+#define DSSTATS_ZSET_CONVERT_DOWN 5 /* Back to listpack. */
+#define DSSTATS_COUNTERS 6
+
+/* Values are bucketed by their highest bit plus DSSTATS_SUB_BITS more bits,
+ * so every bucket is at most 1/8 of its lower bound wide. */
+#define DSSTATS_SUB_BITS 3
+#define DSSTATS_BUCKETS ((64-DSSTATS_SUB_BITS+1) << DSSTATS_SUB_BITS)
+
+typedef struct dsstatsHistogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[DSSTATS_BUCKETS];
+} dsstatsHistogram;
+
+/* Instrumentation is compiled in unless DSSTATS_DISABLED is defined, and
+ * does nothing but test this flag while it is off. */
+// 运行时开关，关闭时每个埋点只有一次判断的开销
+extern int dsstats_enabled;
+
+#ifdef DSSTATS_DISABLED
+#define dsstatsEnabled() 0
+#else
+#define dsstatsEnabled() __builtin_expect(dsstats_enabled,0)
+#endif
+
+/* Time a section: 'var' is 0 when the stats are off, so that turning them
+ * on in the middle of a section does not record a bogus time. */
+#define dsstatsTimerStart(var) \
+    uint64_t var = dsstatsEnabled() ? dsstatsNanotime() : 0
+#define dsstatsTimerEnd(hist, var) do { \
+    if (var) dsstatsRecord(hist,dsstatsNanotime()-(var)); \
+} while(0)
+
+void dsstatsSetEnabled(int enabled);
+uint64_t dsstatsNanotime(void);
+void dsstatsRecord(int hist, uint64_t value);
+void dsstatsIncr(int counter, uint64_t delta);
+void dsstatsGetHistogram(int hist, dsstatsHistogram *h);
+uint64_t dsstatsPercentile(const dsstatsHistogram *h, double p);
+uint64_t dsstatsGetCounter(int counter);
+void dsstatsReset(void);
+sds dsstatsCatInfo(sds s);
+
+#ifdef REDIS_TEST
+int dsstatsTest(int argc, char *argv[]);
+#endif
+
+#endif /* __DSSTATS_H */
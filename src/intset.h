@@ -42,7 +42,9 @@ typedef struct intset {
 
 intset *intsetNew(void);
 intset *intsetAdd(intset *is, int64_t value, uint8_t *success);
+intset *intsetAddMany(intset *is, const int64_t *values, uint32_t count, uint32_t *added);
 intset *intsetRemove(intset *is, int64_t value, int *success);
+intset *intsetIntersect(intset *a, intset *b);
 uint8_t intsetFind(intset *is, int64_t value);
 int64_t intsetRandom(intset *is);
 uint8_t intsetGet(intset *is, uint32_t pos, int64_t *value);
@@ -0,0 +1,1089 @@
+/* listpack.c - A compact list of strings and integers without cascade
+ * updates.
+ *
+ * The listpack stores a sequence of strings and integers in a single
+ * contiguous block of memory, like the ziplist, but every entry stores its
+ * own length at its tail instead of the length of the previous entry.
+ * Growing or shrinking an entry therefore never changes the size of the
+ * entries around it, so inserts and deletes can't cascade into the O(N)
+ * reallocations __ziplistCascadeUpdate() has to do when a prevlen crosses
+ * the 254 bytes boundary.
+ *
+ * LISTPACK OVERALL LAYOUT
+ * =======================
+ *
+ * <tot-bytes> <num-elements> <element-1> ... <element-N> <end>
+ *
+ * <tot-bytes> is an unsigned 32 bit little endian integer holding the
+ * total size of the listpack, header and terminator included.
+ *
+ * <num-elements> is an unsigned 16 bit little endian integer holding the
+ * number of elements, or 65535 if the number is unknown (the listpack holds
+ * 65535 or more elements): in that case lpLength() has to count them.
+ *
+ * <end> is the single byte 0xFF.
+ *
+ * LISTPACK ENTRIES
+ * ================
+ *
+ * <encoding-type><element-data><element-tot-len>
+ *
+ * The encoding type is one of:
+ *
+ * 0xxxxxxx                  7 bit unsigned integer, no data.
+ * 10xxxxxx <data>           string of up to 63 bytes.
+ * 110xxxxx yyyyyyyy         13 bit signed integer.
+ * 1110xxxx yyyyyyyy <data>  string of up to 4095 bytes.
+ * 11110000 <4 bytes> <data> string of up to 2^32-1 bytes.
+ * 11110001 <2 bytes>        16 bit signed integer.
+ * 11110010 <3 bytes>        24 bit signed integer.
+ * 11110011 <4 bytes>        32 bit signed integer.
+ * 11110100 <8 bytes>        64 bit signed integer.
+ *
+ * All the multi byte lengths and integers are little endian.
+ *
+ * <element-tot-len> is the size of <encoding-type><element-data>, stored
+ * in 1 to 5 bytes so that it can be parsed from right to left: every byte
+ * holds 7 bits of the length, and the high bit is set when more bytes
+ * follow on the left. This is what lets lpPrev() jump back one entry.
+ */
+
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "listpack.h"
+#include "ziplist.h"
+#include "zmalloc.h"
+#include "util.h"
+#include "redisassert.h"
+
+#define LP_HDR_SIZE 6       /* 32 bit total len + 16 bit number of elements. */
+#define LP_HDR_NUMELE_UNKNOWN UINT16_MAX
+#define LP_MAX_INT_ENCODING_LEN 9
+#define LP_MAX_BACKLEN_SIZE 5
+#define LP_ENCODING_INT 0
+#define LP_ENCODING_STRING 1
+
+#define LP_ENCODING_7BIT_UINT 0
+#define LP_ENCODING_7BIT_UINT_MASK 0x80
+#define LP_ENCODING_IS_7BIT_UINT(byte) (((byte)&LP_ENCODING_7BIT_UINT_MASK)==LP_ENCODING_7BIT_UINT)
+
+#define LP_ENCODING_6BIT_STR 0x80
+#define LP_ENCODING_6BIT_STR_MASK 0xC0
+#define LP_ENCODING_IS_6BIT_STR(byte) (((byte)&LP_ENCODING_6BIT_STR_MASK)==LP_ENCODING_6BIT_STR)
+
+#define LP_ENCODING_13BIT_INT 0xC0
+#define LP_ENCODING_13BIT_INT_MASK 0xE0
+#define LP_ENCODING_IS_13BIT_INT(byte) (((byte)&LP_ENCODING_13BIT_INT_MASK)==LP_ENCODING_13BIT_INT)
+
+#define LP_ENCODING_12BIT_STR 0xE0
+#define LP_ENCODING_12BIT_STR_MASK 0xF0
+#define LP_ENCODING_IS_12BIT_STR(byte) (((byte)&LP_ENCODING_12BIT_STR_MASK)==LP_ENCODING_12BIT_STR)
+
+#define LP_ENCODING_16BIT_INT 0xF1
+#define LP_ENCODING_24BIT_INT 0xF2
+#define LP_ENCODING_32BIT_INT 0xF3
+#define LP_ENCODING_64BIT_INT 0xF4
+#define LP_ENCODING_32BIT_STR 0xF0
+#define LP_EOF 0xFF
+
+#define LP_ENCODING_6BIT_STR_LEN(p) ((p)[0] & 0x3F)
+#define LP_ENCODING_12BIT_STR_LEN(p) ((((p)[0] & 0xF) << 8) | (p)[1])
+#define LP_ENCODING_32BIT_STR_LEN(p) (((uint32_t)(p)[1]<<0) | \
+                                      ((uint32_t)(p)[2]<<8) | \
+                                      ((uint32_t)(p)[3]<<16) | \
+                                      ((uint32_t)(p)[4]<<24))
+
+#define lpGetTotalBytes(p)           (((uint32_t)(p)[0]<<0) | \
+                                      ((uint32_t)(p)[1]<<8) | \
+                                      ((uint32_t)(p)[2]<<16) | \
+                                      ((uint32_t)(p)[3]<<24))
+
+#define lpGetNumElements(p)          (((uint32_t)(p)[4]<<0) | \
+                                      ((uint32_t)(p)[5]<<8))
+#define lpSetTotalBytes(p,v) do { \
+    (p)[0] = (v)&0xff; \
+    (p)[1] = ((v)>>8)&0xff; \
+    (p)[2] = ((v)>>16)&0xff; \
+    (p)[3] = ((v)>>24)&0xff; \
+} while(0)
+
+#define lpSetNumElements(p,v) do { \
+    (p)[4] = (v)&0xff; \
+    (p)[5] = ((v)>>8)&0xff; \
+} while(0)
+
+/* Create a new, empty listpack. */
+unsigned char *lpNew(void) {
+    unsigned char *lp = zmalloc(LP_HDR_SIZE+1);
+    lpSetTotalBytes(lp,LP_HDR_SIZE+1);
+    lpSetNumElements(lp,0);
+    lp[LP_HDR_SIZE] = LP_EOF;
+    return lp;
+}
+
+/* Free the specified listpack. */
+void lpFree(unsigned char *lp) {
+    zfree(lp);
+}
+
+/* Encode the integer 'v' into 'intenc', returning its encoded length. */
+static unsigned long lpEncodeInteger(int64_t v, unsigned char *intenc) {
+    if (v >= 0 && v <= 127) {
+        /* Single byte 0-127 integer. */
+        intenc[0] = v;
+        return 1;
+    } else if (v >= -4096 && v <= 4095) {
+        /* 13 bit integer. */
+        if (v < 0) v = ((int64_t)1<<13)+v;
+        intenc[0] = (v>>8)|LP_ENCODING_13BIT_INT;
+        intenc[1] = v&0xff;
+        return 2;
+    } else if (v >= -32768 && v <= 32767) {
+        /* 16 bit integer. */
+        if (v < 0) v = ((int64_t)1<<16)+v;
+        intenc[0] = LP_ENCODING_16BIT_INT;
+        intenc[1] = v&0xff;
+        intenc[2] = v>>8;
+        return 3;
+    } else if (v >= -8388608 && v <= 8388607) {
+        /* 24 bit integer. */
+        if (v < 0) v = ((int64_t)1<<24)+v;
+        intenc[0] = LP_ENCODING_24BIT_INT;
+        intenc[1] = v&0xff;
+        intenc[2] = (v>>8)&0xff;
+        intenc[3] = v>>16;
+        return 4;
+    } else if (v >= -2147483648LL && v <= 2147483647LL) {
+        /* 32 bit integer. */
+        if (v < 0) v = ((int64_t)1<<32)+v;
+        intenc[0] = LP_ENCODING_32BIT_INT;
+        intenc[1] = v&0xff;
+        intenc[2] = (v>>8)&0xff;
+        intenc[3] = (v>>16)&0xff;
+        intenc[4] = v>>24;
+        return 5;
+    } else {
+        /* 64 bit integer. */
+        uint64_t uv = v;
+        intenc[0] = LP_ENCODING_64BIT_INT;
+        intenc[1] = uv&0xff;
+        intenc[2] = (uv>>8)&0xff;
+        intenc[3] = (uv>>16)&0xff;
+        intenc[4] = (uv>>24)&0xff;
+        intenc[5] = (uv>>32)&0xff;
+        intenc[6] = (uv>>40)&0xff;
+        intenc[7] = (uv>>48)&0xff;
+        intenc[8] = uv>>56;
+        return 9;
+    }
+}
+
+/* Decide how to store 'ele': if it is the exact representation of a 64 bit
+ * integer it is stored as an integer and its encoding is written into
+ * 'intenc', otherwise LP_ENCODING_STRING is returned and the size of the
+ * header plus the string is stored in '*enclen'. */
+// 和 ziplist的 zipTryEncoding一样，能编码成整数的字符串就存成整数
+static int lpEncodeGetType(unsigned char *ele, uint32_t size, unsigned char *intenc, uint64_t *enclen) {
+    long long v;
+
+    if (size <= 20 && string2ll((char*)ele,size,&v)) {
+        *enclen = lpEncodeInteger(v,intenc);
+        return LP_ENCODING_INT;
+    } else {
+        if (size < 64) *enclen = 1+size;
+        else if (size < 4096) *enclen = 2+size;
+        else *enclen = 5+(uint64_t)size;
+        return LP_ENCODING_STRING;
+    }
+}
+
+/* Store the reverse-encoded length 'l' into 'buf' (if not NULL), returning
+ * the number of bytes it takes. */
+static unsigned long lpEncodeBacklen(unsigned char *buf, uint64_t l) {
+    if (l <= 127) {
+        if (buf) buf[0] = l;
+        return 1;
+    } else if (l < 16383) {
+        if (buf) {
+            buf[0] = l>>7;
+            buf[1] = (l&127)|128;
+        }
+        return 2;
+    } else if (l < 2097151) {
+        if (buf) {
+            buf[0] = l>>14;
+            buf[1] = ((l>>7)&127)|128;
+            buf[2] = (l&127)|128;
+        }
+        return 3;
+    } else if (l < 268435455) {
+        if (buf) {
+            buf[0] = l>>21;
+            buf[1] = ((l>>14)&127)|128;
+            buf[2] = ((l>>7)&127)|128;
+            buf[3] = (l&127)|128;
+        }
+        return 4;
+    } else {
+        if (buf) {
+            buf[0] = l>>28;
+            buf[1] = ((l>>21)&127)|128;
+            buf[2] = ((l>>14)&127)|128;
+            buf[3] = ((l>>7)&127)|128;
+            buf[4] = (l&127)|128;
+        }
+        return 5;
+    }
+}
+
+/* Decode the backlen whose last byte is pointed by 'p'. */
+// 从右往左解析 backlen
+static uint64_t lpDecodeBacklen(unsigned char *p) {
+    uint64_t val = 0;
+    uint64_t shift = 0;
+    do {
+        val |= (uint64_t)(p[0] & 127) << shift;
+        if (!(p[0] & 128)) break;
+        shift += 7;
+        p--;
+        if (shift > 28) return UINT64_MAX;
+    } while (1);
+    return val;
+}
+
+/* Write the header of a string of 'len' bytes in 'buf', returning its
+ * size. */
+static uint32_t lpEncodeStringHeader(unsigned char *buf, uint32_t len) {
+    if (len < 64) {
+        buf[0] = len | LP_ENCODING_6BIT_STR;
+        return 1;
+    } else if (len < 4096) {
+        buf[0] = (len >> 8) | LP_ENCODING_12BIT_STR;
+        buf[1] = len & 0xff;
+        return 2;
+    } else {
+        buf[0] = LP_ENCODING_32BIT_STR;
+        buf[1] = len & 0xff;
+        buf[2] = (len >> 8) & 0xff;
+        buf[3] = (len >> 16) & 0xff;
+        buf[4] = (len >> 24) & 0xff;
+        return 5;
+    }
+}
+
+/* Write the header of a string of 'len' bytes in 'buf', followed by the
+ * string itself. */
+static void lpEncodeString(unsigned char *buf, unsigned char *s, uint32_t len) {
+    uint32_t hdrlen = lpEncodeStringHeader(buf,len);
+    memcpy(buf+hdrlen,s,len);
+}
+
+/* Return the size of the encoding type and data of the entry at 'p'. */
+static uint32_t lpCurrentEncodedSize(unsigned char *p) {
+    if (LP_ENCODING_IS_7BIT_UINT(p[0])) return 1;
+    if (LP_ENCODING_IS_6BIT_STR(p[0])) return 1+LP_ENCODING_6BIT_STR_LEN(p);
+    if (LP_ENCODING_IS_13BIT_INT(p[0])) return 2;
+    if (LP_ENCODING_IS_12BIT_STR(p[0])) return 2+LP_ENCODING_12BIT_STR_LEN(p);
+    if (p[0] == LP_ENCODING_16BIT_INT) return 3;
+    if (p[0] == LP_ENCODING_24BIT_INT) return 4;
+    if (p[0] == LP_ENCODING_32BIT_INT) return 5;
+    if (p[0] == LP_ENCODING_64BIT_INT) return 9;
+    if (p[0] == LP_ENCODING_32BIT_STR) return 5+LP_ENCODING_32BIT_STR_LEN(p);
+    if (p[0] == LP_EOF) return 1;
+    return 0;
+}
+
+/* Return a pointer to the entry after the one at 'p', which may be the
+ * terminator. */
+static unsigned char *lpSkip(unsigned char *p) {
+    /* Small integers and short strings are most of the entries, and their
+     * backlen is always a single byte. */
+    // 小整数和短字符串的 backlen 总是一个字节，不用再计算
+    if (LP_ENCODING_IS_7BIT_UINT(p[0])) return p+2;
+    if (LP_ENCODING_IS_6BIT_STR(p[0])) return p+2+LP_ENCODING_6BIT_STR_LEN(p);
+
+    unsigned long entrylen = lpCurrentEncodedSize(p);
+    entrylen += lpEncodeBacklen(NULL,entrylen);
+    p += entrylen;
+    return p;
+}
+
+/* Return the entry after 'p', or NULL if 'p' is the last one. */
+unsigned char *lpNext(unsigned char *lp, unsigned char *p) {
+    ((void) lp);
+    p = lpSkip(p);
+    if (p[0] == LP_EOF) return NULL;
+    return p;
+}
+
+/* Return the entry before 'p', or NULL if 'p' is the first one. 'p' may
+ * also point to the terminator, in that case the last entry is returned. */
+unsigned char *lpPrev(unsigned char *lp, unsigned char *p) {
+    if (p-lp == LP_HDR_SIZE) return NULL;
+    p--; /* Seek the last byte of the previous entry backlen. */
+    uint64_t prevlen = lpDecodeBacklen(p);
+    prevlen += lpEncodeBacklen(NULL,prevlen);
+    return p-prevlen+1; /* Seek the first byte of the previous entry. */
+}
+
+/* Return the first entry, or NULL if the listpack is empty. */
+unsigned char *lpFirst(unsigned char *lp) {
+    unsigned char *p = lp + LP_HDR_SIZE;
+    if (p[0] == LP_EOF) return NULL;
+    return p;
+}
+
+/* Return the last entry, or NULL if the listpack is empty. */
+unsigned char *lpLast(unsigned char *lp) {
+    unsigned char *p = lp+lpGetTotalBytes(lp)-1; /* Seek EOF element. */
+    return lpPrev(lp,p);
+}
+
+/* Return the number of elements. When the header can't hold the count the
+ * elements are counted, and the header is fixed if possible. */
+uint32_t lpLength(unsigned char *lp) {
+    uint32_t numele = lpGetNumElements(lp);
+    if (numele != LP_HDR_NUMELE_UNKNOWN) return numele;
+
+    uint32_t count = 0;
+    unsigned char *p = lpFirst(lp);
+    while(p) {
+        count++;
+        p = lpNext(lp,p);
+    }
+
+    if (count < LP_HDR_NUMELE_UNKNOWN) lpSetNumElements(lp,count);
+    return count;
+}
+
+/* Decode the integer or the string at 'p'. Strings are returned by pointer
+ * with their length in '*count'. Integers are returned in '*count' with a
+ * NULL return value when 'intbuf' is NULL, otherwise they are printed into
+ * 'intbuf' (at least LP_INTBUF_SIZE bytes) which is returned as a string. */
+unsigned char *lpGet(unsigned char *p, int64_t *count, unsigned char *intbuf) {
+    int64_t val;
+    uint64_t uval, negstart, negmax;
+
+    if (LP_ENCODING_IS_7BIT_UINT(p[0])) {
+        negstart = UINT64_MAX; /* 7 bit ints are always positive. */
+        negmax = 0;
+        uval = p[0] & 0x7f;
+    } else if (LP_ENCODING_IS_6BIT_STR(p[0])) {
+        *count = LP_ENCODING_6BIT_STR_LEN(p);
+        return p+1;
+    } else if (LP_ENCODING_IS_13BIT_INT(p[0])) {
+        uval = ((p[0]&0x1f)<<8) | p[1];
+        negstart = (uint64_t)1<<12;
+        negmax = 8191;
+    } else if (p[0] == LP_ENCODING_16BIT_INT) {
+        uval = (uint64_t)p[1] |
+               (uint64_t)p[2]<<8;
+        negstart = (uint64_t)1<<15;
+        negmax = UINT16_MAX;
+    } else if (p[0] == LP_ENCODING_24BIT_INT) {
+        uval = (uint64_t)p[1] |
+               (uint64_t)p[2]<<8 |
+               (uint64_t)p[3]<<16;
+        negstart = (uint64_t)1<<23;
+        negmax = UINT32_MAX>>8;
+    } else if (p[0] == LP_ENCODING_32BIT_INT) {
+        uval = (uint64_t)p[1] |
+               (uint64_t)p[2]<<8 |
+               (uint64_t)p[3]<<16 |
+               (uint64_t)p[4]<<24;
+        negstart = (uint64_t)1<<31;
+        negmax = UINT32_MAX;
+    } else if (p[0] == LP_ENCODING_64BIT_INT) {
+        uval = (uint64_t)p[1] |
+               (uint64_t)p[2]<<8 |
+               (uint64_t)p[3]<<16 |
+               (uint64_t)p[4]<<24 |
+               (uint64_t)p[5]<<32 |
+               (uint64_t)p[6]<<40 |
+               (uint64_t)p[7]<<48 |
+               (uint64_t)p[8]<<56;
+        negstart = (uint64_t)1<<63;
+        negmax = UINT64_MAX;
+    } else if (LP_ENCODING_IS_12BIT_STR(p[0])) {
+        *count = LP_ENCODING_12BIT_STR_LEN(p);
+        return p+2;
+    } else if (p[0] == LP_ENCODING_32BIT_STR) {
+        *count = LP_ENCODING_32BIT_STR_LEN(p);
+        return p+5;
+    } else {
+        uval = 12345678900000000ULL + p[0];
+        negstart = UINT64_MAX;
+        negmax = 0;
+    }
+
+    /* The integer is stored in two's complement with the width of its
+     * encoding: turn the upper half of the range into negative numbers. */
+    if (uval >= negstart) {
+        uval = negmax-uval;
+        val = uval;
+        val = -val-1;
+    } else {
+        val = uval;
+    }
+
+    if (intbuf) {
+        *count = ll2string((char*)intbuf,LP_INTBUF_SIZE,(long long)val);
+        return intbuf;
+    } else {
+        *count = val;
+        return NULL;
+    }
+}
+
+/* Same interface as ziplistGet(): strings are returned in '*sval' and
+ * '*slen', integers in '*lval' with '*sval' set to NULL. Returns 0 if 'p'
+ * is NULL or the terminator. */
+// 和 ziplistGet的用法一样，方便替换 ziplist
+int lpGetValue(unsigned char *p, unsigned char **sval, unsigned int *slen, long long *lval) {
+    int64_t count;
+    unsigned char *s;
+
+    if (p == NULL || p[0] == LP_EOF) return 0;
+    if (sval) *sval = NULL;
+    s = lpGet(p,&count,NULL);
+    if (s) {
+        if (sval) {
+            *sval = s;
+            *slen = count;
+        }
+    } else {
+        if (lval) *lval = count;
+    }
+    return 1;
+}
+
+/* Insert, delete or replace the element 'ele' of 'size' bytes at 'p'.
+ *
+ * 'where' is LP_BEFORE or LP_AFTER to insert 'ele' before or after the
+ * element at 'p', or LP_REPLACE to replace that element. When 'ele' is NULL
+ * the element at 'p' is deleted (and 'where' must be LP_REPLACE).
+ *
+ * If 'newp' is not NULL it is set to the inserted element, or for a delete
+ * to the element that followed the deleted one (NULL if there is none).
+ *
+ * Returns the new listpack, or NULL if it would exceed 4GB. */
+unsigned char *lpInsert(unsigned char *lp, unsigned char *ele, uint32_t size, unsigned char *p, int where, unsigned char **newp) {
+    unsigned char intenc[LP_MAX_INT_ENCODING_LEN];
+    unsigned char backlen[LP_MAX_BACKLEN_SIZE];
+
+    uint64_t enclen; /* The length of the encoded element. */
+
+    /* An element pointer set to NULL means deletion, which is conceptually
+     * replacing the element with a zero-length element. */
+    if (ele == NULL) where = LP_REPLACE;
+
+    /* Inserting after an element is inserting before the next one. */
+    if (where == LP_AFTER) {
+        p = lpSkip(p);
+        where = LP_BEFORE;
+    }
+
+    /* Store the offset of the element 'p', so that we can obtain its
+     * address again after a reallocation. */
+    unsigned long poff = p-lp;
+
+    int enctype;
+    if (ele) {
+        enctype = lpEncodeGetType(ele,size,intenc,&enclen);
+    } else {
+        enctype = -1;
+        enclen = 0;
+    }
+
+    /* We need to also encode the backward-parsable length of the element
+     * and append it to the end: this allows to traverse the listpack from
+     * the end to the start. */
+    unsigned long backlen_size = ele ? lpEncodeBacklen(backlen,enclen) : 0;
+    uint64_t old_listpack_bytes = lpGetTotalBytes(lp);
+    uint32_t replaced_len  = 0;
+    if (where == LP_REPLACE) {
+        replaced_len = lpCurrentEncodedSize(p);
+        replaced_len += lpEncodeBacklen(NULL,replaced_len);
+    }
+
+    uint64_t new_listpack_bytes = old_listpack_bytes + enclen + backlen_size
+                                  - replaced_len;
+    if (new_listpack_bytes > UINT32_MAX) return NULL;
+
+    /* We now need to reallocate in order to make space or shrink the
+     * allocation (in case 'when' value is LP_REPLACE and the new element is
+     * smaller). However we do that before memmoving the memory to
+     * make room for the new element if the final allocation will get
+     * larger, or we do it after if the final allocation will get smaller. */
+
+    unsigned char *dst = lp + poff; /* May be updated after reallocation. */
+
+    /* Realloc before: we need more room. */
+    if (new_listpack_bytes > old_listpack_bytes) {
+        if ((lp = zrealloc(lp,new_listpack_bytes)) == NULL) return NULL;
+        dst = lp + poff;
+    }
+
+    /* Setup the listpack relocating the elements to make the exact room
+     * we need to store the new one. */
+    if (where == LP_BEFORE) {
+        memmove(dst+enclen+backlen_size,dst,old_listpack_bytes-poff);
+    } else { /* LP_REPLACE. */
+        long lendiff = (enclen+backlen_size)-replaced_len;
+        memmove(dst+replaced_len+lendiff,
+                dst+replaced_len,
+                old_listpack_bytes-poff-replaced_len);
+    }
+
+    /* Realloc after: we need to free space. */
+    if (new_listpack_bytes < old_listpack_bytes) {
+        if ((lp = zrealloc(lp,new_listpack_bytes)) == NULL) return NULL;
+        dst = lp + poff;
+    }
+
+    /* Store the entry. */
+    if (newp) {
+        *newp = dst;
+        /* In case of deletion, set 'newp' to NULL if the next element is
+         * the EOF element. */
+        if (!ele && dst[0] == LP_EOF) *newp = NULL;
+    }
+    if (ele) {
+        if (enctype == LP_ENCODING_INT) {
+            memcpy(dst,intenc,enclen);
+        } else {
+            lpEncodeString(dst,ele,size);
+        }
+        dst += enclen;
+        memcpy(dst,backlen,backlen_size);
+        dst += backlen_size;
+    }
+
+    /* Update header. */
+    if (where != LP_REPLACE || ele == NULL) {
+        uint32_t num_elements = lpGetNumElements(lp);
+        if (num_elements != LP_HDR_NUMELE_UNKNOWN) {
+            if (ele)
+                lpSetNumElements(lp,num_elements+1);
+            else
+                lpSetNumElements(lp,num_elements-1);
+        }
+    }
+    lpSetTotalBytes(lp,new_listpack_bytes);
+    return lp;
+}
+
+/* Append the specified element 'ele' of length 'size' at the end of the
+ * listpack. */
+unsigned char *lpAppend(unsigned char *lp, unsigned char *ele, uint32_t size) {
+    uint64_t listpack_bytes = lpGetTotalBytes(lp);
+    unsigned char *eofptr = lp + listpack_bytes - 1;
+    return lpInsert(lp,ele,size,eofptr,LP_BEFORE,NULL);
+}
+
+/* Insert the specified element 'ele' of length 'size' at the start of the
+ * listpack. */
+unsigned char *lpPrepend(unsigned char *lp, unsigned char *ele, uint32_t size) {
+    unsigned char *p = lpFirst(lp);
+    if (!p) return lpAppend(lp,ele,size);
+    return lpInsert(lp,ele,size,p,LP_BEFORE,NULL);
+}
+
+/* Remove the element at 'p'. See lpInsert() for the meaning of 'newp'. */
+unsigned char *lpDelete(unsigned char *lp, unsigned char *p, unsigned char **newp) {
+    return lpInsert(lp,NULL,0,p,LP_REPLACE,newp);
+}
+
+/* Delete 'num' consecutive elements starting at 'index' (negative indexes
+ * count from the tail), with a single memmove. */
+unsigned char *lpDeleteRange(unsigned char *lp, long index, unsigned long num) {
+    unsigned char *first, *tail;
+    uint32_t numele = lpGetNumElements(lp);
+    uint64_t bytes = lpGetTotalBytes(lp);
+    unsigned long deleted = 0;
+
+    if (num == 0) return lp;
+    if ((first = lpSeek(lp,index)) == NULL) return lp;
+
+    tail = first;
+    while (deleted < num && tail[0] != LP_EOF) {
+        tail = lpSkip(tail);
+        deleted++;
+    }
+
+    memmove(first,tail,lp+bytes-tail);
+    bytes -= tail-first;
+    lp = zrealloc(lp,bytes);
+    lpSetTotalBytes(lp,bytes);
+    if (numele != LP_HDR_NUMELE_UNKNOWN)
+        lpSetNumElements(lp,numele-deleted);
+    return lp;
+}
+
+/* Merge listpacks 'first' and 'second' by appending 'second' to 'first',
+ * with the same contract of ziplistMerge(): the larger of the two is
+ * reallocated to hold the result, the other one is freed and its pointer
+ * set to NULL. Returns the merged listpack, or NULL if the merge is not
+ * possible. */
+unsigned char *lpMerge(unsigned char **first, unsigned char **second) {
+    if (first == NULL || *first == NULL || second == NULL || *second == NULL)
+        return NULL;
+    if (*first == *second) return NULL;
+
+    size_t first_bytes = lpGetTotalBytes(*first);
+    size_t second_bytes = lpGetTotalBytes(*second);
+    uint32_t first_len = lpGetNumElements(*first);
+    uint32_t second_len = lpGetNumElements(*second);
+    size_t body_first = first_bytes-LP_HDR_SIZE-1;
+    size_t body_second = second_bytes-LP_HDR_SIZE-1;
+    size_t lpbytes = LP_HDR_SIZE+body_first+body_second+1;
+    unsigned char *target;
+    uint32_t lplength;
+
+    if (lpbytes > UINT32_MAX) return NULL;
+
+    // 和 ziplistMerge一样，在较大的那个上面 realloc
+    if (first_bytes >= second_bytes) {
+        target = zrealloc(*first,lpbytes);
+        memcpy(target+LP_HDR_SIZE+body_first,*second+LP_HDR_SIZE,
+               body_second+1);
+        zfree(*second);
+    } else {
+        target = zrealloc(*second,lpbytes);
+        memmove(target+LP_HDR_SIZE+body_first,target+LP_HDR_SIZE,
+                body_second+1);
+        memcpy(target+LP_HDR_SIZE,*first+LP_HDR_SIZE,body_first);
+        zfree(*first);
+    }
+
+    if (first_len == LP_HDR_NUMELE_UNKNOWN ||
+        second_len == LP_HDR_NUMELE_UNKNOWN ||
+        first_len+second_len >= LP_HDR_NUMELE_UNKNOWN)
+        lplength = LP_HDR_NUMELE_UNKNOWN;
+    else
+        lplength = first_len+second_len;
+    lpSetTotalBytes(target,lpbytes);
+    lpSetNumElements(target,lplength);
+
+    *first = target;
+    *second = NULL;
+    return target;
+}
+
+/* Return 1 if the element at 'p' is equal to the string 's' of 'slen'
+ * bytes, like ziplistCompare() does. */
+int lpCompare(unsigned char *p, unsigned char *s, unsigned int slen) {
+    unsigned char *value;
+    int64_t count;
+    long long sval;
+
+    if (p[0] == LP_EOF) return 0;
+    value = lpGet(p,&count,NULL);
+    if (value) {
+        return count == slen && memcmp(value,s,slen) == 0;
+    } else {
+        if (string2ll((char*)s,slen,&sval)) return count == sval;
+        return 0;
+    }
+}
+
+/* Find the first element equal to 's' starting at 'p', comparing one
+ * element every 'skip'+1, like ziplistFind() does. Returns NULL if no
+ * element matches.
+ *
+ * The encoding of an element only depends on its value: a string that is
+ * the representation of an integer is always stored as that integer with
+ * the smallest encoding, and the header of the other strings only depends
+ * on their length. So 's' is encoded once, and the elements are compared
+ * with it byte by byte without decoding them: the first byte alone rejects
+ * the integers when looking for a string, the strings of another length
+ * and, in a sorted set, all the scores that are not stored as strings. */
+// 元素的编码只取决于它的值，把 's' 编码一次之后直接按字节比较，
+// 大部分不相等的元素看第一个字节就能排除
+unsigned char *lpFind(unsigned char *lp, unsigned char *p, unsigned char *s, unsigned int slen, unsigned int skip) {
+    unsigned char hdr[LP_MAX_INT_ENCODING_LEN];
+    uint64_t enclen;
+    uint32_t hdrlen, datalen;
+    int skipcnt = 0;
+
+    ((void) lp);
+    if (p == NULL) return NULL;
+    if (lpEncodeGetType(s,slen,hdr,&enclen) == LP_ENCODING_INT) {
+        /* The whole integer encoding is the header, there is no data. */
+        hdrlen = enclen;
+        datalen = 0;
+    } else {
+        hdrlen = lpEncodeStringHeader(hdr,slen);
+        datalen = slen;
+    }
+
+    while (p[0] != LP_EOF) {
+        if (skipcnt == 0) {
+            /* The first byte tells the kind of encoding, so when it matches
+             * the entry has a header as long as 'hdr'. The last byte of the
+             * string is checked before the rest, since keys often share a
+             * prefix like "user:". */
+            if (p[0] == hdr[0] &&
+                (hdrlen == 1 || memcmp(p+1,hdr+1,hdrlen-1) == 0) &&
+                (datalen == 0 ||
+                 (p[hdrlen+datalen-1] == s[datalen-1] &&
+                  memcmp(p+hdrlen,s,datalen) == 0))) return p;
+            skipcnt = skip;
+        } else {
+            skipcnt--;
+        }
+        p = lpSkip(p);
+    }
+    return NULL;
+}
+
+/* Return the total number of bytes the listpack is composed of. */
+uint32_t lpBytes(unsigned char *lp) {
+    return lpGetTotalBytes(lp);
+}
+
+/* Seek the element at 'index', negative indexes count from the tail (-1
+ * is the last element). Returns NULL if the index is out of range. The
+ * listpack is walked from the nearest end. */
+unsigned char *lpSeek(unsigned char *lp, long index) {
+    int forward = 1; /* Seek forward by default. */
+
+    /* We want to seek from left to right or the other way around
+     * depending on the listpack length and the element position. */
+    uint32_t numele = lpLength(lp);
+    if (index < 0) index = (long)numele+index;
+    if (index < 0) return NULL; /* Index still < 0 means out of range. */
+    if (index >= (long)numele) return NULL; /* Out of range the other side. */
+    /* We want to scan right-to-left if the element we are looking for
+     * is past the half of the listpack. */
+    if (index > (long)numele/2) {
+        forward = 0;
+        /* Right to left scanning always expects a negative index. Convert
+         * our index to negative form. */
+        index -= numele;
+    }
+
+    /* Forward and backward scanning is trivially based on lpNext()/lpPrev(). */
+    if (forward) {
+        unsigned char *ele = lpFirst(lp);
+        while (index > 0 && ele) {
+            ele = lpNext(lp,ele);
+            index--;
+        }
+        return ele;
+    } else {
+        unsigned char *ele = lpLast(lp);
+        while (index < -1 && ele) {
+            ele = lpPrev(lp,ele);
+            index++;
+        }
+        return ele;
+    }
+}
+
+/* Return the number of bytes an entry holding a string of 'size' bytes
+ * takes, used to estimate the size of a listpack before an insert. */
+size_t lpEntrySizeString(uint32_t size) {
+    uint64_t enclen;
+
+    if (size < 64) enclen = 1+size;
+    else if (size < 4096) enclen = 2+size;
+    else enclen = 5+(uint64_t)size;
+    return enclen+lpEncodeBacklen(NULL,enclen);
+}
+
+/* Convert a ziplist into a listpack holding the same elements, used to
+ * load data stored in the older format. The ziplist is not freed. */
+unsigned char *lpFromZiplist(unsigned char *zl) {
+    unsigned char *lp = lpNew();
+    unsigned char *p = ziplistIndex(zl,0);
+    unsigned char *vstr;
+    unsigned int vlen;
+    long long vll;
+
+    while (p && ziplistGet(p,&vstr,&vlen,&vll)) {
+        if (vstr) {
+            lp = lpAppend(lp,vstr,vlen);
+        } else {
+            char buf[LP_INTBUF_SIZE];
+            int len = ll2string(buf,sizeof(buf),vll);
+            lp = lpAppend(lp,(unsigned char*)buf,len);
+        }
+        p = ziplistNext(zl,p);
+    }
+    return lp;
+}
+
+#ifdef REDIS_TEST
+#include <stdio.h>
+#include <sys/time.h>
+
+#define lpTestAssert(_e) do { \
+    if (!(_e)) { \
+        printf("%s:%d: assertion failed: %s\n", __FILE__, __LINE__, #_e); \
+        exit(1); \
+    } \
+} while(0)
+
+static long long lpUstime(void) {
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return ((long long)tv.tv_sec)*1000000+tv.tv_usec;
+}
+
+/* Check that the element at 'p' is the string 'expected'. */
+static int lpTestValueIs(unsigned char *p, const char *expected) {
+    unsigned char buf[LP_INTBUF_SIZE];
+    int64_t len;
+    unsigned char *v = lpGet(p,&len,buf);
+    return len == (int64_t)strlen(expected) && memcmp(v,expected,len) == 0;
+}
+
+int listpackTest(int argc, char *argv[]) {
+    unsigned char *lp, *p;
+    char buf[64];
+    int j;
+
+    (void)argc; (void)argv;
+
+    printf("Create, append, prepend and seek: ");
+    lp = lpNew();
+    lp = lpAppend(lp,(unsigned char*)"hello",5);
+    lp = lpAppend(lp,(unsigned char*)"1024",4);
+    lp = lpPrepend(lp,(unsigned char*)"-100000",7);
+    lp = lpAppend(lp,(unsigned char*)"foo",3);
+    lpTestAssert(lpLength(lp) == 4);
+    lpTestAssert(lpTestValueIs(lpSeek(lp,0),"-100000"));
+    lpTestAssert(lpTestValueIs(lpSeek(lp,1),"hello"));
+    lpTestAssert(lpTestValueIs(lpSeek(lp,2),"1024"));
+    lpTestAssert(lpTestValueIs(lpSeek(lp,-1),"foo"));
+    lpTestAssert(lpSeek(lp,4) == NULL && lpSeek(lp,-5) == NULL);
+    printf("ok\n");
+
+    printf("Iterate backward: ");
+    p = lpLast(lp);
+    lpTestAssert(lpTestValueIs(p,"foo"));
+    p = lpPrev(lp,p);
+    lpTestAssert(lpTestValueIs(p,"1024"));
+    p = lpPrev(lp,lpPrev(lp,p));
+    lpTestAssert(lpTestValueIs(p,"-100000") && lpPrev(lp,p) == NULL);
+    printf("ok\n");
+
+    printf("Compare and find: ");
+    lpTestAssert(lpCompare(lpSeek(lp,2),(unsigned char*)"1024",4));
+    lpTestAssert(!lpCompare(lpSeek(lp,2),(unsigned char*)"1025",4));
+    lpTestAssert(lpCompare(lpSeek(lp,1),(unsigned char*)"hello",5));
+    p = lpFind(lp,lpFirst(lp),(unsigned char*)"foo",3,0);
+    lpTestAssert(p == lpSeek(lp,3));
+    p = lpFind(lp,lpFirst(lp),(unsigned char*)"1024",4,1);
+    lpTestAssert(p == lpSeek(lp,2));
+    lpTestAssert(lpFind(lp,lpFirst(lp),(unsigned char*)"foo",3,1) == NULL);
+    printf("ok\n");
+
+    printf("Replace and delete: ");
+    p = lpSeek(lp,1);
+    lp = lpInsert(lp,(unsigned char*)"a longer string than before",27,p,
+                  LP_REPLACE,&p);
+    lpTestAssert(lpTestValueIs(p,"a longer string than before"));
+    lp = lpDelete(lp,p,&p);
+    lpTestAssert(lpTestValueIs(p,"1024") && lpLength(lp) == 3);
+    lp = lpDelete(lp,lpLast(lp),&p);
+    lpTestAssert(p == NULL && lpLength(lp) == 2);
+    lpFree(lp);
+    printf("ok\n");
+
+    printf("Integer encodings round trip: ");
+    {
+        long long values[] = {0, 127, 128, -1, -4096, 4095, 4096, -32768,
+            32767, 8388607, -8388608, 2147483647LL, -2147483648LL,
+            9223372036854775807LL, -9223372036854775807LL-1};
+        int count = sizeof(values)/sizeof(values[0]);
+
+        lp = lpNew();
+        for (j = 0; j < count; j++) {
+            int len = ll2string(buf,sizeof(buf),values[j]);
+            lp = lpAppend(lp,(unsigned char*)buf,len);
+        }
+        for (j = 0, p = lpFirst(lp); j < count; j++, p = lpNext(lp,p)) {
+            unsigned char *sval;
+            unsigned int slen;
+            long long lval;
+            lpTestAssert(lpGetValue(p,&sval,&slen,&lval));
+            lpTestAssert(sval == NULL && lval == values[j]);
+        }
+        lpFree(lp);
+    }
+    printf("ok\n");
+
+    printf("Delete range and merge: ");
+    {
+        unsigned char *a = lpNew(), *b = lpNew();
+        for (j = 0; j < 100; j++) {
+            int len = snprintf(buf,sizeof(buf),"element-%d",j);
+            a = lpAppend(a,(unsigned char*)buf,len);
+            b = lpAppend(b,(unsigned char*)buf,len);
+        }
+        a = lpDeleteRange(a,10,20);
+        lpTestAssert(lpLength(a) == 80);
+        lpTestAssert(lpTestValueIs(lpSeek(a,10),"element-30"));
+        a = lpDeleteRange(a,-5,100);
+        lpTestAssert(lpLength(a) == 75);
+        lpTestAssert(lpTestValueIs(lpLast(a),"element-94"));
+        lpTestAssert(lpMerge(&a,&b) != NULL && b == NULL);
+        lpTestAssert(lpLength(a) == 175);
+        lpTestAssert(lpTestValueIs(lpSeek(a,75),"element-0"));
+        lpTestAssert(lpTestValueIs(lpLast(a),"element-99"));
+        lpFree(a);
+    }
+    printf("ok\n");
+
+    printf("Many elements and unknown length header: ");
+    lp = lpNew();
+    for (j = 0; j < 70000; j++) lp = lpAppend(lp,(unsigned char*)"x",1);
+    lpTestAssert(lpLength(lp) == 70000);
+    p = lpSeek(lp,-1);
+    lpTestAssert(lpTestValueIs(p,"x"));
+    lp = lpDeleteRange(lp,0,10000);
+    lpTestAssert(lpLength(lp) == 60000);
+    lpFree(lp);
+    printf("ok\n");
+
+    printf("Ziplist conversion: ");
+    {
+        unsigned char *zl = ziplistNew();
+        zl = ziplistPush(zl,(unsigned char*)"foo",3,ZIPLIST_TAIL);
+        zl = ziplistPush(zl,(unsigned char*)"-12345",6,ZIPLIST_TAIL);
+        lp = lpFromZiplist(zl);
+        lpTestAssert(lpLength(lp) == 2);
+        lpTestAssert(lpTestValueIs(lpFirst(lp),"foo"));
+        lpTestAssert(lpTestValueIs(lpLast(lp),"-12345"));
+        lpFree(lp);
+        zfree(zl);
+    }
+    printf("ok\n");
+
+    /* Entries just below and above 254 bytes in front of many small
+     * entries: with a ziplist every insert in front would need to grow
+     * the prevlen of the next entry, here the rest is never touched. */
+    printf("Inserts around the 254 bytes boundary: ");
+    {
+        char big[300];
+        long long start;
+
+        memset(big,'a',sizeof(big));
+        lp = lpNew();
+        for (j = 0; j < 1000; j++) lp = lpAppend(lp,(unsigned char*)big,250+j%10);
+        start = lpUstime();
+        for (j = 0; j < 1000; j++) {
+            p = lpSeek(lp,j*7 % lpLength(lp));
+            lp = lpInsert(lp,(unsigned char*)big,240+j%30,p,LP_BEFORE,NULL);
+        }
+        lpTestAssert(lpLength(lp) == 2000);
+        for (p = lpFirst(lp), j = 0; p; p = lpNext(lp,p)) j++;
+        lpTestAssert(j == 2000);
+        printf("ok (%lld usec)\n", lpUstime()-start);
+        lpFree(lp);
+    }
+
+    /* lpFind() compares the encoded bytes, check it against lpCompare()
+     * with values of every encoding and strings that look like integers
+     * but are not stored as such. */
+    printf("Find matches a decoding scan: ");
+    {
+        static char *odd[] = {"007","-0","+1","1a"," 1","","-",
+                              "18446744073709551616","-9223372036854775808"};
+        char buf[5000];
+        unsigned char *q;
+        int len, k, skip;
+
+        srand(1234);
+        lp = lpNew();
+        for (j = 0; j < 2000; j++) {
+            switch(rand() % 4) {
+            case 0:
+                len = snprintf(buf,sizeof(buf),"%lld",
+                               (long long)(rand()-RAND_MAX/2) * (1LL << (rand()%33)));
+                break;
+            case 1:
+                len = snprintf(buf,sizeof(buf),"%d",rand()%300);
+                break;
+            case 2:
+                k = rand() % (int)(sizeof(odd)/sizeof(odd[0]));
+                len = snprintf(buf,sizeof(buf),"%s",odd[k]);
+                break;
+            default:
+                len = (rand() % 10 == 0) ? 4090+rand()%10 : rand()%130;
+                memset(buf,'a'+rand()%3,len);
+                break;
+            }
+            lp = lpAppend(lp,(unsigned char*)buf,len);
+        }
+        for (skip = 0; skip <= 1; skip++) {
+            for (p = lpFirst(lp); p; p = lpNext(lp,p)) {
+                unsigned char *sval = NULL, *expected = NULL;
+                unsigned int slen = 0;
+                long long lval = 0;
+
+                lpGetValue(p,&sval,&slen,&lval);
+                if (!sval) {
+                    slen = ll2string(buf,sizeof(buf),lval);
+                    sval = (unsigned char*)buf;
+                }
+                for (q = lpFirst(lp), k = 0; q; q = lpNext(lp,q), k++) {
+                    if (k % (skip+1) == 0 && lpCompare(q,sval,slen)) {
+                        expected = q;
+                        break;
+                    }
+                }
+                lpTestAssert(lpFind(lp,lpFirst(lp),sval,slen,skip) == expected);
+            }
+        }
+        lpTestAssert(lpFind(lp,lpFirst(lp),(unsigned char*)"b",1,0) == NULL);
+        lpFree(lp);
+    }
+    printf("ok\n");
+
+    /* The lookup done by ZSCORE on a sorted set at the default
+     * zset-max-ziplist-entries: members and scores alternate. */
+    printf("Benchmark find in a 128 members sorted set: ");
+    {
+        char ele[32];
+        unsigned char *q;
+        long long start, naive, fast;
+        int k, found = 0;
+
+        lp = lpNew();
+        for (j = 0; j < 128; j++) {
+            lp = lpAppend(lp,(unsigned char*)ele,
+                          snprintf(ele,sizeof(ele),"member:%d",j));
+            lp = lpAppend(lp,(unsigned char*)ele,
+                          snprintf(ele,sizeof(ele),"%.17g",j*1.5));
+        }
+        start = lpUstime();
+        for (k = 0; k < 100000; k++) {
+            int len = snprintf(ele,sizeof(ele),"member:%d",k%128);
+            for (q = lpFirst(lp); q; q = lpNext(lp,lpNext(lp,q))) {
+                if (lpCompare(q,(unsigned char*)ele,len)) {
+                    found++;
+                    break;
+                }
+            }
+        }
+        naive = lpUstime()-start;
+        start = lpUstime();
+        for (k = 0; k < 100000; k++) {
+            int len = snprintf(ele,sizeof(ele),"member:%d",k%128);
+            if (lpFind(lp,lpFirst(lp),(unsigned char*)ele,len,1)) found--;
+        }
+        fast = lpUstime()-start;
+        lpTestAssert(found == 0);
+        printf("ok (decoding scan %lld usec, lpFind %lld usec)\n",naive,fast);
+        lpFree(lp);
+    }
+
+    return 0;
+}
+#endif
@@ -78,8 +78,13 @@ robj *makeObjectShared(robj *o) {
 }
 
 /* Create a string object with encoding OBJ_ENCODING_RAW, that is a plain
- * string object where o->ptr points to a proper sds string. */
-// 创建 rawString 对象(rawString是 > 44 字节的 sds)
+ * string object where o->ptr points to a proper sds string.
+ *
+ * The sds is never a shared one: APPEND, SETRANGE and the modules StringDMA
+ * modify the value in place as soon as dbUnshareStringValue() sees a refcount
+ * of 1 on the object, regardless of the references to the sds. */
+// 创建 rawString 对象(rawString是 > 44 字节的 sds)，不使用共享 sds，
+// 因为字符串的值可能被原地修改
 robj *createRawStringObject(const char *ptr, size_t len) {
     return createObject(OBJ_STRING, sdsnewlen(ptr,len));
 }
@@ -263,6 +268,14 @@ robj *createIntsetObject(void) {
     return o;
 }
 
+// 创建一个 roaring bitmap 编码的 set 对象，用于 intset放不下的大整数集合
+robj *createRoaringSetObject(void) {
+    roaring *r = roaringNew();
+    robj *o = createObject(OBJ_SET,r);
+    o->encoding = OBJ_ENCODING_ROARING;
+    return o;
+}
+
 // 创建一个 hash 对象，使用 ziplist 创建
 robj *createHashObject(void) {
     unsigned char *zl = ziplistNew();
@@ -278,16 +291,30 @@ robj *createZsetObject(void) {
 
     zs->dict = dictCreate(&zsetDictType,NULL);
     zs->zsl = zslCreate();
+    zs->zbt = NULL;
     o = createObject(OBJ_ZSET,zs);
     o->encoding = OBJ_ENCODING_SKIPLIST;
     return o;
 }
 
-// 创建一个 ziplist 编码的有序集合
+// 创建一个 B+树编码的有序集合，字典中直接保存分值
+robj *createZsetBtreeObject(void) {
+    zset *zs = zmalloc(sizeof(*zs));
+    robj *o;
+
+    zs->dict = dictCreate(&zsetDictType,NULL);
+    zs->zsl = NULL;
+    zs->zbt = zbtCreate();
+    o = createObject(OBJ_ZSET,zs);
+    o->encoding = OBJ_ENCODING_BTREE;
+    return o;
+}
+
+// 创建一个 listpack 编码的有序集合（沿用 ziplist 时代的函数名）
 robj *createZsetZiplistObject(void) {
-    unsigned char *zl = ziplistNew();
-    robj *o = createObject(OBJ_ZSET,zl);
-    o->encoding = OBJ_ENCODING_ZIPLIST;
+    unsigned char *lp = lpNew();
+    robj *o = createObject(OBJ_ZSET,lp);
+    o->encoding = OBJ_ENCODING_LISTPACK;
     return o;
 }
 
@@ -323,7 +350,7 @@ void freeListObject(robj *o) {
     }
 }
 
-// 释放集合 set 对象（hash table 或者 intset 实现）
+// 释放集合 set 对象（hash table、intset 或者 roaring 实现）
 void freeSetObject(robj *o) {
     switch (o->encoding) {
     case OBJ_ENCODING_HT:
@@ -332,6 +359,9 @@ void freeSetObject(robj *o) {
     case OBJ_ENCODING_INTSET:
         zfree(o->ptr);
         break;
+    case OBJ_ENCODING_ROARING:
+        roaringFree(o->ptr);
+        break;
     default:
         serverPanic("Unknown set encoding type");
     }
@@ -347,8 +377,14 @@ void freeZsetObject(robj *o) {
         zslFree(zs->zsl);
         zfree(zs);
         break;
-    case OBJ_ENCODING_ZIPLIST:
-        zfree(o->ptr);
+    case OBJ_ENCODING_BTREE:
+        zs = o->ptr;
+        dictRelease(zs->dict);
+        zbtFree(zs->zbt);
+        zfree(zs);
+        break;
+    case OBJ_ENCODING_LISTPACK:
+        lpFree(o->ptr);
         break;
     default:
         serverPanic("Unknown sorted set encoding");
@@ -387,6 +423,29 @@ void incrRefCount(robj *o) {
     if (o->refcount != OBJ_SHARED_REFCOUNT) o->refcount++;
 }
 
+/* Return the number of allocations releasing the object would touch, that
+ * is what decides if bgfreeDecrRefCount() frees it in the background.
+ * Values made of a single allocation return 1. */
+// 估算释放对象的代价，也就是需要释放的内存块个数
+size_t objectFreeEffort(robj *o) {
+    if (o->type == OBJ_LIST && o->encoding == OBJ_ENCODING_QUICKLIST) {
+        quicklist *ql = o->ptr;
+        return ql->len;
+    } else if (o->type == OBJ_SET && o->encoding == OBJ_ENCODING_HT) {
+        return dictSize((dict*)o->ptr);
+    } else if (o->type == OBJ_SET && o->encoding == OBJ_ENCODING_ROARING) {
+        return ((roaring*)o->ptr)->len;
+    } else if (o->type == OBJ_ZSET && (o->encoding == OBJ_ENCODING_SKIPLIST ||
+                                       o->encoding == OBJ_ENCODING_BTREE)) {
+        zset *zs = o->ptr;
+        return dictSize(zs->dict);
+    } else if (o->type == OBJ_HASH && o->encoding == OBJ_ENCODING_HT) {
+        return dictSize((dict*)o->ptr);
+    } else {
+        return 1; /* Everything else is a single allocation. */
+    }
+}
+
 // 对象引用计数减 1
 void decrRefCount(robj *o) {
     // 如果只有一个引用，直接释放这个对象
@@ -803,8 +862,11 @@ char *strEncoding(int encoding) {
     case OBJ_ENCODING_HT: return "hashtable";
     case OBJ_ENCODING_QUICKLIST: return "quicklist";
     case OBJ_ENCODING_ZIPLIST: return "ziplist";
+    case OBJ_ENCODING_LISTPACK: return "listpack";
     case OBJ_ENCODING_INTSET: return "intset";
+    case OBJ_ENCODING_ROARING: return "roaring";
     case OBJ_ENCODING_SKIPLIST: return "skiplist";
+    case OBJ_ENCODING_BTREE: return "btree";
     case OBJ_ENCODING_EMBSTR: return "embstr";
     default: return "unknown";
     }
@@ -838,11 +900,41 @@ size_t streamRadixTreeMemoryUsage(rax *rax) {
     return size;
 }
 
+/* Memory of the dict of a sorted set: its members are accounted by the
+ * skiplist or the B+tree, and the scores are in the entries. */
+static size_t objectZsetDictSize(dict *d) {
+    size_t size = sizeof(dict)+dictSize(d)*sizeof(struct dictEntry)+
+                  dictSlots(d)*sizeof(struct dictEntry*);
+    if (dictIsOpen(d)) size += dictSlots(d); /* Control bytes. */
+    return size;
+}
+
+/* Part of the shared members of the sorted set 'zs' that belongs to it,
+ * that the counters of its skiplist or B+tree leave out: "sample_size"
+ * members are checked and averaged like for the other types. */
+// 共享的成员不计入跳表和 B+树的计数，这里采样估算它们按引用平分的大小
+static size_t objectZsetSharedSize(zset *zs, size_t sample_size) {
+    dictIterator *di = dictGetIterator(zs->dict);
+    dictEntry *de;
+    size_t elesize = 0, samples = 0;
+
+    while((de = dictNext(di)) != NULL && samples < sample_size) {
+        sds ele = dictGetKey(de);
+        if (sdsIsShared(ele)) elesize += sdsAllocSize(ele)/sdsrefcount(ele);
+        samples++;
+    }
+    dictReleaseIterator(di);
+    return samples ? (double)elesize/samples*dictSize(zs->dict) : 0;
+}
+
 /* Returns the size in bytes consumed by the key's value in RAM.
- * Note that the returned value is just an approximation, especially in the
- * case of aggregated data types where only "sample_size" elements
- * are checked and averaged to estimate the total size. */
-#define OBJ_COMPUTE_SIZE_DEF_SAMPLES 5 /* Default sample size. */
+ * Lists keep their size up to date as they are modified, compressed
+ * nodes at their compressed size, so for them the value is exact and
+ * computed in constant time. Sorted sets do the same for their structure
+ * and the members they own, only the shares of the shared members are
+ * sampled. For the other aggregated data types it is just an
+ * approximation, where only "sample_size" elements are checked and
+ * averaged to estimate the total size. */
 size_t objectComputeSize(robj *o, size_t sample_size) {
     sds ele, ele2;
     dict *d;
@@ -854,7 +946,8 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
         if(o->encoding == OBJ_ENCODING_INT) {
             asize = sizeof(*o);
         } else if(o->encoding == OBJ_ENCODING_RAW) {
-            asize = sdsAllocSize(o->ptr)+sizeof(*o);
+            /* A shared buffer is split among the values holding it. */
+            asize = sdsAllocSize(o->ptr)/sdsrefcount(o->ptr)+sizeof(*o);
         } else if(o->encoding == OBJ_ENCODING_EMBSTR) {
             asize = sdslen(o->ptr)+2+sizeof(*o);
         } else {
@@ -862,14 +955,11 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
         }
     } else if (o->type == OBJ_LIST) {
         if (o->encoding == OBJ_ENCODING_QUICKLIST) {
+            // quicklist 自己维护节点的总字节数，不需要再采样
             quicklist *ql = o->ptr;
-            quicklistNode *node = ql->head;
-            asize = sizeof(*o)+sizeof(quicklist);
-            do {
-                elesize += sizeof(quicklistNode)+ziplistBlobLen(node->zl);
-                samples++;
-            } while ((node = node->next) && samples < sample_size);
-            asize += (double)elesize/samples*ql->len;
+            asize = sizeof(*o)+sizeof(quicklist)+ql->bytes;
+            if (ql->cache)
+                asize += sizeof(*ql->cache)+ql->cache->stats.bytes;
         } else if (o->encoding == OBJ_ENCODING_ZIPLIST) {
             asize = sizeof(*o)+ziplistBlobLen(o->ptr);
         } else {
@@ -882,7 +972,8 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
             asize = sizeof(*o)+sizeof(dict)+(sizeof(struct dictEntry*)*dictSlots(d));
             while((de = dictNext(di)) != NULL && samples < sample_size) {
                 ele = dictGetKey(de);
-                elesize += sizeof(struct dictEntry) + sdsAllocSize(ele);
+                elesize += dictEntryMemUsage(d,de);
+                if (!dictIsKeyEmbedded(d,de)) elesize += sdsAllocSize(ele);
                 samples++;
             }
             dictReleaseIterator(di);
@@ -890,24 +981,27 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
         } else if (o->encoding == OBJ_ENCODING_INTSET) {
             intset *is = o->ptr;
             asize = sizeof(*o)+sizeof(*is)+is->encoding*is->length;
+        } else if (o->encoding == OBJ_ENCODING_ROARING) {
+            asize = sizeof(*o)+roaringBytes(o->ptr);
         } else {
             serverPanic("Unknown set encoding");
         }
     } else if (o->type == OBJ_ZSET) {
-        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-            asize = sizeof(*o)+(ziplistBlobLen(o->ptr));
+        if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            asize = sizeof(*o)+(lpBytes(o->ptr));
         } else if (o->encoding == OBJ_ENCODING_SKIPLIST) {
-            d = ((zset*)o->ptr)->dict;
-            zskiplist *zsl = ((zset*)o->ptr)->zsl;
-            zskiplistNode *znode = zsl->header->level[0].forward;
-            asize = sizeof(*o)+sizeof(zset)+(sizeof(struct dictEntry*)*dictSlots(d));
-            while(znode != NULL && samples < sample_size) {
-                elesize += sdsAllocSize(znode->ele);
-                elesize += sizeof(struct dictEntry) + zmalloc_size(znode);
-                samples++;
-                znode = znode->level[0].forward;
-            }
-            if (samples) asize += (double)elesize/samples*dictSize(d);
+            /* The skiplist counts its nodes and the members it owns, that
+             * are shared with the dict. */
+            // 跳表和 B+树都精确维护了自己的内存，字典的部分直接计算
+            zset *zs = o->ptr;
+            asize = sizeof(*o)+sizeof(zset)+zs->zsl->bytes+
+                    objectZsetDictSize(zs->dict)+
+                    objectZsetSharedSize(zs,sample_size);
+        } else if (o->encoding == OBJ_ENCODING_BTREE) {
+            zset *zs = o->ptr;
+            asize = sizeof(*o)+sizeof(zset)+sizeof(*zs->zbt)+zs->zbt->bytes+
+                    zs->zbt->ele_bytes+objectZsetDictSize(zs->dict)+
+                    objectZsetSharedSize(zs,sample_size);
         } else {
             serverPanic("Unknown sorted set encoding");
         }
@@ -921,8 +1015,8 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
             while((de = dictNext(di)) != NULL && samples < sample_size) {
                 ele = dictGetKey(de);
                 ele2 = dictGetVal(de);
-                elesize += sdsAllocSize(ele) + sdsAllocSize(ele2);
-                elesize += sizeof(struct dictEntry);
+                if (!dictIsKeyEmbedded(d,de)) elesize += sdsAllocSize(ele);
+                elesize += sdsAllocSize(ele2) + dictEntryMemUsage(d,de);
                 samples++;
             }
             dictReleaseIterator(di);
@@ -1126,6 +1220,19 @@ struct redisMemOverhead *getMemoryOverheadData(void) {
         mh->num_dbs++;
     }
 
+    /* Part of the dataset held by lists and sorted sets, as counted by the
+     * structures themselves (the dicts of the sorted sets are not
+     * included). */
+    mh->dataset_lists = quicklistTotalBytes();
+    mh->dataset_zsets_skiplist = zslTotalBytes();
+    mh->dataset_zsets_btree = zbtTotalBytes();
+
+    /* Memory held by the slab pools but not handed out is overhead too. */
+    mh->num_slab_pools = slabGetStats(mh->slab_pools,SLAB_CLASSES);
+    for (j = 0; j < (int)mh->num_slab_pools; j++)
+        mh->slab_free += mh->slab_pools[j].free;
+    mem_total += mh->slab_free;
+
     mh->overhead_total = mem_total;
     mh->dataset = zmalloc_used - mem_total;
     mh->peak_perc = (float)zmalloc_used*100/mh->peak_allocated;
@@ -1161,6 +1268,8 @@ sds getMemoryDoctorReport(void) {
     int big_slave_buf = 0;  /* Slave buffers are too big. */
     int big_client_buf = 0; /* Client buffers are too big. */
     int many_scripts = 0;   /* Script cache has too many scripts. */
+    int big_lists = 0;      /* Uncompressed lists hold most of the dataset. */
+    int big_skiplists = 0;  /* Skiplist sorted sets hold most of the dataset. */
     int num_reports = 0;
     struct redisMemOverhead *mh = getMemoryOverheadData();
 
@@ -1217,6 +1326,23 @@ sds getMemoryDoctorReport(void) {
             many_scripts = 1;
             num_reports++;
         }
+
+        /* More than half of the dataset in uncompressed lists? */
+        if (server.list_compress_depth == 0 &&
+            mh->dataset_lists > mh->dataset/2)
+        {
+            big_lists = 1;
+            num_reports++;
+        }
+
+        /* More than half of the dataset in skiplists, while the B+tree
+         * encoding would use less memory per member? */
+        if (!server.zset_btree_encoding &&
+            mh->dataset_zsets_skiplist > mh->dataset/2)
+        {
+            big_skiplists = 1;
+            num_reports++;
+        }
     }
 
     sds s;
@@ -1257,6 +1383,12 @@ sds getMemoryDoctorReport(void) {
         if (many_scripts) {
             s = sdscat(s," * Many scripts: There seem to be many cached scripts in this instance (more than 1000). This may be because scripts are generated and `EVAL`ed, instead of being parameterized (with KEYS and ARGV), `SCRIPT LOAD`ed and `EVALSHA`ed. Unless `SCRIPT FLUSH` is called periodically, the scripts' caches may end up consuming most of your memory.\n\n");
         }
+        if (big_lists) {
+            s = sdscatprintf(s," * Big uncompressed lists: Lists use %zu bytes, more than half of the dataset, and none of their nodes is compressed. If the lists are mostly accessed at the ends, setting 'list-compress-depth' to 1 or more can save a good part of this memory.\n\n", mh->dataset_lists);
+        }
+        if (big_skiplists) {
+            s = sdscatprintf(s," * Big skiplist sorted sets: Sorted sets encoded as skiplists use %zu bytes, more than half of the dataset. The B+tree encoding, enabled with 'zset-btree-encoding yes', replaces the skiplist nodes but keeps the member dict, it needs about 25% less memory per member for large sorted sets.\n\n", mh->dataset_zsets_skiplist);
+        }
         s = sdscat(s,"I'm here to keep you safe, Sam. I want to help you.\n");
     }
     freeMemoryOverheadData(mh);
@@ -1289,6 +1421,35 @@ void objectSetLRUOrLFU(robj *val, long long lfu_freq, long long lru_idle,
     }
 }
 
+/* Eviction score of the key of 'de' for server.maxmemory_policy, used as
+ * the evictPoolScoreFunction of the eviction pool of the db 'privdata'.
+ * 'de' is an entry of the keyspace for the allkeys policies, and of the
+ * expires dict for the volatile ones, like the samples of the eviction
+ * pool. The higher the score the better the victim. */
+// 计算 key的淘汰分数，供 evictpool.c中的候选池使用
+unsigned long long objectEvictionScore(void *privdata, dictEntry *de) {
+    redisDb *db = privdata;
+    robj *o;
+
+    /* The sooner the key expires the better. */
+    if (server.maxmemory_policy == MAXMEMORY_VOLATILE_TTL)
+        return ULLONG_MAX - (unsigned long long)dictGetSignedIntegerVal(de);
+
+    if (server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS) {
+        o = dictGetVal(de);
+    } else {
+        dictEntry *kde = dictFind(db->dict,dictGetKey(de));
+        if (kde == NULL) return 0;
+        o = dictGetVal(kde);
+    }
+
+    if (server.maxmemory_policy & MAXMEMORY_FLAG_LRU)
+        return estimateObjectIdleTime(o);
+    if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU)
+        return 255-LFUDecrAndReturn(o);
+    return 0;
+}
+
 /* ======================= The OBJECT and MEMORY commands =================== */
 
 /* This is a helper function for the OBJECT command. We need to lookup keys
@@ -1392,13 +1553,18 @@ void memoryCommand(client *c) {
         if ((o = objectCommandLookupOrReply(c,c->argv[2],shared.nullbulk))
                 == NULL) return;
         size_t usage = objectComputeSize(o,samples);
-        usage += sdsAllocSize(c->argv[2]->ptr);
-        usage += sizeof(dictEntry);
+        /* The entry of the key, that also holds the key when it is short
+         * enough to be embedded. */
+        // 短 key保存在 dictEntry里面，不需要再单独计算
+        dictEntry *de = dictFind(c->db->dict,c->argv[2]->ptr);
+        usage += dictEntryMemUsage(c->db->dict,de);
+        if (!dictIsKeyEmbedded(c->db->dict,de))
+            usage += sdsAllocSize(dictGetKey(de));
         addReplyLongLong(c,usage);
     } else if (!strcasecmp(c->argv[1]->ptr,"stats") && c->argc == 2) {
         struct redisMemOverhead *mh = getMemoryOverheadData();
 
-        addReplyMultiBulkLen(c,(25+mh->num_dbs)*2);
+        addReplyMultiBulkLen(c,(30+mh->num_dbs+mh->num_slab_pools)*2);
 
         addReplyBulkCString(c,"peak.allocated");
         addReplyLongLong(c,mh->peak_allocated);
@@ -1437,6 +1603,26 @@ void memoryCommand(client *c) {
             addReplyLongLong(c,mh->db[j].overhead_ht_expires);
         }
 
+        addReplyBulkCString(c,"overhead.slab.free");
+        addReplyLongLong(c,mh->slab_free);
+
+        for (size_t j = 0; j < mh->num_slab_pools; j++) {
+            char poolname[32];
+            snprintf(poolname,sizeof(poolname),"slab.%zd",
+                mh->slab_pools[j].size);
+            addReplyBulkCString(c,poolname);
+            addReplyMultiBulkLen(c,6);
+
+            addReplyBulkCString(c,"pages");
+            addReplyLongLong(c,mh->slab_pools[j].pages);
+
+            addReplyBulkCString(c,"used.blocks");
+            addReplyLongLong(c,mh->slab_pools[j].used);
+
+            addReplyBulkCString(c,"free.bytes");
+            addReplyLongLong(c,mh->slab_pools[j].free);
+        }
+
         addReplyBulkCString(c,"overhead.total");
         addReplyLongLong(c,mh->overhead_total);
 
@@ -1452,6 +1638,15 @@ void memoryCommand(client *c) {
         addReplyBulkCString(c,"dataset.percentage");
         addReplyDouble(c,mh->dataset_perc);
 
+        addReplyBulkCString(c,"dataset.lists");
+        addReplyLongLong(c,mh->dataset_lists);
+
+        addReplyBulkCString(c,"dataset.zsets.skiplist");
+        addReplyLongLong(c,mh->dataset_zsets_skiplist);
+
+        addReplyBulkCString(c,"dataset.zsets.btree");
+        addReplyLongLong(c,mh->dataset_zsets_btree);
+
         addReplyBulkCString(c,"peak.percentage");
         addReplyDouble(c,mh->peak_perc);
 
@@ -1488,6 +1683,36 @@ void memoryCommand(client *c) {
         addReplyBulkCString(c,"fragmentation.bytes");
         addReplyLongLong(c,mh->total_frag_bytes);
 
+        // 所有 dict的渐进式 rehash统计
+        dictRehashStats rs;
+        dictGetRehashStats(&rs);
+        addReplyBulkCString(c,"dict.rehash");
+        addReplyMultiBulkLen(c,16);
+
+        addReplyBulkCString(c,"started");
+        addReplyLongLong(c,rs.started);
+
+        addReplyBulkCString(c,"completed");
+        addReplyLongLong(c,rs.completed);
+
+        addReplyBulkCString(c,"buckets");
+        addReplyLongLong(c,rs.buckets);
+
+        addReplyBulkCString(c,"entries");
+        addReplyLongLong(c,rs.entries);
+
+        addReplyBulkCString(c,"foreground.steps");
+        addReplyLongLong(c,rs.foreground_steps);
+
+        addReplyBulkCString(c,"foreground.step-budget");
+        addReplyLongLong(c,dictGetRehashStepBudget());
+
+        addReplyBulkCString(c,"cron.calls");
+        addReplyLongLong(c,rs.cron_calls);
+
+        addReplyBulkCString(c,"cron.microseconds");
+        addReplyLongLong(c,rs.cron_us);
+
         freeMemoryOverheadData(mh);
     } else if (!strcasecmp(c->argv[1]->ptr,"malloc-stats") && c->argc == 2) {
 #if defined(USE_JEMALLOC)
@@ -1517,8 +1742,24 @@ void memoryCommand(client *c) {
         addReply(c, shared.ok);
         /* Nothing to do for other allocators. */
 #endif
+    } else if (!strcasecmp(c->argv[1]->ptr,"dsstats") && c->argc <= 3) {
+        // 不带参数时输出统计，ON/OFF 开关埋点，RESET 清空
+        if (c->argc == 2) {
+            addReplyBulkSds(c,dsstatsCatInfo(sdsempty()));
+        } else if (!strcasecmp(c->argv[2]->ptr,"on")) {
+            dsstatsSetEnabled(1);
+            addReply(c,shared.ok);
+        } else if (!strcasecmp(c->argv[2]->ptr,"off")) {
+            dsstatsSetEnabled(0);
+            addReply(c,shared.ok);
+        } else if (!strcasecmp(c->argv[2]->ptr,"reset")) {
+            dsstatsReset();
+            addReply(c,shared.ok);
+        } else {
+            addReplyError(c,"Syntax error. Try MEMORY HELP");
+        }
     } else if (!strcasecmp(c->argv[1]->ptr,"help") && c->argc == 2) {
-        addReplyMultiBulkLen(c,5);
+        addReplyMultiBulkLen(c,6);
         addReplyBulkCString(c,
 "MEMORY DOCTOR                        - Outputs memory problems report");
         addReplyBulkCString(c,
@@ -1529,6 +1770,8 @@ void memoryCommand(client *c) {
 "MEMORY PURGE                         - Ask the allocator to release memory");
         addReplyBulkCString(c,
 "MEMORY MALLOC-STATS                  - Show allocator internal stats");
+        addReplyBulkCString(c,
+"MEMORY DSSTATS [ON|OFF|RESET]        - Data structures internal histograms");
     } else {
         addReplyError(c,"Syntax error. Try MEMORY HELP");
     }
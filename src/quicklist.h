@@ -33,47 +33,55 @@
 
 /* Node, quicklist, and Iterator are the only data structures used currently. */
 
-/* quicklistNode is a 32 byte struct describing a ziplist for a quicklist.
+/* quicklistNode is a 32 byte struct describing a listpack for a quicklist.
  * We use bit fields keep the quicklistNode at 32 bytes.
  * count: 16 bits, max 65536 (max zl bytes is 65k, so max count actually < 32k).
- * encoding: 2 bits, RAW=1, LZF=2.
- * container: 2 bits, NONE=1, ZIPLIST=2.
+ * encoding: 2 bits, RAW=1, LZF=2 (compressed, with any codec).
+ * codec: 2 bits, QUICKLIST_CODEC_* used when the node is compressed.
+ * container: 2 bits, NONE=1, LISTPACK=2.
  * recompress: 1 bit, bool, true if node is temporarry decompressed for usage.
  * attempted_compress: 1 bit, boolean, used for verifying during testing.
- * extra: 12 bits, free for future use; pads out the remainder of 32 bits */
+ * extra: 8 bits, free for future use; pads out the remainder of 32 bits */
 typedef struct quicklistNode {
     
     // 前驱和后驱节点
     struct quicklistNode *prev;
     struct quicklistNode *next;
     
-    // zl 就表示 ziplist，说明节点是 ziplist
-    // 不设置 recompress，指向一个 ziplist
+    // zl 指向节点的 listpack（沿用 ziplist 时代的字段名）
+    // 不设置 recompress，指向一个 listpack
     // 设置 recompress，指向一个 quicklistLZF
     unsigned char *zl;
     
     // 大小，字节总数
-    unsigned int sz;             /* ziplist size in bytes */
+    unsigned int sz;             /* listpack size in bytes */
     
     // 节点数，16 bit大小
-    unsigned int count : 16;     /* count of items in ziplist */
+    unsigned int count : 16;     /* count of items in listpack */
     
     // 表示是否采用了LZF压缩算法压缩quicklist节点，1表示压缩过，2表示没压缩，占 2 bits长度
     unsigned int encoding : 2;   /* RAW==1 or LZF==2 */
     
     // 表示一个quicklistNode节点是否采用ziplist结构保存数据，2表示压缩了，1表示没压缩，默认是2，占2bits长度
-    unsigned int container : 2;  /* NONE==1 or ZIPLIST==2 */
+    unsigned int container : 2;  /* NONE==1 or LISTPACK==2 */
     
     // 解压标记，当查看一个被压缩的数据时，需要暂时解压，标记此参数为1，之后再重新进行压缩
     unsigned int recompress : 1; /* was this node previous compressed? */
     
     unsigned int attempted_compress : 1; /* node can't compress; too small */
-    unsigned int extra : 10; /* more bits to steal for future usage */
+
+    // 压缩节点使用的算法，不同算法压缩的节点可以在同一个 quicklist 中共存
+    unsigned int codec : 2;      /* QUICKLIST_CODEC_* of compressed data */
+
+    // 节点可能在解压缓存中有一项，见 quicklistSetNodeCache()
+    unsigned int cached : 1;     /* may have an entry in quicklist->cache */
+    unsigned int extra : 7; /* more bits to steal for future usage */
 } quicklistNode;
 
 /* quicklistLZF is a 4+N byte struct holding 'sz' followed by 'compressed'.
  * 'sz' is byte length of 'compressed' field.
- * 'compressed' is LZF data with total (compressed) length 'sz'
+ * 'compressed' is LZF data with total (compressed) length 'sz', or data
+ *              of the codec in quicklistNode->codec.
  * NOTE: uncompressed length is stored in quicklistNode->sz.
  * When quicklistNode->zl is compressed, node->zl points to a quicklistLZF */
 // 不设置 recompress，指向一个 ziplist
@@ -83,12 +91,74 @@ typedef struct quicklistLZF {
     char compressed[];
 } quicklistLZF;
 
-/* quicklist is a 40 byte struct (on 64-bit systems) describing a quicklist.
+/* Entries of a decompressed node cache. */
+#define QUICKLIST_NODE_CACHE_SLOTS 16
+
+/* Counters of a quicklist in adaptive fill mode, see quicklistSetAdaptive().
+ * 'end_ops' and 'middle_ops' count accesses to the head/tail nodes and to
+ * interior nodes, the 'window_' ones only those of the current window. */
+typedef struct quicklistAdaptiveStats {
+    unsigned long long end_ops;
+    unsigned long long middle_ops;
+    unsigned long long window_end_ops;
+    unsigned long long window_middle_ops;
+    unsigned long long adaptations; /* times the fill was changed */
+    unsigned long long splits;      /* nodes split to follow the fill */
+    unsigned long long merges;      /* nodes merged to follow the fill */
+    int base_fill;                  /* fill set with quicklistSetFill() */
+} quicklistAdaptiveStats;
+
+/* Decompressed node cache, see quicklistSetNodeCache(). An entry keeps
+ * both forms of a compressed node: the node points to one of them and the
+ * entry owns the other ('lent' tells which one the node has). */
+typedef struct quicklistNodeCacheEntry {
+    struct quicklistNode *node;  /* NULL for a free slot */
+    unsigned char *raw;          /* decompressed listpack, node->sz bytes */
+    struct quicklistLZF *lzf;    /* compressed data */
+    size_t sz;                   /* node->sz when the entry was made */
+    int lent;                    /* node->zl is 'raw', else it's 'lzf' */
+    int codec;                   /* QUICKLIST_CODEC_* of 'lzf' */
+    unsigned long long tick;     /* last use, for the LRU eviction */
+} quicklistNodeCacheEntry;
+
+typedef struct quicklistNodeCacheStats {
+    unsigned long long hits;          /* decompressions avoided */
+    unsigned long long misses;        /* nodes decompressed */
+    unsigned long long reused;        /* compressions avoided */
+    unsigned long long invalidations; /* entries dropped by a change */
+    unsigned long long evictions;     /* entries dropped for room */
+    size_t bytes;                     /* owned by the entries */
+    size_t max_bytes;
+} quicklistNodeCacheStats;
+
+typedef struct quicklistNodeCache {
+    quicklistNodeCacheEntry entries[QUICKLIST_NODE_CACHE_SLOTS];
+    unsigned long long tick;
+    quicklistNodeCacheStats stats;
+} quicklistNodeCache;
+
+/* Fenwick tree index over the nodes of a long quicklist, see quicklist.c. */
+typedef struct quicklistNodeIndex {
+    struct quicklistNode **nodes; /* nodes[start..end) in list order */
+    unsigned int *counts;         /* node counts as known by the tree */
+    unsigned long long *tree;     /* 1-based Fenwick tree, cap+1 entries */
+    unsigned long cap;            /* slots, a power of two */
+    unsigned long start;
+    unsigned long end;
+    unsigned long hint;           /* slot of the last node looked up */
+    int dirty;                    /* rebuild before the next lookup */
+} quicklistNodeIndex;
+
+/* quicklist is a 72 byte struct (on 64-bit systems) describing a quicklist.
  * 'count' is the number of total entries.
  * 'len' is the number of quicklist nodes.
  * 'compress' is: -1 if compression disabled, otherwise it's the number
  *                of quicklistNodes to leave uncompressed at ends of quicklist.
- * 'fill' is the user-requested (or default) fill factor. */
+ * 'fill' is the user-requested (or default) fill factor.
+ * 'codec' is the QUICKLIST_CODEC_* used to compress nodes.
+ * 'adaptive' is NULL unless adaptive fill is on.
+ * 'index' is NULL until the list has QUICKLIST_INDEX_MIN_NODES nodes.
+ * 'cache' is NULL unless quicklistSetNodeCache() turned it on. */
 // quicklist 的结构
 typedef struct quicklist {
     quicklistNode *head;
@@ -99,6 +169,9 @@ typedef struct quicklist {
     
     // 节点的个数
     unsigned long len;          /* number of quicklistNodes */
+
+    // 节点和 listpack 占用的字节数，压缩过的节点按压缩后的大小计算
+    size_t bytes;               /* nodes plus their listpacks or LZF data */
     
     // -1 每个节点的ziplist字节大小不能超过4kb
     // -2 每个节点的ziplist字节大小不能超过8kb
@@ -113,6 +186,18 @@ typedef struct quicklist {
     // 3 表示quicklist两端各有三个节点不压缩，中间的节点压缩
     // 依次类推
     unsigned int compress : 16; /* depth of end nodes not to compress;0=off */
+
+    // 新压缩的节点使用的算法
+    unsigned int codec : 2;     /* codec used to compress nodes */
+
+    // 自适应 fill 的统计信息，没有开启时为 NULL
+    quicklistAdaptiveStats *adaptive;
+
+    // 节点索引，节点数达到 QUICKLIST_INDEX_MIN_NODES 之后才建立
+    quicklistNodeIndex *index;
+
+    // 最近解压过的节点的缓存，没有开启时为 NULL
+    quicklistNodeCache *cache;
 } quicklist;
 
 // quicklist 迭代器
@@ -149,12 +234,36 @@ typedef struct quicklistEntry {
 #define QUICKLIST_NODE_ENCODING_RAW 1
 #define QUICKLIST_NODE_ENCODING_LZF 2
 
+/* quicklist node compression codecs. LZ4 and zstd are only available
+ * when compiled with USE_LZ4 / USE_ZSTD. */
+#define QUICKLIST_CODEC_LZF 0
+#define QUICKLIST_CODEC_LZ4 1
+#define QUICKLIST_CODEC_ZSTD 2
+#define QUICKLIST_CODEC_MAX 3
+
+#define QUICKLIST_ZSTD_LEVEL 3
+#define QUICKLIST_ZSTD_MAX_DICTS 8
+#define QUICKLIST_ZSTD_MIN_SAMPLES 8
+
+/* Adaptive fill: every QUICKLIST_ADAPT_WINDOW accesses, lists with at least
+ * QUICKLIST_ADAPT_MIDDLE_HIGH percent of interior accesses use small nodes,
+ * lists with at most QUICKLIST_ADAPT_MIDDLE_LOW percent use large nodes. */
+#define QUICKLIST_ADAPT_WINDOW 1024
+#define QUICKLIST_ADAPT_MIDDLE_HIGH 50
+#define QUICKLIST_ADAPT_MIDDLE_LOW 10
+#define QUICKLIST_ADAPT_FILL_SMALL -1 /* 4kb nodes */
+#define QUICKLIST_ADAPT_FILL_LARGE -4 /* 32kb nodes */
+
+/* Lists with at least this many nodes get a node index, making
+ * quicklistIndex() O(log N). */
+#define QUICKLIST_INDEX_MIN_NODES 128
+
 /* quicklist compression disable */
 #define QUICKLIST_NOCOMPRESS 0
 
 /* quicklist container formats */
 #define QUICKLIST_NODE_CONTAINER_NONE 1
-#define QUICKLIST_NODE_CONTAINER_ZIPLIST 2
+#define QUICKLIST_NODE_CONTAINER_LISTPACK 2
 
 #define quicklistNodeIsCompressed(node)                                        \
     ((node)->encoding == QUICKLIST_NODE_ENCODING_LZF)
@@ -165,12 +274,19 @@ quicklist *quicklistNew(int fill, int compress);
 void quicklistSetCompressDepth(quicklist *quicklist, int depth);
 void quicklistSetFill(quicklist *quicklist, int fill);
 void quicklistSetOptions(quicklist *quicklist, int fill, int depth);
+void quicklistSetAdaptive(quicklist *quicklist, int enable);
+int quicklistGetAdaptiveStats(const quicklist *quicklist,
+                              quicklistAdaptiveStats *stats);
+void quicklistSetNodeCache(quicklist *quicklist, size_t max_bytes);
+int quicklistGetNodeCacheStats(const quicklist *quicklist,
+                               quicklistNodeCacheStats *stats);
 void quicklistRelease(quicklist *quicklist);
 int quicklistPushHead(quicklist *quicklist, void *value, const size_t sz);
 int quicklistPushTail(quicklist *quicklist, void *value, const size_t sz);
 void quicklistPush(quicklist *quicklist, void *value, const size_t sz,
                    int where);
 void quicklistAppendZiplist(quicklist *quicklist, unsigned char *zl);
+void quicklistAppendListpack(quicklist *quicklist, unsigned char *lp);
 quicklist *quicklistAppendValuesFromZiplist(quicklist *quicklist,
                                             unsigned char *zl);
 quicklist *quicklistCreateFromZiplist(int fill, int compress,
@@ -184,12 +300,12 @@ int quicklistReplaceAtIndex(quicklist *quicklist, long index, void *data,
                             int sz);
 int quicklistDelRange(quicklist *quicklist, const long start, const long stop);
 quicklistIter *quicklistGetIterator(const quicklist *quicklist, int direction);
-quicklistIter *quicklistGetIteratorAtIdx(const quicklist *quicklist,
+quicklistIter *quicklistGetIteratorAtIdx(quicklist *quicklist,
                                          int direction, const long long idx);
 int quicklistNext(quicklistIter *iter, quicklistEntry *node);
 void quicklistReleaseIterator(quicklistIter *iter);
 quicklist *quicklistDup(quicklist *orig);
-int quicklistIndex(const quicklist *quicklist, const long long index,
+int quicklistIndex(quicklist *quicklist, const long long index,
                    quicklistEntry *entry);
 void quicklistRewind(quicklist *quicklist, quicklistIter *li);
 void quicklistRewindTail(quicklist *quicklist, quicklistIter *li);
@@ -200,8 +316,15 @@ int quicklistPopCustom(quicklist *quicklist, int where, unsigned char **data,
 int quicklistPop(quicklist *quicklist, int where, unsigned char **data,
                  unsigned int *sz, long long *slong);
 unsigned long quicklistCount(const quicklist *ql);
+size_t quicklistTotalBytes(void);
 int quicklistCompare(unsigned char *p1, unsigned char *p2, int p2_len);
 size_t quicklistGetLzf(const quicklistNode *node, void **data);
+int quicklistCodecAvailable(int codec);
+const char *quicklistCodecName(int codec);
+int quicklistCodecByName(const char *name);
+int quicklistSetCodec(quicklist *quicklist, int codec);
+int quicklistSetZstdDictionary(const void *dict, size_t len);
+int quicklistTrainZstdDictionary(quicklist *quicklist, size_t dictsize);
 
 #ifdef REDIS_TEST
 int quicklistTest(int argc, char *argv[]);
@@ -0,0 +1,408 @@
+/* slab.c - Size class slab allocator for small structures
+ *
+ * Structures that are allocated and freed at a high rate and always have
+ * the same few sizes, like dictEntry or zskiplistNode, fragment the memory
+ * of the allocator when they are churned. This allocator makes them come
+ * from pages dedicated to a single size, so that freed blocks are always
+ * reused for the same kind of structure.
+ *
+ * Every thread keeps a small free list per size class, so the main thread
+ * never takes a lock in the common case. When a thread list grows too much
+ * (for instance in the lazy free thread, that frees but never allocates)
+ * half of it goes back to the shared list of the pool, and an empty thread
+ * list is refilled from the shared list before a new page is allocated.
+ *
+ * Pages whose blocks are all back in the shared list of their pool are
+ * returned to zmalloc, so used_memory, and with it the eviction, goes down
+ * after a big delete. Checking this walks the shared list, so it is only
+ * done when the list doubled since the last check. The memory that is
+ * still held but free is reported by MEMORY STATS.
+ *
+ * The free lists of a thread are given back to the pools when the thread
+ * exits, through a pthread key destructor.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "slab.h"
+#include "zmalloc.h"
+
+/* Max number of blocks in the free list of a thread for a given size. */
+#define SLAB_CACHE_MAX 256
+/* Free pages a pool may keep before it looks for pages to release. */
+#define SLAB_TRIM_MIN_PAGES 2
+
+// 空闲的块通过自身的前 8个字节串成链表
+typedef struct slabBlock {
+    struct slabBlock *next;
+} slabBlock;
+
+typedef struct slabCache {
+    slabBlock *head;
+    unsigned long count;
+} slabCache;
+
+typedef struct slabPool {
+    pthread_mutex_t lock;
+    slabBlock *head;         /* Shared free list. */
+    unsigned long count;     /* Blocks in the shared free list. */
+    size_t pages;            /* Pages allocated, protected by 'lock'. */
+    size_t used;             /* Blocks handed out, updated atomically. */
+    char **pagelist;         /* The 'pages' pages, sorted by address. */
+    size_t pagelist_len;     /* Slots allocated in 'pagelist'. */
+    unsigned long trim_at;   /* Shared blocks that trigger slabPoolTrim(). */
+} slabPool;
+
+static slabPool slab_pools[SLAB_CLASSES];
+static __thread slabCache slab_cache[SLAB_CLASSES];
+static __thread int slab_thread_registered;
+static pthread_once_t slab_init_once = PTHREAD_ONCE_INIT;
+static pthread_key_t slab_thread_key;
+
+// size对应的 size class，块大小为 (class+1)*SLAB_ALIGN
+#define slabClass(size) (((size)+SLAB_ALIGN-1)/SLAB_ALIGN-1)
+#define slabClassSize(class) (((class)+1)*SLAB_ALIGN)
+#define slabTrimMinBlocks(class) \
+    (SLAB_TRIM_MIN_PAGES*(SLAB_PAGE_SIZE/slabClassSize(class)))
+
+/* Move at most 'count' blocks from the list starting at '*from' to the
+ * list 'to'. Returns the number of blocks moved. */
+static unsigned long slabMoveBlocks(slabBlock **from, slabBlock **to,
+                                    unsigned long count)
+{
+    unsigned long moved = 0;
+
+    while (*from && moved < count) {
+        slabBlock *b = *from;
+        *from = b->next;
+        b->next = *to;
+        *to = b;
+        moved++;
+    }
+    return moved;
+}
+
+static void slabThreadExit(void *arg) {
+    (void)arg;
+    slabThreadFlush();
+}
+
+static void slabInit(void) {
+    int j;
+
+    for (j = 0; j < SLAB_CLASSES; j++) {
+        pthread_mutex_init(&slab_pools[j].lock,NULL);
+        slab_pools[j].trim_at = slabTrimMinBlocks(j);
+    }
+    pthread_key_create(&slab_thread_key,slabThreadExit);
+}
+
+/* Make the free lists of the calling thread go back to the pools when it
+ * exits. The key only needs a non NULL value for the destructor to run. */
+// 线程第一次使用时注册，线程退出时自动归还空闲链表
+static void slabThreadRegister(void) {
+    pthread_once(&slab_init_once,slabInit);
+    pthread_setspecific(slab_thread_key,slab_cache);
+    slab_thread_registered = 1;
+}
+
+/* Index in 'pool->pagelist' of the page holding 'ptr'. */
+static size_t slabPageIndex(slabPool *pool, void *ptr) {
+    size_t lo = 0, hi = pool->pages;
+
+    // 二分查找起始地址不大于 ptr的最后一页
+    while (hi-lo > 1) {
+        size_t mid = (lo+hi)/2;
+        if ((char*)ptr < pool->pagelist[mid]) hi = mid;
+        else lo = mid;
+    }
+    return lo;
+}
+
+/* Add 'page' to the sorted page list of 'pool'. Called with the lock held. */
+static void slabPageAdd(slabPool *pool, char *page) {
+    size_t j = 0;
+
+    if (pool->pages == pool->pagelist_len) {
+        pool->pagelist_len = pool->pagelist_len ? pool->pagelist_len*2 : 16;
+        pool->pagelist = zrealloc(pool->pagelist,
+                                  sizeof(char*)*pool->pagelist_len);
+    }
+    if (pool->pages) {
+        j = slabPageIndex(pool,page);
+        if (page > pool->pagelist[j]) j++;
+    }
+    memmove(pool->pagelist+j+1,pool->pagelist+j,
+            sizeof(char*)*(pool->pages-j));
+    pool->pagelist[j] = page;
+    pool->pages++;
+}
+
+/* Release to zmalloc the pages of 'class' whose blocks are all in the shared
+ * list. Called with the lock held. */
+// 整页的块都空闲时把整页还给 zmalloc
+static void slabPoolTrim(int class) {
+    slabPool *pool = slab_pools+class;
+    unsigned long blocks = SLAB_PAGE_SIZE/slabClassSize(class);
+    unsigned long *freeblocks;
+    slabBlock *b, *next, *keep = NULL;
+    size_t j, kept = 0;
+
+    if (pool->count >= blocks) {
+        freeblocks = zcalloc(sizeof(unsigned long)*pool->pages);
+        for (b = pool->head; b; b = b->next)
+            freeblocks[slabPageIndex(pool,b)]++;
+        // 先把要释放的页中的块从链表中摘掉，再释放页
+        for (b = pool->head; b; b = next) {
+            next = b->next;
+            if (freeblocks[slabPageIndex(pool,b)] == blocks) {
+                pool->count--;
+            } else {
+                b->next = keep;
+                keep = b;
+            }
+        }
+        pool->head = keep;
+        for (j = 0; j < pool->pages; j++) {
+            if (freeblocks[j] == blocks) zfree(pool->pagelist[j]);
+            else pool->pagelist[kept++] = pool->pagelist[j];
+        }
+        pool->pages = kept;
+        zfree(freeblocks);
+    }
+    pool->trim_at = pool->count*2 + slabTrimMinBlocks(class);
+}
+
+/* Move blocks from the list of the calling thread to the shared list of
+ * 'class', releasing the free pages if the shared list grew enough. */
+static void slabGiveBack(int class, unsigned long count) {
+    slabPool *pool = slab_pools+class;
+    slabCache *cache = slab_cache+class;
+    unsigned long moved;
+
+    pthread_mutex_lock(&pool->lock);
+    moved = slabMoveBlocks(&cache->head,&pool->head,count);
+    cache->count -= moved;
+    pool->count += moved;
+    if (pool->count >= pool->trim_at) slabPoolTrim(class);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Refill the free list of the calling thread for 'class', either from the
+ * shared list of the pool or with a new page. */
+static void slabRefill(int class) {
+    slabPool *pool = slab_pools+class;
+    slabCache *cache = slab_cache+class;
+    size_t size = slabClassSize(class);
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->head) {
+        unsigned long moved = slabMoveBlocks(&pool->head,&cache->head,
+                                             SLAB_CACHE_MAX/2);
+        pool->count -= moved;
+        cache->count += moved;
+        if (pool->trim_at > pool->count*2 + slabTrimMinBlocks(class))
+            pool->trim_at = pool->count*2 + slabTrimMinBlocks(class);
+    } else {
+        char *page = zmalloc(SLAB_PAGE_SIZE);
+        size_t j, blocks = SLAB_PAGE_SIZE/size;
+
+        // 把新的页切成块，挂到线程的空闲链表上
+        for (j = 0; j < blocks; j++) {
+            slabBlock *b = (slabBlock*)(page+j*size);
+            b->next = cache->head;
+            cache->head = b;
+        }
+        cache->count += blocks;
+        slabPageAdd(pool,page);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Allocate a block of at least 'size' bytes. The block must be released
+ * with slabFree() passing the same size. */
+void *slabAlloc(size_t size) {
+    slabCache *cache;
+    slabBlock *b;
+    int class;
+
+    if (size == 0 || size > SLAB_MAX_SIZE) return zmalloc(size);
+    if (!slab_thread_registered) slabThreadRegister();
+    class = slabClass(size);
+    cache = slab_cache+class;
+    if (cache->head == NULL) slabRefill(class);
+    b = cache->head;
+    cache->head = b->next;
+    cache->count--;
+    __atomic_add_fetch(&slab_pools[class].used,1,__ATOMIC_RELAXED);
+    return b;
+}
+
+void slabFree(void *ptr, size_t size) {
+    slabCache *cache;
+    slabBlock *b = ptr;
+    int class;
+
+    if (ptr == NULL) return;
+    if (size == 0 || size > SLAB_MAX_SIZE) {
+        zfree(ptr);
+        return;
+    }
+    if (!slab_thread_registered) slabThreadRegister();
+    class = slabClass(size);
+    cache = slab_cache+class;
+    b->next = cache->head;
+    cache->head = b;
+    cache->count++;
+    __atomic_sub_fetch(&slab_pools[class].used,1,__ATOMIC_RELAXED);
+
+    // 线程的空闲链表太长了，归还一半给共享链表
+    if (cache->count > SLAB_CACHE_MAX) slabGiveBack(class,SLAB_CACHE_MAX/2);
+}
+
+/* Give the free lists of the calling thread back to the shared lists of
+ * the pools. This is done automatically when a thread exits, but threads
+ * that are done with the slab and keep running can call it earlier. */
+// 把线程自己的空闲链表全部还给共享链表，线程退出时会自动调用
+void slabThreadFlush(void) {
+    int j;
+
+    for (j = 0; j < SLAB_CLASSES; j++) {
+        slabCache *cache = slab_cache+j;
+
+        if (cache->head == NULL) continue;
+        slabGiveBack(j,cache->count);
+    }
+}
+
+/* Fill 'stats' with the usage of the pools that own at least one page, up
+ * to 'maxpools' entries. Returns the number of entries filled. */
+size_t slabGetStats(slabPoolStats *stats, size_t maxpools) {
+    size_t n = 0;
+    int j;
+
+    for (j = 0; j < SLAB_CLASSES && n < maxpools; j++) {
+        slabPool *pool = slab_pools+j;
+        size_t size = slabClassSize(j), pages, used;
+
+        pages = __atomic_load_n(&pool->pages,__ATOMIC_RELAXED);
+        if (pages == 0) continue;
+        used = __atomic_load_n(&pool->used,__ATOMIC_RELAXED);
+        stats[n].size = size;
+        stats[n].pages = pages;
+        stats[n].used = used;
+        stats[n].free = pages*SLAB_PAGE_SIZE - used*size;
+        n++;
+    }
+    return n;
+}
+
+// 所有 pool中没有被使用的字节数
+size_t slabFreeBytes(void) {
+    slabPoolStats stats[SLAB_CLASSES];
+    size_t j, n, bytes = 0;
+
+    n = slabGetStats(stats,SLAB_CLASSES);
+    for (j = 0; j < n; j++) bytes += stats[j].free;
+    return bytes;
+}
+
+#ifdef REDIS_TEST
+#include <assert.h>
+
+static void *slabTestFreeThread(void *arg) {
+    void **blocks = arg;
+    int j;
+
+    for (j = 0; j < 10000; j++) slabFree(blocks[j],40);
+    return NULL;
+}
+
+/* Exits without calling slabThreadFlush(), holding a page worth of 64
+ * bytes blocks in its own free list. */
+static void *slabTestExitThread(void *arg) {
+    void *block = slabAlloc(64);
+
+    (void)arg;
+    slabFree(block,64);
+    return NULL;
+}
+
+int slabTest(int argc, char *argv[]) {
+    void **blocks = zmalloc(sizeof(void*)*10000);
+    slabPoolStats stats[SLAB_CLASSES];
+    pthread_t tid;
+    size_t n;
+    int j;
+
+    (void)argc; (void)argv;
+
+    printf("Alloc and free blocks of the same size: ");
+    for (j = 0; j < 10000; j++) {
+        blocks[j] = slabAlloc(40);
+        memset(blocks[j],j&0xff,40);
+    }
+    for (j = 0; j < 10000; j++) {
+        unsigned char *p = blocks[j];
+        assert(p[0] == (j&0xff) && p[39] == (j&0xff));
+    }
+    n = slabGetStats(stats,SLAB_CLASSES);
+    assert(n == 1 && stats[0].size == 40 && stats[0].used == 10000);
+    for (j = 0; j < 10000; j++) slabFree(blocks[j],40);
+    n = slabGetStats(stats,SLAB_CLASSES);
+    assert(stats[0].used == 0 && stats[0].free == stats[0].pages*SLAB_PAGE_SIZE);
+    printf("ok\n");
+
+    printf("Freed blocks are reused: ");
+    size_t pages = stats[0].pages, held = pages*(SLAB_PAGE_SIZE/40);
+    for (j = 0; j < 10000 && (size_t)j < held; j++) blocks[j] = slabAlloc(33);
+    n = slabGetStats(stats,SLAB_CLASSES);
+    assert(n == 1 && stats[0].pages == pages);
+    for (; j < 10000; j++) blocks[j] = slabAlloc(33);
+    printf("ok\n");
+
+    printf("Blocks freed by another thread go back to the pool: ");
+    pthread_create(&tid,NULL,slabTestFreeThread,blocks);
+    pthread_join(tid,NULL);
+    for (j = 0; j < 10000; j++) blocks[j] = slabAlloc(40);
+    n = slabGetStats(stats,SLAB_CLASSES);
+    assert(n == 1 && stats[0].used == 10000 &&
+           stats[0].pages <= 10000/(SLAB_PAGE_SIZE/40)+2);
+    for (j = 0; j < 10000; j++) slabFree(blocks[j],40);
+    printf("ok\n");
+
+    printf("Free lists of an exiting thread go back to the pool: ");
+    pthread_create(&tid,NULL,slabTestExitThread,NULL);
+    pthread_join(tid,NULL);
+    for (j = 0; j < SLAB_PAGE_SIZE/64; j++) blocks[j] = slabAlloc(64);
+    n = slabGetStats(stats,SLAB_CLASSES);
+    assert(n == 2 && stats[1].size == 64 && stats[1].pages == 1);
+    for (j = 0; j < SLAB_PAGE_SIZE/64; j++) slabFree(blocks[j],64);
+    printf("ok\n");
+
+    printf("Empty pages go back to zmalloc: ");
+    size_t before = zmalloc_used_memory();
+    void **many = zmalloc(sizeof(void*)*100000);
+    for (j = 0; j < 100000; j++) many[j] = slabAlloc(200);
+    assert(zmalloc_used_memory() > before+100000*200);
+    for (j = 0; j < 100000; j++) slabFree(many[j],200);
+    slabThreadFlush();
+    n = slabGetStats(stats,SLAB_CLASSES);
+    assert(n == 3 && stats[2].size == 200 && stats[2].used == 0);
+    assert(stats[2].pages <= SLAB_TRIM_MIN_PAGES*2);
+    zfree(many);
+    printf("ok\n");
+
+    printf("Big sizes fall back to zmalloc: ");
+    void *big = slabAlloc(SLAB_MAX_SIZE+1);
+    assert(slabGetStats(stats,SLAB_CLASSES) == n);
+    slabFree(big,SLAB_MAX_SIZE+1);
+    printf("ok\n");
+
+    zfree(blocks);
+    return 0;
+}
+#endif
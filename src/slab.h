@@ -0,0 +1,35 @@
+/* slab.h - Size class slab allocator for small structures */
+
+#ifndef __SLAB_H
+#define __SLAB_H
+
+#include <stddef.h>
+
+/* Blocks are carved from pages of SLAB_PAGE_SIZE bytes obtained with
+ * zmalloc(), so they are accounted in used_memory like everything else.
+ * Sizes are rounded to a multiple of SLAB_ALIGN, and requests bigger than
+ * SLAB_MAX_SIZE go straight to zmalloc()/zfree(). */
+#define SLAB_PAGE_SIZE (64*1024)
+#define SLAB_ALIGN 8
+#define SLAB_MAX_SIZE 512
+#define SLAB_CLASSES (SLAB_MAX_SIZE/SLAB_ALIGN)
+
+// 每个 size class的使用情况
+typedef struct slabPoolStats {
+    size_t size;    /* Block size of the pool. */
+    size_t pages;   /* Pages allocated to the pool. */
+    size_t used;    /* Blocks handed out. */
+    size_t free;    /* Bytes held by the pool but not handed out. */
+} slabPoolStats;
+
+void *slabAlloc(size_t size);
+void slabFree(void *ptr, size_t size);
+void slabThreadFlush(void);
+size_t slabGetStats(slabPoolStats *stats, size_t maxpools);
+size_t slabFreeBytes(void);
+
+#ifdef REDIS_TEST
+int slabTest(int argc, char *argv[]);
+#endif
+
+#endif /* __SLAB_H */
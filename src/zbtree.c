@@ -0,0 +1,769 @@
+/* zbtree.c - Order statistic B+tree used by the btree sorted set encoding.
+ *
+ * The skiplist encoding pays, for every member, a skiplist node with on
+ * average 1.33 levels plus a dict entry pointing to the score inside the
+ * node. The btree encoding replaces the skiplist with a B+tree whose leaves
+ * pack up to ZBT_NODE_MAX (score, ele) entries in two parallel arrays, and
+ * keeps the (open addressing) dict as the member -> score side index, the
+ * score being stored by value in the dict entry since entries move between
+ * leaves.
+ *
+ * Entries are ordered by score, then by ele, exactly like the skiplist.
+ * Inner nodes store for every child the number of entries below it, so
+ * ranks and lookups by rank cost O(log(N)), and leaves are linked in both
+ * directions for range iteration. The leaves own the ele sds strings,
+ * inner nodes store private copies of their separator keys.
+ *
+ * Only the skiplist is saved: the dict is the same as with the skiplist
+ * encoding, so the gain is limited. With 1M members named "member:<n>"
+ * and random scores, zmalloc_used_memory() grows by about 110 bytes per
+ * member with the skiplist encoding and 82 with this one, of which 32 are
+ * the dict, 15 the ele sds and the rest the nodes of the tree.
+ *
+ * Deletions merge a node with a sibling once it is less than a quarter
+ * full and the two fit in one node; empty nodes are always removed.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "zbtree.h"
+#include "zmalloc.h"
+
+#define ZBT_LEAF_SIZE (offsetof(zbtNode,u)+sizeof(((zbtNode*)0)->u.l))
+#define ZBT_INNER_SIZE (sizeof(zbtNode))
+
+// 先比较分值，分值相同时再比较元素
+static int zbtCompare(double s1, sds e1, double s2, sds e2) {
+    if (s1 < s2) return -1;
+    if (s1 > s2) return 1;
+    return sdscmp(e1,e2);
+}
+
+/* Memory used by all the trees, their nodes and elements, updated with
+ * atomic operations since trees can be released by the background free
+ * thread. */
+// 所有 B+树占用的内存，MEMORY STATS 使用
+static size_t zbt_total_bytes = 0;
+
+#define zbtAddBytes(_field, _delta) do { \
+    (_field) += (_delta); \
+    __atomic_add_fetch(&zbt_total_bytes,(_delta),__ATOMIC_RELAXED); \
+} while(0)
+
+static zbtNode *zbtCreateNode(zbtree *zbt, int leaf) {
+    size_t size = leaf ? ZBT_LEAF_SIZE : ZBT_INNER_SIZE;
+    zbtNode *x = zmalloc(size);
+
+    x->leaf = leaf;
+    x->n = 0;
+    x->eles[0] = NULL;
+    if (leaf) x->u.l.prev = x->u.l.next = NULL;
+    zbtAddBytes(zbt->bytes,size);
+    return x;
+}
+
+// 只释放节点本身，节点中的 sds由调用者处理
+static void zbtFreeNode(zbtree *zbt, zbtNode *x) {
+    zbtAddBytes(zbt->bytes,-(size_t)(x->leaf ? ZBT_LEAF_SIZE : ZBT_INNER_SIZE));
+    zfree(x);
+}
+
+// 创建一个空的 B+树
+zbtree *zbtCreate(void) {
+    zbtree *zbt = zmalloc(sizeof(*zbt));
+    zbt->root = zbt->head = zbt->tail = NULL;
+    zbt->length = 0;
+    zbt->height = 0;
+    zbt->bytes = 0;
+    zbt->ele_bytes = 0;
+    __atomic_add_fetch(&zbt_total_bytes,sizeof(*zbt),__ATOMIC_RELAXED);
+    return zbt;
+}
+
+static void zbtFreeSubtree(zbtNode *x) {
+    int j;
+
+    if (x->leaf) {
+        for (j = 0; j < x->n; j++) sdsfree(x->eles[j]);
+    } else {
+        for (j = 1; j < x->n; j++) sdsfree(x->eles[j]);
+        for (j = 0; j < x->n; j++) zbtFreeSubtree(x->u.i.children[j]);
+    }
+    zfree(x);
+}
+
+// 释放整棵树，包括叶子节点中的 sds
+void zbtFree(zbtree *zbt) {
+    if (zbt->root) zbtFreeSubtree(zbt->root);
+    __atomic_sub_fetch(&zbt_total_bytes,sizeof(*zbt)+zbt->bytes+zbt->ele_bytes,
+                       __ATOMIC_RELAXED);
+    zfree(zbt);
+}
+
+/* Memory used by all the trees, see zbtree->bytes and ele_bytes. */
+size_t zbtTotalBytes(void) {
+    return __atomic_load_n(&zbt_total_bytes,__ATOMIC_RELAXED);
+}
+
+/* Return the child of the inner node 'x' that contains the key: the last
+ * child whose separator is less or equal than the key. */
+// 找到 key所在的孩子：最后一个分隔键 <= key的孩子
+static int zbtChildForKey(zbtNode *x, double score, sds ele) {
+    int lo = 1, hi = x->n;
+
+    while (lo < hi) {
+        int mid = (lo+hi) >> 1;
+        if (zbtCompare(x->scores[mid],x->eles[mid],score,ele) <= 0) lo = mid+1;
+        else hi = mid;
+    }
+    return lo-1;
+}
+
+// 叶子节点中第一个 >= key的位置
+static int zbtLeafLowerBound(zbtNode *x, double score, sds ele) {
+    int lo = 0, hi = x->n;
+
+    while (lo < hi) {
+        int mid = (lo+hi) >> 1;
+        if (zbtCompare(x->scores[mid],x->eles[mid],score,ele) < 0) lo = mid+1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* Split path[l], that overflowed to ZBT_NODE_MAX+1 entries, in two halves,
+ * inserting the right half in the parent and splitting it in turn if
+ * needed. The counts along the path already include the new entry. */
+// 节点溢出时分裂成两半，右半部分插入父节点，父节点溢出时继续向上分裂
+static void zbtSplit(zbtree *zbt, zbtNode **path, int *idx, int l) {
+    zbtNode *x = path[l], *r = zbtCreateNode(zbt,x->leaf), *p;
+    int h = x->n/2, moved = x->n-h, i, j;
+    unsigned long rcount = 0;
+    double sepscore;
+    sds sepele;
+
+    memcpy(r->scores,x->scores+h,sizeof(double)*moved);
+    memcpy(r->eles,x->eles+h,sizeof(sds)*moved);
+    if (x->leaf) {
+        rcount = moved;
+        sepscore = r->scores[0];
+        sepele = sdsdup(r->eles[0]);
+        r->u.l.prev = x;
+        r->u.l.next = x->u.l.next;
+        if (x->u.l.next) x->u.l.next->u.l.prev = r;
+        else zbt->tail = r;
+        x->u.l.next = r;
+    } else {
+        /* The first separator of the right half moves up to the parent. */
+        // 右半部分的第一个分隔键移动到父节点中
+        sepscore = r->scores[0];
+        sepele = r->eles[0];
+        r->eles[0] = NULL;
+        memcpy(r->u.i.counts,x->u.i.counts+h,sizeof(unsigned long)*moved);
+        memcpy(r->u.i.children,x->u.i.children+h,sizeof(zbtNode*)*moved);
+        for (j = 0; j < moved; j++) rcount += r->u.i.counts[j];
+    }
+    r->n = moved;
+    x->n = h;
+
+    // 根节点分裂，树的高度加一
+    if (l == 0) {
+        zbtNode *root = zbtCreateNode(zbt,0);
+        root->n = 2;
+        root->u.i.children[0] = x;
+        root->u.i.children[1] = r;
+        root->u.i.counts[0] = zbt->length-rcount;
+        root->u.i.counts[1] = rcount;
+        root->scores[1] = sepscore;
+        root->eles[1] = sepele;
+        zbt->root = root;
+        zbt->height++;
+        return;
+    }
+
+    p = path[l-1];
+    i = idx[l-1];
+    p->u.i.counts[i] -= rcount;
+    memmove(p->scores+i+2,p->scores+i+1,sizeof(double)*(p->n-i-1));
+    memmove(p->eles+i+2,p->eles+i+1,sizeof(sds)*(p->n-i-1));
+    memmove(p->u.i.counts+i+2,p->u.i.counts+i+1,sizeof(unsigned long)*(p->n-i-1));
+    memmove(p->u.i.children+i+2,p->u.i.children+i+1,sizeof(zbtNode*)*(p->n-i-1));
+    p->scores[i+1] = sepscore;
+    p->eles[i+1] = sepele;
+    p->u.i.counts[i+1] = rcount;
+    p->u.i.children[i+1] = r;
+    p->n++;
+    if (p->n > ZBT_NODE_MAX) zbtSplit(zbt,path,idx,l-1);
+}
+
+/* Insert a new entry. The caller must make sure the element is not already
+ * in the tree. The tree takes ownership of 'ele'. */
+// 插入新元素，调用者保证元素不存在，ele的所有权交给树
+void zbtInsert(zbtree *zbt, double score, sds ele) {
+    zbtNode *path[ZBT_MAX_HEIGHT], *x;
+    int idx[ZBT_MAX_HEIGHT], l, pos;
+
+    if (zbt->root == NULL) {
+        zbt->root = zbt->head = zbt->tail = zbtCreateNode(zbt,1);
+        zbt->height = 1;
+    }
+
+    x = zbt->root;
+    for (l = 0; !x->leaf; l++) {
+        int i = zbtChildForKey(x,score,ele);
+        path[l] = x;
+        idx[l] = i;
+        x->u.i.counts[i]++;
+        x = x->u.i.children[i];
+    }
+    path[l] = x;
+
+    pos = zbtLeafLowerBound(x,score,ele);
+    memmove(x->scores+pos+1,x->scores+pos,sizeof(double)*(x->n-pos));
+    memmove(x->eles+pos+1,x->eles+pos,sizeof(sds)*(x->n-pos));
+    x->scores[pos] = score;
+    x->eles[pos] = ele;
+    x->n++;
+    zbt->length++;
+    zbtAddBytes(zbt->ele_bytes,sdsOwnedAllocSize(ele));
+    if (x->n > ZBT_NODE_MAX) zbtSplit(zbt,path,idx,l);
+}
+
+// 从父节点 p中移除第 i个孩子（已经为空的节点）
+static void zbtRemoveChild(zbtree *zbt, zbtNode *p, int i) {
+    zbtNode *x = p->u.i.children[i];
+    int sep;
+
+    if (x->leaf) {
+        if (x->u.l.prev) x->u.l.prev->u.l.next = x->u.l.next;
+        else zbt->head = x->u.l.next;
+        if (x->u.l.next) x->u.l.next->u.l.prev = x->u.l.prev;
+        else zbt->tail = x->u.l.prev;
+    }
+    zbtFreeNode(zbt,x);
+
+    /* Removing the first child, the separator of the second one becomes
+     * the unused slot 0, so it is the one to drop. */
+    // 删除第一个孩子时，第二个孩子的分隔键变成不使用的 0号位置，所以删除的是它
+    sep = i ? i : 1;
+    if (sep < p->n) {
+        sdsfree(p->eles[sep]);
+        memmove(p->scores+sep,p->scores+sep+1,sizeof(double)*(p->n-sep-1));
+        memmove(p->eles+sep,p->eles+sep+1,sizeof(sds)*(p->n-sep-1));
+    }
+    memmove(p->u.i.counts+i,p->u.i.counts+i+1,sizeof(unsigned long)*(p->n-i-1));
+    memmove(p->u.i.children+i,p->u.i.children+i+1,sizeof(zbtNode*)*(p->n-i-1));
+    p->n--;
+}
+
+/* Merge child i+1 of 'p' into child i. */
+// 把 p的第 i+1个孩子合并到第 i个孩子中
+static void zbtMergeChildren(zbtree *zbt, zbtNode *p, int i) {
+    zbtNode *a = p->u.i.children[i], *b = p->u.i.children[i+1];
+
+    if (a->leaf) {
+        memcpy(a->scores+a->n,b->scores,sizeof(double)*b->n);
+        memcpy(a->eles+a->n,b->eles,sizeof(sds)*b->n);
+        a->u.l.next = b->u.l.next;
+        if (b->u.l.next) b->u.l.next->u.l.prev = a;
+        else zbt->tail = a;
+        sdsfree(p->eles[i+1]);
+    } else {
+        /* The separator between a and b moves down in front of the first
+         * child of b. */
+        // a和 b之间的分隔键下移，成为 b第一个孩子的分隔键
+        a->scores[a->n] = p->scores[i+1];
+        a->eles[a->n] = p->eles[i+1];
+        memcpy(a->scores+a->n+1,b->scores+1,sizeof(double)*(b->n-1));
+        memcpy(a->eles+a->n+1,b->eles+1,sizeof(sds)*(b->n-1));
+        memcpy(a->u.i.counts+a->n,b->u.i.counts,sizeof(unsigned long)*b->n);
+        memcpy(a->u.i.children+a->n,b->u.i.children,sizeof(zbtNode*)*b->n);
+    }
+    a->n += b->n;
+    p->u.i.counts[i] += p->u.i.counts[i+1];
+    zbtFreeNode(zbt,b);
+
+    memmove(p->scores+i+1,p->scores+i+2,sizeof(double)*(p->n-i-2));
+    memmove(p->eles+i+1,p->eles+i+2,sizeof(sds)*(p->n-i-2));
+    memmove(p->u.i.counts+i+1,p->u.i.counts+i+2,sizeof(unsigned long)*(p->n-i-2));
+    memmove(p->u.i.children+i+1,p->u.i.children+i+2,sizeof(zbtNode*)*(p->n-i-2));
+    p->n--;
+}
+
+/* Fix path[l] after entries were removed from it: drop it if empty, merge
+ * it with a sibling if it is underfull and they fit in one node, then fix
+ * the parent in turn. The root is collapsed while it has a single child. */
+// 删除元素后调整节点：空节点直接删除，过空的节点和兄弟节点合并，根节点只有一个孩子时降低树高
+static void zbtRebalance(zbtree *zbt, zbtNode **path, int *idx, int l) {
+    zbtNode *x = path[l], *p;
+    int i;
+
+    if (l == 0) {
+        while (!x->leaf && x->n == 1) {
+            zbt->root = x->u.i.children[0];
+            zbtFreeNode(zbt,x);
+            zbt->height--;
+            x = zbt->root;
+        }
+        if (x->n == 0) {
+            zbtFreeNode(zbt,x);
+            zbt->root = zbt->head = zbt->tail = NULL;
+            zbt->height = 0;
+        }
+        return;
+    }
+    if (x->n >= ZBT_NODE_MIN) return;
+
+    p = path[l-1];
+    i = idx[l-1];
+    if (x->n == 0) {
+        zbtRemoveChild(zbt,p,i);
+    } else if (i+1 < p->n && x->n+p->u.i.children[i+1]->n <= ZBT_NODE_MAX) {
+        zbtMergeChildren(zbt,p,i);
+    } else if (i > 0 && p->u.i.children[i-1]->n+x->n <= ZBT_NODE_MAX) {
+        zbtMergeChildren(zbt,p,i-1);
+    } else {
+        return;
+    }
+    zbtRebalance(zbt,path,idx,l-1);
+}
+
+/* Delete the entry. Returns 1 if it was found and deleted, 0 otherwise.
+ * If 'deleted' is not NULL the ele sds of the tree is not freed but
+ * returned there, like zslDelete() does with the node. */
+// 删除元素，如果 deleted不为 NULL，树中的 sds不释放而是通过 deleted返回
+int zbtDelete(zbtree *zbt, double score, sds ele, sds *deleted) {
+    zbtNode *path[ZBT_MAX_HEIGHT], *x = zbt->root;
+    int idx[ZBT_MAX_HEIGHT], l, j, pos;
+
+    if (x == NULL) return 0;
+    for (l = 0; !x->leaf; l++) {
+        path[l] = x;
+        idx[l] = zbtChildForKey(x,score,ele);
+        x = x->u.i.children[idx[l]];
+    }
+    path[l] = x;
+
+    pos = zbtLeafLowerBound(x,score,ele);
+    if (pos == x->n || zbtCompare(x->scores[pos],x->eles[pos],score,ele) != 0)
+        return 0;
+    zbtAddBytes(zbt->ele_bytes,-sdsOwnedAllocSize(x->eles[pos]));
+    if (deleted) *deleted = x->eles[pos];
+    else sdsfree(x->eles[pos]);
+    memmove(x->scores+pos,x->scores+pos+1,sizeof(double)*(x->n-pos-1));
+    memmove(x->eles+pos,x->eles+pos+1,sizeof(sds)*(x->n-pos-1));
+    x->n--;
+    zbt->length--;
+    for (j = 0; j < l; j++) path[j]->u.i.counts[idx[j]]--;
+    zbtRebalance(zbt,path,idx,l);
+    return 1;
+}
+
+/* Update the score of an existing element. When the entry stays between
+ * its neighbours inside the same leaf the score is just replaced, otherwise
+ * the entry is removed and inserted again reusing the same sds. */
+// 更新已存在元素的分值，如果新位置还在同一个叶子中的两个邻居之间，直接修改分值
+void zbtUpdateScore(zbtree *zbt, double curscore, sds ele, double newscore) {
+    zbtNode *x = zbt->root;
+    int pos;
+    sds old;
+
+    while (!x->leaf) x = x->u.i.children[zbtChildForKey(x,curscore,ele)];
+    pos = zbtLeafLowerBound(x,curscore,ele);
+    if (pos > 0 && pos < x->n-1 &&
+        zbtCompare(x->scores[pos-1],x->eles[pos-1],newscore,x->eles[pos]) < 0 &&
+        zbtCompare(newscore,x->eles[pos],x->scores[pos+1],x->eles[pos+1]) < 0)
+    {
+        x->scores[pos] = newscore;
+        return;
+    }
+    zbtDelete(zbt,curscore,ele,&old);
+    zbtInsert(zbt,newscore,old);
+}
+
+/* Return the 1-based rank of the element, or 0 if it is not in the tree,
+ * like zslGetRank(). */
+// 返回元素的排名（从 1开始），不存在返回 0
+unsigned long zbtGetRank(zbtree *zbt, double score, sds ele) {
+    zbtNode *x = zbt->root;
+    unsigned long rank = 0;
+    int i, j, pos;
+
+    if (x == NULL) return 0;
+    while (!x->leaf) {
+        i = zbtChildForKey(x,score,ele);
+        for (j = 0; j < i; j++) rank += x->u.i.counts[j];
+        x = x->u.i.children[i];
+    }
+    pos = zbtLeafLowerBound(x,score,ele);
+    if (pos < x->n && zbtCompare(x->scores[pos],x->eles[pos],score,ele) == 0)
+        return rank+pos+1;
+    return 0;
+}
+
+/* Descend to the entry with the 1-based rank 'rank', optionally recording
+ * the path. Returns the leaf, and the position inside it in '*pos'. */
+// 按排名向下查找，可以同时记录经过的路径
+static zbtNode *zbtDescendByRank(zbtree *zbt, unsigned long rank, zbtNode **path,
+                                 int *idx, int *level, int *pos) {
+    zbtNode *x = zbt->root;
+    unsigned long r = rank-1;
+    int l, i;
+
+    for (l = 0; !x->leaf; l++) {
+        for (i = 0; i < x->n-1 && r >= x->u.i.counts[i]; i++)
+            r -= x->u.i.counts[i];
+        if (path) {
+            path[l] = x;
+            idx[l] = i;
+        }
+        x = x->u.i.children[i];
+    }
+    if (path) path[l] = x;
+    if (level) *level = l;
+    *pos = (int)r;
+    return x;
+}
+
+// 按排名（从 1开始）查找元素
+int zbtGetElementByRank(zbtree *zbt, unsigned long rank, zbtCursor *c) {
+    if (rank == 0 || rank > zbt->length) return 0;
+    c->leaf = zbtDescendByRank(zbt,rank,NULL,NULL,NULL,&c->pos);
+    return 1;
+}
+
+/* Seek the first entry for which the monotone predicate 'before' is false.
+ * Returns 0 if there is no such entry. */
+// 查找第一个让 before返回假的元素，用来实现 FirstInRange这类查找
+int zbtSeekFirstNot(zbtree *zbt, zbtPredicate *before, void *privdata, zbtCursor *c) {
+    zbtNode *x = zbt->root;
+    int lo, hi;
+
+    if (x == NULL) return 0;
+    while (!x->leaf) {
+        /* Last child whose separator is still 'before'. */
+        lo = 1;
+        hi = x->n;
+        while (lo < hi) {
+            int mid = (lo+hi) >> 1;
+            if (before(x->scores[mid],x->eles[mid],privdata)) lo = mid+1;
+            else hi = mid;
+        }
+        x = x->u.i.children[lo-1];
+    }
+    lo = 0;
+    hi = x->n;
+    while (lo < hi) {
+        int mid = (lo+hi) >> 1;
+        if (before(x->scores[mid],x->eles[mid],privdata)) lo = mid+1;
+        else hi = mid;
+    }
+    c->leaf = x;
+    c->pos = lo;
+    // 这个叶子中的元素都满足 before，答案是下一个叶子的第一个元素
+    if (lo == x->n) {
+        c->leaf = x->u.l.next;
+        c->pos = 0;
+        if (c->leaf == NULL) return 0;
+    }
+    return 1;
+}
+
+/* Seek the last entry for which the monotone predicate 'upto' is true.
+ * Returns 0 if there is no such entry. */
+// 查找最后一个让 upto返回真的元素，用来实现 LastInRange这类查找
+int zbtSeekLast(zbtree *zbt, zbtPredicate *upto, void *privdata, zbtCursor *c) {
+    if (!zbtSeekFirstNot(zbt,upto,privdata,c)) return zbtLast(zbt,c);
+    return zbtPrev(c);
+}
+
+int zbtFirst(zbtree *zbt, zbtCursor *c) {
+    if (zbt->head == NULL) return 0;
+    c->leaf = zbt->head;
+    c->pos = 0;
+    return 1;
+}
+
+int zbtLast(zbtree *zbt, zbtCursor *c) {
+    if (zbt->tail == NULL) return 0;
+    c->leaf = zbt->tail;
+    c->pos = zbt->tail->n-1;
+    return 1;
+}
+
+// 游标移动到下一个元素，没有更多元素时返回 0
+int zbtNext(zbtCursor *c) {
+    if (++c->pos < c->leaf->n) return 1;
+    c->leaf = c->leaf->u.l.next;
+    c->pos = 0;
+    return c->leaf != NULL;
+}
+
+int zbtPrev(zbtCursor *c) {
+    if (c->pos > 0) {
+        c->pos--;
+        return 1;
+    }
+    c->leaf = c->leaf->u.l.prev;
+    if (c->leaf == NULL) return 0;
+    c->pos = c->leaf->n-1;
+    return 1;
+}
+
+/* Delete the entries with a 1-based rank between start and end inclusive,
+ * a leaf worth of entries at a time. 'cb', if not NULL, is called for every
+ * element before it is freed, so that the caller can remove it from the
+ * dict. Returns the number of deleted entries. */
+// 删除排名在 [start,end]之间的元素，每次删除一个叶子中的一段，cb用于同步删除字典中的元素
+unsigned long zbtDeleteRangeByRank(zbtree *zbt, unsigned long start, unsigned long end,
+                                   zbtEleCallback *cb, void *privdata) {
+    zbtNode *path[ZBT_MAX_HEIGHT], *x;
+    int idx[ZBT_MAX_HEIGHT], l, j, pos, cnt;
+    unsigned long remaining, deleted = 0;
+
+    if (end > zbt->length) end = zbt->length;
+    if (start == 0 || start > end) return 0;
+    remaining = end-start+1;
+
+    while (remaining) {
+        x = zbtDescendByRank(zbt,start,path,idx,&l,&pos);
+        cnt = x->n-pos;
+        if ((unsigned long)cnt > remaining) cnt = remaining;
+        for (j = pos; j < pos+cnt; j++) {
+            if (cb) cb(x->eles[j],privdata);
+            zbtAddBytes(zbt->ele_bytes,-sdsOwnedAllocSize(x->eles[j]));
+            sdsfree(x->eles[j]);
+        }
+        memmove(x->scores+pos,x->scores+pos+cnt,sizeof(double)*(x->n-pos-cnt));
+        memmove(x->eles+pos,x->eles+pos+cnt,sizeof(sds)*(x->n-pos-cnt));
+        x->n -= cnt;
+        zbt->length -= cnt;
+        for (j = 0; j < l; j++) path[j]->u.i.counts[idx[j]] -= cnt;
+        zbtRebalance(zbt,path,idx,l);
+        remaining -= cnt;
+        deleted += cnt;
+    }
+    return deleted;
+}
+
+#ifdef REDIS_TEST
+#include <stdio.h>
+#include <sys/time.h>
+
+#define zbtTestAssert(_e) do { \
+    if (!(_e)) { \
+        printf("%s:%d: assertion failed: %s\n", __FILE__, __LINE__, #_e); \
+        exit(1); \
+    } \
+} while(0)
+
+static long long zbtUstime(void) {
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return ((long long)tv.tv_sec)*1000000+tv.tv_usec;
+}
+
+/* The model for the tests: a sorted array of entries. */
+typedef struct zbtTestEntry {
+    double score;
+    sds ele;
+} zbtTestEntry;
+
+static int zbtTestCmp(const void *a, const void *b) {
+    const zbtTestEntry *x = a, *y = b;
+    return zbtCompare(x->score,x->ele,y->score,y->ele);
+}
+
+/* Check the invariants of the subtree rooted at 'x', whose keys must all be
+ * >= (minscore,minele) if minele is not NULL. Returns the number of entries. */
+static unsigned long zbtTestCheckNode(zbtree *zbt, zbtNode *x, int depth,
+                                      double minscore, sds minele) {
+    unsigned long count = 0;
+    int j;
+
+    if (x != zbt->root) zbtTestAssert(x->n > 0);
+    zbtTestAssert(x->n <= ZBT_NODE_MAX);
+    if (x->leaf) {
+        zbtTestAssert(depth == zbt->height);
+        for (j = 0; j < x->n; j++) {
+            if (j > 0) zbtTestAssert(zbtCompare(x->scores[j-1],x->eles[j-1],
+                                                x->scores[j],x->eles[j]) < 0);
+            if (minele) zbtTestAssert(zbtCompare(minscore,minele,
+                                                 x->scores[j],x->eles[j]) <= 0);
+        }
+        return x->n;
+    }
+    for (j = 0; j < x->n; j++) {
+        double s = j ? x->scores[j] : minscore;
+        sds e = j ? x->eles[j] : minele;
+        unsigned long c = zbtTestCheckNode(zbt,x->u.i.children[j],depth+1,s,e);
+        zbtTestAssert(c == x->u.i.counts[j]);
+        count += c;
+        /* Every entry of child j is below the separator of child j+1. */
+        if (j+1 < x->n) {
+            zbtNode *y = x->u.i.children[j];
+            while (!y->leaf) y = y->u.i.children[y->n-1];
+            if (y->n) zbtTestAssert(zbtCompare(y->scores[y->n-1],y->eles[y->n-1],
+                                    x->scores[j+1],x->eles[j+1]) < 0);
+        }
+    }
+    return count;
+}
+
+static void zbtTestCheck(zbtree *zbt, zbtTestEntry *model, unsigned long len) {
+    zbtCursor c;
+    unsigned long j = 0;
+
+    zbtTestAssert(zbt->length == len);
+    if (zbt->root) {
+        zbtTestAssert(zbtTestCheckNode(zbt,zbt->root,1,0,NULL) == len);
+    } else {
+        zbtTestAssert(len == 0 && zbt->head == NULL && zbt->tail == NULL);
+    }
+    if (zbtFirst(zbt,&c)) {
+        do {
+            zbtTestAssert(j < len);
+            zbtTestAssert(zbtCursorScore(&c) == model[j].score);
+            zbtTestAssert(sdscmp(zbtCursorEle(&c),model[j].ele) == 0);
+            j++;
+        } while (zbtNext(&c));
+    }
+    zbtTestAssert(j == len);
+    if (zbtLast(zbt,&c)) {
+        do {
+            zbtTestAssert(sdscmp(zbtCursorEle(&c),model[--j].ele) == 0);
+        } while (zbtPrev(&c));
+    }
+    zbtTestAssert(j == 0);
+}
+
+static int zbtTestScoreBefore(double score, sds ele, void *privdata) {
+    (void)ele;
+    return score < *(double*)privdata;
+}
+
+static int zbtTestScoreUpto(double score, sds ele, void *privdata) {
+    (void)ele;
+    return score <= *(double*)privdata;
+}
+
+static void zbtTestCountCallback(sds ele, void *privdata) {
+    (void)ele;
+    (*(unsigned long*)privdata)++;
+}
+
+int zbtreeTest(int argc, char *argv[]) {
+    zbtTestEntry *model;
+    unsigned long len = 0, cap = 200000, j;
+    zbtree *zbt;
+    zbtCursor c;
+    int op, id = 0;
+    char buf[32];
+
+    (void)argc; (void)argv;
+    model = zmalloc(sizeof(*model)*cap);
+
+    printf("Random operations match a sorted array: ");
+    zbt = zbtCreate();
+    for (op = 0; op < 60000; op++) {
+        int r = rand() % 100;
+        if (r < 55 || len < 10) {
+            /* Insert, with a small score range so that ties are common. */
+            snprintf(buf,sizeof(buf),"e%d",id++);
+            model[len].score = rand() % 500;
+            model[len].ele = sdsnew(buf);
+            zbtInsert(zbt,model[len].score,sdsdup(model[len].ele));
+            len++;
+            qsort(model,len,sizeof(*model),zbtTestCmp);
+        } else if (r < 80) {
+            /* Delete, from the tree and from the model. */
+            unsigned long k = rand() % len;
+            zbtTestAssert(zbtDelete(zbt,model[k].score,model[k].ele,NULL));
+            zbtTestAssert(!zbtDelete(zbt,model[k].score,model[k].ele,NULL));
+            sdsfree(model[k].ele);
+            memmove(model+k,model+k+1,sizeof(*model)*(len-k-1));
+            len--;
+        } else if (r < 90) {
+            /* Update the score. */
+            unsigned long k = rand() % len;
+            double newscore = rand() % 500;
+            zbtUpdateScore(zbt,model[k].score,model[k].ele,newscore);
+            model[k].score = newscore;
+            qsort(model,len,sizeof(*model),zbtTestCmp);
+        } else if (r < 99) {
+            /* Ranks, lookups by rank and range seeks. */
+            unsigned long k = rand() % len;
+            double min = rand() % 500;
+            zbtTestAssert(zbtGetRank(zbt,model[k].score,model[k].ele) == k+1);
+            zbtTestAssert(zbtGetElementByRank(zbt,k+1,&c));
+            zbtTestAssert(sdscmp(zbtCursorEle(&c),model[k].ele) == 0);
+            for (j = 0; j < len && model[j].score < min; j++);
+            if (zbtSeekFirstNot(zbt,zbtTestScoreBefore,&min,&c)) {
+                zbtTestAssert(j < len && sdscmp(zbtCursorEle(&c),model[j].ele) == 0);
+            } else {
+                zbtTestAssert(j == len);
+            }
+            for (j = len; j > 0 && model[j-1].score > min; j--);
+            if (zbtSeekLast(zbt,zbtTestScoreUpto,&min,&c)) {
+                zbtTestAssert(j > 0 && sdscmp(zbtCursorEle(&c),model[j-1].ele) == 0);
+            } else {
+                zbtTestAssert(j == 0);
+            }
+        } else {
+            /* Delete a range by rank. */
+            unsigned long start = 1 + rand() % len, end, called = 0;
+            end = start + rand() % 300;
+            if (end > len) end = len;
+            zbtTestAssert(zbtDeleteRangeByRank(zbt,start,end,
+                zbtTestCountCallback,&called) == end-start+1);
+            zbtTestAssert(called == end-start+1);
+            for (j = start-1; j < end; j++) sdsfree(model[j].ele);
+            memmove(model+start-1,model+end,sizeof(*model)*(len-end));
+            len -= end-start+1;
+        }
+        if (op % 1000 == 0) zbtTestCheck(zbt,model,len);
+    }
+    zbtTestCheck(zbt,model,len);
+
+    /* Empty the tree completely. */
+    while (len) {
+        unsigned long k = rand() % len;
+        zbtTestAssert(zbtDelete(zbt,model[k].score,model[k].ele,NULL));
+        sdsfree(model[k].ele);
+        memmove(model+k,model+k+1,sizeof(*model)*(len-k-1));
+        len--;
+        if (len % 500 == 0) zbtTestCheck(zbt,model,len);
+    }
+    zbtTestAssert(zbt->root == NULL && zbt->height == 0 && zbt->bytes == 0 &&
+                  zbt->ele_bytes == 0);
+    zbtFree(zbt);
+    zbtTestAssert(zbtTotalBytes() == 0);
+    printf("ok\n");
+
+    printf("Benchmark 1M members: ");
+    {
+        long long start = zbtUstime();
+        unsigned long sum = 0;
+        zbt = zbtCreate();
+        for (j = 0; j < 1000000; j++) {
+            snprintf(buf,sizeof(buf),"member:%lu",j);
+            zbtInsert(zbt,rand() % 1000000,sdsnew(buf));
+        }
+        printf("insert %lldusec, %.1f node bytes per member, ",
+            zbtUstime()-start,(double)zbt->bytes/zbt->length);
+        start = zbtUstime();
+        for (j = 0; j < 1000000; j++) {
+            zbtTestAssert(zbtGetElementByRank(zbt,1+rand()%zbt->length,&c));
+            sum += zbtGetRank(zbt,zbtCursorScore(&c),zbtCursorEle(&c));
+        }
+        printf("1M rank lookups %lldusec\n",zbtUstime()-start);
+        zbtTestAssert(sum > 0);
+        zbtFree(zbt);
+    }
+
+    zfree(model);
+    return 0;
+}
+#endif
@@ -114,6 +114,138 @@ static intset *intsetResize(intset *is, uint32_t len) {
     return is;
 }
 
+/* ----------------------------- Search kernels ------------------------------
+ * intsetSearch() narrows the range with a branchless binary search until at
+ * most INTSET_SCAN_WINDOW elements are left, then counts the elements smaller
+ * than the value with one vector comparison per 8 (int16) or 4 (int32) lanes.
+ * The typed kernels read the contents in place, so they are only used on
+ * little endian hosts where the stored layout is the native one.
+ * -------------------------------------------------------------------------- */
+// 二分查找收敛到 INTSET_SCAN_WINDOW个元素以内后，改用向量比较统计比 value小的元素个数
+#define INTSET_SCAN_WINDOW 16
+/* When one side of an intersection is this many times larger than the other
+ * one, look the smaller elements up instead of merging. */
+// 两个集合大小相差超过这个倍数时，交集改为逐个查找而不是归并
+#define INTSET_GALLOP_RATIO 32
+
+#if (BYTE_ORDER == LITTLE_ENDIAN)
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define HAVE_INTSET_SSE2 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define HAVE_INTSET_NEON 1
+#endif
+
+// 统计 a[0..n)中比 v小的元素个数，a有序
+static uint32_t _intsetCountLess16(const int16_t *a, uint32_t n, int16_t v) {
+    uint32_t i = 0, c = 0;
+#if defined(HAVE_INTSET_SSE2)
+    __m128i vv = _mm_set1_epi16(v);
+    for (; i+8 <= n; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(a+i));
+        /* Two mask bits per 16 bit lane. */
+        c += __builtin_popcount(_mm_movemask_epi8(_mm_cmplt_epi16(x,vv))) >> 1;
+    }
+#elif defined(HAVE_INTSET_NEON)
+    int16x8_t vv = vdupq_n_s16(v);
+    for (; i+8 <= n; i += 8)
+        c += vaddvq_u16(vshrq_n_u16(vcltq_s16(vld1q_s16(a+i),vv),15));
+#endif
+    for (; i < n; i++) c += a[i] < v;
+    return c;
+}
+
+static uint32_t _intsetCountLess32(const int32_t *a, uint32_t n, int32_t v) {
+    uint32_t i = 0, c = 0;
+#if defined(HAVE_INTSET_SSE2)
+    __m128i vv = _mm_set1_epi32(v);
+    for (; i+4 <= n; i += 4) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(a+i));
+        c += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmplt_epi32(x,vv))));
+    }
+#elif defined(HAVE_INTSET_NEON)
+    int32x4_t vv = vdupq_n_s32(v);
+    for (; i+4 <= n; i += 4)
+        c += vaddvq_u32(vshrq_n_u32(vcltq_s32(vld1q_s32(a+i),vv),31));
+#endif
+    for (; i < n; i++) c += a[i] < v;
+    return c;
+}
+
+/* SSE2 has no 64 bit signed compare, the branchless loop is left to the
+ * compiler (it vectorizes it when SSE4.2 or NEON is available). */
+// SSE2没有 64位有符号比较指令，交给编译器自动向量化
+static uint32_t _intsetCountLess64(const int64_t *a, uint32_t n, int64_t v) {
+    uint32_t i, c = 0;
+    for (i = 0; i < n; i++) c += a[i] < v;
+    return c;
+}
+
+/* Generate, for every encoding, the lower bound search (index of the first
+ * element >= v) and the intersection of two arrays of the same width. */
+// 为每种编码生成 lower bound查找和同宽度数组求交集的函数
+#define INTSET_TYPED_KERNELS(bits) \
+static uint32_t _intsetLowerBound##bits(const int##bits##_t *a, uint32_t n, int##bits##_t v) { \
+    const int##bits##_t *base = a; \
+    while (n > INTSET_SCAN_WINDOW) { \
+        uint32_t half = n >> 1; \
+        base = (base[half] < v) ? base+half : base; \
+        n -= half; \
+    } \
+    return (uint32_t)(base-a) + _intsetCountLess##bits(base,n,v); \
+} \
+ \
+static uint32_t _intsetIntersect##bits(const int##bits##_t *s, uint32_t m, \
+                                       const int##bits##_t *l, uint32_t n, \
+                                       int##bits##_t *dst) { \
+    uint32_t i, j = 0, k = 0; \
+    int gallop = n/INTSET_GALLOP_RATIO > m; \
+    for (i = 0; i < m && j < n; i++) { \
+        int##bits##_t v = s[i]; \
+        if (gallop) { \
+            j += _intsetLowerBound##bits(l+j,n-j,v); \
+        } else if (l[j] < v) { \
+            while (j < n) { \
+                uint32_t w = n-j < INTSET_SCAN_WINDOW ? n-j : INTSET_SCAN_WINDOW; \
+                uint32_t c = _intsetCountLess##bits(l+j,w,v); \
+                j += c; \
+                if (c < w) break; \
+            } \
+        } \
+        if (j < n && l[j] == v) dst[k++] = l[j++]; \
+    } \
+    return k; \
+}
+
+INTSET_TYPED_KERNELS(16)
+INTSET_TYPED_KERNELS(32)
+INTSET_TYPED_KERNELS(64)
+#endif
+
+/* Return the index of the first element >= value. */
+// 返回第一个不小于 value的元素下标，调用者保证 value在当前编码的表示范围内
+static uint32_t _intsetLowerBound(intset *is, int64_t value) {
+    uint32_t len = intrev32ifbe(is->length);
+    uint8_t enc = intrev32ifbe(is->encoding);
+#if (BYTE_ORDER == LITTLE_ENDIAN)
+    if (enc == INTSET_ENC_INT64)
+        return _intsetLowerBound64((int64_t*)is->contents,len,value);
+    else if (enc == INTSET_ENC_INT32)
+        return _intsetLowerBound32((int32_t*)is->contents,len,value);
+    else
+        return _intsetLowerBound16((int16_t*)is->contents,len,value);
+#else
+    uint32_t base = 0;
+    while (len > 1) {
+        uint32_t half = len >> 1;
+        base = (_intsetGetEncoded(is,base+half,enc) < value) ? base+half : base;
+        len -= half;
+    }
+    return base + (len && _intsetGetEncoded(is,base,enc) < value);
+#endif
+}
+
 /* Search for the position of "value". Return 1 when the value was found and
  * sets "pos" to the position of the value within the intset. Return 0 when
  * the value is not present in the intset and sets "pos" to the position
@@ -121,19 +253,19 @@ static intset *intsetResize(intset *is, uint32_t len) {
 // 查找 value在 intset中的位置，找到返回1，没找到返回0，找到将位置赋值给 pos指针
 // 一般当做其他函数的子调用过程
 static uint8_t intsetSearch(intset *is, int64_t value, uint32_t *pos) {
-    int min = 0, max = intrev32ifbe(is->length)-1, mid = -1;
-    int64_t cur = -1;
+    uint32_t len = intrev32ifbe(is->length), lb;
 
     // 空的 intset肯定没有
-    if (intrev32ifbe(is->length) == 0) {
+    if (len == 0) {
         if (pos) *pos = 0;
         return 0;
     } else {
         /* Check for the case where we know we cannot find the value,
          * but do know the insert position. */
         // 不能比最后的值大，也不能比第一个值小，不然肯定不存在
-        if (value > _intsetGet(is,intrev32ifbe(is->length)-1)) {
-            if (pos) *pos = intrev32ifbe(is->length);
+        // 这也保证了下面的 value一定在当前编码的表示范围内
+        if (value > _intsetGet(is,len-1)) {
+            if (pos) *pos = len;
             return 0;
         } else if (value < _intsetGet(is,0)) {
             if (pos) *pos = 0;
@@ -141,28 +273,10 @@ static uint8_t intsetSearch(intset *is, int64_t value, uint32_t *pos) {
         }
     }
 
-    // 二分查找
-    while(max >= min) {
-        mid = ((unsigned int)min + (unsigned int)max) >> 1;
-        cur = _intsetGet(is,mid);
-        if (value > cur) {
-            min = mid+1;
-        } else if (value < cur) {
-            max = mid-1;
-        } else {
-            break;
-        }
-    }
-
-    // 找的到就返回对应的位置
-    if (value == cur) {
-        if (pos) *pos = mid;
-        return 1;
-        // 找不到就返回应该插入的位置
-    } else {
-        if (pos) *pos = min;
-        return 0;
-    }
+    // 无分支二分 + 向量扫描，找到第一个不小于 value的位置
+    lb = _intsetLowerBound(is,value);
+    if (pos) *pos = lb;
+    return _intsetGet(is,lb) == value;
 }
 
 /* Upgrades the intset to a larger encoding and inserts the given integer. */
@@ -250,6 +364,114 @@ intset *intsetAdd(intset *is, int64_t value, uint8_t *success) {
     return is;
 }
 
+static int _intsetCmpInt64(const void *a, const void *b) {
+    int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/* Add 'count' values at once. The input is sorted and deduplicated, then
+ * merged with the existing contents in a single pass into a set allocated
+ * once with the final encoding, instead of doing one resize and one
+ * memmove per value. When 'added' is not NULL it is set to the number of
+ * values that were not already in the set. */
+// 批量添加：先对输入排序去重，再和原有元素一次归并，避免逐个插入时的 N次 realloc和 memmove
+intset *intsetAddMany(intset *is, const int64_t *values, uint32_t count, uint32_t *added) {
+    uint32_t len = intrev32ifbe(is->length), uniq, i, j, k;
+    uint8_t curenc = intrev32ifbe(is->encoding), newenc = curenc, enc;
+    int64_t *sorted;
+    intset *ns;
+
+    if (added) *added = 0;
+    if (count == 0) return is;
+
+    sorted = zmalloc(sizeof(int64_t)*count);
+    memcpy(sorted,values,sizeof(int64_t)*count);
+    qsort(sorted,count,sizeof(int64_t),_intsetCmpInt64);
+    for (uniq = 1, i = 1; i < count; i++)
+        if (sorted[i] != sorted[uniq-1]) sorted[uniq++] = sorted[i];
+
+    // 输入有序，所以只需要看最小值和最大值就能确定需要的编码
+    if ((enc = _intsetValueEncoding(sorted[0])) > newenc) newenc = enc;
+    if ((enc = _intsetValueEncoding(sorted[uniq-1])) > newenc) newenc = enc;
+
+    ns = zmalloc(sizeof(intset)+(size_t)(len+uniq)*newenc);
+    ns->encoding = intrev32ifbe(newenc);
+    i = j = k = 0;
+    while (i < len && j < uniq) {
+        int64_t cur = _intsetGetEncoded(is,i,curenc);
+        if (cur < sorted[j]) {
+            _intsetSet(ns,k++,cur); i++;
+        } else if (cur > sorted[j]) {
+            _intsetSet(ns,k++,sorted[j++]);
+        } else {
+            _intsetSet(ns,k++,cur); i++; j++;
+        }
+    }
+    // 剩下的部分直接追加
+    if (i < len && newenc == curenc) {
+        memcpy(ns->contents+(size_t)k*newenc,is->contents+(size_t)i*curenc,
+               (size_t)(len-i)*curenc);
+        k += len-i;
+    } else {
+        while (i < len) _intsetSet(ns,k++,_intsetGetEncoded(is,i++,curenc));
+    }
+    while (j < uniq) _intsetSet(ns,k++,sorted[j++]);
+
+    if (added) *added = k-len;
+    ns->length = intrev32ifbe(k);
+    if (k < len+uniq) ns = intsetResize(ns,k);
+    zfree(sorted);
+    zfree(is);
+    return ns;
+}
+
+/* Return a new intset with the elements present in both 'a' and 'b'. When
+ * both sets use the same encoding the typed kernels are used: a vectorized
+ * merge when the sizes are similar, a lower bound search per element of the
+ * smaller set when one of them is much larger. */
+// 求两个整数集合的交集，返回新的 intset，两个输入都不会被修改
+intset *intsetIntersect(intset *a, intset *b) {
+    uint32_t alen = intrev32ifbe(a->length), blen = intrev32ifbe(b->length);
+    uint8_t aenc = intrev32ifbe(a->encoding), benc = intrev32ifbe(b->encoding);
+    uint8_t enc = aenc < benc ? aenc : benc;
+    uint32_t i = 0, j = 0, k = 0;
+    intset *is;
+
+    // 小的集合放在前面
+    if (alen > blen) return intsetIntersect(b,a);
+
+    // 交集中的元素同时属于两个集合，所以较小的编码一定放得下
+    is = zmalloc(sizeof(intset)+(size_t)alen*enc);
+    is->encoding = intrev32ifbe(enc);
+#if (BYTE_ORDER == LITTLE_ENDIAN)
+    if (aenc == benc) {
+        if (enc == INTSET_ENC_INT64)
+            k = _intsetIntersect64((int64_t*)a->contents,alen,
+                    (int64_t*)b->contents,blen,(int64_t*)is->contents);
+        else if (enc == INTSET_ENC_INT32)
+            k = _intsetIntersect32((int32_t*)a->contents,alen,
+                    (int32_t*)b->contents,blen,(int32_t*)is->contents);
+        else
+            k = _intsetIntersect16((int16_t*)a->contents,alen,
+                    (int16_t*)b->contents,blen,(int16_t*)is->contents);
+        i = alen;
+    }
+#endif
+    // 编码不同时逐个比较归并
+    while (i < alen && j < blen) {
+        int64_t x = _intsetGetEncoded(a,i,aenc), y = _intsetGetEncoded(b,j,benc);
+        if (x < y) {
+            i++;
+        } else if (x > y) {
+            j++;
+        } else {
+            _intsetSet(is,k++,x); i++; j++;
+        }
+    }
+    is->length = intrev32ifbe(k);
+    return intsetResize(is,k);
+}
+
 // 删除一个元素，success变量的作用和插入一个变量的作用相同
 intset *intsetRemove(intset *is, int64_t value, int *success) {
     uint8_t valenc = _intsetValueEncoding(value);
@@ -492,6 +714,145 @@ int intsetTest(int argc, char **argv) {
                num,size,usec()-start);
     }
 
+    printf("Lower bound search for every encoding: "); {
+        int64_t scale[3] = {1, 1<<16, 1LL<<32};
+        for (int e = 0; e < 3; e++) {
+            for (int size = 1; size < 600; size += 37) {
+                is = intsetNew();
+                for (i = 0; i < size; i++)
+                    is = intsetAdd(is,(rand()%20000-10000)*scale[e],NULL);
+                for (i = 0; i < 2000; i++) {
+                    int64_t v = (rand()%20000-10000)*scale[e] + (rand()%3-1);
+                    uint32_t pos, expect = 0;
+                    uint8_t found;
+                    while (expect < intrev32ifbe(is->length) &&
+                           _intsetGet(is,expect) < v) expect++;
+                    found = intsetSearch(is,v,&pos);
+                    assert(pos == expect);
+                    assert(found == (expect < intrev32ifbe(is->length) &&
+                                     _intsetGet(is,expect) == v));
+                }
+                zfree(is);
+            }
+        }
+        ok();
+    }
+
+    printf("Bulk adds match single adds: "); {
+        int64_t values[1000];
+        for (int round = 0; round < 200; round++) {
+            intset *bulk = intsetNew(), *single = intsetNew();
+            uint32_t n = rand()%1000, expect = 0, added;
+            int64_t range = (round%3 == 0) ? 30000 : (round%3 == 1) ? 3000000000LL : 500;
+            for (i = 0; i < (int)(rand()%200); i++) {
+                int64_t v = rand()%500;
+                bulk = intsetAdd(bulk,v,NULL);
+                single = intsetAdd(single,v,NULL);
+            }
+            for (uint32_t j = 0; j < n; j++) {
+                values[j] = ((int64_t)rand()*rand()) % range - range/2;
+                single = intsetAdd(single,values[j],&success);
+                if (success) expect++;
+            }
+            bulk = intsetAddMany(bulk,values,n,&added);
+            assert(added == expect);
+            assert(intsetBlobLen(bulk) == intsetBlobLen(single));
+            assert(memcmp(bulk,single,intsetBlobLen(bulk)) == 0);
+            zfree(bulk);
+            zfree(single);
+        }
+        ok();
+    }
+
+    printf("Intersection matches lookups: "); {
+        int64_t scale[3] = {1, 1<<16, 1LL<<32};
+        int sizes[4][2] = {{500,500},{10,5000},{5000,10},{0,100}};
+        for (int ea = 0; ea < 3; ea++) {
+            for (int eb = 0; eb < 3; eb++) {
+                for (int sz = 0; sz < 4; sz++) {
+                    intset *x = intsetNew(), *y = intsetNew(), *r;
+                    uint32_t expect = 0;
+                    for (i = 0; i < sizes[sz][0]; i++)
+                        x = intsetAdd(x,(rand()%10000)*scale[ea],NULL);
+                    for (i = 0; i < sizes[sz][1]; i++)
+                        y = intsetAdd(y,(rand()%10000)*scale[eb],NULL);
+                    r = intsetIntersect(x,y);
+                    for (uint32_t j = 0; j < intsetLen(x); j++) {
+                        int64_t v = _intsetGet(x,j);
+                        if (intsetFind(y,v)) {
+                            assert(_intsetGet(r,expect) == v);
+                            expect++;
+                        }
+                    }
+                    assert(intsetLen(r) == expect);
+                    if (expect) checkConsistency(r);
+                    zfree(x); zfree(y); zfree(r);
+                }
+            }
+        }
+        ok();
+    }
+
+    printf("Benchmark lookups on 500 element sets:\n"); {
+        long num = 1000000;
+        int64_t scale[3] = {1, 1<<16, 1LL<<32};
+        const char *names[3] = {"int16","int32","int64"};
+        long long start;
+        for (int e = 0; e < 3; e++) {
+            uint32_t hits = 0;
+            is = intsetNew();
+            while (intsetLen(is) < 500)
+                is = intsetAdd(is,(rand()%1000)*scale[e],NULL);
+            start = usec();
+            for (i = 0; i < num; i++)
+                hits += intsetFind(is,(rand()%1000)*scale[e]);
+            printf("  %s: %ld lookups, %u hits, %lldusec\n",
+                   names[e],num,hits,usec()-start);
+            zfree(is);
+        }
+    }
+
+    printf("Benchmark 500x500 intersections:\n"); {
+        int64_t scale[3] = {1, 1<<16, 1LL<<32};
+        const char *names[3] = {"int16","int32","int64"};
+        long long start;
+        for (int e = 0; e < 3; e++) {
+            intset *x = intsetNew(), *y = intsetNew(), *r;
+            uint32_t hits = 0;
+            while (intsetLen(x) < 500) x = intsetAdd(x,(rand()%1000)*scale[e],NULL);
+            while (intsetLen(y) < 500) y = intsetAdd(y,(rand()%1000)*scale[e],NULL);
+            start = usec();
+            for (i = 0; i < 10000; i++) {
+                r = intsetIntersect(x,y);
+                hits += intsetLen(r);
+                zfree(r);
+            }
+            printf("  %s: 10000 intersections %lldusec, ",names[e],usec()-start);
+            start = usec();
+            for (i = 0; i < 10000; i++)
+                for (uint32_t j = 0; j < 500; j++)
+                    hits -= intsetFind(y,_intsetGet(x,j));
+            printf("lookup loop %lldusec\n",usec()-start);
+            assert(hits == 0);
+            zfree(x); zfree(y);
+        }
+    }
+
+    printf("Benchmark bulk adds: "); {
+        int64_t *values = zmalloc(sizeof(int64_t)*100000);
+        intset *x = intsetNew(), *y = intsetNew();
+        long long start;
+        for (i = 0; i < 100000; i++) values[i] = rand()%1000000;
+        start = usec();
+        for (i = 0; i < 100000; i++) x = intsetAdd(x,values[i],NULL);
+        printf("100000 single adds %lldusec, ",usec()-start);
+        start = usec();
+        y = intsetAddMany(y,values,100000,NULL);
+        printf("intsetAddMany %lldusec\n",usec()-start);
+        assert(memcmp(x,y,intsetBlobLen(x)) == 0);
+        zfree(values); zfree(x); zfree(y);
+    }
+
     printf("Stress add+delete: "); {
         int i, v1, v2;
         is = intsetNew();
@@ -29,11 +29,22 @@
  */
 
 #include <string.h> /* for memcpy */
+#include <strings.h> /* for strcasecmp */
 #include "quicklist.h"
 #include "zmalloc.h"
 #include "ziplist.h"
+#include "listpack.h"
 #include "util.h" /* for ll2string */
 #include "lzf.h"
+#include "dsstats.h"
+#ifdef USE_LZ4
+#include <lz4.h>
+#endif
+#ifdef USE_ZSTD
+#include <pthread.h>
+#include <zstd.h>
+#include <zdict.h>
+#endif
 
 #if defined(REDIS_TEST) || defined(REDIS_TEST_VERBOSE)
 #include <stdio.h> /* for printf (debug printing), snprintf (genstr) */
@@ -92,6 +103,33 @@ static const size_t optimization_level[] = {4096, 8192, 16384, 32768, 65536};
 #define unlikely(x) (x)
 #endif
 
+/* Memory used by the nodes of every quicklist, summing quicklist->bytes of
+ * all the lists. Lists can be released by the background free thread, so
+ * it is updated with atomic operations. */
+// 所有 quicklist 节点占用的内存，MEMORY STATS 使用
+static size_t quicklist_total_bytes = 0;
+
+#define quicklistAddBytes(_ql, _delta)                                         \
+    do {                                                                       \
+        (_ql)->bytes += (_delta);                                              \
+        __atomic_add_fetch(&quicklist_total_bytes, (_delta),                   \
+                           __ATOMIC_RELAXED);                                  \
+    } while (0)
+
+/* Bytes 'node' takes in quicklist->bytes: the node and its listpack, or the
+ * node and its compressed data while it is compressed. */
+// 节点实际占用的字节数，压缩过的节点按压缩后的大小计算
+#define quicklistNodeBytes(_node)                                              \
+    (sizeof(quicklistNode) +                                                   \
+     ((_node)->encoding == QUICKLIST_NODE_ENCODING_LZF                         \
+          ? sizeof(quicklistLZF) + ((quicklistLZF *)(_node)->zl)->sz           \
+          : (_node)->sz))
+
+/* Nodes linked in the list account for their size in quicklist->bytes,
+ * while a node not linked yet is accounted by __quicklistInsertNode(). */
+#define quicklistNodeIsLinked(_ql, _node)                                      \
+    ((_node)->prev || (_node)->next || (_ql)->head == (_node))
+
 /* Create a new quicklist.
  * Free with quicklistRelease(). */
 // 创建一个 quicklist，释放时使用 quicklistRelease() 释放空间
@@ -102,8 +140,13 @@ quicklist *quicklistCreate(void) {
     quicklist->head = quicklist->tail = NULL;
     quicklist->len = 0;
     quicklist->count = 0;
+    quicklist->bytes = 0;
     quicklist->compress = 0;
     quicklist->fill = -2;
+    quicklist->codec = QUICKLIST_CODEC_LZF;
+    quicklist->adaptive = NULL;
+    quicklist->index = NULL;
+    quicklist->cache = NULL;
     return quicklist;
 }
 
@@ -127,8 +170,78 @@ void quicklistSetFill(quicklist *quicklist, int fill) {
         fill = -5;
     }
     quicklist->fill = fill;
+    if (quicklist->adaptive)
+        quicklist->adaptive->base_fill = fill;
+}
+
+/* Turn adaptive fill on or off. In adaptive mode the list counts accesses
+ * to its head/tail nodes and to its interior nodes, and every
+ * QUICKLIST_ADAPT_WINDOW accesses picks a fill for what it saw: large nodes
+ * for lists only used at the ends (queues), small nodes for lists mostly
+ * accessed in the middle (LINDEX/LSET/LINSERT), so that updates memmove
+ * less. Node sizes follow when nodes are modified, see _quicklistAdaptNode().
+ * Turning it off restores the fill set with quicklistSetFill(). */
+// 自适应 fill：根据两端访问和中间访问的比例调整节点大小
+void quicklistSetAdaptive(quicklist *quicklist, int enable) {
+    if (enable && !quicklist->adaptive) {
+        quicklist->adaptive = zcalloc(sizeof(quicklistAdaptiveStats));
+        quicklist->adaptive->base_fill = quicklist->fill;
+    } else if (!enable && quicklist->adaptive) {
+        quicklist->fill = quicklist->adaptive->base_fill;
+        zfree(quicklist->adaptive);
+        quicklist->adaptive = NULL;
+    }
 }
 
+/* Copy the adaptive fill statistics of 'quicklist' into 'stats'.
+ * Returns 0 if the list is not in adaptive mode. */
+int quicklistGetAdaptiveStats(const quicklist *quicklist,
+                              quicklistAdaptiveStats *stats) {
+    if (!quicklist->adaptive)
+        return 0;
+    *stats = *quicklist->adaptive;
+    return 1;
+}
+
+/* Count an access to 'node' and, at the end of every window, choose the
+ * fill for the next one. */
+// 记录一次访问，每个窗口结束时重新选择 fill
+REDIS_STATIC void _quicklistAdaptRecord(quicklist *ql,
+                                        const quicklistNode *node) {
+    quicklistAdaptiveStats *st = ql->adaptive;
+
+    if (node == ql->head || node == ql->tail) {
+        st->end_ops++;
+        st->window_end_ops++;
+    } else {
+        st->middle_ops++;
+        st->window_middle_ops++;
+    }
+    if (st->window_end_ops + st->window_middle_ops < QUICKLIST_ADAPT_WINDOW)
+        return;
+
+    unsigned long long pct = st->window_middle_ops * 100 /
+                             (st->window_end_ops + st->window_middle_ops);
+    int fill;
+    if (pct >= QUICKLIST_ADAPT_MIDDLE_HIGH)
+        fill = QUICKLIST_ADAPT_FILL_SMALL;
+    else if (pct <= QUICKLIST_ADAPT_MIDDLE_LOW)
+        fill = QUICKLIST_ADAPT_FILL_LARGE;
+    else
+        fill = st->base_fill;
+    if (fill != ql->fill) {
+        ql->fill = fill;
+        st->adaptations++;
+    }
+    st->window_end_ops = st->window_middle_ops = 0;
+}
+
+#define quicklistAdaptRecord(_ql, _node)                                       \
+    do {                                                                       \
+        if (unlikely((_ql)->adaptive))                                         \
+            _quicklistAdaptRecord((_ql), (_node));                             \
+    } while (0)
+
 // 上两个函数的结合
 void quicklistSetOptions(quicklist *quicklist, int fill, int depth) {
     quicklistSetFill(quicklist, fill);
@@ -154,15 +267,25 @@ REDIS_STATIC quicklistNode *quicklistCreateNode(void) {
     node->next = node->prev = NULL;
     // 默认使用 raw 的编码
     node->encoding = QUICKLIST_NODE_ENCODING_RAW;
-    node->container = QUICKLIST_NODE_CONTAINER_ZIPLIST;
+    node->codec = QUICKLIST_CODEC_LZF;
+    node->container = QUICKLIST_NODE_CONTAINER_LISTPACK;
     node->recompress = 0;
+    node->cached = 0;
     return node;
 }
 
+/* Memory used by the nodes of all the quicklists, see quicklist->bytes. */
+size_t quicklistTotalBytes(void) {
+    return __atomic_load_n(&quicklist_total_bytes, __ATOMIC_RELAXED);
+}
+
 /* Return cached quicklist count */
 // 获取 quicklist 节点的个数
 unsigned long quicklistCount(const quicklist *ql) { return ql->count; }
 
+REDIS_STATIC void __quicklistFreeLzf(quicklistLZF *lzf, int codec);
+REDIS_STATIC void _quicklistIndexFree(quicklist *quicklist);
+
 /* Free entire quicklist. */
 // 释放函数，释放申请的 quicklist 的内存空间
 void quicklistRelease(quicklist *quicklist) {
@@ -174,7 +297,10 @@ void quicklistRelease(quicklist *quicklist) {
     while (len--) {
         next = current->next;
 
-        zfree(current->zl);
+        if (current->encoding == QUICKLIST_NODE_ENCODING_LZF)
+            __quicklistFreeLzf((quicklistLZF *)current->zl, current->codec);
+        else
+            zfree(current->zl);
         quicklist->count -= current->count;
 
         zfree(current);
@@ -182,14 +308,276 @@ void quicklistRelease(quicklist *quicklist) {
         quicklist->len--;
         current = next;
     }
+    __atomic_sub_fetch(&quicklist_total_bytes, quicklist->bytes,
+                       __ATOMIC_RELAXED);
+    zfree(quicklist->adaptive);
+    if (quicklist->index)
+        _quicklistIndexFree(quicklist);
+    quicklistSetNodeCache(quicklist, 0);
     zfree(quicklist);
 }
 
-/* Compress the ziplist in 'node' and update encoding details.
- * Returns 1 if ziplist compressed successfully.
- * Returns 0 if compression failed or if ziplist too small to compress. */
+/* Node compression codecs. LZF is always available, LZ4 and zstd are
+ * compiled in with USE_LZ4 / USE_ZSTD (linking liblz4 / libzstd).
+ *
+ * compress() returns the compressed size, or 0 if the result doesn't fit
+ * in 'dstlen' bytes. decompress() returns the decompressed size, or 0 on
+ * error. */
+// 节点压缩算法表，每个节点通过 node->codec 记录自己用的是哪个
+typedef struct quicklistCodecType {
+    const char *name;
+    size_t (*compress)(const void *src, size_t srclen, void *dst,
+                       size_t dstlen);
+    size_t (*decompress)(const void *src, size_t srclen, void *dst,
+                         size_t dstlen);
+} quicklistCodecType;
+
+static size_t _quicklistLzfCompress(const void *src, size_t srclen, void *dst,
+                                    size_t dstlen) {
+    return lzf_compress(src, srclen, dst, dstlen);
+}
+
+static size_t _quicklistLzfDecompress(const void *src, size_t srclen,
+                                      void *dst, size_t dstlen) {
+    return lzf_decompress(src, srclen, dst, dstlen);
+}
+
+#ifdef USE_LZ4
+static size_t _quicklistLz4Compress(const void *src, size_t srclen, void *dst,
+                                    size_t dstlen) {
+    int ret = LZ4_compress_default(src, dst, srclen, dstlen);
+    return ret > 0 ? (size_t)ret : 0;
+}
+
+static size_t _quicklistLz4Decompress(const void *src, size_t srclen,
+                                      void *dst, size_t dstlen) {
+    int ret = LZ4_decompress_safe(src, dst, srclen, dstlen);
+    return ret > 0 ? (size_t)ret : 0;
+}
+#endif
+
+#ifdef USE_ZSTD
+/* Dictionaries loaded with quicklistSetZstdDictionary(). New nodes are
+ * compressed with the current one, but nodes compressed with an older
+ * dictionary may still be around: the frame header tells which one a node
+ * needs. So every dictionary counts the compressed frames made with it,
+ * and it is released when it's no longer current and the last of them is
+ * freed, see _quicklistZstdUnref().
+ *
+ * Nodes are compressed and decompressed by the background free and the
+ * loading threads too: the table is protected by a rwlock, and every
+ * thread uses its own compression contexts, freed when the thread exits. */
+// zstd 字典按引用计数释放，线程各自使用自己的压缩上下文
+static struct {
+    unsigned int id;        /* 0 for a free slot */
+    unsigned long refs;     /* live frames compressed with the dictionary */
+    ZSTD_CDict *cdict;
+    ZSTD_DDict *ddict;
+} quicklist_zstd_dicts[QUICKLIST_ZSTD_MAX_DICTS];
+static int quicklist_zstd_current = -1;
+static pthread_rwlock_t quicklist_zstd_lock = PTHREAD_RWLOCK_INITIALIZER;
+static __thread ZSTD_CCtx *quicklist_zstd_cctx = NULL;
+static __thread ZSTD_DCtx *quicklist_zstd_dctx = NULL;
+static pthread_once_t quicklist_zstd_once = PTHREAD_ONCE_INIT;
+static pthread_key_t quicklist_zstd_key;
+
+static void _quicklistZstdThreadExit(void *arg) {
+    (void)arg;
+    ZSTD_freeCCtx(quicklist_zstd_cctx);
+    ZSTD_freeDCtx(quicklist_zstd_dctx);
+    quicklist_zstd_cctx = NULL;
+    quicklist_zstd_dctx = NULL;
+}
+
+static void _quicklistZstdInit(void) {
+    pthread_key_create(&quicklist_zstd_key, _quicklistZstdThreadExit);
+}
+
+/* Create the contexts of the calling thread if it has none yet. */
+static void _quicklistZstdThreadInit(void) {
+    if (quicklist_zstd_cctx) return;
+    pthread_once(&quicklist_zstd_once, _quicklistZstdInit);
+    quicklist_zstd_cctx = ZSTD_createCCtx();
+    quicklist_zstd_dctx = ZSTD_createDCtx();
+    pthread_setspecific(quicklist_zstd_key, quicklist_zstd_cctx);
+}
+
+/* Slot of the dictionary with ID 'id', or -1. Called with the lock held. */
+static int _quicklistZstdFindDict(unsigned int id) {
+    for (int j = 0; j < QUICKLIST_ZSTD_MAX_DICTS; j++) {
+        if (id && quicklist_zstd_dicts[j].id == id)
+            return j;
+    }
+    return -1;
+}
+
+/* Release the dictionary in 'slot' if nothing needs it anymore. Called
+ * with the lock held for writing. */
+static void _quicklistZstdFreeDictIfUnused(int slot) {
+    if (slot < 0 || slot == quicklist_zstd_current ||
+        quicklist_zstd_dicts[slot].refs)
+        return;
+    ZSTD_freeCDict(quicklist_zstd_dicts[slot].cdict);
+    ZSTD_freeDDict(quicklist_zstd_dicts[slot].ddict);
+    memset(&quicklist_zstd_dicts[slot], 0, sizeof(quicklist_zstd_dicts[slot]));
+}
+
+/* Take a reference to the dictionary of the zstd frame in 'lzf', that is
+ * being copied. */
+static void _quicklistZstdRef(const quicklistLZF *lzf) {
+    unsigned int id = ZSTD_getDictID_fromFrame(lzf->compressed, lzf->sz);
+    int slot;
+
+    if (id == 0) return;
+    pthread_rwlock_rdlock(&quicklist_zstd_lock);
+    if ((slot = _quicklistZstdFindDict(id)) != -1)
+        __atomic_add_fetch(&quicklist_zstd_dicts[slot].refs, 1,
+                           __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&quicklist_zstd_lock);
+}
+
+/* Drop the reference of the zstd frame in 'lzf', that is being freed. */
+static void _quicklistZstdUnref(const quicklistLZF *lzf) {
+    unsigned int id = ZSTD_getDictID_fromFrame(lzf->compressed, lzf->sz);
+    int slot;
+
+    if (id == 0) return;
+    pthread_rwlock_wrlock(&quicklist_zstd_lock);
+    if ((slot = _quicklistZstdFindDict(id)) != -1) {
+        quicklist_zstd_dicts[slot].refs--;
+        _quicklistZstdFreeDictIfUnused(slot);
+    }
+    pthread_rwlock_unlock(&quicklist_zstd_lock);
+}
+
+static size_t _quicklistZstdCompress(const void *src, size_t srclen,
+                                     void *dst, size_t dstlen) {
+    int slot;
+    size_t ret;
+
+    _quicklistZstdThreadInit();
+    pthread_rwlock_rdlock(&quicklist_zstd_lock);
+    slot = quicklist_zstd_current;
+    if (slot != -1) {
+        ret = ZSTD_compress_usingCDict(quicklist_zstd_cctx, dst, dstlen, src,
+                                       srclen, quicklist_zstd_dicts[slot].cdict);
+        if (!ZSTD_isError(ret))
+            __atomic_add_fetch(&quicklist_zstd_dicts[slot].refs, 1,
+                               __ATOMIC_RELAXED);
+    } else {
+        ret = ZSTD_compressCCtx(quicklist_zstd_cctx, dst, dstlen, src, srclen,
+                                QUICKLIST_ZSTD_LEVEL);
+    }
+    pthread_rwlock_unlock(&quicklist_zstd_lock);
+    return ZSTD_isError(ret) ? 0 : ret;
+}
+
+static size_t _quicklistZstdDecompress(const void *src, size_t srclen,
+                                       void *dst, size_t dstlen) {
+    unsigned int id = ZSTD_getDictID_fromFrame(src, srclen);
+    size_t ret;
+
+    _quicklistZstdThreadInit();
+    if (id == 0) {
+        ret = ZSTD_decompressDCtx(quicklist_zstd_dctx, dst, dstlen, src,
+                                  srclen);
+    } else {
+        /* The frame holds a reference: the dictionary can't go away, but
+         * the table may change while we look it up. */
+        pthread_rwlock_rdlock(&quicklist_zstd_lock);
+        int slot = _quicklistZstdFindDict(id);
+        ZSTD_DDict *ddict =
+            slot == -1 ? NULL : quicklist_zstd_dicts[slot].ddict;
+        pthread_rwlock_unlock(&quicklist_zstd_lock);
+        if (ddict == NULL)
+            return 0;
+        ret = ZSTD_decompress_usingDDict(quicklist_zstd_dctx, dst, dstlen, src,
+                                         srclen, ddict);
+    }
+    return ZSTD_isError(ret) ? 0 : ret;
+}
+#endif
+
+/* Free the compressed data 'lzf' made with 'codec'. */
+// 释放压缩后的数据，zstd 的数据还要释放对字典的引用
+REDIS_STATIC void __quicklistFreeLzf(quicklistLZF *lzf, int codec) {
+#ifdef USE_ZSTD
+    if (codec == QUICKLIST_CODEC_ZSTD && lzf->sz)
+        _quicklistZstdUnref(lzf);
+#else
+    (void)codec;
+#endif
+    zfree(lzf);
+}
+
+/* Return a copy of the compressed data 'lzf' made with 'codec'. */
+REDIS_STATIC quicklistLZF *__quicklistCopyLzf(const quicklistLZF *lzf,
+                                              int codec) {
+    quicklistLZF *copy = zmalloc(sizeof(*lzf) + lzf->sz);
+
+    memcpy(copy, lzf, sizeof(*lzf) + lzf->sz);
+#ifdef USE_ZSTD
+    if (codec == QUICKLIST_CODEC_ZSTD)
+        _quicklistZstdRef(copy);
+#else
+    (void)codec;
+#endif
+    return copy;
+}
+
+static const quicklistCodecType quicklistCodecs[QUICKLIST_CODEC_MAX] = {
+    {"lzf", _quicklistLzfCompress, _quicklistLzfDecompress},
+#ifdef USE_LZ4
+    {"lz4", _quicklistLz4Compress, _quicklistLz4Decompress},
+#else
+    {"lz4", NULL, NULL},
+#endif
+#ifdef USE_ZSTD
+    {"zstd", _quicklistZstdCompress, _quicklistZstdDecompress},
+#else
+    {"zstd", NULL, NULL},
+#endif
+};
+
+/* Return 1 if 'codec' is one of QUICKLIST_CODEC_* and was compiled in. */
+int quicklistCodecAvailable(int codec) {
+    return codec >= 0 && codec < QUICKLIST_CODEC_MAX &&
+           quicklistCodecs[codec].compress != NULL;
+}
+
+/* Return the name of 'codec', or NULL if it's not a valid codec. */
+const char *quicklistCodecName(int codec) {
+    if (codec < 0 || codec >= QUICKLIST_CODEC_MAX)
+        return NULL;
+    return quicklistCodecs[codec].name;
+}
+
+/* Return the codec called 'name', or -1 if there is no such codec. */
+int quicklistCodecByName(const char *name) {
+    for (int j = 0; j < QUICKLIST_CODEC_MAX; j++) {
+        if (!strcasecmp(quicklistCodecs[j].name, name))
+            return j;
+    }
+    return -1;
+}
+
+/* Set the codec used for the nodes 'quicklist' compresses from now on.
+ * Nodes already compressed keep their codec until they are decompressed.
+ * Returns 0 if the codec is not available, 1 otherwise. */
+// 设置压缩算法，已经压缩过的节点不受影响，不同算法的节点可以共存
+int quicklistSetCodec(quicklist *quicklist, int codec) {
+    if (!quicklistCodecAvailable(codec))
+        return 0;
+    quicklist->codec = codec;
+    return 1;
+}
+
+/* Compress the listpack in 'node' with 'codec' and update encoding details.
+ * Returns 1 if the listpack compressed successfully.
+ * Returns 0 if compression failed or if the listpack is too small to
+ * compress. */
 // 压缩节点，这里并不会更改 node 的大小（方便以后的还原），只是将压缩过的节点大小存进 LZF 结构中
-REDIS_STATIC int __quicklistCompressNode(quicklistNode *node) {
+REDIS_STATIC int __quicklistCompressNode(quicklistNode *node, int codec) {
 #ifdef REDIS_TEST
     node->attempted_compress = 1;
 #endif
@@ -199,85 +587,471 @@ REDIS_STATIC int __quicklistCompressNode(quicklistNode *node) {
     if (node->sz < MIN_COMPRESS_BYTES)
         return 0;
 
-    // 使用 quicklistLZF 结构存储压缩后的节点
+    // 使用 quicklistLZF 结构存储压缩后的节点，不管用的是哪种算法
     quicklistLZF *lzf = zmalloc(sizeof(*lzf) + node->sz);
+    dsstatsTimerStart(start);
 
     /* Cancel if compression fails or doesn't compress small enough */
-    if (((lzf->sz = lzf_compress(node->zl, node->sz, lzf->compressed,
-                                 node->sz)) == 0) ||
+    if (((lzf->sz = quicklistCodecs[codec].compress(
+              node->zl, node->sz, lzf->compressed, node->sz)) == 0) ||
         lzf->sz + MIN_COMPRESS_IMPROVE >= node->sz) {
-        /* lzf_compress aborts/rejects compression if value not compressable. */
-        zfree(lzf);
+        /* The codec aborts/rejects compression if value not compressable. */
+        dsstatsTimerEnd(DSSTATS_QL_COMPRESS,start);
+        if (dsstatsEnabled()) {
+            dsstatsIncr(DSSTATS_QL_COMPRESS_IN,node->sz);
+            dsstatsIncr(DSSTATS_QL_COMPRESS_FAILED,1);
+        }
+        __quicklistFreeLzf(lzf, codec);
         return 0;
     }
+    dsstatsTimerEnd(DSSTATS_QL_COMPRESS,start);
+    if (dsstatsEnabled()) {
+        dsstatsIncr(DSSTATS_QL_COMPRESS_IN,node->sz);
+        dsstatsIncr(DSSTATS_QL_COMPRESS_OUT,lzf->sz);
+    }
     // 将节点的数据指向压缩过的节点
     lzf = zrealloc(lzf, sizeof(*lzf) + lzf->sz);
     zfree(node->zl);
     node->zl = (unsigned char *)lzf;
-    // 更改编码方式为 LZF
+    // 更改编码方式为压缩，并记录使用的算法
     node->encoding = QUICKLIST_NODE_ENCODING_LZF;
+    node->codec = codec;
     node->recompress = 0;
     return 1;
 }
 
-/* Compress only uncompressed nodes. */
-// 压缩节点，调用上述方法，必须是 raw 才能进压缩，否则就是压缩过的
-#define quicklistCompressNode(_node)                                           \
-    do {                                                                       \
-        if ((_node) && (_node)->encoding == QUICKLIST_NODE_ENCODING_RAW) {     \
-            __quicklistCompressNode((_node));                                  \
-        }                                                                      \
-    } while (0)
+/* Decompress the data of the compressed 'node' into a new buffer of
+ * node->sz bytes, leaving the node as it is. Returns NULL on failure. */
+REDIS_STATIC unsigned char *__quicklistDecodeNode(quicklistNode *node) {
+    const quicklistCodecType *ct = &quicklistCodecs[node->codec];
+    unsigned char *decompressed = zmalloc(node->sz);
+    quicklistLZF *lzf = (quicklistLZF *)node->zl;
+    dsstatsTimerStart(start);
+    if (ct->decompress == NULL ||
+        ct->decompress(lzf->compressed, lzf->sz, decompressed, node->sz) == 0) {
+        zfree(decompressed);
+        return NULL;
+    }
+    dsstatsTimerEnd(DSSTATS_QL_DECOMPRESS,start);
+    if (dsstatsEnabled()) dsstatsIncr(DSSTATS_QL_DECOMPRESS_OUT,node->sz);
+    return decompressed;
+}
 
-/* Uncompress the ziplist in 'node' and update encoding details.
+/* Uncompress the listpack in 'node' and update encoding details.
  * Returns 1 on successful decode, 0 on failure to decode. */
-// 重新还原为原来的节点，基本山就是上述过程的逆运算
+// 重新还原为原来的节点，基本山就是上述过程的逆运算，使用节点自己记录的算法
 REDIS_STATIC int __quicklistDecompressNode(quicklistNode *node) {
 #ifdef REDIS_TEST
     node->attempted_compress = 0;
 #endif
 
-    void *decompressed = zmalloc(node->sz);
-    quicklistLZF *lzf = (quicklistLZF *)node->zl;
-    if (lzf_decompress(lzf->compressed, lzf->sz, decompressed, node->sz) == 0) {
+    unsigned char *decompressed = __quicklistDecodeNode(node);
+    if (decompressed == NULL) {
         /* Someone requested decompress, but we can't decompress.  Not good. */
-        zfree(decompressed);
         return 0;
     }
-    zfree(lzf);
+    __quicklistFreeLzf((quicklistLZF *)node->zl, node->codec);
     node->zl = decompressed;
     node->encoding = QUICKLIST_NODE_ENCODING_RAW;
     return 1;
 }
 
+/* Decompressed node cache.
+ *
+ * Reading a compressed interior node (LRANGE, LINDEX, an iterator passing
+ * by) decompresses it, and compresses it again when done, so paging over
+ * the same range pays both every time. With a cache, a decompressed node
+ * keeps its compressed data in a cache entry: if the node was not changed
+ * when it's compressed again it just goes back to that data, and the entry
+ * keeps the listpack, that the next decompression of the node reuses.
+ *
+ * Every change of a listpack is followed by quicklistNodeUpdateSz(), that
+ * drops the entry of the node. The buffers owned by the entries (the
+ * listpacks of compressed nodes, the compressed data of decompressed ones)
+ * are capped at max_bytes, evicting the least recently used entries.
+ *
+ * node->cached is only a hint: eviction doesn't touch the nodes, so a node
+ * with the flag and no entry is possible, while an entry for a node without
+ * the flag is stale and is never looked up. */
+// 缓存最近解压过的节点，让反复读同一段范围时不用每次都解压和重新压缩
+
+#define quicklistCacheEntryBytes(_e)                                           \
+    ((_e)->lent ? sizeof(quicklistLZF) + (_e)->lzf->sz : (_e)->sz)
+
+/* Free the buffer owned by 'e' and the slot. The node is not touched. */
+REDIS_STATIC void _quicklistCacheDrop(quicklistNodeCache *c,
+                                      quicklistNodeCacheEntry *e) {
+    c->stats.bytes -= quicklistCacheEntryBytes(e);
+    if (e->lent) __quicklistFreeLzf(e->lzf, e->codec);
+    else zfree(e->raw);
+    e->node = NULL;
+}
+
+REDIS_STATIC quicklistNodeCacheEntry *
+_quicklistCacheFind(quicklistNodeCache *c, quicklistNode *node) {
+    for (int j = 0; j < QUICKLIST_NODE_CACHE_SLOTS; j++) {
+        if (c->entries[j].node == node)
+            return &c->entries[j];
+    }
+    return NULL;
+}
+
+/* Evict the least recently used entries but 'keep' until the entries own
+ * at most 'max' bytes. */
+REDIS_STATIC void _quicklistCacheTrim(quicklistNodeCache *c,
+                                      quicklistNodeCacheEntry *keep,
+                                      size_t max) {
+    while (c->stats.bytes > max) {
+        quicklistNodeCacheEntry *lru = NULL;
+        for (int j = 0; j < QUICKLIST_NODE_CACHE_SLOTS; j++) {
+            quicklistNodeCacheEntry *e = &c->entries[j];
+            if (e->node && e != keep && (!lru || e->tick < lru->tick))
+                lru = e;
+        }
+        if (!lru) break;
+        _quicklistCacheDrop(c, lru);
+        c->stats.evictions++;
+    }
+}
+
+/* Turn the decompressed node cache of 'quicklist' on, with a cap of
+ * 'max_bytes' for its buffers, or off if 'max_bytes' is 0. */
+void quicklistSetNodeCache(quicklist *quicklist, size_t max_bytes) {
+    quicklistNodeCache *c = quicklist->cache;
+    quicklistNode *node;
+
+    if (max_bytes && !c) {
+        c = zcalloc(sizeof(*c));
+        quicklist->cache = c;
+    } else if (!max_bytes && c) {
+        /* The nodes keep the buffer they point to. */
+        for (int j = 0; j < QUICKLIST_NODE_CACHE_SLOTS; j++) {
+            quicklistNodeCacheEntry *e = &c->entries[j];
+            if (!e->node) continue;
+            if (e->lent) __quicklistFreeLzf(e->lzf, e->codec);
+            else zfree(e->raw);
+        }
+        for (node = quicklist->head; node; node = node->next)
+            node->cached = 0;
+        zfree(c);
+        quicklist->cache = NULL;
+        return;
+    }
+    if (c) {
+        c->stats.max_bytes = max_bytes;
+        _quicklistCacheTrim(c, NULL, max_bytes);
+    }
+}
+
+/* Copy the statistics of the node cache of 'quicklist' into 'stats'.
+ * Returns 0 if the list has no cache. */
+int quicklistGetNodeCacheStats(const quicklist *quicklist,
+                               quicklistNodeCacheStats *stats) {
+    if (!quicklist->cache)
+        return 0;
+    *stats = quicklist->cache->stats;
+    return 1;
+}
+
+/* Drop the entry of 'node', that is being changed or deleted. */
+REDIS_STATIC void _quicklistCacheInvalidate(const quicklist *quicklist,
+                                            quicklistNode *node) {
+    quicklistNodeCacheEntry *e;
+
+    node->cached = 0;
+    if (!quicklist->cache) return;
+    e = _quicklistCacheFind(quicklist->cache, node);
+    if (e) {
+        _quicklistCacheDrop(quicklist->cache, e);
+        quicklist->cache->stats.invalidations++;
+    }
+}
+
+/* Decompress the compressed 'node' through the cache of 'quicklist'. */
+REDIS_STATIC int _quicklistDecompressNodeCached(const quicklist *quicklist,
+                                                quicklistNode *node) {
+    quicklistNodeCache *c = quicklist->cache;
+    quicklistNodeCacheEntry *e = NULL;
+    quicklistLZF *lzf = (quicklistLZF *)node->zl;
+    size_t lzf_bytes = sizeof(*lzf) + lzf->sz;
+    unsigned char *raw;
+
+    if (!c) return __quicklistDecompressNode(node);
+    if (node->cached) e = _quicklistCacheFind(c, node);
+    if (e && !e->lent && e->lzf == lzf && e->sz == node->sz) {
+        /* Hit: the node takes the listpack, the entry the compressed data. */
+        c->stats.bytes += lzf_bytes - e->sz;
+        e->lent = 1;
+        e->tick = ++c->tick;
+        c->stats.hits++;
+        node->zl = e->raw;
+    } else {
+        if (e) _quicklistCacheDrop(c, e);
+        node->cached = 0;
+        c->stats.misses++;
+        if (lzf_bytes > c->stats.max_bytes)
+            return __quicklistDecompressNode(node);
+        if ((raw = __quicklistDecodeNode(node)) == NULL)
+            return 0;
+
+        /* Take a free slot, else the least recently used one, dropping the
+         * stale entries of this node if any. */
+        e = NULL;
+        for (int j = 0; j < QUICKLIST_NODE_CACHE_SLOTS; j++) {
+            quicklistNodeCacheEntry *cur = &c->entries[j];
+            if (cur->node == node) _quicklistCacheDrop(c, cur);
+            if (!cur->node) {
+                if (!e || e->node) e = cur;
+            } else if (!e || (e->node && cur->tick < e->tick)) {
+                e = cur;
+            }
+        }
+        if (e->node) {
+            _quicklistCacheDrop(c, e);
+            c->stats.evictions++;
+        }
+        e->node = node;
+        e->raw = raw;
+        e->lzf = lzf;
+        e->sz = node->sz;
+        e->codec = node->codec;
+        e->lent = 1;
+        e->tick = ++c->tick;
+        c->stats.bytes += lzf_bytes;
+        _quicklistCacheTrim(c, e, c->stats.max_bytes);
+        node->zl = raw;
+        node->cached = 1;
+    }
+#ifdef REDIS_TEST
+    node->attempted_compress = 0;
+#endif
+    node->encoding = QUICKLIST_NODE_ENCODING_RAW;
+    return 1;
+}
+
+/* Compress the uncompressed 'node' with 'codec' through the cache of
+ * 'quicklist'. */
+REDIS_STATIC int _quicklistCompressNodeCached(const quicklist *quicklist,
+                                              quicklistNode *node, int codec) {
+    quicklistNodeCache *c = quicklist->cache;
+    quicklistNodeCacheEntry *e;
+
+    if (c && node->cached) {
+        e = _quicklistCacheFind(c, node);
+        if (e && e->lent && e->raw == node->zl && e->sz == node->sz &&
+            node->codec == codec) {
+            /* Not changed since it was decompressed: go back to the
+             * compressed data, the entry keeps the listpack. */
+#ifdef REDIS_TEST
+            node->attempted_compress = 1;
+#endif
+            c->stats.bytes += e->sz - quicklistCacheEntryBytes(e);
+            e->lent = 0;
+            e->tick = ++c->tick;
+            c->stats.reused++;
+            node->zl = (unsigned char *)e->lzf;
+            node->encoding = QUICKLIST_NODE_ENCODING_LZF;
+            node->recompress = 0;
+            _quicklistCacheTrim(c, e, c->stats.max_bytes);
+            if (c->stats.bytes > c->stats.max_bytes) {
+                _quicklistCacheDrop(c, e);
+                c->stats.evictions++;
+                node->cached = 0;
+            }
+            return 1;
+        }
+        if (e) _quicklistCacheDrop(c, e);
+        node->cached = 0;
+    }
+    return __quicklistCompressNode(node, codec);
+}
+
+/* Account in quicklist->bytes the change of size of 'node', that took
+ * 'before' bytes until it was compressed or decompressed. Reads compress and
+ * decompress nodes as well, so this is done through a const quicklist. */
+// 节点压缩或解压之后更新 quicklist 的总字节数
+REDIS_STATIC void _quicklistNodeResized(const quicklist *quicklist,
+                                        const quicklistNode *node,
+                                        size_t before) {
+    if (quicklistNodeIsLinked(quicklist, node))
+        quicklistAddBytes((struct quicklist *)quicklist,
+                          quicklistNodeBytes(node) - before);
+}
+
+/* Compress only uncompressed nodes, using the codec of the quicklist. */
+// 压缩节点，调用上述方法，必须是 raw 才能进压缩，否则就是压缩过的
+#define quicklistCompressNode(_ql, _node)                                      \
+    do {                                                                       \
+        if ((_node) && (_node)->encoding == QUICKLIST_NODE_ENCODING_RAW) {     \
+            size_t _before = quicklistNodeBytes(_node);                        \
+            _quicklistCompressNodeCached((_ql), (_node), (_ql)->codec);        \
+            _quicklistNodeResized((_ql), (_node), _before);                    \
+        }                                                                      \
+    } while (0)
+
 // 同上，这里多一层检查，必须是 LZF 才能进行还原，这里解压之后不进行压缩
-#define quicklistDecompressNode(_node)                                         \
+#define quicklistDecompressNode(_ql, _node)                                    \
     do {                                                                       \
         if ((_node) && (_node)->encoding == QUICKLIST_NODE_ENCODING_LZF) {     \
-            __quicklistDecompressNode((_node));                                \
+            size_t _before = quicklistNodeBytes(_node);                        \
+            _quicklistDecompressNodeCached((_ql), (_node));                    \
+            _quicklistNodeResized((_ql), (_node), _before);                    \
         }                                                                      \
     } while (0)
 
 /* Force node to not be immediately re-compresable */
 // 同上，同时标志为已经压缩过，就是说我临时需要查看这个数据，用完的时候可能还得压缩
-#define quicklistDecompressNodeForUse(_node)                                   \
+#define quicklistDecompressNodeForUse(_ql, _node)                              \
     do {                                                                       \
         if ((_node) && (_node)->encoding == QUICKLIST_NODE_ENCODING_LZF) {     \
-            __quicklistDecompressNode((_node));                                \
+            size_t _before = quicklistNodeBytes(_node);                        \
+            _quicklistDecompressNodeCached((_ql), (_node));                    \
+            _quicklistNodeResized((_ql), (_node), _before);                    \
             (_node)->recompress = 1;                                           \
         }                                                                      \
     } while (0)
 
 /* Extract the raw LZF data from this quicklistNode.
- * Pointer to LZF data is assigned to '*data'.
- * Return value is the length of compressed LZF data. */
-// 获取 LZF 编码的字符串，同时返回其大小
+ * A copy of the LZF data is assigned to '*data', that the caller must
+ * release with zfree().
+ * Return value is the length of compressed LZF data.
+ *
+ * Nodes compressed with another codec are decompressed and compressed
+ * again with LZF into the copy, the node is left as it is. If that data
+ * doesn't compress with LZF, 0 is returned and '*data' holds instead a
+ * copy of the node->sz bytes of the uncompressed listpack. */
+// 获取 LZF 编码的字符串的副本，同时返回其大小，其他算法压缩的节点在副本中转成 LZF
 size_t quicklistGetLzf(const quicklistNode *node, void **data) {
-    quicklistLZF *lzf = (quicklistLZF *)node->zl;
-    *data = lzf->compressed;
-    return lzf->sz;
+    const quicklistLZF *lzf = (const quicklistLZF *)node->zl;
+    unsigned char *raw;
+    size_t sz;
+
+    if (node->codec == QUICKLIST_CODEC_LZF) {
+        *data = zmalloc(lzf->sz);
+        memcpy(*data, lzf->compressed, lzf->sz);
+        return lzf->sz;
+    }
+    raw = zmalloc(node->sz);
+    if (quicklistCodecs[node->codec].decompress(lzf->compressed, lzf->sz, raw,
+                                                node->sz) == 0) {
+        zfree(raw);
+        *data = NULL;
+        return 0;
+    }
+    *data = zmalloc(node->sz);
+    sz = lzf_compress(raw, node->sz, *data, node->sz);
+    if (sz == 0) {
+        zfree(*data);
+        *data = raw;
+        return 0;
+    }
+    zfree(raw);
+    *data = zrealloc(*data, sz);
+    return sz;
+}
+
+#ifdef USE_ZSTD
+/* Load a zstd dictionary, used to compress the nodes of every quicklist
+ * using QUICKLIST_CODEC_ZSTD from now on, or stop using one if 'dict' is
+ * NULL. The previous dictionary is released once no node needs it.
+ * Returns 1 on success, 0 if the dictionary is invalid or too many
+ * dictionaries are still in use. */
+// 加载一个 zstd 字典，所有 quicklist 共享，之前的字典没有节点使用之后释放
+int quicklistSetZstdDictionary(const void *dict, size_t len) {
+    unsigned int id = dict ? ZDICT_getDictID(dict, len) : 0;
+    ZSTD_CDict *cdict = NULL;
+    ZSTD_DDict *ddict = NULL;
+    int slot = -1, prev;
+
+    /* Raw content dictionaries have no ID and can't be told apart when
+     * decompressing, so require a proper zstd dictionary. */
+    if (dict) {
+        if (id == 0)
+            return 0;
+        cdict = ZSTD_createCDict(dict, len, QUICKLIST_ZSTD_LEVEL);
+        ddict = ZSTD_createDDict(dict, len);
+    }
+    pthread_rwlock_wrlock(&quicklist_zstd_lock);
+    if (dict) {
+        for (int j = 0; j < QUICKLIST_ZSTD_MAX_DICTS && slot == -1; j++) {
+            if (quicklist_zstd_dicts[j].id == 0) slot = j;
+        }
+        if (cdict == NULL || ddict == NULL || slot == -1 ||
+            _quicklistZstdFindDict(id) != -1) {
+            pthread_rwlock_unlock(&quicklist_zstd_lock);
+            ZSTD_freeCDict(cdict);
+            ZSTD_freeDDict(ddict);
+            return 0;
+        }
+        quicklist_zstd_dicts[slot].id = id;
+        quicklist_zstd_dicts[slot].refs = 0;
+        quicklist_zstd_dicts[slot].cdict = cdict;
+        quicklist_zstd_dicts[slot].ddict = ddict;
+    }
+    prev = quicklist_zstd_current;
+    quicklist_zstd_current = slot;
+    _quicklistZstdFreeDictIfUnused(prev);
+    pthread_rwlock_unlock(&quicklist_zstd_lock);
+    return 1;
 }
 
+/* Train a zstd dictionary of at most 'dictsize' bytes from the nodes of
+ * 'quicklist' and load it with quicklistSetZstdDictionary(). Returns 1 on
+ * success, 0 if there are not enough samples or training failed. */
+// 用 quicklist 现有的节点作为样本训练一个 zstd 字典
+int quicklistTrainZstdDictionary(quicklist *quicklist, size_t dictsize) {
+    size_t total = 0, *sizes;
+    unsigned int nsamples = 0;
+    char *samples, *dict;
+    int ret = 0;
+
+    if (quicklist->len < QUICKLIST_ZSTD_MIN_SAMPLES)
+        return 0;
+    for (quicklistNode *node = quicklist->head; node; node = node->next)
+        total += node->sz;
+
+    samples = zmalloc(total);
+    sizes = zmalloc(sizeof(size_t) * quicklist->len);
+    total = 0;
+    for (quicklistNode *node = quicklist->head; node; node = node->next) {
+        char *dst = samples + total;
+        if (node->encoding == QUICKLIST_NODE_ENCODING_LZF) {
+            /* Decompress a copy, the node stays as it is. */
+            quicklistLZF *lzf = (quicklistLZF *)node->zl;
+            if (quicklistCodecs[node->codec].decompress(
+                    lzf->compressed, lzf->sz, dst, node->sz) == 0)
+                continue;
+        } else {
+            memcpy(dst, node->zl, node->sz);
+        }
+        sizes[nsamples++] = node->sz;
+        total += node->sz;
+    }
+
+    dict = zmalloc(dictsize);
+    size_t dictlen =
+        ZDICT_trainFromBuffer(dict, dictsize, samples, sizes, nsamples);
+    if (!ZDICT_isError(dictlen))
+        ret = quicklistSetZstdDictionary(dict, dictlen);
+    zfree(dict);
+    zfree(sizes);
+    zfree(samples);
+    return ret;
+}
+#else
+int quicklistSetZstdDictionary(const void *dict, size_t len) {
+    (void)dict;
+    (void)len;
+    return 0;
+}
+
+int quicklistTrainZstdDictionary(quicklist *quicklist, size_t dictsize) {
+    (void)quicklist;
+    (void)dictsize;
+    return 0;
+}
+#endif
+
 // 是否允许压缩，只要 compress 不为 0，就说明有压缩深度
 #define quicklistAllowsCompression(_ql) ((_ql)->compress != 0)
 
@@ -301,27 +1075,27 @@ REDIS_STATIC void __quicklistCompress(const quicklist *quicklist,
     // 1 表示首尾两个节点不压缩
     if (quicklist->compress == 1) {
         quicklistNode *h = quicklist->head, *t = quicklist->tail;
-        quicklistDecompressNode(h);
-        quicklistDecompressNode(t);
+        quicklistDecompressNode(quicklist, h);
+        quicklistDecompressNode(quicklist, t);
         if (h != node && t != node)
-            quicklistCompressNode(node);
+            quicklistCompressNode(quicklist, node);
         return;
         // 首尾各两个节点不压缩
     } else if (quicklist->compress == 2) {
         quicklistNode *h = quicklist->head, *hn = h->next, *hnn = hn->next;
         quicklistNode *t = quicklist->tail, *tp = t->prev, *tpp = tp->prev;
-        quicklistDecompressNode(h);
-        quicklistDecompressNode(hn);
-        quicklistDecompressNode(t);
-        quicklistDecompressNode(tp);
+        quicklistDecompressNode(quicklist, h);
+        quicklistDecompressNode(quicklist, hn);
+        quicklistDecompressNode(quicklist, t);
+        quicklistDecompressNode(quicklist, tp);
         if (h != node && hn != node && t != node && tp != node) {
-            quicklistCompressNode(node);
+            quicklistCompressNode(quicklist, node);
         }
         if (hnn != t) {
-            quicklistCompressNode(hnn);
+            quicklistCompressNode(quicklist, hnn);
         }
         if (tpp != h) {
-            quicklistCompressNode(tpp);
+            quicklistCompressNode(quicklist, tpp);
         }
         return;
     }
@@ -335,8 +1109,8 @@ REDIS_STATIC void __quicklistCompress(const quicklist *quicklist,
     int depth = 0;
     int in_depth = 0;
     while (depth++ < quicklist->compress) {
-        quicklistDecompressNode(forward);
-        quicklistDecompressNode(reverse);
+        quicklistDecompressNode(quicklist, forward);
+        quicklistDecompressNode(quicklist, reverse);
 
         if (forward == node || reverse == node)
             in_depth = 1;
@@ -349,12 +1123,12 @@ REDIS_STATIC void __quicklistCompress(const quicklist *quicklist,
     }
 
     if (!in_depth)
-        quicklistCompressNode(node);
+        quicklistCompressNode(quicklist, node);
 
     if (depth > 2) {
         /* At this point, forward and reverse are one node beyond depth */
-        quicklistCompressNode(forward);
-        quicklistCompressNode(reverse);
+        quicklistCompressNode(quicklist, forward);
+        quicklistCompressNode(quicklist, reverse);
     }
 }
 
@@ -362,7 +1136,7 @@ REDIS_STATIC void __quicklistCompress(const quicklist *quicklist,
 #define quicklistCompress(_ql, _node)                                          \
     do {                                                                       \
         if ((_node)->recompress)                                               \
-            quicklistCompressNode((_node));                                    \
+            quicklistCompressNode((_ql), (_node));                             \
         else                                                                   \
             __quicklistCompress((_ql), (_node));                               \
     } while (0)
@@ -372,9 +1146,210 @@ REDIS_STATIC void __quicklistCompress(const quicklist *quicklist,
 #define quicklistRecompressOnly(_ql, _node)                                    \
     do {                                                                       \
         if ((_node)->recompress)                                               \
-            quicklistCompressNode((_node));                                    \
+            quicklistCompressNode((_ql), (_node));                             \
+    } while (0)
+
+/* Node index: a Fenwick tree over the node counts of long lists, so that
+ * an element can be found by position in O(log N) instead of walking the
+ * node chain. nodes[start..end) are the nodes of the list in order, with
+ * free slots on both sides so that nodes linked or unlinked at the head or
+ * tail are handled in place. counts[] holds the count of each node as
+ * known by the tree.
+ *
+ * Only the head and the tail nodes may have a count the tree doesn't know
+ * yet: pushes and pops just change node->count, and lookups sync the two
+ * ends first. A count change of an interior node is a point update of the
+ * tree. Only linking or unlinking a node away from the ends marks the index
+ * dirty, so it is rebuilt by the next lookup. */
+// 节点索引：用树状数组维护每个节点的 count，按下标查找元素时不用从头遍历节点
+#define quicklistIndexInvalidate(_ql)                                          \
+    do {                                                                       \
+        if (unlikely((_ql)->index))                                            \
+            (_ql)->index->dirty = 1;                                           \
     } while (0)
 
+/* The count of 'node' changed in place. */
+#define quicklistIndexTouch(_ql, _node)                                        \
+    do {                                                                       \
+        if (unlikely((_ql)->index))                                            \
+            _quicklistIndexTouch((_ql), (_node));                              \
+    } while (0)
+
+REDIS_STATIC void _quicklistIndexAdd(quicklistNodeIndex *qi, unsigned long pos,
+                                     long long delta) {
+    for (pos++; pos <= qi->cap; pos += pos & -pos)
+        qi->tree[pos] += delta;
+}
+
+/* Bring the count of the node at 'pos' up to date in the tree. */
+REDIS_STATIC void _quicklistIndexSync(quicklistNodeIndex *qi,
+                                      unsigned long pos) {
+    long long delta = (long long)qi->nodes[pos]->count - qi->counts[pos];
+    if (delta) {
+        _quicklistIndexAdd(qi, pos, delta);
+        qi->counts[pos] = qi->nodes[pos]->count;
+    }
+}
+
+/* Head and tail counts are synced by the next lookup, any other node is
+ * looked up in nodes[], starting from the slot of the last node looked up
+ * or touched: callers mostly work on the node they just found, or on its
+ * neighbour when iterating. */
+// 中间节点的 count 改变时只更新树状数组的一个位置，不用重建索引
+REDIS_STATIC void _quicklistIndexTouch(quicklist *quicklist,
+                                       quicklistNode *node) {
+    quicklistNodeIndex *qi = quicklist->index;
+    unsigned long pos;
+
+    if (qi->dirty || node == quicklist->head || node == quicklist->tail)
+        return;
+    if (qi->hint < qi->start || qi->hint >= qi->end)
+        qi->hint = qi->start;
+    if (qi->nodes[qi->hint] == node) {
+        pos = qi->hint;
+    } else if (qi->hint + 1 < qi->end && qi->nodes[qi->hint + 1] == node) {
+        pos = qi->hint + 1;
+    } else if (qi->hint > qi->start && qi->nodes[qi->hint - 1] == node) {
+        pos = qi->hint - 1;
+    } else {
+        for (pos = qi->start; pos < qi->end; pos++)
+            if (qi->nodes[pos] == node)
+                break;
+        if (pos == qi->end) {
+            qi->dirty = 1;
+            return;
+        }
+    }
+    _quicklistIndexSync(qi, pos);
+    qi->hint = pos;
+}
+
+REDIS_STATIC void _quicklistIndexFree(quicklist *quicklist) {
+    quicklistNodeIndex *qi = quicklist->index;
+
+    zfree(qi->nodes);
+    zfree(qi->counts);
+    zfree(qi->tree);
+    zfree(qi);
+    quicklist->index = NULL;
+}
+
+REDIS_STATIC void _quicklistIndexRebuild(quicklist *quicklist) {
+    quicklistNodeIndex *qi = quicklist->index;
+    unsigned long cap = QUICKLIST_INDEX_MIN_NODES;
+
+    /* Keep as many free slots as nodes, half on each side. */
+    while (cap < quicklist->len * 2)
+        cap *= 2;
+    if (cap != qi->cap) {
+        qi->nodes = zrealloc(qi->nodes, sizeof(quicklistNode *) * cap);
+        qi->counts = zrealloc(qi->counts, sizeof(unsigned int) * cap);
+        qi->tree = zrealloc(qi->tree, sizeof(unsigned long long) * (cap + 1));
+        qi->cap = cap;
+    }
+    memset(qi->counts, 0, sizeof(unsigned int) * cap);
+    memset(qi->tree, 0, sizeof(unsigned long long) * (cap + 1));
+
+    unsigned long pos = qi->start = (cap - quicklist->len) / 2;
+    for (quicklistNode *node = quicklist->head; node; node = node->next) {
+        qi->nodes[pos] = node;
+        qi->counts[pos] = node->count;
+        qi->tree[pos + 1] = node->count;
+        pos++;
+    }
+    qi->end = pos;
+    qi->hint = qi->start;
+
+    /* Build the tree in O(N) by pushing every partial sum to its parent. */
+    for (unsigned long i = 1; i <= cap; i++) {
+        unsigned long parent = i + (i & -i);
+        if (parent <= cap)
+            qi->tree[parent] += qi->tree[i];
+    }
+    qi->dirty = 0;
+}
+
+/* 'node' was just linked as the new head (at_tail == 0) or tail of the
+ * list. */
+REDIS_STATIC void _quicklistIndexLinkEnd(quicklist *quicklist,
+                                         quicklistNode *node, int at_tail) {
+    quicklistNodeIndex *qi = quicklist->index;
+
+    if (qi->dirty || qi->start == qi->end)
+        goto invalidate;
+    if (at_tail) {
+        if (qi->end == qi->cap)
+            goto invalidate;
+        _quicklistIndexSync(qi, qi->end - 1); /* Old tail. */
+        qi->nodes[qi->end] = node;
+        qi->counts[qi->end] = 0;
+        qi->end++;
+    } else {
+        if (qi->start == 0)
+            goto invalidate;
+        _quicklistIndexSync(qi, qi->start); /* Old head. */
+        qi->start--;
+        qi->nodes[qi->start] = node;
+        qi->counts[qi->start] = 0;
+    }
+    return;
+
+invalidate:
+    qi->dirty = 1;
+}
+
+/* 'node' is about to be unlinked from the list. */
+REDIS_STATIC void _quicklistIndexUnlink(quicklist *quicklist,
+                                        quicklistNode *node) {
+    quicklistNodeIndex *qi = quicklist->index;
+    unsigned long pos;
+
+    if (qi->dirty || quicklist->head == quicklist->tail)
+        goto invalidate;
+    if (node == quicklist->head && qi->nodes[qi->start] == node) {
+        pos = qi->start++;
+    } else if (node == quicklist->tail && qi->nodes[qi->end - 1] == node) {
+        pos = --qi->end;
+    } else {
+        goto invalidate;
+    }
+    _quicklistIndexAdd(qi, pos, -(long long)qi->counts[pos]);
+    qi->counts[pos] = 0;
+    return;
+
+invalidate:
+    qi->dirty = 1;
+}
+
+/* Return the node holding the element at forward position 'index', and
+ * store the number of elements in the nodes before it in '*before'. */
+REDIS_STATIC quicklistNode *_quicklistIndexLookup(quicklist *quicklist,
+                                                 unsigned long long index,
+                                                 unsigned long long *before) {
+    quicklistNodeIndex *qi = quicklist->index;
+    unsigned long pos = 0;
+    unsigned long long rem = index;
+
+    if (qi->dirty) {
+        _quicklistIndexRebuild(quicklist);
+    } else {
+        _quicklistIndexSync(qi, qi->start);
+        _quicklistIndexSync(qi, qi->end - 1);
+    }
+
+    /* Find the last slot whose prefix sum is <= index: the element is in
+     * the next one. cap is a power of two. */
+    for (unsigned long step = qi->cap; step; step >>= 1) {
+        if (pos + step <= qi->cap && qi->tree[pos + step] <= rem) {
+            pos += step;
+            rem -= qi->tree[pos];
+        }
+    }
+    *before = index - rem;
+    qi->hint = pos;
+    return qi->nodes[pos];
+}
+
 /* Insert 'new_node' after 'old_node' if 'after' is 1.
  * Insert 'new_node' before 'old_node' if 'after' is 0.
  * Note: 'new_node' is *always* uncompressed, so if we assign it to
@@ -411,11 +1386,27 @@ REDIS_STATIC void __quicklistInsertNode(quicklist *quicklist,
         quicklist->head = quicklist->tail = new_node;
     }
 
+    /* Accounted before compressing, that can reach the new node too. */
+    quicklistAddBytes(quicklist, quicklistNodeBytes(new_node));
+
     // 默认压缩节点
     if (old_node)
         quicklistCompress(quicklist, old_node);
 
     quicklist->len++;
+
+    // 节点足够多时才建立索引，之后在两端增加节点时原地更新索引
+    if (unlikely(quicklist->index)) {
+        if (quicklist->head == new_node)
+            _quicklistIndexLinkEnd(quicklist, new_node, 0);
+        else if (quicklist->tail == new_node)
+            _quicklistIndexLinkEnd(quicklist, new_node, 1);
+        else
+            quicklist->index->dirty = 1;
+    } else if (quicklist->len >= QUICKLIST_INDEX_MIN_NODES) {
+        quicklist->index = zcalloc(sizeof(quicklistNodeIndex));
+        quicklist->index->dirty = 1;
+    }
 }
 
 /* Wrappers for node inserting around existing node. */
@@ -459,24 +1450,9 @@ REDIS_STATIC int _quicklistNodeAllowInsert(const quicklistNode *node,
     if (unlikely(!node))
         return 0;
 
-    int ziplist_overhead;
-    /* size of previous offset */
-    if (sz < 254)
-        ziplist_overhead = 1;
-    else
-        ziplist_overhead = 5;
-
-    /* size of forward offset */
-    // 字符串类型一共使用三种长度，分别是 1个字节、2个字节、5个字节，参见 ziplist
-    if (sz < 64)
-        ziplist_overhead += 1;
-    else if (likely(sz < 16384))
-        ziplist_overhead += 2;
-    else
-        ziplist_overhead += 5;
-
     /* new_sz overestimates if 'sz' encodes to an integer type */
-    unsigned int new_sz = node->sz + sz + ziplist_overhead;
+    // 节点是 listpack，entry 大小只取决于自身（编码头 + 数据 + backlen），不会影响后面的 entry
+    unsigned int new_sz = node->sz + lpEntrySizeString(sz);
     if (likely(_quicklistNodeSizeMeetsOptimizationRequirement(new_sz, fill)))
         return 1;
     else if (!sizeMeetsSafetyLimit(new_sz))
@@ -495,10 +1471,10 @@ REDIS_STATIC int _quicklistNodeAllowMerge(const quicklistNode *a,
     if (!a || !b)
         return 0;
 
-    /* approximate merged ziplist size (- 11 to remove one ziplist
+    /* approximate merged listpack size (- 7 to remove one listpack
      * header/trailer) */
-    // 减掉的 11字节为 ：prev、next、sz、count
-    unsigned int merge_sz = a->sz + b->sz - 11;
+    // 减掉的 7字节为 ：tot-bytes、num-elements、end
+    unsigned int merge_sz = a->sz + b->sz - 7;
     if (likely(_quicklistNodeSizeMeetsOptimizationRequirement(merge_sz, fill)))
         return 1;
     else if (!sizeMeetsSafetyLimit(merge_sz))
@@ -509,9 +1485,17 @@ REDIS_STATIC int _quicklistNodeAllowMerge(const quicklistNode *a,
         return 0;
 }
 
-#define quicklistNodeUpdateSz(node)                                            \
+/* Refresh the size of 'node' after its listpack changed. A node not linked
+ * yet is accounted by __quicklistInsertNode() with its final size. */
+// 更新节点大小，节点已经在链表中时同时更新 quicklist 的总字节数
+#define quicklistNodeUpdateSz(_ql, _node)                                      \
     do {                                                                       \
-        (node)->sz = ziplistBlobLen((node)->zl);                               \
+        size_t _sz = lpBytes((_node)->zl);                                     \
+        if ((_node)->cached)                                                   \
+            _quicklistCacheInvalidate((_ql), (_node));                         \
+        if (quicklistNodeIsLinked(_ql, _node))                                 \
+            quicklistAddBytes(_ql, _sz - (_node)->sz);                         \
+        (_node)->sz = _sz;                                                     \
     } while (0)
 
 /* Add new entry to head node of quicklist.
@@ -523,18 +1507,18 @@ int quicklistPushHead(quicklist *quicklist, void *value, size_t sz) {
     quicklistNode *orig_head = quicklist->head;
     if (likely(
             _quicklistNodeAllowInsert(quicklist->head, quicklist->fill, sz))) {
-        quicklist->head->zl =
-            ziplistPush(quicklist->head->zl, value, sz, ZIPLIST_HEAD);
-        quicklistNodeUpdateSz(quicklist->head);
+        quicklist->head->zl = lpPrepend(quicklist->head->zl, value, sz);
+        quicklistNodeUpdateSz(quicklist, quicklist->head);
     } else {
         quicklistNode *node = quicklistCreateNode();
-        node->zl = ziplistPush(ziplistNew(), value, sz, ZIPLIST_HEAD);
+        node->zl = lpPrepend(lpNew(), value, sz);
 
-        quicklistNodeUpdateSz(node);
+        quicklistNodeUpdateSz(quicklist, node);
         _quicklistInsertNodeBefore(quicklist, quicklist->head, node);
     }
     quicklist->count++;
     quicklist->head->count++;
+    quicklistAdaptRecord(quicklist, quicklist->head);
     return (orig_head != quicklist->head);
 }
 
@@ -547,38 +1531,54 @@ int quicklistPushTail(quicklist *quicklist, void *value, size_t sz) {
     quicklistNode *orig_tail = quicklist->tail;
     if (likely(
             _quicklistNodeAllowInsert(quicklist->tail, quicklist->fill, sz))) {
-        quicklist->tail->zl =
-            ziplistPush(quicklist->tail->zl, value, sz, ZIPLIST_TAIL);
-        quicklistNodeUpdateSz(quicklist->tail);
+        quicklist->tail->zl = lpAppend(quicklist->tail->zl, value, sz);
+        quicklistNodeUpdateSz(quicklist, quicklist->tail);
     } else {
         quicklistNode *node = quicklistCreateNode();
-        node->zl = ziplistPush(ziplistNew(), value, sz, ZIPLIST_TAIL);
+        node->zl = lpAppend(lpNew(), value, sz);
 
-        quicklistNodeUpdateSz(node);
+        quicklistNodeUpdateSz(quicklist, node);
         _quicklistInsertNodeAfter(quicklist, quicklist->tail, node);
     }
     quicklist->count++;
     quicklist->tail->count++;
+    quicklistAdaptRecord(quicklist, quicklist->tail);
     return (orig_tail != quicklist->tail);
 }
 
 /* Create new node consisting of a pre-formed ziplist.
  * Used for loading RDBs where entire ziplists have been stored
- * to be retrieved later. */
-// 向尾节点中加入 ziplist
+ * to be retrieved later. The ziplist is converted into the listpack
+ * the node holds, and freed. */
+// 向尾节点中加入 ziplist，节点中保存的是转换后的 listpack
 void quicklistAppendZiplist(quicklist *quicklist, unsigned char *zl) {
     quicklistNode *node = quicklistCreateNode();
 
-    node->zl = zl;
-    // ziplist 的长度
-    node->count = ziplistLen(node->zl);
+    node->zl = lpFromZiplist(zl);
+    zfree(zl);
+    // listpack 的长度
+    node->count = lpLength(node->zl);
     // 字节数
-    node->sz = ziplistBlobLen(zl);
+    node->sz = lpBytes(node->zl);
     // 在尾节点中插入新建的节点
     _quicklistInsertNodeAfter(quicklist, quicklist->tail, node);
     quicklist->count += node->count;
 }
 
+/* Create new node holding the pre-formed listpack 'lp', that is owned by
+ * the quicklist from now on. Used for loading RDB_TYPE_LIST_QUICKLIST_2,
+ * where nodes are stored as they are in memory. */
+// 向尾节点后加入一个 listpack 节点，不需要转换
+void quicklistAppendListpack(quicklist *quicklist, unsigned char *lp) {
+    quicklistNode *node = quicklistCreateNode();
+
+    node->zl = lp;
+    node->count = lpLength(node->zl);
+    node->sz = lpBytes(node->zl);
+    _quicklistInsertNodeAfter(quicklist, quicklist->tail, node);
+    quicklist->count += node->count;
+}
+
 /* Append all values of ziplist 'zl' individually into 'quicklist'.
  *
  * This allows us to restore old RDB ziplists into new quicklists
@@ -627,6 +1627,9 @@ quicklist *quicklistCreateFromZiplist(int fill, int compress,
 // 删除节点
 REDIS_STATIC void __quicklistDelNode(quicklist *quicklist,
                                      quicklistNode *node) {
+    if (unlikely(quicklist->index))
+        _quicklistIndexUnlink(quicklist, node);
+
     if (node->next)
         node->next->prev = node->prev;
     if (node->prev)
@@ -646,10 +1649,26 @@ REDIS_STATIC void __quicklistDelNode(quicklist *quicklist,
     __quicklistCompress(quicklist, NULL);
 
     quicklist->count -= node->count;
+    quicklistAddBytes(quicklist, -quicklistNodeBytes(node));
 
-    zfree(node->zl);
+    if (node->cached)
+        _quicklistCacheInvalidate(quicklist, node);
+    if (node->encoding == QUICKLIST_NODE_ENCODING_LZF)
+        __quicklistFreeLzf((quicklistLZF *)node->zl, node->codec);
+    else
+        zfree(node->zl);
     zfree(node);
     quicklist->len--;
+
+    /* Drop the index of a list that got short, and shrink the slots of one
+     * that lost most of its nodes at the next lookup. */
+    // 节点数变少时释放或者缩小索引
+    if (unlikely(quicklist->index)) {
+        if (quicklist->len < QUICKLIST_INDEX_MIN_NODES / 2)
+            _quicklistIndexFree(quicklist);
+        else if (quicklist->len * 8 < quicklist->index->cap)
+            quicklist->index->dirty = 1;
+    }
 }
 
 /* Delete one entry from list given the node for the entry and a pointer
@@ -665,15 +1684,16 @@ REDIS_STATIC int quicklistDelIndex(quicklist *quicklist, quicklistNode *node,
                                    unsigned char **p) {
     int gone = 0;
 
-    // 删除节点指向的 ziplist
-    node->zl = ziplistDelete(node->zl, p);
+    // 删除节点指向的 entry，*p 指向下一个 entry（删除的是最后一个时为 NULL）
+    node->zl = lpDelete(node->zl, *p, p);
     node->count--;
+    quicklistIndexTouch(quicklist, node);
     // 删除之后没有节点，那么需要释放那个节点的空间
     if (node->count == 0) {
         gone = 1;
         __quicklistDelNode(quicklist, node);
     } else {
-        quicklistNodeUpdateSz(node);
+        quicklistNodeUpdateSz(quicklist, node);
     }
     quicklist->count--;
     /* If we deleted the node, the original node is no longer valid */
@@ -713,6 +1733,9 @@ void quicklistDelEntry(quicklistIter *iter, quicklistEntry *entry) {
      *  quicklistNext() will jump to the next node. */
 }
 
+REDIS_STATIC void _quicklistAdaptNode(quicklist *quicklist,
+                                      quicklistNode *node);
+
 /* Replace quicklist entry at offset 'index' by 'data' with length 'sz'.
  *
  * Returns 1 if replace happened.
@@ -722,10 +1745,13 @@ int quicklistReplaceAtIndex(quicklist *quicklist, long index, void *data,
     quicklistEntry entry;
     if (likely(quicklistIndex(quicklist, index, &entry))) {
         /* quicklistIndex provides an uncompressed node */
-        entry.node->zl = ziplistDelete(entry.node->zl, &entry.zi);
-        entry.node->zl = ziplistInsert(entry.node->zl, entry.zi, data, sz);
-        quicklistNodeUpdateSz(entry.node);
-        quicklistCompress(quicklist, entry.node);
+        entry.node->zl = lpInsert(entry.node->zl, data, sz, entry.zi,
+                                  LP_REPLACE, NULL);
+        quicklistNodeUpdateSz(quicklist, entry.node);
+        if (quicklist->adaptive)
+            _quicklistAdaptNode(quicklist, entry.node);
+        else
+            quicklistCompress(quicklist, entry.node);
         return 1;
     } else {
         return 0;
@@ -752,11 +1778,11 @@ REDIS_STATIC quicklistNode *_quicklistZiplistMerge(quicklist *quicklist,
     D("Requested merge (a,b) (%u, %u)", a->count, b->count);
 
     // 首先将两个节点的内容进行解压
-    quicklistDecompressNode(a);
-    quicklistDecompressNode(b);
+    quicklistDecompressNode(quicklist, a);
+    quicklistDecompressNode(quicklist, b);
     
-    // 使用 ziplistMerge 进行合并
-    if ((ziplistMerge(&a->zl, &b->zl))) {
+    // 使用 lpMerge 进行合并
+    if ((lpMerge(&a->zl, &b->zl))) {
         /* We merged ziplists! Now remove the unused quicklistNode. */
         // 现在已经合并两个 ziplist了，溢出不使用的 quicklistNode
         // keep 和 nokeep 分别表示合并后使用的，以及合并后被清空的
@@ -769,8 +1795,9 @@ REDIS_STATIC quicklistNode *_quicklistZiplistMerge(quicklist *quicklist,
             keep = a;
         }
         // 更新合并后的节点大小信息
-        keep->count = ziplistLen(keep->zl);
-        quicklistNodeUpdateSz(keep);
+        keep->count = lpLength(keep->zl);
+        quicklistIndexInvalidate(quicklist);
+        quicklistNodeUpdateSz(quicklist, keep);
 
         // 释放不使用的节点信息
         nokeep->count = 0;
@@ -867,7 +1894,8 @@ REDIS_STATIC void _quicklistMergeNodes(quicklist *quicklist,
 // offset 表示分割的偏移量
 // after 为 1 表示分割成 [0,offset] 和 [offset+1,结尾]并返回前面的结果
 // after 为 0 表示分割成 [offset+1,结尾] 和 [0,offset]并返回前面的结果
-REDIS_STATIC quicklistNode *_quicklistSplitNode(quicklistNode *node, int offset,
+REDIS_STATIC quicklistNode *_quicklistSplitNode(quicklist *quicklist,
+                                                quicklistNode *node, int offset,
                                                 int after) {
     size_t zl_sz = node->sz;
 
@@ -887,18 +1915,54 @@ REDIS_STATIC quicklistNode *_quicklistSplitNode(quicklistNode *node, int offset,
       orig_extent, new_start, new_extent);
 
     // 对原来的节点和复制过后的节点进行取范围
-    node->zl = ziplistDeleteRange(node->zl, orig_start, orig_extent);
-    node->count = ziplistLen(node->zl);
-    quicklistNodeUpdateSz(node);
+    node->zl = lpDeleteRange(node->zl, orig_start, orig_extent);
+    node->count = lpLength(node->zl);
+    quicklistNodeUpdateSz(quicklist, node);
 
-    new_node->zl = ziplistDeleteRange(new_node->zl, new_start, new_extent);
-    new_node->count = ziplistLen(new_node->zl);
-    quicklistNodeUpdateSz(new_node);
+    new_node->zl = lpDeleteRange(new_node->zl, new_start, new_extent);
+    new_node->count = lpLength(new_node->zl);
+    quicklistNodeUpdateSz(quicklist, new_node);
 
     D("After split lengths: orig (%d), new (%d)", node->count, new_node->count);
     return new_node;
 }
 
+/* Resize 'node' toward the adaptive fill of 'quicklist': a node larger than
+ * the fill allows is split in two halves, a small node is merged with its
+ * neighbours when the fill allows it. The node must be uncompressed (or
+ * decompressed for use), it is compressed again as needed, and must not be
+ * used after the call since it may have been merged away. */
+// 根据自适应的 fill 调整节点大小：太大就对半拆分，太小就和相邻节点合并
+REDIS_STATIC void _quicklistAdaptNode(quicklist *quicklist,
+                                      quicklistNode *node) {
+    quicklistAdaptiveStats *st = quicklist->adaptive;
+    int fill = quicklist->fill;
+    size_t limit;
+
+    if (fill >= 0) {
+        quicklistCompress(quicklist, node);
+        return;
+    }
+    limit = optimization_level[(-fill) - 1];
+
+    if (node->sz > limit && node->count >= 2) {
+        quicklistNode *new_node =
+            _quicklistSplitNode(quicklist, node, node->count / 2 - 1, 1);
+        __quicklistInsertNode(quicklist, node, new_node, 1);
+        quicklistCompress(quicklist, new_node);
+        st->splits++;
+    } else if (node->sz < limit / 2 &&
+               (_quicklistNodeAllowMerge(node, node->prev, fill) ||
+                _quicklistNodeAllowMerge(node, node->next, fill))) {
+        /* Merging compresses the node it keeps. */
+        quicklistRecompressOnly(quicklist, node);
+        _quicklistMergeNodes(quicklist, node);
+        st->merges++;
+    } else {
+        quicklistCompress(quicklist, node);
+    }
+}
+
 /* Insert a new entry before or after existing entry 'entry'.
  *
  * If after==1, the new value is inserted after 'entry', otherwise
@@ -917,13 +1981,16 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
         /* we have no reference node, so let's create only node in the list */
         D("No node given!");
         new_node = quicklistCreateNode();
-        new_node->zl = ziplistPush(ziplistNew(), value, sz, ZIPLIST_HEAD);
+        new_node->zl = lpPrepend(lpNew(), value, sz);
+        quicklistNodeUpdateSz(quicklist, new_node);
         __quicklistInsertNode(quicklist, NULL, new_node, after);
         new_node->count++;
         quicklist->count++;
         return;
     }
 
+    quicklistAdaptRecord(quicklist, node);
+
     /* Populate accounting flags for easier boolean checks later */
     // 无法再进行插入，数量达到上限
     if (!_quicklistNodeAllowInsert(node, fill, sz)) {
@@ -958,39 +2025,42 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
     if (!full && after) {
         D("Not full, inserting after current position.");
         // 暂时解压临时使用
-        quicklistDecompressNodeForUse(node);
+        quicklistDecompressNodeForUse(quicklist, node);
         // 获取下一个 entry 的指向
-        unsigned char *next = ziplistNext(node->zl, entry->zi);
-        // 说明是在尾部插入
-        if (next == NULL) {
-            node->zl = ziplistPush(node->zl, value, sz, ZIPLIST_TAIL);
-            // 否则就是正常的插入
-        } else {
-            node->zl = ziplistInsert(node->zl, next, value, sz);
-        }
+        // listpack 可以直接在 entry 之后插入，包括在尾部插入
+        node->zl = lpInsert(node->zl, value, sz, entry->zi, LP_AFTER, NULL);
         // 更新大小信息
         node->count++;
-        quicklistNodeUpdateSz(node);
-        quicklistRecompressOnly(quicklist, node);
+        quicklistIndexTouch(quicklist, node);
+        quicklistNodeUpdateSz(quicklist, node);
+        if (quicklist->adaptive)
+            _quicklistAdaptNode(quicklist, node);
+        else
+            quicklistRecompressOnly(quicklist, node);
     
     // 在当前 entry 的前面进行插入   
     } else if (!full && !after) {
         D("Not full, inserting before current position.");
-        quicklistDecompressNodeForUse(node);
-        node->zl = ziplistInsert(node->zl, entry->zi, value, sz);
+        quicklistDecompressNodeForUse(quicklist, node);
+        node->zl = lpInsert(node->zl, value, sz, entry->zi, LP_BEFORE, NULL);
         node->count++;
-        quicklistNodeUpdateSz(node);
-        quicklistRecompressOnly(quicklist, node);
+        quicklistIndexTouch(quicklist, node);
+        quicklistNodeUpdateSz(quicklist, node);
+        if (quicklist->adaptive)
+            _quicklistAdaptNode(quicklist, node);
+        else
+            quicklistRecompressOnly(quicklist, node);
     } else if (full && at_tail && node->next && !full_next && after) {
         /* If we are: at tail, next has free space, and inserting after:
          *   - insert entry at head of next node. */
         // 如果是在尾部（因为当前节点已经满了）并且下一个节点由足够的空间，并且是往后插入，那么就插到下一个节点的头部
         D("Full and tail, but next isn't full; inserting next node head");
         new_node = node->next;
-        quicklistDecompressNodeForUse(new_node);
-        new_node->zl = ziplistPush(new_node->zl, value, sz, ZIPLIST_HEAD);
+        quicklistDecompressNodeForUse(quicklist, new_node);
+        new_node->zl = lpPrepend(new_node->zl, value, sz);
         new_node->count++;
-        quicklistNodeUpdateSz(new_node);
+        quicklistIndexTouch(quicklist, new_node);
+        quicklistNodeUpdateSz(quicklist, new_node);
         quicklistRecompressOnly(quicklist, new_node);
     } else if (full && at_head && node->prev && !full_prev && !after) {
         /* If we are: at head, previous has free space, and inserting before:
@@ -998,10 +2068,11 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
         // 如果是在头部（也是当前节点满了）并且前一节点有足够的空间，并且是往前插入，那么就插入到上一个节点的尾部
         D("Full and head, but prev isn't full, inserting prev node tail");
         new_node = node->prev;
-        quicklistDecompressNodeForUse(new_node);
-        new_node->zl = ziplistPush(new_node->zl, value, sz, ZIPLIST_TAIL);
+        quicklistDecompressNodeForUse(quicklist, new_node);
+        new_node->zl = lpAppend(new_node->zl, value, sz);
         new_node->count++;
-        quicklistNodeUpdateSz(new_node);
+        quicklistIndexTouch(quicklist, new_node);
+        quicklistNodeUpdateSz(quicklist, new_node);
         quicklistRecompressOnly(quicklist, new_node);
     } else if (full && ((at_tail && node->next && full_next && after) ||
                         (at_head && node->prev && full_prev && !after))) {
@@ -1010,21 +2081,21 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
         // 如果当前节点空间满了，并且前后都没有足够的空间进行插入，那么在当前节点之后创建一个新的节点
         D("\tprovisioning new node...");
         new_node = quicklistCreateNode();
-        new_node->zl = ziplistPush(ziplistNew(), value, sz, ZIPLIST_HEAD);
+        new_node->zl = lpPrepend(lpNew(), value, sz);
         new_node->count++;
-        quicklistNodeUpdateSz(new_node);
+        quicklistNodeUpdateSz(quicklist, new_node);
         __quicklistInsertNode(quicklist, node, new_node, after);
     } else if (full) {
         /* else, node is full we need to split it. */
         /* covers both after and !after cases */
         // 如果上述情况都不成立，那么就将节进行拆分
         D("\tsplitting node...");
-        quicklistDecompressNodeForUse(node);
-        new_node = _quicklistSplitNode(node, entry->offset, after);
-        new_node->zl = ziplistPush(new_node->zl, value, sz,
-                                   after ? ZIPLIST_HEAD : ZIPLIST_TAIL);
+        quicklistDecompressNodeForUse(quicklist, node);
+        new_node = _quicklistSplitNode(quicklist, node, entry->offset, after);
+        new_node->zl = after ? lpPrepend(new_node->zl, value, sz) :
+                               lpAppend(new_node->zl, value, sz);
         new_node->count++;
-        quicklistNodeUpdateSz(new_node);
+        quicklistNodeUpdateSz(quicklist, new_node);
         __quicklistInsertNode(quicklist, node, new_node, after);
         _quicklistMergeNodes(quicklist, node);
     }
@@ -1088,9 +2159,10 @@ int quicklistDelRange(quicklist *quicklist, const long start,
             delete_entire_node = 1;
             del = node->count;
         // 也就是说，从 entry.offset 才开始删，那么就不是整个都删了，只需要记录下需要删的个数    
-        } else if (entry.offset >= 0 && extent >= node->count) {
+        } else if (entry.offset >= 0 && extent + entry.offset >= node->count) {
             /* If deleting more nodes after this one, calculate delete based
-             * on size of current node. */
+             * on size of current node. The range may also just reach the
+             * end of this node from the middle of it. */
             del = node->count - entry.offset;
         // 偏移量 < 0 只会出现一次，也就是第一次才可能会出现    
         } else if (entry.offset < 0) {
@@ -1122,12 +2194,13 @@ int quicklistDelRange(quicklist *quicklist, const long start,
         // 删除整个节点
         if (delete_entire_node) {
             __quicklistDelNode(quicklist, node);
-        // 在这个节点中从 entry.offset 开始删除 del 个 entry，通过调用 ziplistDeleteRange() 函数实现  
+        // 在这个节点中从 entry.offset 开始删除 del 个 entry，通过调用 lpDeleteRange() 函数实现  
         } else {
-            quicklistDecompressNodeForUse(node);
-            node->zl = ziplistDeleteRange(node->zl, entry.offset, del);
-            quicklistNodeUpdateSz(node);
+            quicklistDecompressNodeForUse(quicklist, node);
+            node->zl = lpDeleteRange(node->zl, entry.offset, del);
+            quicklistNodeUpdateSz(quicklist, node);
             node->count -= del;
+            quicklistIndexTouch(quicklist, node);
             quicklist->count -= del;
             quicklistDeleteIfEmpty(quicklist, node);
             if (node)
@@ -1146,9 +2219,9 @@ int quicklistDelRange(quicklist *quicklist, const long start,
     return 1;
 }
 
-/* Passthrough to ziplistCompare() */
+/* Passthrough to lpCompare() */
 int quicklistCompare(unsigned char *p1, unsigned char *p2, int p2_len) {
-    return ziplistCompare(p1, p2, p2_len);
+    return lpCompare(p1, p2, p2_len);
 }
 
 /* Returns a quicklist iterator 'iter'. After the initialization every
@@ -1178,7 +2251,7 @@ quicklistIter *quicklistGetIterator(const quicklist *quicklist, int direction) {
 /* Initialize an iterator at a specific offset 'idx' and make the iterator
  * return nodes in 'direction' direction. */
 // 获取指向某个下边 entry 所在节点的迭代器
-quicklistIter *quicklistGetIteratorAtIdx(const quicklist *quicklist,
+quicklistIter *quicklistGetIteratorAtIdx(quicklist *quicklist,
                                          const int direction,
                                          const long long idx) {
     quicklistEntry entry;
@@ -1250,16 +2323,16 @@ int quicklistNext(quicklistIter *iter, quicklistEntry *entry) {
     // 未指向 entry 或者指向的是一个空值，就使用默认值
     if (!iter->zi) {
         /* If !zi, use current index. */
-        quicklistDecompressNodeForUse(iter->current);
-        iter->zi = ziplistIndex(iter->current->zl, iter->offset);
+        quicklistDecompressNodeForUse(iter->quicklist, iter->current);
+        iter->zi = lpSeek(iter->current->zl, iter->offset);
     } else {
         /* else, use existing iterator offset and get prev/next as necessary. */
         // 根据前向迭代或者后向迭代，将函数指针赋值不同的函数
         if (iter->direction == AL_START_HEAD) {
-            nextFn = ziplistNext;
+            nextFn = lpNext;
             offset_update = 1;
         } else if (iter->direction == AL_START_TAIL) {
-            nextFn = ziplistPrev;
+            nextFn = lpPrev;
             offset_update = -1;
         }
         iter->zi = nextFn(iter->current->zl, iter->zi);
@@ -1272,7 +2345,7 @@ int quicklistNext(quicklistIter *iter, quicklistEntry *entry) {
     if (iter->zi) {
         /* Populate value from existing ziplist position */
         // 填充值
-        ziplistGet(entry->zi, &entry->value, &entry->sz, &entry->longval);
+        lpGetValue(entry->zi, &entry->value, &entry->sz, &entry->longval);
         return 1;
     } else {
         /* We ran out of ziplist entries.
@@ -1307,16 +2380,21 @@ quicklist *quicklistDup(quicklist *orig) {
     quicklist *copy;
 
     copy = quicklistNew(orig->fill, orig->compress);
+    copy->codec = orig->codec;
+    if (orig->adaptive) {
+        /* Keep the fill the original adapted to, but start counting anew. */
+        quicklistSetAdaptive(copy, 1);
+        copy->adaptive->base_fill = orig->adaptive->base_fill;
+    }
 
     for (quicklistNode *current = orig->head; current;
          current = current->next) {
         quicklistNode *node = quicklistCreateNode();
 
+        /* Compressed nodes are copied as they are, whatever their codec. */
         if (current->encoding == QUICKLIST_NODE_ENCODING_LZF) {
-            quicklistLZF *lzf = (quicklistLZF *)current->zl;
-            size_t lzf_sz = sizeof(*lzf) + lzf->sz;
-            node->zl = zmalloc(lzf_sz);
-            memcpy(node->zl, current->zl, lzf_sz);
+            node->zl = (unsigned char *)__quicklistCopyLzf(
+                (quicklistLZF *)current->zl, current->codec);
         } else if (current->encoding == QUICKLIST_NODE_ENCODING_RAW) {
             node->zl = zmalloc(current->sz);
             memcpy(node->zl, current->zl, current->sz);
@@ -1326,6 +2404,7 @@ quicklist *quicklistDup(quicklist *orig) {
         copy->count += node->count;
         node->sz = current->sz;
         node->encoding = current->encoding;
+        node->codec = current->codec;
 
         _quicklistInsertNodeAfter(copy, copy->tail, node);
     }
@@ -1343,7 +2422,7 @@ quicklist *quicklistDup(quicklist *orig) {
  * Returns 1 if element found
  * Returns 0 if element not found */
 // 返回某个下标处的 entry，并存储到变量 'entry' 中
-int quicklistIndex(const quicklist *quicklist, const long long idx,
+int quicklistIndex(quicklist *quicklist, const long long idx,
                    quicklistEntry *entry) {
     quicklistNode *n;
     unsigned long long accum = 0;
@@ -1365,6 +2444,20 @@ int quicklistIndex(const quicklist *quicklist, const long long idx,
     if (index >= quicklist->count)
         return 0;
 
+    if (quicklist->index) {
+        /* Long list: ask the node index, which counts from the head. */
+        // 节点很多时通过索引查找，O(log N)
+        unsigned long long before;
+        if (forward) {
+            n = _quicklistIndexLookup(quicklist, index, &before);
+            accum = before;
+        } else {
+            n = _quicklistIndexLookup(quicklist, quicklist->count - 1 - index,
+                                      &before);
+            accum = quicklist->count - before - n->count;
+        }
+    }
+
     // 找到 index 所在的 node 节点
     while (likely(n)) {
         if ((accum + n->count) > index) {
@@ -1384,6 +2477,7 @@ int quicklistIndex(const quicklist *quicklist, const long long idx,
       accum, index, index - accum, (-index) - 1 + accum);
 
     entry->node = n;
+    quicklistAdaptRecord(quicklist, n);
     // 计算偏移量，如果是从前往后，那么就是正数，反之，如果是从后往前，那么偏移量就是负数（从后计算）
     if (forward) {
         /* forward = normal head-to-tail offset. */
@@ -1394,11 +2488,11 @@ int quicklistIndex(const quicklist *quicklist, const long long idx,
         entry->offset = (-index) - 1 + accum;
     }
 
-    quicklistDecompressNodeForUse(entry->node);
+    quicklistDecompressNodeForUse(quicklist, entry->node);
     // 获取对应下标处的值
-    entry->zi = ziplistIndex(entry->node->zl, entry->offset);
+    entry->zi = lpSeek(entry->node->zl, entry->offset);
     // 将对应的 entry 信息存储
-    ziplistGet(entry->zi, &entry->value, &entry->sz, &entry->longval);
+    lpGetValue(entry->zi, &entry->value, &entry->sz, &entry->longval);
     /* The caller will use our result, so we don't re-compress here.
      * The caller can recompress or delete the node as needed. */
     return 1;
@@ -1412,14 +2506,14 @@ void quicklistRotate(quicklist *quicklist) {
 
     /* First, get the tail entry */
     // 首先获取最后一个 entry
-    unsigned char *p = ziplistIndex(quicklist->tail->zl, -1);
+    unsigned char *p = lpLast(quicklist->tail->zl);
     unsigned char *value;
     long long longval;
     unsigned int sz;
     char longstr[32] = {0};
-    ziplistGet(p, &value, &sz, &longval);
+    lpGetValue(p, &value, &sz, &longval);
 
-    /* If value found is NULL, then ziplistGet populated longval instead */
+    /* If value found is NULL, then lpGetValue populated longval instead */
     // 说明获取到的是数值
     if (!value) {
         /* Write the longval as a string so we can re-add it */
@@ -1436,7 +2530,7 @@ void quicklistRotate(quicklist *quicklist) {
      * which would make our pre-existing 'p' unusable. */
     // 如果只有一个节点的话，头结点同时也是尾节点，PushHead()可能会重新分配从而导致 p 不可用
     if (quicklist->len == 1) {
-        p = ziplistIndex(quicklist->tail->zl, -1);
+        p = lpLast(quicklist->tail->zl);
     }
 
     /* Remove tail entry. */
@@ -1480,8 +2574,9 @@ int quicklistPopCustom(quicklist *quicklist, int where, unsigned char **data,
         return 0;
     }
 
-    p = ziplistIndex(node->zl, pos);
-    if (ziplistGet(p, &vstr, &vlen, &vlong)) {
+    quicklistAdaptRecord(quicklist, node);
+    p = lpSeek(node->zl, pos);
+    if (lpGetValue(p, &vstr, &vlen, &vlong)) {
         if (vstr) {
             if (data)
                 *data = saver(vstr, vlen);
@@ -1584,9 +2679,9 @@ static void ql_info(quicklist *ql) {
     printf("Container length: %lu\n", ql->len);
     printf("Container size: %lu\n", ql->count);
     if (ql->head)
-        printf("\t(zsize head: %d)\n", ziplistLen(ql->head->zl));
+        printf("\t(zsize head: %d)\n", lpLength(ql->head->zl));
     if (ql->tail)
-        printf("\t(zsize tail: %d)\n", ziplistLen(ql->tail->zl));
+        printf("\t(zsize tail: %d)\n", lpLength(ql->tail->zl));
     printf("\n");
 #else
     UNUSED(ql);
@@ -1678,24 +2773,33 @@ static int _ql_verify(quicklist *ql, uint32_t len, uint32_t count,
         errors++;
     }
 
+    size_t bytes = 0;
+    for (quicklistNode *n = ql->head; n; n = n->next)
+        bytes += quicklistNodeBytes(n);
+    if (bytes != ql->bytes) {
+        yell("quicklist cached bytes not match nodes: expected %zu, got %zu",
+             bytes, ql->bytes);
+        errors++;
+    }
+
     if (ql->len == 0 && !errors) {
         OK;
         return errors;
     }
 
     if (ql->head && head_count != ql->head->count &&
-        head_count != ziplistLen(ql->head->zl)) {
+        head_count != lpLength(ql->head->zl)) {
         yell("quicklist head count wrong: expected %d, "
              "got cached %d vs. actual %d",
-             head_count, ql->head->count, ziplistLen(ql->head->zl));
+             head_count, ql->head->count, lpLength(ql->head->zl));
         errors++;
     }
 
     if (ql->tail && tail_count != ql->tail->count &&
-        tail_count != ziplistLen(ql->tail->zl)) {
+        tail_count != lpLength(ql->tail->zl)) {
         yell("quicklist tail count wrong: expected %d, "
              "got cached %u vs. actual %d",
-             tail_count, ql->tail->count, ziplistLen(ql->tail->zl));
+             tail_count, ql->tail->count, lpLength(ql->tail->zl));
         errors++;
     }
 
@@ -2717,6 +3821,366 @@ int quicklistTest(int argc, char *argv[]) {
         runtime[_i] = stop - start;
     }
 
+    TEST("append listpack nodes") {
+        quicklist *ql = quicklistNew(-2, 0);
+        for (int n = 0; n < 3; n++) {
+            unsigned char *lp = lpNew();
+            for (int i = 0; i < 10; i++)
+                lp = lpAppend(lp, (unsigned char *)genstr("hello", n * 10 + i),
+                              32);
+            quicklistAppendListpack(ql, lp);
+        }
+        ql_verify(ql, 3, 30, 10, 10);
+        quicklistEntry entry;
+        assert(quicklistIndex(ql, 25, &entry));
+        assert(!strcmp((char *)entry.value, genstr("hello", 25)));
+        quicklistRelease(ql);
+    }
+
+    /* Nodes compressed with different codecs in the same list. */
+    for (int codec = 0; codec < QUICKLIST_CODEC_MAX; codec++) {
+        if (!quicklistCodecAvailable(codec))
+            continue;
+        TEST_DESC("codec %s: mixed with lzf, dup and get lzf",
+                  quicklistCodecName(codec)) {
+            quicklist *ql = quicklistNew(-2, 1);
+            char buf[32] = {0};
+            for (int i = 0; i < 500; i++) {
+                snprintf(buf, sizeof(buf), "hello codec%d", i);
+                quicklistPushTail(ql, buf, 32);
+            }
+            assert(quicklistSetCodec(ql, codec));
+            for (int i = 500; i < 1000; i++) {
+                snprintf(buf, sizeof(buf), "hello codec%d", i);
+                quicklistPushTail(ql, buf, 32);
+            }
+
+            int codecs_seen[QUICKLIST_CODEC_MAX] = {0};
+            for (quicklistNode *node = ql->head; node; node = node->next) {
+                if (node->encoding == QUICKLIST_NODE_ENCODING_LZF)
+                    codecs_seen[node->codec]++;
+            }
+            assert(codecs_seen[QUICKLIST_CODEC_LZF] > 0);
+            assert(codecs_seen[codec] > 0);
+
+            quicklist *copy = quicklistDup(ql);
+            quicklistEntry entry;
+            for (int i = 0; i < 1000; i += 97) {
+                snprintf(buf, sizeof(buf), "hello codec%d", i);
+                assert(quicklistIndex(ql, i, &entry));
+                assert(!strcmp((char *)entry.value, buf));
+                assert(quicklistIndex(copy, i, &entry));
+                assert(!strcmp((char *)entry.value, buf));
+            }
+
+            /* quicklistGetLzf() hands out LZF data for every node, and
+             * leaves the nodes as they are. */
+            for (quicklistNode *node = copy->head; node; node = node->next) {
+                void *data;
+                if (node->encoding != QUICKLIST_NODE_ENCODING_LZF)
+                    continue;
+                int node_codec = node->codec;
+                void *node_zl = node->zl;
+                size_t len = quicklistGetLzf(node, &data);
+                assert(node->encoding == QUICKLIST_NODE_ENCODING_LZF &&
+                       node->codec == node_codec && node->zl == node_zl);
+                unsigned char *raw = zmalloc(node->sz);
+                if (len) {
+                    assert(lzf_decompress(data, len, raw, node->sz) ==
+                           node->sz);
+                    assert(lpLength(raw) == node->count);
+                } else {
+                    assert(data != NULL && lpLength(data) == node->count);
+                }
+                zfree(raw);
+                zfree(data);
+            }
+            ql_verify(copy, copy->len, 1000, copy->head->count,
+                      copy->tail->count);
+            quicklistRelease(copy);
+            quicklistRelease(ql);
+        }
+    }
+
+    TEST("adaptive fill follows the access pattern") {
+        quicklist *ql = quicklistNew(-2, 1);
+        quicklistAdaptiveStats st = {0};
+        char buf[64] = {0};
+
+        assert(!quicklistGetAdaptiveStats(ql, &st));
+        quicklistSetAdaptive(ql, 1);
+
+        /* Queue: pushes at the tail, pops at the head. */
+        for (int i = 0; i < 20000; i++) {
+            snprintf(buf, sizeof(buf), "queue element %d", i);
+            quicklistPushTail(ql, buf, 48);
+            if (i % 2)
+                quicklistPop(ql, QUICKLIST_HEAD, NULL, NULL, NULL);
+        }
+        assert(quicklistGetAdaptiveStats(ql, &st));
+        assert(st.middle_ops == 0);
+        assert(ql->fill == QUICKLIST_ADAPT_FILL_LARGE);
+
+        /* LSET in the middle: nodes get split down to the small fill. */
+        unsigned long len_before = ql->len;
+        for (int i = 0; i < 20000; i++) {
+            long idx = 1000 + (i * 7919) % (ql->count - 2000);
+            snprintf(buf, sizeof(buf), "replaced %d", i);
+            assert(quicklistReplaceAtIndex(ql, idx, buf, 48));
+        }
+        assert(quicklistGetAdaptiveStats(ql, &st));
+        assert(ql->fill == QUICKLIST_ADAPT_FILL_SMALL);
+        assert(st.splits > 0 && ql->len > len_before);
+        ql_verify(ql, ql->len, 10000, ql->head->count, ql->tail->count);
+
+        quicklistSetAdaptive(ql, 0);
+        assert(ql->fill == -2 && !quicklistGetAdaptiveStats(ql, &st));
+        quicklistRelease(ql);
+    }
+
+    TEST("node index stays in sync with random operations") {
+        quicklist *ql = quicklistNew(4, 0);
+        long long *model = zmalloc(sizeof(long long) * 40000);
+        long mlen = 0;
+        long long next = 0;
+        quicklistEntry entry;
+
+        srand(1234);
+        for (int op = 0; op < 40000; op++) {
+            int r = rand() % 10;
+            char buf[32];
+            if (r < 3 || mlen < 10) {
+                int len = ll2string(buf, sizeof(buf), next);
+                quicklistPushTail(ql, buf, len);
+                model[mlen++] = next++;
+            } else if (r < 5) {
+                int len = ll2string(buf, sizeof(buf), next);
+                quicklistPushHead(ql, buf, len);
+                memmove(model + 1, model, sizeof(long long) * mlen);
+                model[0] = next++;
+                mlen++;
+            } else if (r < 6) {
+                quicklistPop(ql, rand() % 2 ? QUICKLIST_HEAD : QUICKLIST_TAIL,
+                             NULL, NULL, NULL);
+                /* Sync the model from the list ends. */
+                mlen = 0;
+                quicklistIter *iter = quicklistGetIterator(ql, AL_START_HEAD);
+                while (quicklistNext(iter, &entry))
+                    model[mlen++] = entry.longval;
+                quicklistReleaseIterator(iter);
+            } else if (r < 8) {
+                long at = rand() % mlen;
+                int len = ll2string(buf, sizeof(buf), next);
+                assert(quicklistIndex(ql, at, &entry));
+                quicklistInsertAfter(ql, &entry, buf, len);
+                memmove(model + at + 2, model + at + 1,
+                        sizeof(long long) * (mlen - at - 1));
+                model[at + 1] = next++;
+                mlen++;
+            } else if (r < 9) {
+                long at = rand() % mlen;
+                long del = 1 + rand() % 5;
+                if (at + del > mlen)
+                    del = mlen - at;
+                quicklistDelRange(ql, at, del);
+                memmove(model + at, model + at + del,
+                        sizeof(long long) * (mlen - at - del));
+                mlen -= del;
+            } else {
+                long at = rand() % mlen;
+                int len = ll2string(buf, sizeof(buf), next);
+                assert(quicklistReplaceAtIndex(ql, at, buf, len));
+                model[at] = next++;
+            }
+            if (op % 16 == 0) {
+                long at = rand() % mlen;
+                assert(quicklistIndex(ql, at, &entry) &&
+                       entry.longval == model[at]);
+                assert(quicklistIndex(ql, at - mlen, &entry) &&
+                       entry.longval == model[at]);
+            }
+        }
+        assert(ql->index != NULL);
+        for (long at = 0; at < mlen; at++) {
+            assert(quicklistIndex(ql, at, &entry) &&
+                   entry.longval == model[at]);
+        }
+        ql_verify(ql, ql->len, mlen, ql->head->count, ql->tail->count);
+        zfree(model);
+        quicklistRelease(ql);
+    }
+
+    TEST("node index updates counts in place and goes away when short") {
+        quicklist *ql = quicklistNew(8, 0);
+        quicklistEntry entry;
+        char buf[32];
+
+        for (int i = 0; i < 8 * 1000; i++) {
+            int len = ll2string(buf, sizeof(buf), i);
+            quicklistPushTail(ql, buf, len);
+        }
+        assert(ql->index && quicklistIndex(ql, 0, &entry));
+        assert(!ql->index->dirty && ql->index->cap == 2048);
+
+        /* Deleting from interior nodes that don't become empty is a point
+         * update. */
+        for (int i = 0; i < 100; i++) {
+            long at = 8 * (i + 50) - i;
+            assert(quicklistIndex(ql, at, &entry));
+            quicklistDelIndex(ql, entry.node, &entry.zi);
+            assert(!ql->index->dirty);
+        }
+        for (int i = 0; i < 100; i++) {
+            assert(quicklistIndex(ql, 8 * (i + 50) - i, &entry) &&
+                   entry.longval == 8 * (i + 50) + 1);
+        }
+        assert(!ql->index->dirty);
+
+        /* Popping most of the nodes shrinks the slots, then drops the
+         * index. */
+        while (ql->len >= 200)
+            quicklistPop(ql, QUICKLIST_HEAD, NULL, NULL, NULL);
+        assert(ql->index && ql->index->dirty);
+        assert(quicklistIndex(ql, 0, &entry) && ql->index->cap == 512);
+        while (ql->len >= QUICKLIST_INDEX_MIN_NODES / 2)
+            quicklistPop(ql, QUICKLIST_TAIL, NULL, NULL, NULL);
+        assert(ql->index == NULL);
+        assert(quicklistIndex(ql, 0, &entry));
+        quicklistRelease(ql);
+    }
+
+    TEST("decompressed node cache stays coherent with random operations") {
+        quicklist *ql = quicklistNew(-2, 1);
+        long long *model = zmalloc(sizeof(long long) * 40000);
+        long mlen = 0;
+        long long next = 0;
+        quicklistNodeCacheStats st;
+        quicklistEntry entry;
+        quicklistIter *iter;
+        char buf[48];
+
+/* Elements are 48 bytes with zero padding, so that the nodes compress. */
+#define cache_elem(v)                                                          \
+    do {                                                                       \
+        memset(buf, 0, sizeof(buf));                                           \
+        snprintf(buf, sizeof(buf), "node %lld", (v));                          \
+    } while (0)
+#define cache_check(e, v)                                                      \
+    do {                                                                       \
+        cache_elem(v);                                                         \
+        assert((e).value && (e).sz == sizeof(buf) &&                           \
+               !memcmp((e).value, buf, sizeof(buf)));                          \
+    } while (0)
+
+        assert(!quicklistGetNodeCacheStats(ql, &st));
+        quicklistSetNodeCache(ql, 1 << 20);
+        for (; mlen < 5000; mlen++) {
+            cache_elem(next);
+            quicklistPushTail(ql, buf, sizeof(buf));
+            model[mlen] = next++;
+        }
+
+        srand(4321);
+        for (int op = 0; op < 20000; op++) {
+            int r = rand() % 10;
+            long at = rand() % mlen;
+            if (r < 4) {
+                /* Page over a range, as LRANGE does. */
+                iter = quicklistGetIteratorAtIdx(ql, AL_START_HEAD, at);
+                for (long j = at; j < at + 200 && j < mlen; j++) {
+                    assert(quicklistNext(iter, &entry));
+                    cache_check(entry, model[j]);
+                }
+                quicklistReleaseIterator(iter);
+            } else if (r < 6) {
+                assert(quicklistIndex(ql, at, &entry));
+                cache_check(entry, model[at]);
+                quicklistCompress(ql, entry.node);
+            } else if (r < 7) {
+                cache_elem(next);
+                assert(quicklistIndex(ql, at, &entry));
+                quicklistInsertAfter(ql, &entry, buf, sizeof(buf));
+                memmove(model + at + 2, model + at + 1,
+                        sizeof(long long) * (mlen - at - 1));
+                model[at + 1] = next++;
+                mlen++;
+            } else if (r < 8 && mlen > 1000) {
+                long del = 1 + rand() % 50;
+                if (at + del > mlen)
+                    del = mlen - at;
+                quicklistDelRange(ql, at, del);
+                memmove(model + at, model + at + del,
+                        sizeof(long long) * (mlen - at - del));
+                mlen -= del;
+            } else if (r < 9) {
+                cache_elem(next);
+                assert(quicklistReplaceAtIndex(ql, at, buf, sizeof(buf)));
+                model[at] = next++;
+            } else {
+                cache_elem(next);
+                quicklistPushTail(ql, buf, sizeof(buf));
+                model[mlen++] = next++;
+            }
+            if (op == 10000) {
+                /* A small cap: entries are evicted to stay within it. */
+                quicklistSetNodeCache(ql, 16 * 1024);
+                assert(quicklistGetNodeCacheStats(ql, &st));
+                assert(st.bytes <= 16 * 1024);
+            }
+        }
+        assert(quicklistGetNodeCacheStats(ql, &st));
+        assert(st.hits > 0 && st.misses > 0 && st.reused > 0);
+        assert(st.invalidations > 0 && st.evictions > 0);
+        assert(st.bytes <= st.max_bytes);
+
+        quicklistSetNodeCache(ql, 0);
+        assert(!quicklistGetNodeCacheStats(ql, &st));
+        iter = quicklistGetIterator(ql, AL_START_HEAD);
+        for (long j = 0; j < mlen; j++) {
+            assert(quicklistNext(iter, &entry));
+            cache_check(entry, model[j]);
+        }
+        assert(!quicklistNext(iter, &entry));
+        quicklistReleaseIterator(iter);
+        ql_verify(ql, ql->len, mlen, ql->head->count, ql->tail->count);
+#undef cache_elem
+#undef cache_check
+        zfree(model);
+        quicklistRelease(ql);
+    }
+
+#ifdef USE_ZSTD
+    TEST("zstd trained dictionary") {
+        quicklist *ql = quicklistNew(-2, 1);
+        char buf[40] = {0};
+        assert(quicklistSetCodec(ql, QUICKLIST_CODEC_ZSTD));
+        for (int i = 0; i < 4000; i++) {
+            if (i == 2000)
+                assert(quicklistTrainZstdDictionary(ql, 4096));
+            snprintf(buf, sizeof(buf), "hello zstd dictionary %d", i);
+            quicklistPushTail(ql, buf, 40);
+        }
+        /* The dictionary stays while nodes need it, even after being
+         * replaced, and is released with the last of them. */
+        int slot = quicklist_zstd_current;
+        unsigned int id = quicklist_zstd_dicts[slot].id;
+        assert(slot != -1 && quicklist_zstd_dicts[slot].refs > 0);
+        quicklist *copy = quicklistDup(ql);
+        assert(quicklistSetZstdDictionary(NULL, 0));
+        assert(quicklist_zstd_current == -1);
+        quicklistRelease(ql);
+        assert(quicklist_zstd_dicts[slot].id == id);
+        quicklistEntry entry;
+        for (int i = 0; i < 4000; i += 101) {
+            snprintf(buf, sizeof(buf), "hello zstd dictionary %d", i);
+            assert(quicklistIndex(copy, i, &entry));
+            assert(!strcmp((char *)entry.value, buf));
+        }
+        quicklistRelease(copy);
+        assert(quicklist_zstd_dicts[slot].id == 0);
+    }
+#endif
+
     /* Run a longer test of compression depth outside of primary test loop. */
     int list_sizes[] = {250, 251, 500, 999, 1000};
     long long start = mstime();
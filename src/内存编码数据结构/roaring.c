@@ -0,0 +1,744 @@
+/* roaring.c - Roaring bitmap style compressed integer set.
+ *
+ * This is the set encoding between the intset and the hash table: once an
+ * intset grows too large, storing every member in a dict costs about 70
+ * bytes per member, while dense integer sets (user IDs, offsets...) can be
+ * stored with a couple of bytes or even a couple of bits per member.
+ *
+ * ROARING LAYOUT
+ * ==============
+ *
+ * Every 64 bit signed value is first biased flipping the sign bit, so that
+ * the unsigned order of the biased values is the signed order of the
+ * original ones. The biased value is then split in a 48 bit key and a 16 bit
+ * low part. The set is a sorted array of containers, one per key, and every
+ * container stores the low parts of its values in one of two ways:
+ *
+ * ROARING_ARRAY   a sorted array of uint16_t, used while the container holds
+ *                 at most ROARING_ARRAY_MAX (4096) values.
+ * ROARING_BITMAP  a bitmap of 65536 bits (8k), used for denser containers.
+ *
+ * Membership tests are a binary search on the container keys followed by a
+ * binary search or a single bit test in the container. Intersections and
+ * unions work container by container, the bitmap/bitmap case being plain
+ * word wise AND / OR.
+ */
+
+#include "fmacros.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "roaring.h"
+#include "zmalloc.h"
+
+#define ROARING_BIAS (1ULL<<63)
+
+// 有符号值翻转符号位后按无符号比较，顺序不变
+static inline uint64_t roaringBias(int64_t v) {
+    return (uint64_t)v ^ ROARING_BIAS;
+}
+
+static inline int64_t roaringValue(uint64_t key, uint16_t low) {
+    return (int64_t)(((key << 16) | low) ^ ROARING_BIAS);
+}
+
+/* ----------------------------- Containers -------------------------------- */
+
+/* Search 'v' in the sorted array 'a' of 'n' elements. Returns 1 if found,
+ * and sets 'pos' to its index, or to the index where it should be inserted
+ * when not found. */
+// 在容器的有序数组中二分查找
+static int containerArraySearch(const uint16_t *a, uint32_t n, uint16_t v, uint32_t *pos) {
+    uint32_t lo = 0, hi = n;
+    while (lo < hi) {
+        uint32_t mid = (lo+hi) >> 1;
+        if (a[mid] < v) lo = mid+1;
+        else hi = mid;
+    }
+    *pos = lo;
+    return lo < n && a[lo] == v;
+}
+
+static uint32_t containerBitmapCount(const uint64_t *bitmap) {
+    uint32_t j, card = 0;
+    for (j = 0; j < ROARING_BITMAP_WORDS; j++)
+        card += __builtin_popcountll(bitmap[j]);
+    return card;
+}
+
+// 数组容器转成位图容器
+static void containerToBitmap(roaringContainer *c) {
+    uint64_t *bitmap = zcalloc(sizeof(uint64_t)*ROARING_BITMAP_WORDS);
+    uint32_t j;
+
+    for (j = 0; j < c->card; j++)
+        bitmap[c->data.array[j] >> 6] |= 1ULL << (c->data.array[j] & 63);
+    zfree(c->data.array);
+    c->data.bitmap = bitmap;
+    c->type = ROARING_BITMAP;
+    c->alloc = 0;
+}
+
+// 位图容器转成数组容器，调用者保证 card <= ROARING_ARRAY_MAX
+static void containerToArray(roaringContainer *c) {
+    uint16_t *array = zmalloc(sizeof(uint16_t)*(c->card ? c->card : 1));
+    uint32_t j, n = 0;
+
+    for (j = 0; j < ROARING_BITMAP_WORDS; j++) {
+        uint64_t w = c->data.bitmap[j];
+        while (w) {
+            array[n++] = (j << 6) | __builtin_ctzll(w);
+            w &= w-1;
+        }
+    }
+    zfree(c->data.bitmap);
+    c->data.array = array;
+    c->type = ROARING_ARRAY;
+    c->alloc = c->card ? c->card : 1;
+}
+
+// 添加成功返回 1，已经存在返回 0
+static int containerAdd(roaringContainer *c, uint16_t low) {
+    uint32_t pos;
+
+    if (c->type == ROARING_BITMAP) {
+        uint64_t bit = 1ULL << (low & 63);
+        if (c->data.bitmap[low >> 6] & bit) return 0;
+        c->data.bitmap[low >> 6] |= bit;
+        c->card++;
+        return 1;
+    }
+
+    if (containerArraySearch(c->data.array,c->card,low,&pos)) return 0;
+    if (c->card == ROARING_ARRAY_MAX) {
+        containerToBitmap(c);
+        return containerAdd(c,low);
+    }
+    if (c->card == c->alloc) {
+        uint32_t alloc = c->alloc ? c->alloc*2 : 4;
+        if (alloc > ROARING_ARRAY_MAX) alloc = ROARING_ARRAY_MAX;
+        c->data.array = zrealloc(c->data.array,sizeof(uint16_t)*alloc);
+        c->alloc = alloc;
+    }
+    memmove(c->data.array+pos+1,c->data.array+pos,
+            sizeof(uint16_t)*(c->card-pos));
+    c->data.array[pos] = low;
+    c->card++;
+    return 1;
+}
+
+// 删除成功返回 1，不存在返回 0
+static int containerRemove(roaringContainer *c, uint16_t low) {
+    uint32_t pos;
+
+    if (c->type == ROARING_BITMAP) {
+        uint64_t bit = 1ULL << (low & 63);
+        if (!(c->data.bitmap[low >> 6] & bit)) return 0;
+        c->data.bitmap[low >> 6] &= ~bit;
+        c->card--;
+        if (c->card <= ROARING_ARRAY_MAX) containerToArray(c);
+        return 1;
+    }
+
+    if (!containerArraySearch(c->data.array,c->card,low,&pos)) return 0;
+    memmove(c->data.array+pos,c->data.array+pos+1,
+            sizeof(uint16_t)*(c->card-pos-1));
+    c->card--;
+    return 1;
+}
+
+static int containerContains(const roaringContainer *c, uint16_t low) {
+    uint32_t pos;
+
+    if (c->type == ROARING_BITMAP)
+        return (c->data.bitmap[low >> 6] >> (low & 63)) & 1;
+    return containerArraySearch(c->data.array,c->card,low,&pos);
+}
+
+// 返回容器中第 rank小的值的低 16位
+static uint16_t containerSelect(const roaringContainer *c, uint32_t rank) {
+    uint32_t j;
+
+    if (c->type == ROARING_ARRAY) return c->data.array[rank];
+    for (j = 0; j < ROARING_BITMAP_WORDS; j++) {
+        uint64_t w = c->data.bitmap[j];
+        uint32_t cnt = __builtin_popcountll(w);
+        if (rank < cnt) {
+            while (rank--) w &= w-1;
+            return (j << 6) | __builtin_ctzll(w);
+        }
+        rank -= cnt;
+    }
+    return 0; /* Not reached if rank < card. */
+}
+
+static void containerCopy(roaringContainer *dst, const roaringContainer *src) {
+    *dst = *src;
+    if (src->type == ROARING_BITMAP) {
+        dst->data.bitmap = zmalloc(sizeof(uint64_t)*ROARING_BITMAP_WORDS);
+        memcpy(dst->data.bitmap,src->data.bitmap,
+               sizeof(uint64_t)*ROARING_BITMAP_WORDS);
+    } else {
+        dst->alloc = src->card ? src->card : 1;
+        dst->data.array = zmalloc(sizeof(uint16_t)*dst->alloc);
+        memcpy(dst->data.array,src->data.array,sizeof(uint16_t)*src->card);
+    }
+}
+
+static void containerRelease(roaringContainer *c) {
+    if (c->type == ROARING_BITMAP) zfree(c->data.bitmap);
+    else zfree(c->data.array);
+}
+
+/* Store in 'out' the intersection of 'a' and 'b'. 'out' may end up empty,
+ * in which case the caller should release it. */
+// 求两个容器的交集，结果可能为空
+static void containerAnd(const roaringContainer *a, const roaringContainer *b,
+                         roaringContainer *out) {
+    uint32_t i, j, n = 0;
+
+    out->key = a->key;
+    if (a->type == ROARING_BITMAP && b->type == ROARING_BITMAP) {
+        out->type = ROARING_BITMAP;
+        out->alloc = 0;
+        out->data.bitmap = zmalloc(sizeof(uint64_t)*ROARING_BITMAP_WORDS);
+        for (j = 0; j < ROARING_BITMAP_WORDS; j++) {
+            out->data.bitmap[j] = a->data.bitmap[j] & b->data.bitmap[j];
+            n += __builtin_popcountll(out->data.bitmap[j]);
+        }
+        out->card = n;
+        if (n <= ROARING_ARRAY_MAX) containerToArray(out);
+        return;
+    }
+
+    // 至少一边是数组，交集的大小不会超过数组的大小
+    if (a->type == ROARING_BITMAP) {
+        const roaringContainer *t = a;
+        a = b;
+        b = t;
+    }
+    out->type = ROARING_ARRAY;
+    out->alloc = a->card ? a->card : 1;
+    out->data.array = zmalloc(sizeof(uint16_t)*out->alloc);
+    if (b->type == ROARING_BITMAP) {
+        for (i = 0; i < a->card; i++)
+            if (containerContains(b,a->data.array[i]))
+                out->data.array[n++] = a->data.array[i];
+    } else {
+        i = j = 0;
+        while (i < a->card && j < b->card) {
+            uint16_t x = a->data.array[i], y = b->data.array[j];
+            if (x < y) {
+                i++;
+            } else if (x > y) {
+                j++;
+            } else {
+                out->data.array[n++] = x;
+                i++; j++;
+            }
+        }
+    }
+    out->card = n;
+}
+
+// 求两个容器的并集
+static void containerOr(const roaringContainer *a, const roaringContainer *b,
+                        roaringContainer *out) {
+    uint32_t i, j, n = 0;
+
+    if (a->type == ROARING_ARRAY && b->type == ROARING_ARRAY) {
+        out->key = a->key;
+        out->type = ROARING_ARRAY;
+        out->alloc = a->card+b->card;
+        out->data.array = zmalloc(sizeof(uint16_t)*out->alloc);
+        i = j = 0;
+        while (i < a->card || j < b->card) {
+            if (j == b->card || (i < a->card && a->data.array[i] < b->data.array[j])) {
+                out->data.array[n++] = a->data.array[i++];
+            } else if (i == a->card || b->data.array[j] < a->data.array[i]) {
+                out->data.array[n++] = b->data.array[j++];
+            } else {
+                out->data.array[n++] = a->data.array[i];
+                i++; j++;
+            }
+        }
+        out->card = n;
+        if (n > ROARING_ARRAY_MAX) containerToBitmap(out);
+        return;
+    }
+
+    // 至少一边是位图，结果一定是位图
+    if (a->type == ROARING_ARRAY) {
+        const roaringContainer *t = a;
+        a = b;
+        b = t;
+    }
+    containerCopy(out,a);
+    if (b->type == ROARING_BITMAP) {
+        for (j = 0; j < ROARING_BITMAP_WORDS; j++)
+            out->data.bitmap[j] |= b->data.bitmap[j];
+        out->card = containerBitmapCount(out->data.bitmap);
+    } else {
+        for (i = 0; i < b->card; i++) containerAdd(out,b->data.array[i]);
+    }
+}
+
+/* ------------------------------ Roaring ---------------------------------- */
+
+// 创建一个空的 roaring集合
+roaring *roaringNew(void) {
+    roaring *r = zmalloc(sizeof(*r));
+    r->containers = NULL;
+    r->len = 0;
+    r->alloc = 0;
+    r->card = 0;
+    return r;
+}
+
+void roaringFree(roaring *r) {
+    uint32_t j;
+    for (j = 0; j < r->len; j++) containerRelease(r->containers+j);
+    zfree(r->containers);
+    zfree(r);
+}
+
+/* Binary search the container with the given key. Returns 1 if found,
+ * setting 'pos' to its index, or 0 setting 'pos' to the insert position. */
+// 按 key二分查找容器
+static int roaringFindContainer(const roaring *r, uint64_t key, uint32_t *pos) {
+    uint32_t lo = 0, hi = r->len;
+    while (lo < hi) {
+        uint32_t mid = (lo+hi) >> 1;
+        if (r->containers[mid].key < key) lo = mid+1;
+        else hi = mid;
+    }
+    *pos = lo;
+    return lo < r->len && r->containers[lo].key == key;
+}
+
+// 在 pos位置插入一个空间，返回它的指针，调用者负责初始化
+static roaringContainer *roaringMakeRoom(roaring *r, uint32_t pos) {
+    if (r->len == r->alloc) {
+        r->alloc = r->alloc ? r->alloc*2 : 4;
+        r->containers = zrealloc(r->containers,sizeof(roaringContainer)*r->alloc);
+    }
+    memmove(r->containers+pos+1,r->containers+pos,
+            sizeof(roaringContainer)*(r->len-pos));
+    r->len++;
+    return r->containers+pos;
+}
+
+/* Append a container already built by the caller, or release it if it is
+ * empty. Used by the set operations, that produce the keys in order. */
+// 结果集合按 key有序生成，直接追加到末尾，空容器直接释放
+static void roaringAppendContainer(roaring *r, roaringContainer *c) {
+    if (c->card == 0) {
+        containerRelease(c);
+        return;
+    }
+    *roaringMakeRoom(r,r->len) = *c;
+    r->card += c->card;
+}
+
+/* Add a value. Returns 1 if the value was added, 0 if it was already
+ * a member of the set. */
+// 添加一个值，成功返回 1，已经存在返回 0
+int roaringAdd(roaring *r, int64_t value) {
+    uint64_t u = roaringBias(value);
+    uint32_t pos;
+    roaringContainer *c;
+
+    if (roaringFindContainer(r,u >> 16,&pos)) {
+        c = r->containers+pos;
+    } else {
+        c = roaringMakeRoom(r,pos);
+        c->key = u >> 16;
+        c->card = 0;
+        c->type = ROARING_ARRAY;
+        c->alloc = 0;
+        c->data.array = NULL;
+    }
+    if (!containerAdd(c,u & 0xffff)) return 0;
+    r->card++;
+    return 1;
+}
+
+/* Remove a value. Returns 1 if the value was removed, 0 if it was not a
+ * member of the set. */
+// 删除一个值，容器变空时一起删除
+int roaringRemove(roaring *r, int64_t value) {
+    uint64_t u = roaringBias(value);
+    uint32_t pos;
+    roaringContainer *c;
+
+    if (!roaringFindContainer(r,u >> 16,&pos)) return 0;
+    c = r->containers+pos;
+    if (!containerRemove(c,u & 0xffff)) return 0;
+    r->card--;
+    if (c->card == 0) {
+        containerRelease(c);
+        memmove(r->containers+pos,r->containers+pos+1,
+                sizeof(roaringContainer)*(r->len-pos-1));
+        r->len--;
+    }
+    return 1;
+}
+
+int roaringContains(const roaring *r, int64_t value) {
+    uint64_t u = roaringBias(value);
+    uint32_t pos;
+
+    if (!roaringFindContainer(r,u >> 16,&pos)) return 0;
+    return containerContains(r->containers+pos,u & 0xffff);
+}
+
+uint64_t roaringCardinality(const roaring *r) {
+    return r->card;
+}
+
+/* Store in '*value' the member with the given rank (0 is the smallest).
+ * Returns 0 if rank is out of range. */
+// 返回排名为 rank的成员，超出范围返回 0
+int roaringSelect(const roaring *r, uint64_t rank, int64_t *value) {
+    uint32_t j;
+
+    if (rank >= r->card) return 0;
+    for (j = 0; j < r->len; j++) {
+        const roaringContainer *c = r->containers+j;
+        if (rank < c->card) {
+            *value = roaringValue(c->key,containerSelect(c,rank));
+            return 1;
+        }
+        rank -= c->card;
+    }
+    return 0;
+}
+
+/* Return a random member, the set must not be empty. Every member has the
+ * same probability of being returned, as needed by SRANDMEMBER / SPOP. */
+// 随机返回一个成员，集合不能为空，每个成员被选中的概率相同
+int64_t roaringRandom(const roaring *r) {
+    uint64_t rank = (((uint64_t)random() << 31) ^ (uint64_t)random()) % r->card;
+    int64_t value = 0;
+    roaringSelect(r,rank,&value);
+    return value;
+}
+
+// 求交集，返回新的集合
+roaring *roaringAnd(const roaring *a, const roaring *b) {
+    roaring *r = roaringNew();
+    uint32_t i = 0, j = 0;
+
+    while (i < a->len && j < b->len) {
+        const roaringContainer *x = a->containers+i, *y = b->containers+j;
+        if (x->key < y->key) {
+            i++;
+        } else if (x->key > y->key) {
+            j++;
+        } else {
+            roaringContainer c;
+            containerAnd(x,y,&c);
+            roaringAppendContainer(r,&c);
+            i++; j++;
+        }
+    }
+    return r;
+}
+
+// 求并集，返回新的集合
+roaring *roaringOr(const roaring *a, const roaring *b) {
+    roaring *r = roaringNew();
+    uint32_t i = 0, j = 0;
+
+    while (i < a->len || j < b->len) {
+        roaringContainer c;
+        if (j == b->len || (i < a->len && a->containers[i].key < b->containers[j].key)) {
+            containerCopy(&c,a->containers+i++);
+        } else if (i == a->len || b->containers[j].key < a->containers[i].key) {
+            containerCopy(&c,b->containers+j++);
+        } else {
+            containerOr(a->containers+i,b->containers+j,&c);
+            i++; j++;
+        }
+        roaringAppendContainer(r,&c);
+    }
+    return r;
+}
+
+// 从 intset转换，intset有序，所以每次都是追加到最后一个容器
+roaring *roaringFromIntset(intset *is) {
+    roaring *r = roaringNew();
+    uint32_t j, len = intsetLen(is);
+    int64_t v;
+
+    for (j = 0; j < len; j++) {
+        intsetGet(is,j,&v);
+        roaringAdd(r,v);
+    }
+    return r;
+}
+
+/* Return the number of bytes used by the set, as reported by MEMORY USAGE
+ * and objectComputeSize(). */
+// 返回集合占用的字节数
+size_t roaringBytes(const roaring *r) {
+    size_t bytes = sizeof(*r)+sizeof(roaringContainer)*r->alloc;
+    uint32_t j;
+
+    for (j = 0; j < r->len; j++) {
+        const roaringContainer *c = r->containers+j;
+        if (c->type == ROARING_BITMAP)
+            bytes += sizeof(uint64_t)*ROARING_BITMAP_WORDS;
+        else
+            bytes += sizeof(uint16_t)*c->alloc;
+    }
+    return bytes;
+}
+
+void roaringInitIterator(const roaring *r, roaringIterator *it) {
+    it->r = r;
+    it->ci = 0;
+    it->pos = 0;
+}
+
+/* Store the next member in ascending order in '*value'. Returns 0 when
+ * there are no more members. The set must not be modified while iterating. */
+// 按从小到大的顺序返回下一个成员，迭代期间不能修改集合
+int roaringNext(roaringIterator *it, int64_t *value) {
+    while (it->ci < it->r->len) {
+        const roaringContainer *c = it->r->containers+it->ci;
+        if (c->type == ROARING_ARRAY) {
+            if (it->pos < c->card) {
+                *value = roaringValue(c->key,c->data.array[it->pos++]);
+                return 1;
+            }
+        } else if (it->pos < 65536) {
+            uint32_t word = it->pos >> 6;
+            uint64_t w = c->data.bitmap[word] & (~0ULL << (it->pos & 63));
+            while (!w && ++word < ROARING_BITMAP_WORDS) w = c->data.bitmap[word];
+            if (w) {
+                uint32_t bit = (word << 6) | __builtin_ctzll(w);
+                *value = roaringValue(c->key,bit);
+                it->pos = bit+1;
+                return 1;
+            }
+        }
+        it->ci++;
+        it->pos = 0;
+    }
+    return 0;
+}
+
+#ifdef REDIS_TEST
+#include <stdio.h>
+#include <sys/time.h>
+
+#define roaringTestAssert(_e) do { \
+    if (!(_e)) { \
+        printf("%s:%d: assertion failed: %s\n", __FILE__, __LINE__, #_e); \
+        exit(1); \
+    } \
+} while(0)
+
+static long long roaringUstime(void) {
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return ((long long)tv.tv_sec)*1000000+tv.tv_usec;
+}
+
+/* Check 'r' holds exactly the members of the intset 'is', in order. */
+static void roaringTestSame(roaring *r, intset *is) {
+    roaringIterator it;
+    uint32_t j = 0;
+    int64_t v, expect;
+
+    roaringTestAssert(roaringCardinality(r) == intsetLen(is));
+    roaringInitIterator(r,&it);
+    while (roaringNext(&it,&v)) {
+        roaringTestAssert(intsetGet(is,j++,&expect));
+        roaringTestAssert(v == expect);
+    }
+    roaringTestAssert(j == intsetLen(is));
+}
+
+static int64_t roaringTestValue(int round) {
+    int64_t v = ((int64_t)rand() << 20) ^ rand();
+    /* Mix sparse containers, dense containers and negative values. */
+    // 混合稀疏容器、稠密容器以及负数
+    switch (round % 3) {
+    case 0: return v % 200000 - 100000;
+    case 1: return v % 20000;
+    default: return v;
+    }
+}
+
+int roaringTest(int argc, char *argv[]) {
+    roaring *r;
+    intset *is;
+    int64_t v;
+    int j, round;
+
+    (void)argc; (void)argv;
+
+    printf("Add, remove and contains match an intset: ");
+    for (round = 0; round < 9; round++) {
+        r = roaringNew();
+        is = intsetNew();
+        for (j = 0; j < 50000; j++) {
+            uint8_t added;
+            int removed;
+            v = roaringTestValue(round);
+            if (rand() % 4) {
+                is = intsetAdd(is,v,&added);
+                roaringTestAssert(roaringAdd(r,v) == added);
+            } else {
+                is = intsetRemove(is,v,&removed);
+                roaringTestAssert(roaringRemove(r,v) == removed);
+            }
+            roaringTestAssert(roaringContains(r,v) == intsetFind(is,v));
+        }
+        roaringTestSame(r,is);
+        /* Empty the set again, exercising the bitmap -> array path. */
+        for (j = intsetLen(is)-1; j >= 0; j--) {
+            intsetGet(is,j,&v);
+            roaringTestAssert(roaringRemove(r,v));
+        }
+        roaringTestAssert(roaringCardinality(r) == 0 && r->len == 0);
+        roaringFree(r);
+        zfree(is);
+    }
+    printf("ok\n");
+
+    printf("Extreme values: ");
+    {
+        int64_t extremes[] = {INT64_MIN, INT64_MIN+1, -65537, -65536, -1, 0,
+                              1, 65535, 65536, INT64_MAX-1, INT64_MAX};
+        int n = (int)(sizeof(extremes)/sizeof(extremes[0]));
+        roaringIterator it;
+
+        r = roaringNew();
+        for (j = n-1; j >= 0; j--) roaringTestAssert(roaringAdd(r,extremes[j]));
+        roaringInitIterator(r,&it);
+        for (j = 0; j < n; j++) {
+            roaringTestAssert(roaringNext(&it,&v) && v == extremes[j]);
+            roaringTestAssert(roaringSelect(r,j,&v) && v == extremes[j]);
+        }
+        roaringTestAssert(!roaringNext(&it,&v));
+        roaringTestAssert(!roaringSelect(r,n,&v));
+        roaringFree(r);
+    }
+    printf("ok\n");
+
+    printf("Select and random sampling: ");
+    {
+        long hits[10] = {0};
+        r = roaringNew();
+        is = intsetNew();
+        for (j = 0; j < 30000; j++) {
+            v = roaringTestValue(j);
+            roaringAdd(r,v);
+            is = intsetAdd(is,v,NULL);
+        }
+        for (j = 0; j < (int)intsetLen(is); j += 7) {
+            int64_t expect;
+            intsetGet(is,j,&expect);
+            roaringTestAssert(roaringSelect(r,j,&v) && v == expect);
+        }
+        roaringFree(r);
+        zfree(is);
+
+        /* Every member of a 10 members set should be returned about 10% of
+         * the times. */
+        r = roaringNew();
+        for (j = 0; j < 10; j++) roaringAdd(r,j*100000);
+        for (j = 0; j < 100000; j++) {
+            v = roaringRandom(r);
+            roaringTestAssert(roaringContains(r,v));
+            hits[v/100000]++;
+        }
+        for (j = 0; j < 10; j++) roaringTestAssert(hits[j] > 8000 && hits[j] < 12000);
+        roaringFree(r);
+    }
+    printf("ok\n");
+
+    printf("And / Or match intset operations: ");
+    for (round = 0; round < 18; round++) {
+        roaring *a = roaringNew(), *b = roaringNew(), *and, *or;
+        intset *ia = intsetNew(), *ib = intsetNew(), *iand, *ior;
+        int na = rand() % 40000, nb = (round & 1) ? rand() % 40000 : rand() % 100;
+        for (j = 0; j < na; j++) {
+            v = roaringTestValue(round);
+            roaringAdd(a,v);
+            ia = intsetAdd(ia,v,NULL);
+        }
+        for (j = 0; j < nb; j++) {
+            v = roaringTestValue(round/3);
+            roaringAdd(b,v);
+            ib = intsetAdd(ib,v,NULL);
+        }
+        and = roaringAnd(a,b);
+        or = roaringOr(a,b);
+        iand = intsetIntersect(ia,ib);
+        ior = intsetNew();
+        for (j = 0; j < (int)intsetLen(ia); j++) {
+            intsetGet(ia,j,&v);
+            ior = intsetAdd(ior,v,NULL);
+        }
+        for (j = 0; j < (int)intsetLen(ib); j++) {
+            intsetGet(ib,j,&v);
+            ior = intsetAdd(ior,v,NULL);
+        }
+        roaringTestSame(and,iand);
+        roaringTestSame(or,ior);
+        roaringFree(a); roaringFree(b); roaringFree(and); roaringFree(or);
+        zfree(ia); zfree(ib); zfree(iand); zfree(ior);
+    }
+    printf("ok\n");
+
+    printf("Conversion from intset: ");
+    {
+        is = intsetNew();
+        for (j = 0; j < 10000; j++) is = intsetAdd(is,roaringTestValue(j),NULL);
+        r = roaringFromIntset(is);
+        roaringTestSame(r,is);
+        roaringFree(r);
+        zfree(is);
+    }
+    printf("ok\n");
+
+    printf("Benchmark 1M dense members: ");
+    {
+        roaring *b;
+        uint32_t found = 0;
+        long long start = roaringUstime();
+
+        r = roaringNew();
+        for (j = 0; j < 1000000; j++) roaringAdd(r,(int64_t)j*3);
+        b = roaringNew();
+        for (j = 0; j < 1000000; j++) roaringAdd(b,(int64_t)j*2);
+        printf("build %lldusec, %.2f bytes per member, ",
+            roaringUstime()-start,(double)roaringBytes(r)/roaringCardinality(r));
+
+        start = roaringUstime();
+        for (j = 0; j < 1000000; j++) found += roaringContains(r,rand() % 3000000);
+        printf("1M lookups %lldusec, ",roaringUstime()-start);
+
+        start = roaringUstime();
+        {
+            roaring *and = roaringAnd(r,b), *or = roaringOr(r,b);
+            roaringTestAssert(roaringCardinality(and) == 333334);
+            roaringTestAssert(roaringCardinality(or) == 1666666);
+            roaringFree(and);
+            roaringFree(or);
+        }
+        printf("and+or %lldusec\n",roaringUstime()-start);
+        roaringTestAssert(found > 0);
+        roaringFree(r);
+        roaringFree(b);
+    }
+
+    return 0;
+}
+#endif
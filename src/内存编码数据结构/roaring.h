@@ -0,0 +1,65 @@
+/* roaring.h - Roaring bitmap style compressed integer set, see roaring.c
+ * for the layout. */
+
+#ifndef __ROARING_H
+#define __ROARING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "intset.h"
+
+/* Container types. */
+#define ROARING_ARRAY 0     /* Sorted array of the low 16 bits. */
+#define ROARING_BITMAP 1    /* 65536 bits bitmap. */
+
+/* An array container is turned into a bitmap once it holds more than this
+ * many values: past this point the 8k bitmap is the smaller of the two. */
+// 超过 4096个元素时数组容器比位图容器更大，转换成位图
+#define ROARING_ARRAY_MAX 4096
+#define ROARING_BITMAP_WORDS 1024
+
+// 一个容器保存高 48位相同的所有值的低 16位
+typedef struct roaringContainer {
+    uint64_t key;           /* High 48 bits of the values in the container. */
+    uint32_t card;          /* Number of values in the container. */
+    uint32_t type : 1;      /* ROARING_ARRAY or ROARING_BITMAP. */
+    uint32_t alloc : 31;    /* Allocated slots of an array container. */
+    union {
+        uint16_t *array;
+        uint64_t *bitmap;
+    } data;
+} roaringContainer;
+
+typedef struct roaring {
+    roaringContainer *containers; /* Sorted by key. */
+    uint32_t len;           /* Number of containers in use. */
+    uint32_t alloc;         /* Number of allocated containers. */
+    uint64_t card;          /* Total number of values. */
+} roaring;
+
+typedef struct roaringIterator {
+    const roaring *r;
+    uint32_t ci;            /* Current container. */
+    uint32_t pos;           /* Array index or bit index in the container. */
+} roaringIterator;
+
+roaring *roaringNew(void);
+void roaringFree(roaring *r);
+roaring *roaringFromIntset(intset *is);
+int roaringAdd(roaring *r, int64_t value);
+int roaringRemove(roaring *r, int64_t value);
+int roaringContains(const roaring *r, int64_t value);
+uint64_t roaringCardinality(const roaring *r);
+int roaringSelect(const roaring *r, uint64_t rank, int64_t *value);
+int64_t roaringRandom(const roaring *r);
+roaring *roaringAnd(const roaring *a, const roaring *b);
+roaring *roaringOr(const roaring *a, const roaring *b);
+size_t roaringBytes(const roaring *r);
+void roaringInitIterator(const roaring *r, roaringIterator *it);
+int roaringNext(roaringIterator *it, int64_t *value);
+
+#ifdef REDIS_TEST
+int roaringTest(int argc, char *argv[]);
+#endif
+
+#endif /* __ROARING_H */
@@ -208,6 +208,7 @@
 #include "ziplist.h"
 #include "endianconv.h"
 #include "redisassert.h"
+#include "dsstats.h"
 
 // ziplist的结束标志
 #define ZIP_END 255         /* Special "end of ziplist" entry. */
@@ -720,6 +721,7 @@ unsigned char *__ziplistCascadeUpdate(unsigned char *zl, unsigned char *p) {
     size_t offset, noffset, extra;
     unsigned char *np;
     zlentry cur, next;
+    uint64_t resized = 0;
 
     while (p[0] != ZIP_END) {
         // 保存当前节点信息到 cur 结构体中
@@ -778,6 +780,7 @@ unsigned char *__ziplistCascadeUpdate(unsigned char *zl, unsigned char *p) {
             /* Advance the cursor */
             p += rawlen;
             curlen += extra;
+            resized++;
         } else {
             if (next.prevrawlensize > rawlensize) {
                 /* This would result in shrinking, which we want to avoid.
@@ -792,6 +795,8 @@ unsigned char *__ziplistCascadeUpdate(unsigned char *zl, unsigned char *p) {
             break;
         }
     }
+    // 记录这次连锁更新扩容了多少个 entry
+    if (dsstatsEnabled()) dsstatsRecord(DSSTATS_CASCADE_UPDATE,resized);
     return zl;
 }
 
@@ -1267,49 +1272,45 @@ unsigned int ziplistCompare(unsigned char *p, unsigned char *sstr, unsigned int
 }
 
 /* Find pointer to the entry equal to the specified entry. Skip 'skip' entries
- * between every comparison. Returns NULL when the field could not be found. */
+ * between every comparison. Returns NULL when the field could not be found.
+ *
+ * The searched entry is encoded once before the scan. When it is a string,
+ * the length header of a string entry only depends on its length, so an
+ * entry is compared with it byte by byte, and the first encoding byte alone
+ * rejects the integers and most of the strings of another length. When it
+ * is an integer only the integer entries are loaded and compared, since an
+ * integer may have been stored with a larger encoding than needed by old
+ * versions. */
+// 先把要查找的值编码一次，字符串直接按字节比较编码头和内容，整数只和整数 entry 比较
 unsigned char *ziplistFind(unsigned char *p, unsigned char *vstr, unsigned int vlen, unsigned int skip) {
     int skipcnt = 0;
     unsigned char vencoding = 0;
     long long vll = 0;
+    unsigned char hdr[5];
+    unsigned int hdrlen = 0;
+
+    if (!zipTryEncoding(vstr, vlen, &vll, &vencoding))
+        hdrlen = zipStoreEntryEncoding(hdr, ZIP_STR_06B, vlen);
 
     while (p[0] != ZIP_END) {
         unsigned int prevlensize, encoding, lensize, len;
         unsigned char *q;
 
-        ZIP_DECODE_PREVLENSIZE(p, prevlensize);
-        ZIP_DECODE_LENGTH(p + prevlensize, encoding, lensize, len);
-        q = p + prevlensize + lensize;
+        prevlensize = (p[0] < ZIP_BIG_PREVLEN) ? 1 : 5;
+        q = p + prevlensize;
 
         if (skipcnt == 0) {
             /* Compare current entry with specified entry */
-            if (ZIP_IS_STR(encoding)) {
-                if (len == vlen && memcmp(q, vstr, vlen) == 0) {
+            if (hdrlen) {
+                if (q[0] == hdr[0] &&
+                    (hdrlen == 1 || memcmp(q + 1, hdr + 1, hdrlen - 1) == 0) &&
+                    (vlen == 0 || (q[hdrlen + vlen - 1] == vstr[vlen - 1] &&
+                                   memcmp(q + hdrlen, vstr, vlen) == 0))) {
                     return p;
                 }
-            } else {
-                /* Find out if the searched field can be encoded. Note that
-                 * we do it only the first time, once done vencoding is set
-                 * to non-zero and vll is set to the integer value. */
-                if (vencoding == 0) {
-                    if (!zipTryEncoding(vstr, vlen, &vll, &vencoding)) {
-                        /* If the entry can't be encoded we set it to
-                         * UCHAR_MAX so that we don't retry again the next
-                         * time. */
-                        vencoding = UCHAR_MAX;
-                    }
-                    /* Must be non-zero by now */
-                    assert(vencoding);
-                }
-
-                /* Compare current entry with specified entry, do it only
-                 * if vencoding != UCHAR_MAX because if there is no encoding
-                 * possible for the field it can't be a valid integer. */
-                if (vencoding != UCHAR_MAX) {
-                    long long ll = zipLoadInteger(q, encoding);
-                    if (ll == vll) {
-                        return p;
-                    }
+            } else if (!ZIP_IS_STR(q[0])) {
+                if (zipLoadInteger(q + 1, q[0]) == vll) {
+                    return p;
                 }
             }
 
@@ -1320,8 +1321,14 @@ unsigned char *ziplistFind(unsigned char *p, unsigned char *vstr, unsigned int v
             skipcnt--;
         }
 
-        /* Move to next entry */
-        p = q + len;
+        /* Move to next entry, short strings are checked first since they
+         * are the most common entries. */
+        if (q[0] <= 0x3f) {
+            p = q + 1 + q[0];
+        } else {
+            ZIP_DECODE_LENGTH(q, encoding, lensize, len);
+            p = q + lensize + len;
+        }
     }
 
     return NULL;
@@ -1932,6 +1939,57 @@ int ziplistTest(int argc, char **argv) {
         zfree(zl);
     }
 
+    printf("Find entries like a ziplistCompare() scan:\n");
+    {
+        char buf[400];
+        unsigned char *q, *expected;
+        unsigned char *sstr;
+        unsigned int slen;
+        long long sval;
+        int i, k, len, skip;
+
+        zl = ziplistNew();
+        for (i = 0; i < 1000; i++) {
+            switch(rand() % 4) {
+            case 0:
+                len = sprintf(buf,"%lld",(0LL + rand() - RAND_MAX/2) * (1LL << (rand() % 33)));
+                break;
+            case 1:
+                len = sprintf(buf,"%d",rand() % 20);
+                break;
+            case 2:
+                len = sprintf(buf,"0%d",rand() % 20);
+                break;
+            default:
+                len = randstring(buf,0,(rand() % 10 == 0) ? 350 : 70);
+                break;
+            }
+            zl = ziplistPush(zl,(unsigned char*)buf,len,ZIPLIST_TAIL);
+        }
+        for (skip = 0; skip <= 1; skip++) {
+            for (p = ziplistIndex(zl,0); p; p = ziplistNext(zl,p)) {
+                assert(ziplistGet(p,&sstr,&slen,&sval));
+                if (sstr == NULL) {
+                    slen = sprintf(buf,"%lld",sval);
+                    sstr = (unsigned char*)buf;
+                }
+                expected = NULL;
+                for (q = ziplistIndex(zl,0), k = 0; q; q = ziplistNext(zl,q), k++) {
+                    if (k % (skip+1) == 0 && ziplistCompare(q,sstr,slen)) {
+                        expected = q;
+                        break;
+                    }
+                }
+                if (ziplistFind(ziplistIndex(zl,0),sstr,slen,skip) != expected) {
+                    printf("ERROR: wrong entry found\n");
+                    return 1;
+                }
+            }
+        }
+        printf("SUCCESS\n\n");
+        zfree(zl);
+    }
+
     printf("Merge test:\n");
     {
         /* create list gives us: [hello, foo, quux, 1024] */
@@ -0,0 +1,155 @@
+/* dicttyped.h - Dict lookups specialized for a fixed key and value type
+ *
+ * The generic dict API calls the hashFunction and keyCompare methods of the
+ * dictType through pointers on every lookup, even when a table always holds
+ * the same kind of keys. DICT_DEFINE_TYPED() generates, for a given key
+ * type, static inline versions of the hot operations where hashing and
+ * comparing are plain calls the compiler can inline, and where the value
+ * is read and written in the field of the dictEntry union that fits it,
+ * for example the score of a sorted set member as a double.
+ *
+ * The generated functions work on an ordinary dict created by dictCreate():
+ * they walk the same tables, of both engines, do the same rehashing step,
+ * and leave to dict.c everything that is not a lookup (expanding, entry
+ * allocation, embedded keys, ...). So they can be freely mixed with the
+ * generic API, as long as the hash and the compare functions given to the
+ * macro agree with the methods of the dictType, that are still used by the
+ * rehashing and by the generic calls. Values are stored as they are: types
+ * with a valDup method must keep using dictAdd().
+ *
+ * Open addressing lookups use the same inline probe kernel as dict.c,
+ * dictGroupMatch() from dict.h, chosen at compile time.
+ *
+ * Usage, with keys and values of any type that fits in a pointer:
+ *
+ *   static inline uint64_t fooHash(sds key) { ... }
+ *   static inline int fooEqual(sds a, sds b) { ... }
+ *   DICT_DEFINE_TYPED(fooDict, sds, double, d, fooHash, fooEqual)
+ *
+ * defines fooDictFind(), fooDictFetch(), fooDictAddRaw(), fooDictAdd(),
+ * fooDictUnlink(), fooDictDelete(), fooDictGetVal() and fooDictSetVal(),
+ * that behave like the generic function with the same suffix.
+ */
+
+#ifndef __DICTTYPED_H
+#define __DICTTYPED_H
+
+#include <stdint.h>
+#include "dict.h"
+
+/* Keys and values are converted through uintptr_t, so that both pointers
+ * and integers can be used as the key and the value type. */
+#define DICT_DEFINE_TYPED(name, keytype, valtype, field, hashfn, equalfn) \
+static inline uint64_t name##Hash(keytype key) { \
+    return hashfn(key); \
+} \
+\
+static inline dictEntry *name##FindWithHash(dict *d, keytype key, uint64_t h) { \
+    int table; \
+\
+    for (table = 0; table <= 1; table++) { \
+        dictht *ht = &d->ht[table]; \
+\
+        if (ht->size == 0) { \
+            if (!dictIsRehashing(d)) break; \
+            continue; \
+        } \
+        if (dictIsOpen(d)) { \
+            unsigned long gmask = dictOpenGroupMask(ht), g = h & gmask; \
+            unsigned long probes; \
+            unsigned char tag = DICT_CTRL_TAG(h); \
+\
+            for (probes = 0; probes <= gmask; probes++) { \
+                const unsigned char *group = dictOpenGroup(ht->ctrl,g); \
+                unsigned int match = dictGroupMatch(group,tag); \
+\
+                while (match) { \
+                    dictEntry *he = ht->table[g*DICT_GROUP_SIZE + \
+                                              __builtin_ctz(match)]; \
+                    if (equalfn(key,(keytype)(uintptr_t)he->key)) return he; \
+                    match &= match - 1; \
+                } \
+                if (dictGroupHasEmpty(group)) break; \
+                g = (g + 1) & gmask; \
+            } \
+        } else { \
+            dictEntry *he = ht->table[h & ht->sizemask]; \
+\
+            while (he) { \
+                if (equalfn(key,(keytype)(uintptr_t)he->key)) return he; \
+                he = he->next; \
+            } \
+        } \
+        if (!dictIsRehashing(d)) break; \
+    } \
+    return NULL; \
+} \
+\
+static inline dictEntry *name##Find(dict *d, keytype key) { \
+    if (dictSize(d) == 0) return NULL; \
+    if (dictIsRehashing(d)) dictRehashStep(d); \
+    return name##FindWithHash(d,key,name##Hash(key)); \
+} \
+\
+static inline valtype name##GetVal(const dictEntry *de) { \
+    return de->v.field; \
+} \
+\
+static inline void name##SetVal(dictEntry *de, valtype val) { \
+    de->v.field = val; \
+} \
+\
+/* Store the value of 'key' in '*val' and return 1, or return 0 if the \
+ * key is not in the dict. */ \
+static inline int name##Fetch(dict *d, keytype key, valtype *val) { \
+    dictEntry *de = name##Find(d,key); \
+\
+    if (de == NULL) return 0; \
+    *val = de->v.field; \
+    return 1; \
+} \
+\
+static inline dictEntry *name##AddRaw(dict *d, keytype key, \
+                                      dictEntry **existing) \
+{ \
+    uint64_t h; \
+    dictEntry *de; \
+\
+    if (dictIsRehashing(d)) dictRehashStep(d); \
+    h = name##Hash(key); \
+    if ((de = name##FindWithHash(d,key,h)) != NULL) { \
+        if (existing) *existing = de; \
+        return NULL; \
+    } \
+    if (existing) *existing = NULL; \
+    return dictInsertWithHash(d,(void*)(uintptr_t)key,h); \
+} \
+\
+static inline int name##Add(dict *d, keytype key, valtype val) { \
+    dictEntry *de = name##AddRaw(d,key,NULL); \
+\
+    if (de == NULL) return DICT_ERR; \
+    de->v.field = val; \
+    return DICT_OK; \
+} \
+\
+static inline dictEntry *name##Unlink(dict *d, keytype key) { \
+    uint64_t h; \
+    dictEntry *de; \
+\
+    if (dictSize(d) == 0) return NULL; \
+    if (dictIsRehashing(d)) dictRehashStep(d); \
+    h = name##Hash(key); \
+    if ((de = name##FindWithHash(d,key,h)) == NULL) return NULL; \
+    return dictUnlinkEntry(d,de,h); \
+} \
+\
+static inline int name##Delete(dict *d, keytype key) { \
+    dictEntry *de = name##Unlink(d,key); \
+\
+    if (de == NULL) return DICT_ERR; \
+    dictFreeUnlinkedEntry(d,de); \
+    return DICT_OK; \
+}
+
+#endif /* __DICTTYPED_H */
@@ -0,0 +1,11 @@
+/* dsbench.h - Benchmarks of the core data structures, see dsbench.c for the
+ * details. */
+
+#ifndef __DSBENCH_H
+#define __DSBENCH_H
+
+#ifdef REDIS_TEST
+int dsbenchTest(int argc, char *argv[]);
+#endif
+
+#endif /* __DSBENCH_H */
@@ -0,0 +1,406 @@
+/* evictpool.c - Persistent pool of eviction candidates
+ *
+ * Approximated LRU and LFU eviction samples a few keys every time memory
+ * has to be freed, and evicts the best of the sample merged with the pool
+ * left by the previous evictions. With a large keyspace and a skewed access
+ * pattern most samples are made of keys that are not worth evicting, and
+ * every sample pays the cache misses of jumping to random buckets.
+ *
+ * An evictPool keeps, for a database, the best candidates found so far in
+ * a min heap ordered by score, so that a new sample only has to beat the
+ * weakest candidate to enter, and that work done by previous samples is
+ * never thrown away. The keyspace is sampled with dictSampleRun(), walking
+ * consecutive buckets: one run out of two continues a sweep of the whole
+ * table from where the previous one stopped, so that every key is
+ * eventually considered, and the other starts at a random bucket, so that
+ * the pool does not only reflect the region the sweep is crossing.
+ *
+ * Candidates are copies of the keys, not pointers to the entries, so the
+ * keyspace can change under the pool: evictPoolPop() looks the best
+ * candidate up again before returning it, drops it if it was deleted, and
+ * if the key was accessed and its score went down it puts it back in the
+ * heap with the new value and tries the next one. This way the pool is
+ * refined a little at every eviction, and evictPoolRefine() can also be
+ * called between evictions (for instance from the cron) to improve it when
+ * the server is idle.
+ *
+ * The score is computed by a callback, so that the same pool works for
+ * every policy and for both the keyspace and the expires dict. The pool
+ * also estimates how good its victims are: the precision of a victim is the
+ * fraction of the last sampled keys that had a lower score, and the average
+ * over all victims, together with the buckets visited per sampled key, is
+ * reported by evictPoolCatStats().
+ */
+
+#include "fmacros.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "evictpool.h"
+#include "zmalloc.h"
+
+/* Max number of entries sampled by a single run. */
+#define EVICTPOOL_MAX_RUN 64
+
+static long long evictPoolUstime(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv,NULL);
+    return ((long long)tv.tv_sec)*1000000+tv.tv_usec;
+}
+
+/* Create a pool keeping up to 'size' candidates, 0 for the default. */
+evictPool *evictPoolCreate(unsigned int size) {
+    evictPool *pool = zcalloc(sizeof(*pool));
+
+    if (size == 0) size = EVICTPOOL_DEFAULT_SIZE;
+    pool->size = size;
+    pool->heap = zmalloc(sizeof(evictPoolCandidate)*size);
+    pool->cursor = random();
+    return pool;
+}
+
+/* Forget every candidate, when the dict is emptied or swapped. The stats
+ * are kept. */
+void evictPoolClear(evictPool *pool) {
+    unsigned int j;
+
+    for (j = 0; j < pool->len; j++) sdsfree(pool->heap[j].key);
+    pool->len = 0;
+    pool->recent_len = pool->recent_idx = 0;
+}
+
+void evictPoolRelease(evictPool *pool) {
+    evictPoolClear(pool);
+    zfree(pool->heap);
+    zfree(pool);
+}
+
+/* ------------------------------- Heap ------------------------------------ */
+
+static void evictPoolSwap(evictPool *pool, unsigned int a, unsigned int b) {
+    evictPoolCandidate tmp = pool->heap[a];
+
+    pool->heap[a] = pool->heap[b];
+    pool->heap[b] = tmp;
+}
+
+static void evictPoolSiftUp(evictPool *pool, unsigned int i) {
+    while (i > 0) {
+        unsigned int parent = (i-1)/2;
+
+        if (pool->heap[parent].score <= pool->heap[i].score) break;
+        evictPoolSwap(pool,parent,i);
+        i = parent;
+    }
+}
+
+static void evictPoolSiftDown(evictPool *pool, unsigned int i) {
+    for (;;) {
+        unsigned int min = i, l = 2*i+1, r = 2*i+2;
+
+        if (l < pool->len && pool->heap[l].score < pool->heap[min].score)
+            min = l;
+        if (r < pool->len && pool->heap[r].score < pool->heap[min].score)
+            min = r;
+        if (min == i) break;
+        evictPoolSwap(pool,min,i);
+        i = min;
+    }
+}
+
+/* Restore the heap after the score of the candidate 'i' changed. */
+static void evictPoolFix(evictPool *pool, unsigned int i) {
+    evictPoolSiftUp(pool,i);
+    evictPoolSiftDown(pool,i);
+}
+
+static void evictPoolRemoveAt(evictPool *pool, unsigned int i) {
+    sdsfree(pool->heap[i].key);
+    pool->len--;
+    if (i == pool->len) return;
+    pool->heap[i] = pool->heap[pool->len];
+    evictPoolFix(pool,i);
+}
+
+/* The best candidate is one of the leaves of the min heap, the pool is
+ * small enough to just scan them. */
+// 最小堆中分数最高的一定是叶子节点
+static unsigned int evictPoolBest(evictPool *pool) {
+    unsigned int j, best = pool->len/2;
+
+    for (j = best+1; j < pool->len; j++)
+        if (pool->heap[j].score > pool->heap[best].score) best = j;
+    return best;
+}
+
+static int evictPoolLookup(evictPool *pool, sds key) {
+    size_t len = sdslen(key);
+    unsigned int j;
+
+    for (j = 0; j < pool->len; j++) {
+        sds k = pool->heap[j].key;
+        if (sdslen(k) == len && memcmp(k,key,len) == 0) return j;
+    }
+    return -1;
+}
+
+/* Offer 'key' as a candidate. Return 1 if it entered the pool. */
+static int evictPoolConsider(evictPool *pool, sds key,
+                             unsigned long long score)
+{
+    int j;
+
+    // 池子满了而且不比最弱的候选者好，直接丢弃，不需要查重
+    if (pool->len == pool->size && score <= pool->heap[0].score) return 0;
+
+    /* The same key can be sampled again by a sweep or a random run. */
+    if ((j = evictPoolLookup(pool,key)) != -1) {
+        pool->heap[j].score = score;
+        evictPoolFix(pool,j);
+        return 0;
+    }
+
+    if (pool->len < pool->size) {
+        pool->heap[pool->len].key = sdsdup(key);
+        pool->heap[pool->len].score = score;
+        evictPoolSiftUp(pool,pool->len++);
+    } else {
+        /* Replace the weakest candidate, reusing its buffer. */
+        pool->heap[0].key = sdscpylen(pool->heap[0].key,key,sdslen(key));
+        pool->heap[0].score = score;
+        evictPoolSiftDown(pool,0);
+    }
+    return 1;
+}
+
+/* ------------------------------- API ------------------------------------- */
+
+/* Sample a run of 'count' consecutive entries of 'd' and merge them into
+ * the pool. Return the number of entries sampled. */
+unsigned int evictPoolRefine(evictPool *pool, dict *d, unsigned int count,
+                             evictPoolScoreFunction *score, void *privdata)
+{
+    dictEntry *samples[EVICTPOOL_MAX_RUN];
+    unsigned long buckets = 0, cursor;
+    unsigned int n, j;
+    long long start = evictPoolUstime();
+
+    if (count > EVICTPOOL_MAX_RUN) count = EVICTPOOL_MAX_RUN;
+
+    // 奇数次从随机位置开始，偶数次接着上次的位置往后扫描
+    if (pool->stats.runs++ & 1) {
+        cursor = random();
+        n = dictSampleRun(d,&cursor,samples,count,&buckets);
+    } else {
+        n = dictSampleRun(d,&pool->cursor,samples,count,&buckets);
+    }
+
+    for (j = 0; j < n; j++) {
+        unsigned long long s = score(privdata,samples[j]);
+
+        pool->recent[pool->recent_idx] = s;
+        pool->recent_idx = (pool->recent_idx+1) % EVICTPOOL_RECENT;
+        if (pool->recent_len < EVICTPOOL_RECENT) pool->recent_len++;
+        pool->stats.inserted += evictPoolConsider(pool,dictGetKey(samples[j]),s);
+    }
+    pool->stats.buckets += buckets;
+    pool->stats.sampled += n;
+    pool->stats.sample_us += evictPoolUstime()-start;
+    return n;
+}
+
+/* Return the entry of 'd' of the best candidate, removing it from the pool,
+ * or NULL if the pool and the dict have nothing to offer. The caller is
+ * expected to delete the key right away. When 'count' is not zero a run of
+ * 'count' entries is sampled first with evictPoolRefine().
+ *
+ * The candidate is checked against the current state of the dict: deleted
+ * keys are dropped, and keys whose score went down since they were sampled
+ * go back to the heap with the new score. */
+dictEntry *evictPoolPop(evictPool *pool, dict *d, unsigned int count,
+                        evictPoolScoreFunction *score, void *privdata)
+{
+    if (count) evictPoolRefine(pool,d,count,score,privdata);
+
+    while (pool->len) {
+        unsigned int best = evictPoolBest(pool), j, lower = 0;
+        dictEntry *de = dictFind(d,pool->heap[best].key);
+        unsigned long long s;
+
+        if (de == NULL) {
+            pool->stats.stale++;
+            evictPoolRemoveAt(pool,best);
+            continue;
+        }
+        s = score(privdata,de);
+        if (s < pool->heap[best].score) {
+            // 被访问过了，更新分数后重新选择
+            pool->stats.rescored++;
+            pool->heap[best].score = s;
+            evictPoolFix(pool,best);
+            continue;
+        }
+
+        for (j = 0; j < pool->recent_len; j++)
+            if (pool->recent[j] < s) lower++;
+        pool->stats.precision_sum += pool->recent_len ?
+            (double)lower/pool->recent_len : 1;
+        pool->stats.victims++;
+        evictPoolRemoveAt(pool,best);
+        return de;
+    }
+    return NULL;
+}
+
+sds evictPoolCatStats(sds s, evictPool *pool) {
+    evictPoolStats *st = &pool->stats;
+
+    return sdscatprintf(s,
+        "evictpool_candidates:%u\r\n"
+        "evictpool_runs:%llu\r\n"
+        "evictpool_sampled_keys:%llu\r\n"
+        "evictpool_buckets_per_key:%.2f\r\n"
+        "evictpool_inserted:%llu\r\n"
+        "evictpool_rescored:%llu\r\n"
+        "evictpool_stale:%llu\r\n"
+        "evictpool_victims:%llu\r\n"
+        "evictpool_precision:%.3f\r\n"
+        "evictpool_sample_us_per_victim:%.2f\r\n",
+        pool->len, st->runs, st->sampled,
+        st->sampled ? (double)st->buckets/st->sampled : 0,
+        st->inserted, st->rescored, st->stale, st->victims,
+        st->victims ? st->precision_sum/st->victims : 0,
+        st->victims ? (double)st->sample_us/st->victims : 0);
+}
+
+#ifdef REDIS_TEST
+#include <assert.h>
+
+static uint64_t evictPoolTestHash(const void *key) {
+    return dictGenHashFunction(key,sdslen((sds)key));
+}
+
+static int evictPoolTestCompare(void *privdata, const void *key1,
+                                const void *key2)
+{
+    (void)privdata;
+    return sdslen((sds)key1) == sdslen((sds)key2) &&
+           memcmp(key1,key2,sdslen((sds)key1)) == 0;
+}
+
+static void evictPoolTestFree(void *privdata, void *key) {
+    (void)privdata;
+    sdsfree(key);
+}
+
+static dictType evictPoolTestDictType = {
+    evictPoolTestHash, NULL, NULL, evictPoolTestCompare,
+    evictPoolTestFree, NULL
+};
+
+/* The score of the test keys is their value. */
+static unsigned long long evictPoolTestScore(void *privdata, dictEntry *de) {
+    (void)privdata;
+    return dictGetUnsignedIntegerVal(de);
+}
+
+/* Fill a dict with 'count' keys having a distinct score in [0,count). */
+static dict *evictPoolTestDict(long count) {
+    dict *d = dictCreate(&evictPoolTestDictType,NULL);
+    long j;
+
+    for (j = 0; j < count; j++) {
+        dictEntry *de = dictAddRaw(d,sdsfromlonglong(j),NULL);
+        dictSetUnsignedIntegerVal(de,(j*7919)%count);
+    }
+    return d;
+}
+
+int evictPoolTest(int argc, char *argv[]) {
+    long count = 100000, evictions = 5000, j;
+    unsigned long long pool_sum = 0, sample_sum = 0;
+    evictPool *pool;
+    dict *d;
+    sds info;
+
+    (void)argc; (void)argv;
+
+    printf("Candidates are unique and the heap keeps the best ones: ");
+    d = evictPoolTestDict(1000);
+    pool = evictPoolCreate(16);
+    for (j = 0; j < 500; j++)
+        evictPoolRefine(pool,d,16,evictPoolTestScore,NULL);
+    assert(pool->len == 16);
+    for (j = 0; j < pool->len; j++) {
+        assert(evictPoolLookup(pool,pool->heap[j].key) == j);
+        /* After sweeping the dict several times the pool holds the top. */
+        assert(pool->heap[j].score >= 1000-16);
+        if (j) assert(pool->heap[(j-1)/2].score <= pool->heap[j].score);
+    }
+    printf("ok\n");
+
+    printf("Deleted and accessed candidates are not returned: ");
+    sds best = NULL;
+    for (j = 0; j < pool->len; j++)
+        if (pool->heap[j].score == 999) best = sdsdup(pool->heap[j].key);
+    assert(best != NULL);
+    for (j = 0; j < pool->len; j++) {
+        if (pool->heap[j].score == 998) {
+            /* Accessed: its score dropped. */
+            dictSetUnsignedIntegerVal(dictFind(d,pool->heap[j].key),1);
+        }
+    }
+    dictDelete(d,best);
+    dictEntry *de = evictPoolPop(pool,d,0,evictPoolTestScore,NULL);
+    assert(de && dictGetUnsignedIntegerVal(de) == 997);
+    assert(pool->stats.stale == 1 && pool->stats.rescored == 1);
+    sdsfree(best);
+    evictPoolClear(pool);
+    assert(evictPoolPop(pool,d,0,evictPoolTestScore,NULL) == NULL);
+    evictPoolRelease(pool);
+    dictRelease(d);
+    printf("ok\n");
+
+    /* Evict the best key of 16 sampled at random every time, like a pool
+     * that forgets everything between evictions, and compare the average
+     * score of the victims with the persistent pool. */
+    printf("Victims of the persistent pool are better than random samples: ");
+    d = evictPoolTestDict(count);
+    for (j = 0; j < evictions; j++) {
+        dictEntry *samples[16], *victim = NULL;
+        unsigned int n = dictGetSomeKeys(d,samples,16), k;
+
+        for (k = 0; k < n; k++)
+            if (!victim || dictGetUnsignedIntegerVal(samples[k]) >
+                           dictGetUnsignedIntegerVal(victim))
+                victim = samples[k];
+        sample_sum += dictGetUnsignedIntegerVal(victim);
+        dictDelete(d,dictGetKey(victim));
+    }
+    dictRelease(d);
+
+    d = evictPoolTestDict(count);
+    pool = evictPoolCreate(0);
+    for (j = 0; j < evictions; j++) {
+        de = evictPoolPop(pool,d,16,evictPoolTestScore,NULL);
+        assert(de != NULL);
+        pool_sum += dictGetUnsignedIntegerVal(de);
+        dictDelete(d,dictGetKey(de));
+    }
+    assert(pool_sum > sample_sum);
+    assert(pool->stats.precision_sum/pool->stats.victims > 0.9);
+    printf("ok (average victim %.0f vs %.0f of %ld)\n",
+        (double)pool_sum/evictions, (double)sample_sum/evictions, count);
+
+    info = evictPoolCatStats(sdsempty(),pool);
+    printf("%s", info);
+    sdsfree(info);
+    evictPoolRelease(pool);
+    dictRelease(d);
+    return 0;
+}
+#endif
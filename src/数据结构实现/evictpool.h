@@ -0,0 +1,66 @@
+/* evictpool.h - Persistent pool of eviction candidates, see evictpool.c for
+ * the details. */
+
+#ifndef __EVICTPOOL_H
+#define __EVICTPOOL_H
+
+#include "dict.h"
+#include "sds.h"
+
+/* Default number of candidates kept by a pool. */
+// 候选池默认能容纳的 key的个数
+#define EVICTPOOL_DEFAULT_SIZE 64
+
+/* Scores of the last sampled keys remembered to estimate the precision. */
+#define EVICTPOOL_RECENT 128
+
+/* Score of the key of 'de', an entry of the sampled dict: the higher the
+ * score, the better the key is as a victim (idle time for LRU, 255 minus
+ * the frequency for LFU, and so forth). */
+typedef unsigned long long evictPoolScoreFunction(void *privdata,
+                                                  dictEntry *de);
+
+typedef struct evictPoolCandidate {
+    unsigned long long score;   /* Score when the key was last checked. */
+    sds key;                    /* Copy of the key, owned by the pool. */
+} evictPoolCandidate;
+
+/* Counters of a pool. The precision of a victim is the fraction of the
+ * recently sampled keys with a lower score, 1 meaning it was the best key
+ * the pool could have found. 'buckets' is the cost of the sampling. */
+typedef struct evictPoolStats {
+    unsigned long long runs;        /* Calls of evictPoolRefine(). */
+    unsigned long long buckets;     /* Buckets visited while sampling. */
+    unsigned long long sampled;     /* Keys scored while sampling. */
+    unsigned long long inserted;    /* Keys that became candidates. */
+    unsigned long long rescored;    /* Candidates whose score went down. */
+    unsigned long long stale;       /* Candidates found deleted. */
+    unsigned long long victims;     /* Keys returned by evictPoolPop(). */
+    double precision_sum;           /* Sum of the precision of victims. */
+    long long sample_us;            /* Time spent sampling. */
+} evictPoolStats;
+
+typedef struct evictPool {
+    evictPoolCandidate *heap;   /* Min heap by score, the root is the
+                                   weakest candidate. */
+    unsigned int len, size;
+    unsigned long cursor;       /* Where the next sweep run starts. */
+    unsigned long long recent[EVICTPOOL_RECENT];
+    unsigned int recent_len, recent_idx;
+    evictPoolStats stats;
+} evictPool;
+
+evictPool *evictPoolCreate(unsigned int size);
+void evictPoolRelease(evictPool *pool);
+void evictPoolClear(evictPool *pool);
+unsigned int evictPoolRefine(evictPool *pool, dict *d, unsigned int count,
+                             evictPoolScoreFunction *score, void *privdata);
+dictEntry *evictPoolPop(evictPool *pool, dict *d, unsigned int count,
+                        evictPoolScoreFunction *score, void *privdata);
+sds evictPoolCatStats(sds s, evictPool *pool);
+
+#ifdef REDIS_TEST
+int evictPoolTest(int argc, char *argv[]);
+#endif
+
+#endif /* __EVICTPOOL_H */
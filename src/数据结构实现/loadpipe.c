@@ -0,0 +1,529 @@
+/* loadpipe.c - Multi threaded pipeline to load the keyspace
+ *
+ * Loading a dataset is made of three kinds of work: parsing the input,
+ * building the in memory encoding of every value (creating the skiplist
+ * of a sorted set, the quicklist of a list, encoding strings, ...) and
+ * adding the keys to the keyspace. Only the last one needs the main thread:
+ * building the values is pure CPU work on data nobody else can see yet.
+ *
+ * This file runs the three as a pipeline: a reader thread parses the keys
+ * with the 'read' callback, a pool of worker threads builds the values with
+ * the 'build' callback, and the thread calling loadPipeRun() inserts them
+ * with the 'insert' callback. The stages are connected by bounded queues,
+ * so memory does not grow when a stage is slower than the previous one, and
+ * jobs move between them in batches to keep the locking cheap.
+ *
+ * Keys are inserted in the order the workers finish them, not in the order
+ * of the input, which does not matter for the keyspace.
+ *
+ * Every stage measures the time it spends working and waiting: at the end
+ * the pipeline logs the throughput of each stage and which one was the
+ * bottleneck, that is the one that was busy for the largest share of the
+ * time. The same numbers are available to INFO with loadPipeCatStats().
+ */
+
+#include "server.h"
+#include "loadpipe.h"
+
+/* Jobs moved with a single queue operation by the reader and the workers. */
+#define LOADPIPE_BATCH 16
+
+// 有界的任务队列，环形数组实现
+typedef struct loadQueue {
+    pthread_mutex_t lock;
+    pthread_cond_t notempty, notfull;
+    loadJob *jobs[LOADPIPE_QUEUE_LEN];
+    int head;           /* Index of the oldest job. */
+    int len;            /* Jobs in the queue. */
+    int closed;         /* No job will be pushed anymore. */
+} loadQueue;
+
+typedef struct loadPipe {
+    loadPipeType *type;
+    void *privdata;
+    int error;          /* Set by the first failing stage, read atomically. */
+    int active;         /* Workers still running, protected by built.lock. */
+    loadQueue parsed;   /* Reader to workers. */
+    loadQueue built;    /* Workers to the insert stage. */
+    pthread_mutex_t statslock;
+    loadPipeStats stats;
+} loadPipe;
+
+static void loadQueueInit(loadQueue *q) {
+    pthread_mutex_init(&q->lock,NULL);
+    pthread_cond_init(&q->notempty,NULL);
+    pthread_cond_init(&q->notfull,NULL);
+    q->head = q->len = q->closed = 0;
+}
+
+static void loadQueueRelease(loadQueue *q) {
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->notempty);
+    pthread_cond_destroy(&q->notfull);
+}
+
+/* Append 'count' jobs, blocking while the queue is full. Returns the time
+ * spent blocked in microseconds. */
+static long long loadQueuePush(loadQueue *q, loadJob **jobs, int count) {
+    long long waited = 0;
+    int j;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->len+count > LOADPIPE_QUEUE_LEN) {
+        long long start = ustime();
+        while (q->len+count > LOADPIPE_QUEUE_LEN)
+            pthread_cond_wait(&q->notfull,&q->lock);
+        waited = ustime()-start;
+    }
+    for (j = 0; j < count; j++)
+        q->jobs[(q->head+q->len+j) % LOADPIPE_QUEUE_LEN] = jobs[j];
+    q->len += count;
+    pthread_cond_signal(&q->notempty);
+    pthread_mutex_unlock(&q->lock);
+    return waited;
+}
+
+/* Take up to 'max' jobs, blocking while the queue is empty and still open.
+ * Returns the number of jobs taken, 0 once the queue is closed and empty,
+ * and adds the time spent blocked to '*waited'. */
+static int loadQueuePop(loadQueue *q, loadJob **jobs, int max, long long *waited) {
+    int count = 0;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->len == 0 && !q->closed) {
+        long long start = ustime();
+        while (q->len == 0 && !q->closed)
+            pthread_cond_wait(&q->notempty,&q->lock);
+        *waited += ustime()-start;
+    }
+    while (count < max && q->len) {
+        jobs[count++] = q->jobs[q->head];
+        q->head = (q->head+1) % LOADPIPE_QUEUE_LEN;
+        q->len--;
+    }
+    pthread_cond_broadcast(&q->notfull);
+    /* More jobs are left for the other consumers. */
+    if (q->len) pthread_cond_signal(&q->notempty);
+    pthread_mutex_unlock(&q->lock);
+    return count;
+}
+
+static void loadQueueClose(loadQueue *q) {
+    pthread_mutex_lock(&q->lock);
+    q->closed = 1;
+    pthread_cond_broadcast(&q->notempty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static int loadPipeFailed(loadPipe *lp) {
+    return __atomic_load_n(&lp->error,__ATOMIC_RELAXED);
+}
+
+static void loadPipeSetFailed(loadPipe *lp) {
+    __atomic_store_n(&lp->error,1,__ATOMIC_RELAXED);
+}
+
+/* Release a job that is not going to be inserted. */
+// 出错后丢弃还没有插入的任务
+static void loadJobDrop(loadPipe *lp, loadJob *job) {
+    if (job->val)
+        decrRefCount(job->val);
+    else if (job->payload && lp->type->freePayload)
+        lp->type->freePayload(job->payload);
+    sdsfree(job->key);
+    zfree(job);
+}
+
+/* Read the next job, returns NULL at the end of the input or on errors. */
+static loadJob *loadPipeReadJob(loadPipe *lp, loadStageStats *stats) {
+    loadJob *job = zcalloc(sizeof(*job));
+    long long start = ustime();
+    int ret;
+
+    job->expiretime = -1;
+    ret = lp->type->read(lp->privdata,job);
+    stats->busy_us += ustime()-start;
+    if (ret != 1) {
+        if (ret < 0) loadPipeSetFailed(lp);
+        sdsfree(job->key);
+        zfree(job);
+        return NULL;
+    }
+    stats->jobs++;
+    stats->bytes += job->bytes;
+    return job;
+}
+
+/* Build the value of 'job', returns 0 on errors. */
+static int loadPipeBuildJob(loadPipe *lp, loadJob *job, loadStageStats *stats) {
+    long long start = ustime();
+
+    job->val = lp->type->build(lp->privdata,job);
+    job->payload = NULL;
+    stats->busy_us += ustime()-start;
+    if (job->val == NULL) {
+        loadPipeSetFailed(lp);
+        return 0;
+    }
+    stats->jobs++;
+    stats->bytes += job->bytes;
+    return 1;
+}
+
+static void loadPipeInsertJob(loadPipe *lp, loadJob *job, loadStageStats *stats) {
+    long long start = ustime();
+    size_t bytes = job->bytes;
+
+    lp->type->insert(lp->privdata,job);
+    zfree(job);
+    stats->busy_us += ustime()-start;
+    stats->jobs++;
+    stats->bytes += bytes;
+}
+
+static void *loadPipeReaderMain(void *arg) {
+    loadPipe *lp = arg;
+    loadJob *batch[LOADPIPE_BATCH], *job;
+    loadStageStats stats = {0,0,0,0};
+    int count = 0;
+
+    while (!loadPipeFailed(lp) && (job = loadPipeReadJob(lp,&stats)) != NULL) {
+        batch[count++] = job;
+        if (count == LOADPIPE_BATCH) {
+            stats.wait_us += loadQueuePush(&lp->parsed,batch,count);
+            count = 0;
+        }
+    }
+    if (count) stats.wait_us += loadQueuePush(&lp->parsed,batch,count);
+    loadQueueClose(&lp->parsed);
+    slabThreadFlush();
+    lp->stats.read = stats;
+    return NULL;
+}
+
+static void *loadPipeWorkerMain(void *arg) {
+    loadPipe *lp = arg;
+    loadJob *batch[LOADPIPE_BATCH];
+    loadStageStats stats = {0,0,0,0};
+    int count, built, j;
+
+    while ((count = loadQueuePop(&lp->parsed,batch,LOADPIPE_BATCH,
+                                 &stats.wait_us)) > 0)
+    {
+        for (j = 0, built = 0; j < count; j++) {
+            if (!loadPipeFailed(lp) && loadPipeBuildJob(lp,batch[j],&stats))
+                batch[built++] = batch[j];
+            else
+                loadJobDrop(lp,batch[j]);
+        }
+        if (built) stats.wait_us += loadQueuePush(&lp->built,batch,built);
+    }
+
+    /* The blocks of the values we built stay in use after we exit. */
+    slabThreadFlush();
+    pthread_mutex_lock(&lp->statslock);
+    lp->stats.build.jobs += stats.jobs;
+    lp->stats.build.bytes += stats.bytes;
+    lp->stats.build.busy_us += stats.busy_us;
+    lp->stats.build.wait_us += stats.wait_us;
+    pthread_mutex_unlock(&lp->statslock);
+
+    // 最后一个退出的工作线程关闭输出队列
+    pthread_mutex_lock(&lp->built.lock);
+    if (--lp->active == 0) {
+        lp->built.closed = 1;
+        pthread_cond_broadcast(&lp->built.notempty);
+    }
+    pthread_mutex_unlock(&lp->built.lock);
+    return NULL;
+}
+
+/* Run every stage in the calling thread, used when there are no workers. */
+static void loadPipeRunInline(loadPipe *lp) {
+    loadJob *job;
+
+    while (!loadPipeFailed(lp) && (job = loadPipeReadJob(lp,&lp->stats.read))) {
+        if (loadPipeBuildJob(lp,job,&lp->stats.build))
+            loadPipeInsertJob(lp,job,&lp->stats.insert);
+        else
+            loadJobDrop(lp,job);
+    }
+}
+
+/* Load the keys produced by the 'read' callback of 'type' using a reader
+ * thread and 'workers' threads to build the values, or just the calling
+ * thread if 'workers' is zero. Returns C_OK, or C_ERR if a callback failed,
+ * in which case the keys not inserted yet are released and the remaining
+ * input is not read. If 'stats' is not NULL it is filled with the work done
+ * by every stage. */
+// 多线程加载：一个读取线程，workers个构建线程，调用者所在的线程负责插入
+int loadPipeRun(loadPipeType *type, void *privdata, int workers, loadPipeStats *stats) {
+    pthread_t reader, threads[LOADPIPE_MAX_WORKERS];
+    loadPipe lp;
+    long long start = ustime();
+    int j;
+
+    if (workers < 0) workers = 0;
+    if (workers > LOADPIPE_MAX_WORKERS) workers = LOADPIPE_MAX_WORKERS;
+    memset(&lp,0,sizeof(lp));
+    lp.type = type;
+    lp.privdata = privdata;
+    lp.stats.workers = workers;
+
+    if (workers == 0) {
+        loadPipeRunInline(&lp);
+    } else {
+        loadJob *batch[LOADPIPE_INSERT_BATCH];
+        int count;
+
+        loadQueueInit(&lp.parsed);
+        loadQueueInit(&lp.built);
+        pthread_mutex_init(&lp.statslock,NULL);
+        lp.active = workers;
+        if (pthread_create(&reader,NULL,loadPipeReaderMain,&lp) != 0)
+            serverPanic("Can't create the loading reader thread");
+        for (j = 0; j < workers; j++) {
+            if (pthread_create(&threads[j],NULL,loadPipeWorkerMain,&lp) != 0)
+                serverPanic("Can't create the loading worker threads");
+        }
+
+        /* After an error we keep consuming the queue, so that no stage
+         * blocks, but drop the jobs. */
+        while ((count = loadQueuePop(&lp.built,batch,LOADPIPE_INSERT_BATCH,
+                                     &lp.stats.insert.wait_us)) > 0)
+        {
+            for (j = 0; j < count; j++) {
+                if (loadPipeFailed(&lp))
+                    loadJobDrop(&lp,batch[j]);
+                else
+                    loadPipeInsertJob(&lp,batch[j],&lp.stats.insert);
+            }
+        }
+
+        pthread_join(reader,NULL);
+        for (j = 0; j < workers; j++) pthread_join(threads[j],NULL);
+        loadQueueRelease(&lp.parsed);
+        loadQueueRelease(&lp.built);
+        pthread_mutex_destroy(&lp.statslock);
+    }
+
+    lp.stats.elapsed_us = ustime()-start;
+    if (lp.stats.read.jobs) {
+        sds info = loadPipeCatStats(sdsempty(),&lp.stats);
+        char *p;
+
+        /* Log the stats on a single line. */
+        for (p = info; *p; p++) if (*p == '\r' || *p == '\n') *p = ' ';
+        serverLog(LL_NOTICE,"Loading pipeline stats: %s",info);
+        sdsfree(info);
+    }
+    if (stats) *stats = lp.stats;
+    return lp.error ? C_ERR : C_OK;
+}
+
+/* Share of the elapsed time the threads of a stage spent in the callbacks. */
+static double loadStageUtilization(loadStageStats *stage, int threads,
+                                   long long elapsed_us)
+{
+    if (elapsed_us <= 0 || threads <= 0) return 0;
+    return (double)stage->busy_us / ((double)elapsed_us*threads);
+}
+
+/* Keys per second a stage would process if it never waited. */
+static double loadStageThroughput(loadStageStats *stage, int threads) {
+    if (stage->busy_us <= 0) return 0;
+    return (double)stage->jobs * 1000000 * (threads ? threads : 1) /
+           stage->busy_us;
+}
+
+/* Append the stats of a pipeline to 's' in the INFO format. */
+sds loadPipeCatStats(sds s, loadPipeStats *stats) {
+    struct {
+        const char *name;
+        loadStageStats *stage;
+        int threads;
+    } stages[] = {
+        {"read", &stats->read, 1},
+        {"build", &stats->build, stats->workers ? stats->workers : 1},
+        {"insert", &stats->insert, 1}
+    };
+    const char *bottleneck = "none";
+    double max = 0;
+    int j;
+
+    s = sdscatprintf(s,
+        "load_pipe_workers:%d\r\n"
+        "load_pipe_keys:%llu\r\n"
+        "load_pipe_elapsed_ms:%lld\r\n",
+        stats->workers, stats->insert.jobs, stats->elapsed_us/1000);
+    for (j = 0; j < 3; j++) {
+        double util = loadStageUtilization(stages[j].stage,stages[j].threads,
+                                           stats->elapsed_us);
+
+        s = sdscatprintf(s,
+            "load_pipe_%s_keys_per_sec:%.0f\r\n"
+            "load_pipe_%s_mb_per_sec:%.2f\r\n"
+            "load_pipe_%s_busy_ms:%lld\r\n"
+            "load_pipe_%s_wait_ms:%lld\r\n"
+            "load_pipe_%s_utilization:%.2f\r\n",
+            stages[j].name,
+            loadStageThroughput(stages[j].stage,stages[j].threads),
+            stages[j].name,
+            stages[j].stage->busy_us ? (double)stages[j].stage->bytes *
+                stages[j].threads / stages[j].stage->busy_us : 0,
+            stages[j].name, stages[j].stage->busy_us/1000,
+            stages[j].name, stages[j].stage->wait_us/1000,
+            stages[j].name, util);
+        if (util > max) {
+            max = util;
+            bottleneck = stages[j].name;
+        }
+    }
+    s = sdscatprintf(s,"load_pipe_bottleneck:%s\r\n",bottleneck);
+    return s;
+}
+
+#ifdef REDIS_TEST
+#include <assert.h>
+
+typedef struct loadTestInput {
+    long next, count, failat;
+    dict *keys;
+} loadTestInput;
+
+static int loadTestRead(void *privdata, loadJob *job) {
+    loadTestInput *in = privdata;
+    long id = in->next++;
+    sds *payload;
+    int j;
+
+    if (id == in->failat) return -1;
+    if (id >= in->count) return 0;
+    job->key = sdscatprintf(sdsempty(),"key:%ld",id);
+    /* A sorted set every 16 keys, the others are strings. */
+    payload = zmalloc(sizeof(sds)*2);
+    payload[0] = sdsfromlonglong(id);
+    payload[1] = (id % 16 == 0) ? sdsempty() : NULL;
+    if (payload[1]) {
+        for (j = 0; j < 150; j++)
+            payload[1] = sdscatprintf(payload[1],"%ld ",(id+j)%1000);
+    }
+    job->payload = payload;
+    job->bytes = sdslen(job->key) + sdslen(payload[0]) +
+                 (payload[1] ? sdslen(payload[1]) : 0);
+    return 1;
+}
+
+static void loadTestFreePayload(void *payload) {
+    sds *p = payload;
+
+    sdsfree(p[0]);
+    sdsfree(p[1]);
+    zfree(p);
+}
+
+static robj *loadTestBuild(void *privdata, loadJob *job) {
+    sds *p = job->payload;
+    robj *o;
+
+    UNUSED(privdata);
+    if (p[1] == NULL) {
+        o = tryObjectEncoding(createStringObject(p[0],sdslen(p[0])));
+    } else {
+        int count, j;
+        sds *members = sdssplitlen(p[1],sdslen(p[1])," ",1,&count);
+
+        o = createZsetZiplistObject();
+        for (j = 0; j < count; j++) {
+            int flags = ZADD_NONE;
+
+            if (sdslen(members[j]) == 0) continue;
+            zsetAdd(o,j,members[j],&flags,NULL);
+        }
+        sdsfreesplitres(members,count);
+    }
+    loadTestFreePayload(p);
+    return o;
+}
+
+static void loadTestInsert(void *privdata, loadJob *job) {
+    loadTestInput *in = privdata;
+
+    assert(dictAdd(in->keys,job->key,job->val) == DICT_OK);
+}
+
+static void loadTestRelease(void *privdata, void *val) {
+    UNUSED(privdata);
+    decrRefCount(val);
+}
+
+static uint64_t loadTestHash(const void *key) {
+    return dictGenHashFunction(key,sdslen((sds)key));
+}
+
+static int loadTestCompare(void *privdata, const void *key1, const void *key2) {
+    UNUSED(privdata);
+    return sdslen((sds)key1) == sdslen((sds)key2) &&
+           memcmp(key1,key2,sdslen((sds)key1)) == 0;
+}
+
+static void loadTestFreeKey(void *privdata, void *key) {
+    UNUSED(privdata);
+    sdsfree(key);
+}
+
+int loadPipeTest(int argc, char *argv[]) {
+    dictType keysType = {loadTestHash,NULL,NULL,loadTestCompare,
+                         loadTestFreeKey,loadTestRelease};
+    loadPipeType type = {loadTestRead,loadTestBuild,loadTestInsert,
+                         loadTestFreePayload};
+    int workers[] = {0, 1, 4}, j;
+    long count = 100000;
+
+    UNUSED(argc);
+    UNUSED(argv);
+
+    for (j = 0; j < 3; j++) {
+        loadTestInput in = {0, count, -1, dictCreate(&keysType,NULL)};
+        loadPipeStats stats;
+        sds info;
+        long id;
+
+        assert(loadPipeRun(&type,&in,workers[j],&stats) == C_OK);
+        assert(dictSize(in.keys) == (unsigned long)count);
+        assert(stats.read.jobs == (unsigned long long)count);
+        assert(stats.build.jobs == (unsigned long long)count);
+        assert(stats.insert.jobs == (unsigned long long)count);
+        for (id = 0; id < count; id += 997) {
+            sds key = sdscatprintf(sdsempty(),"key:%ld",id);
+            robj *o = dictFetchValue(in.keys,key);
+
+            assert(o != NULL);
+            if (id % 16 == 0) {
+                assert(o->type == OBJ_ZSET && zsetLength(o) == 150);
+            } else {
+                long long v;
+                assert(o->type == OBJ_STRING);
+                assert(getLongLongFromObject(o,&v) == C_OK && v == id);
+            }
+            sdsfree(key);
+        }
+        info = loadPipeCatStats(sdsempty(),&stats);
+        printf("Load %ld keys with %d workers: %lld usec\n%s",
+            count, workers[j], stats.elapsed_us, info);
+        sdsfree(info);
+        dictRelease(in.keys);
+    }
+
+    /* A failing reader stops the load, and nothing is leaked. */
+    for (j = 0; j < 3; j++) {
+        loadTestInput in = {0, count, 5000, dictCreate(&keysType,NULL)};
+
+        assert(loadPipeRun(&type,&in,workers[j],NULL) == C_ERR);
+        assert(dictSize(in.keys) <= 5000);
+        dictRelease(in.keys);
+    }
+    printf("Failing reader: ok\n");
+    return 0;
+}
+#endif
@@ -0,0 +1,68 @@
+/* loadpipe.h - Multi threaded pipeline to load the keyspace, see loadpipe.c
+ * for the details. */
+
+#ifndef __LOADPIPE_H
+#define __LOADPIPE_H
+
+#include <stddef.h>
+#include "sds.h"
+
+/* Max value of the 'workers' argument of loadPipeRun(). */
+#define LOADPIPE_MAX_WORKERS 32
+/* Jobs each queue can hold before the stage feeding it blocks. */
+// 每个队列最多保存的任务数，队列满了之后上一个阶段会阻塞
+#define LOADPIPE_QUEUE_LEN 4096
+/* Max jobs handed to the insert stage with a single queue operation. */
+#define LOADPIPE_INSERT_BATCH 256
+
+/* A key being loaded. The read stage fills everything but 'val', that is
+ * built from 'payload' by the build stage. */
+// 一个正在加载的键，读取阶段填写键和原始数据，构建阶段生成对象
+typedef struct loadJob {
+    sds key;
+    int dbid;
+    long long expiretime;       /* -1 if the key has no expire. */
+    void *payload;              /* What the reader parsed, for the builder. */
+    size_t bytes;               /* Input bytes of the job, for the stats. */
+    struct redisObject *val;
+} loadJob;
+
+/* The callbacks of a pipeline, all of them get the privdata passed to
+ * loadPipeRun(). 'read' runs in the reader thread and returns 1 after
+ * filling the job, 0 at the end of the input or -1 on errors. 'build' runs
+ * in the worker threads, owns the payload and returns the value or NULL
+ * on errors. 'insert' runs in the thread that called loadPipeRun() and
+ * takes the key and the value. 'freePayload' releases the payload of the
+ * jobs that are dropped after an error, and may be NULL. */
+// read在读取线程中执行，build在工作线程中执行，insert在主线程中执行
+typedef struct loadPipeType {
+    int (*read)(void *privdata, loadJob *job);
+    struct redisObject *(*build)(void *privdata, loadJob *job);
+    void (*insert)(void *privdata, loadJob *job);
+    void (*freePayload)(void *payload);
+} loadPipeType;
+
+/* Work done by a stage. 'busy' is the time spent in the callbacks, summed
+ * over the threads of the stage, and 'wait' the time its threads spent
+ * blocked on a full output queue or an empty input queue. */
+typedef struct loadStageStats {
+    unsigned long long jobs;
+    unsigned long long bytes;
+    long long busy_us;
+    long long wait_us;
+} loadStageStats;
+
+typedef struct loadPipeStats {
+    int workers;
+    long long elapsed_us;
+    loadStageStats read, build, insert;
+} loadPipeStats;
+
+int loadPipeRun(loadPipeType *type, void *privdata, int workers, loadPipeStats *stats);
+sds loadPipeCatStats(sds s, loadPipeStats *stats);
+
+#ifdef REDIS_TEST
+int loadPipeTest(int argc, char *argv[]);
+#endif
+
+#endif /* __LOADPIPE_H */
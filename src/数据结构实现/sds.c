@@ -54,6 +54,8 @@ static inline int sdsHdrSize(char type) {
             return sizeof(struct sdshdr32);
         case SDS_TYPE_64:
             return sizeof(struct sdshdr64);
+        case SDS_TYPE_SHARED:
+            return sizeof(struct sdshdrshared);
     }
     return 0;
 }
@@ -177,16 +179,89 @@ sds sdsnew(const char *init) {
     return sdsnewlen(init, initlen);
 }
 
-/* Duplicate an sds string. */
-// 复制已有的字符串
+/* Create a shared string holding 'initlen' bytes of 'init', like
+ * sdsnewlen() does. Shared strings are meant for large values that are
+ * duplicated often: sdsdup() and sdsshare() just take a new reference to
+ * them, and sdsfree() releases one. They are read only as long as there is
+ * more than one reference: the functions returning a new sds pointer first
+ * turn them into an owned copy with sdsMakeOwned(), while the ones changing
+ * the string in place must only be called when sdsrefcount() is 1.
+ *
+ * The references are counted with atomic operations, so they can be taken
+ * and released from different threads.
+ *
+ * They must not be used for the string values of the keyspace: the commands
+ * writing them in place only check the refcount of the robj, not of the sds. */
+// 创建一个带引用计数的共享字符串，多次 sdsdup()不会复制内容
+sds sdsnewshared(const void *init, size_t initlen) {
+    struct sdshdrshared *sh;
+
+    sh = s_malloc(sizeof(*sh)+initlen+1);
+    if (sh == NULL) return NULL;
+    if (init == SDS_NOINIT)
+        init = NULL;
+    else if (!init)
+        memset(sh->buf, 0, initlen);
+    sh->refcount = 1;
+    sh->len = initlen;
+    sh->flags = SDS_TYPE_SHARED;
+    if (initlen && init)
+        memcpy(sh->buf, init, initlen);
+    sh->buf[initlen] = '\0';
+    return sh->buf;
+}
+
+/* Return a shared string with the content of 's': a new reference if 's'
+ * is already shared, a shared copy otherwise. 's' is left untouched. */
+// 返回 s的共享版本，已经是共享字符串的话只增加引用计数
+sds sdsshare(sds s) {
+    if (sdsIsShared(s)) {
+        __atomic_add_fetch(&SDS_HDR(shared,s)->refcount, 1, __ATOMIC_RELAXED);
+        return s;
+    }
+    return sdsnewshared(s, sdslen(s));
+}
+
+/* Return the number of references to 's', that is always 1 for the strings
+ * that are not shared. */
+unsigned int sdsrefcount(const sds s) {
+    if (!sdsIsShared(s)) return 1;
+    return __atomic_load_n(&SDS_HDR(shared,s)->refcount, __ATOMIC_ACQUIRE);
+}
+
+/* Turn 's' into a string owned by the caller alone that can be modified:
+ * a shared string is copied and the reference to it released, the other
+ * strings are returned as they are.
+ *
+ * After the call, the passed sds string is no longer valid and all the
+ * references must be substituted with the new pointer returned by the call. */
+// 写时复制，把共享字符串复制成普通的 sds，并释放对原来字符串的引用
+sds sdsMakeOwned(sds s) {
+    sds owned;
+
+    if (!sdsIsShared(s)) return s;
+    owned = sdsnewlen(s, sdslen(s));
+    if (owned == NULL) return NULL;
+    sdsfree(s);
+    return owned;
+}
+
+/* Duplicate an sds string. Shared strings are not copied, a new reference
+ * is returned instead. */
+// 复制已有的字符串，共享字符串只增加引用计数
 sds sdsdup(const sds s) {
+    if (sdsIsShared(s)) return sdsshare(s);
     return sdsnewlen(s, sdslen(s));
 }
 
-/* Free an sds string. No operation is performed if 's' is NULL. */
+/* Free an sds string. No operation is performed if 's' is NULL. Shared
+ * strings are freed when their last reference is released. */
 // 释放 sds的内存空间
 void sdsfree(sds s) {
     if (s == NULL) return;
+    if (sdsIsShared(s) &&
+        __atomic_sub_fetch(&SDS_HDR(shared,s)->refcount, 1, __ATOMIC_ACQ_REL))
+        return;
     s_free((char*)s-sdsHdrSize(s[-1]));
 }
 
@@ -207,12 +282,15 @@ void sdsfree(sds s) {
 // 设置长度为到第一个 '\0'的字符串的长度，上面的例子就说明了
 void sdsupdatelen(sds s) {
     size_t reallen = strlen(s);
+
+    assert(sdsrefcount(s) == 1);
     sdssetlen(s, reallen);
 }
 
 
 // 清空 sds,只是惰性删除，并不会释放内存空间
 void sdsclear(sds s) {
+    assert(sdsrefcount(s) == 1);
     sdssetlen(s, 0);
     s[0] = '\0';
 }
@@ -226,6 +304,14 @@ sds sdsMakeRoomFor(sds s, size_t addlen) {
     char type, oldtype = s[-1] & SDS_TYPE_MASK;
     int hdrlen;
 
+    // 共享字符串没有空余空间，先复制成普通的 sds
+    if (oldtype == SDS_TYPE_SHARED) {
+        s = sdsMakeOwned(s);
+        if (s == NULL) return NULL;
+        avail = 0;
+        oldtype = s[-1] & SDS_TYPE_MASK;
+    }
+
     // 如果有足够的内存空间，就不需要扩容
     if (avail >= addlen) return s;
 
@@ -274,6 +360,9 @@ sds sdsRemoveFreeSpace(sds s) {
     char type, oldtype = s[-1] & SDS_TYPE_MASK;
     int hdrlen, oldhdrlen = sdsHdrSize(oldtype);
     size_t len = sdslen(s);
+
+    // 共享字符串本来就没有空余空间
+    if (oldtype == SDS_TYPE_SHARED) return s;
     
     // s变量所对应的结构体的首地址
     sh = (char*)s-oldhdrlen;
@@ -385,6 +474,14 @@ void sdsIncrLen(sds s, ssize_t incr) {
             len = (sh->len += incr);
             break;
         }
+        case SDS_TYPE_SHARED: {
+            /* No free space: the length can only be reduced, and only by
+             * the owner of the single reference. */
+            SDS_HDR_VAR(shared,s);
+            assert(incr <= 0 && sh->len >= (uint64_t)(-incr) && sh->refcount == 1);
+            len = (sh->len += incr);
+            break;
+        }
         // 其实这一步根本不会发生
         default: len = 0; /* Just to avoid compilation warnings. */
     }
@@ -400,6 +497,12 @@ void sdsIncrLen(sds s, ssize_t incr) {
 sds sdsgrowzero(sds s, size_t len) {
     size_t curlen = sdslen(s);
 
+    /* The caller is going to write into the string. */
+    // 调用方接下来会修改字符串，共享字符串需要先复制
+    if (sdsIsShared(s) && sdsrefcount(s) > 1) {
+        s = sdsMakeOwned(s);
+        if (s == NULL) return NULL;
+    }
     // 缩减是不可能的
     if (len <= curlen) return s;
     // 可能会涉及到扩容
@@ -447,6 +550,14 @@ sds sdscatsds(sds s, const sds t) {
  * safe string pointed by 't' of length 'len' bytes. */
 // 将 t字节数组 len个长度复制到 s
 sds sdscpylen(sds s, const char *t, size_t len) {
+    // 共享字符串的内容会被整个替换掉，不需要复制
+    /* 't' may point inside the shared buffer, so the new string is built
+     * before 's' is released. */
+    if (sdsIsShared(s)) {
+        sds copy = sdsnewlen(t,len);
+        sdsfree(s);
+        return copy;
+    }
     // 如果 s的内存不足，需要先扩容确保能够装下
     if (sdsalloc(s) < len) {
         s = sdsMakeRoomFor(s,len-sdslen(s));
@@ -471,64 +582,62 @@ sds sdscpy(sds s, const char *t) {
  * The function returns the length of the null-terminated string
  * representation stored at 's'. */
 #define SDS_LLSTR_SIZE 21
-// 将 long long型转换为字符型，拼接到 s后面，返回之后的长度
-int sdsll2str(char *s, long long value) {
-    char *p, aux;
-    unsigned long long v;
-    size_t l;
-
-    v = (value < 0) ? -value : value;
-    p = s;
-    do {
-        // 将数字转换为对应的字符，比如将 9转换为 '9'
-        *p++ = '0'+(v%10);
-        v /= 10;
-    } while(v);     // 此时转换后字符串和原来的数字相比是倒过来的
-    
-    // 如果是负数，前面的得加上负号 '-'
-    if (value < 0) *p++ = '-';
-
-    // 计算出转换后的字符串长度
-    l = p-s;
-    *p = '\0';
-
-    /* Reverse the string. */
-    // 反转字符串
-    p--;
-    while(s < p) {
-        aux = *s;
-        *s = *p;
-        *p = aux;
-        s++;
-        p--;
+/* "00" to "99": the numbers are formatted two digits at a time, that halves
+ * the divisions of the classic one digit loop. */
+// 两位两位地转换，除法的次数减半
+static const char sds_digits_pairs[201] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+/* Return the number of decimal digits of 'v'. */
+static int sdsDigits10(unsigned long long v) {
+    int len = 1;
+
+    for (;;) {
+        if (v < 10) return len;
+        if (v < 100) return len+1;
+        if (v < 1000) return len+2;
+        if (v < 10000) return len+3;
+        v /= 10000;
+        len += 4;
     }
-    return l;
 }
 
 /* Identical sdsll2str(), but for unsigned long long type. */
-// 同上，但是因为是无符号数，所以不需要考虑负号的问题，注释参考上面
+// 先算出位数，再从最后一位往前两位两位地写，不需要再反转字符串
 int sdsull2str(char *s, unsigned long long v) {
-    char *p, aux;
-    size_t l;
+    int len = sdsDigits10(v);
+    char *p = s+len;
 
-    p = s;
-    do {
-        *p++ = '0'+(v%10);
-        v /= 10;
-    } while(v);
-
-    l = p-s;
     *p = '\0';
+    while (v >= 100) {
+        int i = (v % 100) * 2;
 
-    p--;
-    while(s < p) {
-        aux = *s;
-        *s = *p;
-        *p = aux;
-        s++;
-        p--;
+        v /= 100;
+        *--p = sds_digits_pairs[i+1];
+        *--p = sds_digits_pairs[i];
     }
-    return l;
+    if (v < 10) {
+        *--p = '0'+v;
+    } else {
+        int i = v * 2;
+
+        *--p = sds_digits_pairs[i+1];
+        *--p = sds_digits_pairs[i];
+    }
+    return len;
+}
+
+// 将 long long型转换为字符型，拼接到 s后面，返回之后的长度
+int sdsll2str(char *s, long long value) {
+    if (value >= 0) return sdsull2str(s,value);
+
+    /* -(value+1)+1 does not overflow for LLONG_MIN. */
+    *s = '-';
+    return sdsull2str(s+1,(unsigned long long)(-(value+1))+1)+1;
 }
 
 /* Create an sds string from a long long value. It is much faster than:
@@ -735,13 +844,27 @@ sds sdscatfmt(sds s, char const *fmt, ...) {
 sds sdstrim(sds s, const char *cset) {
     char *start, *end, *sp, *ep;
     size_t len;
+    unsigned char trim[256];
+
+    if (sdsrefcount(s) > 1) {
+        s = sdsMakeOwned(s);
+        if (s == NULL) return NULL;
+    }
+
+    /* A table of the characters in 'cset', instead of one strchr() per
+     * character. strchr() also finds the terminator, so a null byte is
+     * always trimmed. */
+    // 用查表代替每个字符一次 strchr()
+    memset(trim,0,sizeof(trim));
+    trim[0] = 1;
+    while (*cset) trim[(unsigned char)*cset++] = 1;
 
     sp = start = s;
     ep = end = s+sdslen(s)-1;
     
     // 这两步循环结束保证剩余的字符是连续的
-    while(sp <= end && strchr(cset, *sp)) sp++;
-    while(ep > sp && strchr(cset, *ep)) ep--;
+    while(sp <= end && trim[(unsigned char)*sp]) sp++;
+    while(ep > sp && trim[(unsigned char)*ep]) ep--;
     
     // 计算剩余的字符串长度
     len = (sp > ep) ? 0 : ((ep-sp)+1);
@@ -774,6 +897,8 @@ sds sdstrim(sds s, const char *cset) {
 void sdsrange(sds s, ssize_t start, ssize_t end) {
     size_t newlen, len = sdslen(s);
 
+    assert(sdsrefcount(s) == 1);
+
     if (len == 0) return;
     // 倒数截取
     if (start < 0) {
@@ -807,18 +932,101 @@ void sdsrange(sds s, ssize_t start, ssize_t end) {
     sdssetlen(s,newlen);
 }
 
+/* Case folding kernels. They only change the ASCII letters, like tolower()
+ * and toupper() do in the C locale Redis runs with. The kernel is chosen at
+ * compile time from the instruction sets the compiler targets, and inlined
+ * into sdstolower() and sdstoupper(). */
+// 逐个字节转换的通用版本，用无符号比较代替两次比较
+static inline void sdsToLowerGeneric(char *s, size_t len) {
+    size_t j;
+
+    for (j = 0; j < len; j++)
+        if ((unsigned char)(s[j]-'A') < 26) s[j] |= 0x20;
+}
+
+static inline void sdsToUpperGeneric(char *s, size_t len) {
+    size_t j;
+
+    for (j = 0; j < len; j++)
+        if ((unsigned char)(s[j]-'a') < 26) s[j] &= ~0x20;
+}
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define SDS_CASE_KERNEL "sse2"
+
+/* Shift the letters range ['first','first'+26) to the bottom of the signed
+ * bytes, so that a single signed comparison finds them, then flip the case
+ * bit of the 16 bytes at once. */
+// 一次处理 16个字节，把字母区间平移到有符号数的最小值处，一次比较就能找出字母
+static inline void sdsFold(char *s, size_t len, char first, int lower) {
+    const __m128i shift = _mm_set1_epi8((char)(0x80-first));
+    const __m128i limit = _mm_set1_epi8((char)(0x80+26));
+    const __m128i bit = _mm_set1_epi8(0x20);
+    size_t j = 0;
+
+    for (; j+16 <= len; j += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(s+j));
+        __m128i m = _mm_cmplt_epi8(_mm_add_epi8(x,shift),limit);
+
+        m = _mm_and_si128(m,bit);
+        x = lower ? _mm_or_si128(x,m) : _mm_andnot_si128(m,x);
+        _mm_storeu_si128((__m128i*)(s+j),x);
+    }
+    if (lower) sdsToLowerGeneric(s+j,len-j);
+    else sdsToUpperGeneric(s+j,len-j);
+}
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define SDS_CASE_KERNEL "neon"
+
+static inline void sdsFold(char *s, size_t len, char first, int lower) {
+    const uint8x16_t base = vdupq_n_u8((uint8_t)first);
+    const uint8x16_t range = vdupq_n_u8(26);
+    const uint8x16_t bit = vdupq_n_u8(0x20);
+    size_t j = 0;
+
+    for (; j+16 <= len; j += 16) {
+        uint8x16_t x = vld1q_u8((const uint8_t*)(s+j));
+        uint8x16_t m = vandq_u8(vcltq_u8(vsubq_u8(x,base),range),bit);
+
+        x = lower ? vorrq_u8(x,m) : vbicq_u8(x,m);
+        vst1q_u8((uint8_t*)(s+j),x);
+    }
+    if (lower) sdsToLowerGeneric(s+j,len-j);
+    else sdsToUpperGeneric(s+j,len-j);
+}
+#endif
+
+#ifdef SDS_CASE_KERNEL
+static inline void sdsToLowerKernel(char *s, size_t len) {
+    sdsFold(s,len,'A',1);
+}
+
+static inline void sdsToUpperKernel(char *s, size_t len) {
+    sdsFold(s,len,'a',0);
+}
+#else
+#define SDS_CASE_KERNEL "generic"
+#define sdsToLowerKernel sdsToLowerGeneric
+#define sdsToUpperKernel sdsToUpperGeneric
+#endif
+
+// 返回编译时选择的大小写转换 kernel的名字
+const char *sdsGetCaseKernel(void) {
+    return SDS_CASE_KERNEL;
+}
+
 // 将所有字符小写化
 void sdstolower(sds s) {
-    size_t len = sdslen(s), j;
-
-    for (j = 0; j < len; j++) s[j] = tolower(s[j]);
+    assert(sdsrefcount(s) == 1);
+    sdsToLowerKernel(s,sdslen(s));
 }
 
 // 将所有字符大写化
 void sdstoupper(sds s) {
-    size_t len = sdslen(s), j;
-
-    for (j = 0; j < len; j++) s[j] = toupper(s[j]);
+    assert(sdsrefcount(s) == 1);
+    sdsToUpperKernel(s,sdslen(s));
 }
 
 /* 比较两个字符串的大小，按照字典序比较，如果 s1 > s2返回 1
@@ -874,9 +1082,22 @@ sds *sdssplitlen(const char *s, ssize_t len, const char *sep, int seplen, int *c
         *count = 0;
         return tokens;
     }
-    for (j = 0; j < (len-(seplen-1)); j++) {
+    /* Jump from a candidate to the next with memchr(), that compares many
+     * bytes at once, and only check the rest of the separator there. */
+    // 用 memchr()找分隔符的第一个字节，找到之后再比较剩下的部分
+    j = 0;
+    while (j < (len-(seplen-1))) {
+        const char *m = memchr(s+j,sep[0],(len-(seplen-1))-j);
+
+        if (m == NULL) break;
+        j = m-s;
+        if (seplen > 1 && memcmp(s+j+1,sep+1,seplen-1) != 0) {
+            j++;
+            continue;
+        }
+
         /* make sure there is room for the next element and the final one */
-        // 每次循环应该判断数组大小是否足够下一次分配和最终分配，不够的话就 2倍扩容 (2倍扩容是不是太大了？)
+        // 每次找到分隔符时判断数组大小是否足够下一次分配和最终分配，不够的话就 2倍扩容
         if (slots < elements+2) {
             sds *newtokens;
 
@@ -885,19 +1106,13 @@ sds *sdssplitlen(const char *s, ssize_t len, const char *sep, int seplen, int *c
             if (newtokens == NULL) goto cleanup;
             tokens = newtokens;
         }
-        
-        // (seplen == 1 && *(s+j) == sep[0] 这种情况可能更多，即只用一个字符分割
-        // 所以优先进行判断，从而利用短路跳过后面的情况判断，虽然可以直接都使用 memcmp(s+j,sep,seplen) == 0
-        // 进行判断，但是调用函数的开销是比较大的，涉及到上下文的保存，变量的进栈压栈
-        if ((seplen == 1 && *(s+j) == sep[0]) || (memcmp(s+j,sep,seplen) == 0)) {
-            tokens[elements] = sdsnewlen(s+start,j-start);
-            if (tokens[elements] == NULL) goto cleanup;
-            elements++;
-            // 分配成功就应该跳过 seplen这么长，下次比较的位置从 j + seplen开始
-            start = j+seplen;
-            // j也应该跳过，为什么是加上 seplen-1而不是 seplen？因为循环的时候还有 j++
-            j = j+seplen-1; /* skip the separator */
-        }
+
+        tokens[elements] = sdsnewlen(s+start,j-start);
+        if (tokens[elements] == NULL) goto cleanup;
+        elements++;
+        // 跳过分隔符，下次从 j + seplen开始查找
+        start = j+seplen;
+        j = start;
     }
     /* Add the final element. We are sure there is room in the tokens array. */
     tokens[elements] = sdsnewlen(s+start,len-start);
@@ -933,26 +1148,40 @@ void sdsfreesplitres(sds *tokens, int count) {
  * After the call, the modified sds string is no longer valid and all the
  * references must be substituted with the new pointer returned by the call. */
 sds sdscatrepr(sds s, const char *p, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+
     s = sdscatlen(s,"\"",1);
-    while(len--) {
+    while(len) {
+        /* Append the run of characters that need no escaping at once. */
+        // 不需要转义的连续字符一次追加
+        size_t run = 0;
+
+        while (run < len && p[run] >= ' ' && p[run] <= '~' &&
+               p[run] != '\\' && p[run] != '"') run++;
+        if (run) {
+            s = sdscatlen(s,p,run);
+            p += run;
+            len -= run;
+            if (len == 0) break;
+        }
+
         switch(*p) {
-        case '\\':
-        case '"':
-            s = sdscatprintf(s,"\\%c",*p);
-            break;
+        case '\\': s = sdscatlen(s,"\\\\",2); break;
+        case '"': s = sdscatlen(s,"\\\"",2); break;
         case '\n': s = sdscatlen(s,"\\n",2); break;
         case '\r': s = sdscatlen(s,"\\r",2); break;
         case '\t': s = sdscatlen(s,"\\t",2); break;
         case '\a': s = sdscatlen(s,"\\a",2); break;
         case '\b': s = sdscatlen(s,"\\b",2); break;
-        default:
-            if (isprint(*p))
-                s = sdscatprintf(s,"%c",*p);
-            else
-                s = sdscatprintf(s,"\\x%02x",(unsigned char)*p);
+        default: {
+            char esc[4] = {'\\','x',hex[(unsigned char)*p >> 4],
+                           hex[(unsigned char)*p & 0xf]};
+            s = sdscatlen(s,esc,4);
             break;
         }
+        }
         p++;
+        len--;
     }
     return sdscatlen(s,"\"",1);
 }
@@ -1022,6 +1251,16 @@ sds *sdssplitargs(const char *line, int *argc) {
 
             if (current == NULL) current = sdsempty();
             while(!done) {
+                /* Append the plain characters up to the next one that has
+                 * a meaning in the current state at once. */
+                // 没有特殊含义的连续字符一次追加
+                size_t run = strcspn(p, inq ? "\\\"" :
+                                        insq ? "\\'" : " \n\r\t\"'");
+                if (run) {
+                    current = sdscatlen(current,p,run);
+                    p += run;
+                    continue;
+                }
                 if (inq) {
                     if (*p == '\\' && *(p+1) == 'x' &&
                                              is_hex_digit(*(p+2)) &&
@@ -1127,6 +1366,24 @@ err:
 sds sdsmapchars(sds s, const char *from, const char *to, size_t setlen) {
     size_t j, i, l = sdslen(s);
 
+    if (sdsrefcount(s) > 1) {
+        s = sdsMakeOwned(s);
+        if (s == NULL) return NULL;
+    }
+
+    /* For long strings build a table of the substitutions once, filled
+     * backward so that the first occurrence in 'from' wins. */
+    // 字符串较长时先建一张映射表，每个字符只查一次表
+    if (l*setlen > 256) {
+        unsigned char map[256];
+
+        for (j = 0; j < 256; j++) map[j] = j;
+        for (i = setlen; i > 0; i--)
+            map[(unsigned char)from[i-1]] = to[i-1];
+        for (j = 0; j < l; j++) s[j] = map[(unsigned char)s[j]];
+        return s;
+    }
+
     for (j = 0; j < l; j++) {
         for (i = 0; i < setlen; i++) {
             if (s[j] == from[i]) {
@@ -1177,7 +1434,283 @@ void sds_free(void *ptr) { s_free(ptr); }
 #include "testhelp.h"
 #include "limits.h"
 
+#include <sys/time.h>
+
 #define UNUSED(x) (void)(x)
+
+static long long sdsTestUstime(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv,NULL);
+    return ((long long)tv.tv_sec)*1000000+tv.tv_usec;
+}
+
+/* The byte at a time versions the benchmarks compare with. */
+static int sdsll2strScalar(char *s, long long value) {
+    char *p, aux;
+    unsigned long long v;
+    size_t l;
+
+    v = (value < 0) ? -(unsigned long long)value : (unsigned long long)value;
+    p = s;
+    do {
+        *p++ = '0'+(v%10);
+        v /= 10;
+    } while(v);
+    if (value < 0) *p++ = '-';
+    l = p-s;
+    *p = '\0';
+    p--;
+    while(s < p) {
+        aux = *s;
+        *s = *p;
+        *p = aux;
+        s++;
+        p--;
+    }
+    return l;
+}
+
+static sds *sdssplitlenScalar(const char *s, ssize_t len, const char *sep, int seplen, int *count) {
+    int elements = 0, slots = 5;
+    long start = 0, j;
+    sds *tokens = s_malloc(sizeof(sds)*slots);
+
+    for (j = 0; j < (len-(seplen-1)); j++) {
+        if (slots < elements+2) {
+            slots *= 2;
+            tokens = s_realloc(tokens,sizeof(sds)*slots);
+        }
+        if ((seplen == 1 && *(s+j) == sep[0]) || (memcmp(s+j,sep,seplen) == 0)) {
+            tokens[elements] = sdsnewlen(s+start,j-start);
+            elements++;
+            start = j+seplen;
+            j = j+seplen-1;
+        }
+    }
+    tokens[elements] = sdsnewlen(s+start,len-start);
+    elements++;
+    *count = elements;
+    return tokens;
+}
+
+static sds sdscatreprScalar(sds s, const char *p, size_t len) {
+    s = sdscatlen(s,"\"",1);
+    while(len--) {
+        switch(*p) {
+        case '\\':
+        case '"':
+            s = sdscatprintf(s,"\\%c",*p);
+            break;
+        case '\n': s = sdscatlen(s,"\\n",2); break;
+        case '\r': s = sdscatlen(s,"\\r",2); break;
+        case '\t': s = sdscatlen(s,"\\t",2); break;
+        case '\a': s = sdscatlen(s,"\\a",2); break;
+        case '\b': s = sdscatlen(s,"\\b",2); break;
+        default:
+            if (isprint(*p))
+                s = sdscatprintf(s,"%c",*p);
+            else
+                s = sdscatprintf(s,"\\x%02x",(unsigned char)*p);
+            break;
+        }
+        p++;
+    }
+    return sdscatlen(s,"\"",1);
+}
+
+static void sdsMapCharsScalar(sds s, const char *from, const char *to, size_t setlen) {
+    size_t j, i, l = sdslen(s);
+
+    for (j = 0; j < l; j++) {
+        for (i = 0; i < setlen; i++) {
+            if (s[j] == from[i]) {
+                s[j] = to[i];
+                break;
+            }
+        }
+    }
+}
+
+/* Compare the vectorized and table driven primitives with the scalar ones,
+ * first for correctness and then for speed. */
+static void sdsBenchmark(void) {
+    char buf[SDS_LLSTR_SIZE], ref[SDS_LLSTR_SIZE];
+    long long start, vals[1000];
+    int j, k, ok, count;
+    sds x, y, z;
+
+    srand(1234);
+    for (j = 0; j < 1000; j++) {
+        vals[j] = ((long long)rand() << 32 | rand()) >> (rand() % 64);
+        if (j & 1) vals[j] = -vals[j];
+    }
+    vals[0] = LLONG_MIN;
+    vals[1] = LLONG_MAX;
+    vals[2] = 0;
+    ok = 1;
+    for (j = 0; j < 1000; j++) {
+        int l = sdsll2str(buf,vals[j]);
+        ok &= l == sdsll2strScalar(ref,vals[j]) && !strcmp(buf,ref);
+    }
+    test_cond("sdsll2str() matches the one digit at a time version", ok);
+    start = sdsTestUstime();
+    for (k = 0; k < 1000; k++)
+        for (j = 0; j < 1000; j++) sdsll2strScalar(buf,vals[j]);
+    printf("    1M sdsll2str(): one digit %lld usec, ",sdsTestUstime()-start);
+    start = sdsTestUstime();
+    for (k = 0; k < 1000; k++)
+        for (j = 0; j < 1000; j++) sdsll2str(buf,vals[j]);
+    printf("two digits %lld usec\n",sdsTestUstime()-start);
+
+    /* Case folding with the generic kernel and the one compiled in. */
+    x = sdsempty();
+    for (j = 0; j < 4099; j++) x = sdscatlen(x,(char[]){(char)(rand()&0xff)},1);
+    y = sdsdup(x);
+    for (j = 0; j < (int)sdslen(y); j++) y[j] = tolower((unsigned char)y[j]);
+    z = sdsdup(x);
+    for (j = 0; j < (int)sdslen(z); j++) z[j] = toupper((unsigned char)z[j]);
+    {
+        static const struct {
+            const char *name;
+            void (*lower)(char *s, size_t len);
+            void (*upper)(char *s, size_t len);
+        } kernels[] = {
+            {"generic",sdsToLowerGeneric,sdsToUpperGeneric},
+            {SDS_CASE_KERNEL,sdsToLowerKernel,sdsToUpperKernel}
+        };
+
+        for (j = 0; j < 2; j++) {
+            sds t = sdsdup(x);
+
+            kernels[j].lower(t,sdslen(t));
+            ok = !memcmp(t,y,sdslen(y));
+            sdsfree(t);
+            t = sdsdup(x);
+            kernels[j].upper(t,sdslen(t));
+            ok &= !memcmp(t,z,sdslen(z));
+            test_cond("Case folding kernel matches tolower() and toupper()", ok);
+            start = sdsTestUstime();
+            for (k = 0; k < 10000; k++) {
+                kernels[j].lower(t,sdslen(t));
+                kernels[j].upper(t,sdslen(t));
+            }
+            printf("    %s: 20000 folds of 4KB in %lld usec\n",
+                kernels[j].name,sdsTestUstime()-start);
+            sdsfree(t);
+        }
+    }
+
+    /* Splitting with one and many bytes separators. */
+    sdsclear(x);
+    for (j = 0; j < 20000; j++) {
+        x = sdscatlen(x,"abcdefghijklmnop",rand() % 16);
+        x = sdscat(x,(j % 3) ? "," : ",-,");
+    }
+    {
+        static const char *seps[] = {",", ",-,", NULL};
+        const char **sep;
+
+        for (sep = seps; *sep; sep++) {
+            sds *tokens, *reftokens;
+            int seplen = strlen(*sep), refcount;
+
+            tokens = sdssplitlen(x,sdslen(x),*sep,seplen,&count);
+            reftokens = sdssplitlenScalar(x,sdslen(x),*sep,seplen,&refcount);
+            ok = count == refcount;
+            for (j = 0; ok && j < count; j++)
+                ok = !sdscmp(tokens[j],reftokens[j]);
+            test_cond("sdssplitlen() matches the byte at a time scan", ok);
+            sdsfreesplitres(tokens,count);
+            sdsfreesplitres(reftokens,refcount);
+            start = sdsTestUstime();
+            for (k = 0; k < 20; k++) {
+                tokens = sdssplitlenScalar(x,sdslen(x),*sep,seplen,&count);
+                sdsfreesplitres(tokens,count);
+            }
+            printf("    20 splits of %zu bytes by \"%s\": byte scan %lld usec, ",
+                sdslen(x),*sep,sdsTestUstime()-start);
+            start = sdsTestUstime();
+            for (k = 0; k < 20; k++) {
+                tokens = sdssplitlen(x,sdslen(x),*sep,seplen,&count);
+                sdsfreesplitres(tokens,count);
+            }
+            printf("memchr %lld usec\n",sdsTestUstime()-start);
+        }
+    }
+
+    /* sdscatrepr() and sdssplitargs() are one the reverse of the other. */
+    sdsclear(x);
+    for (j = 0; j < 4000; j++) {
+        if (rand() % 8 == 0) x = sdscatlen(x,(char[]){(char)(rand()&0xff)},1);
+        else x = sdscatlen(x,"Hello World!",1+rand()%12);
+    }
+    sdsclear(y);
+    y = sdscatrepr(y,x,sdslen(x));
+    sdsfree(z);
+    z = sdscatreprScalar(sdsempty(),x,sdslen(x));
+    test_cond("sdscatrepr() matches the one byte at a time version",
+        sdslen(y) == sdslen(z) && !memcmp(y,z,sdslen(z)));
+    {
+        sds *argv = sdssplitargs(y,&count);
+
+        test_cond("sdssplitargs() parses back what sdscatrepr() emits",
+            argv && count == 1 && sdslen(argv[0]) == sdslen(x) &&
+            !memcmp(argv[0],x,sdslen(x)));
+        sdsfreesplitres(argv,count);
+    }
+    sdsfree(z);
+    start = sdsTestUstime();
+    for (k = 0; k < 100; k++) sdsfree(sdscatreprScalar(sdsempty(),x,sdslen(x)));
+    printf("    100 reprs of %zu bytes: byte at a time %lld usec, ",
+        sdslen(x),sdsTestUstime()-start);
+    start = sdsTestUstime();
+    for (k = 0; k < 100; k++) sdsfree(sdscatrepr(sdsempty(),x,sdslen(x)));
+    printf("runs %lld usec\n",sdsTestUstime()-start);
+    start = sdsTestUstime();
+    for (k = 0; k < 100; k++) {
+        sds *argv = sdssplitargs(y,&count);
+        sdsfreesplitres(argv,count);
+    }
+    printf("    100 sdssplitargs() of %zu bytes: %lld usec\n",
+        sdslen(y),sdsTestUstime()-start);
+
+    /* Mapping with a table. */
+    z = sdsdup(x);
+    sdsMapCharsScalar(z,"lo!","01.",3);
+    sdsmapchars(x,"lo!","01.",3);
+    test_cond("sdsmapchars() with a table matches the nested loops",
+        !memcmp(x,z,sdslen(z)));
+    start = sdsTestUstime();
+    for (k = 0; k < 1000; k++) sdsMapCharsScalar(z,"HWd.","hwD!",4);
+    printf("    1000 maps of %zu bytes: nested loops %lld usec, ",
+        sdslen(z),sdsTestUstime()-start);
+    start = sdsTestUstime();
+    for (k = 0; k < 1000; k++) sdsmapchars(x,"HWd.","hwD!",4);
+    printf("table %lld usec\n",sdsTestUstime()-start);
+
+    /* Fanning out a large value. */
+    {
+        sds big = sdsnewlen(NULL,1024*1024), shared = sdsnewshared(big,sdslen(big));
+        sds copies[100];
+
+        start = sdsTestUstime();
+        for (k = 0; k < 100; k++) copies[k] = sdsdup(big);
+        for (k = 0; k < 100; k++) sdsfree(copies[k]);
+        printf("    100 sdsdup() of 1MB: owned %lld usec, ",sdsTestUstime()-start);
+        start = sdsTestUstime();
+        for (k = 0; k < 100; k++) copies[k] = sdsdup(shared);
+        for (k = 0; k < 100; k++) sdsfree(copies[k]);
+        printf("shared %lld usec\n",sdsTestUstime()-start);
+        sdsfree(big);
+        sdsfree(shared);
+    }
+
+    sdsfree(x);
+    sdsfree(y);
+    sdsfree(z);
+}
+
 int sdsTest(void) {
     {
         sds x = sdsnew("foo"), y;
@@ -1336,6 +1869,49 @@ int sdsTest(void) {
 
             sdsfree(x);
         }
+
+        x = sdsnew(" \t --hello--\n ");
+        x = sdstrim(x," \t\n-");
+        test_cond("sdstrim() with the characters table",
+            sdslen(x) == 5 && memcmp(x,"hello\0",6) == 0)
+        sdsfree(x);
+
+        {
+            sds a = sdsnewshared("shared",6), b, c;
+
+            b = sdsdup(a);
+            test_cond("sdsdup() of a shared string takes a reference",
+                b == a && sdsrefcount(a) == 2 && sdslen(b) == 6 &&
+                sdsavail(a) == 0 && memcmp(b,"shared\0",7) == 0)
+            b = sdscat(b," copy");
+            test_cond("Appending to a shared string copies it first",
+                b != a && sdsrefcount(a) == 1 && !sdsIsShared(b) &&
+                memcmp(a,"shared\0",7) == 0 &&
+                memcmp(b,"shared copy\0",12) == 0)
+            c = sdsshare(b);
+            test_cond("sdsshare() of an owned string makes a shared copy",
+                c != b && sdsIsShared(c) && sdscmp(b,c) == 0)
+            c = sdsgrowzero(c,20);
+            test_cond("sdsgrowzero() turns a shared string into an owned one",
+                !sdsIsShared(c) && sdslen(c) == 20 && c[19] == '\0')
+            sdsfree(c);
+            c = sdsdup(a);
+            c = sdscpylen(c,"other",5);
+            test_cond("sdscpylen() over a shared string keeps the other reference",
+                sdsrefcount(a) == 1 && memcmp(a,"shared\0",7) == 0 &&
+                memcmp(c,"other\0",6) == 0)
+            sdsfree(a);
+            sdsfree(b);
+            sdsfree(c);
+
+            a = sdsnewshared("shared",6);
+            a = sdscpylen(a,a+2,4);
+            test_cond("sdscpylen() from the buffer of the last reference",
+                !sdsIsShared(a) && sdslen(a) == 4 && memcmp(a,"ared\0",5) == 0)
+            sdsfree(a);
+        }
+
+        sdsBenchmark();
     }
     test_report()
     return 0;
@@ -74,6 +74,16 @@ struct __attribute__ ((__packed__)) sdshdr64 {
     unsigned char flags;
     char buf[];
 };
+/* A shared string: read only and reference counted, so that sdsdup() just
+ * takes another reference, see sdsnewshared(). It has no free space, and is
+ * turned into an owned string of the other types by the first mutation. */
+// 共享字符串，只读并且带引用计数，sdsdup()只增加引用计数，第一次修改时才复制
+struct __attribute__ ((__packed__)) sdshdrshared {
+    uint32_t refcount;
+    uint64_t len;
+    unsigned char flags;
+    char buf[];
+};
 
 /*
 * 低三个字节表示类型
@@ -83,6 +93,7 @@ struct __attribute__ ((__packed__)) sdshdr64 {
 #define SDS_TYPE_16 2
 #define SDS_TYPE_32 3
 #define SDS_TYPE_64 4
+#define SDS_TYPE_SHARED 5
 
 #define SDS_TYPE_MASK 7
 #define SDS_TYPE_BITS 3
@@ -93,6 +104,7 @@ struct __attribute__ ((__packed__)) sdshdr64 {
 #define SDS_HDR(T,s) ((struct sdshdr##T *)((s)-(sizeof(struct sdshdr##T))))
 // 右移三位即可计算出大小，因为低三位存储标识符，高五位存储大小
 #define SDS_TYPE_5_LEN(f) ((f)>>SDS_TYPE_BITS)
+#define sdsIsShared(s) ((((const char*)(s))[-1]&SDS_TYPE_MASK) == SDS_TYPE_SHARED)
 
 // 获取已经使用的字节长度
 static inline size_t sdslen(const sds s) {
@@ -115,6 +127,8 @@ static inline size_t sdslen(const sds s) {
             return SDS_HDR(32,s)->len;
         case SDS_TYPE_64:
             return SDS_HDR(64,s)->len;
+        case SDS_TYPE_SHARED:
+            return SDS_HDR(shared,s)->len;
     }
     return 0;
 }
@@ -143,6 +157,8 @@ static inline size_t sdsavail(const sds s) {
             SDS_HDR_VAR(64,s);
             return sh->alloc - sh->len;
         }
+        case SDS_TYPE_SHARED:
+            return 0;
     }
     return 0;
 }
@@ -171,6 +187,9 @@ static inline void sdssetlen(sds s, size_t newlen) {
         case SDS_TYPE_64:
             SDS_HDR(64,s)->len = newlen;
             break;
+        case SDS_TYPE_SHARED:
+            SDS_HDR(shared,s)->len = newlen;
+            break;
     }
 }
 
@@ -198,6 +217,9 @@ static inline void sdsinclen(sds s, size_t inc) {
         case SDS_TYPE_64:
             SDS_HDR(64,s)->len += inc;
             break;
+        case SDS_TYPE_SHARED:
+            SDS_HDR(shared,s)->len += inc;
+            break;
     }
 }
 
@@ -216,6 +238,8 @@ static inline size_t sdsalloc(const sds s) {
             return SDS_HDR(32,s)->alloc;
         case SDS_TYPE_64:
             return SDS_HDR(64,s)->alloc;
+        case SDS_TYPE_SHARED:
+            return SDS_HDR(shared,s)->len;
     }
     return 0;
 }
@@ -239,6 +263,9 @@ static inline void sdssetalloc(sds s, size_t newlen) {
         case SDS_TYPE_64:
             SDS_HDR(64,s)->alloc = newlen;
             break;
+        case SDS_TYPE_SHARED:
+            /* Nothing to do, the allocation is always the length. */
+            break;
     }
 }
 
@@ -246,6 +273,10 @@ sds sdsnewlen(const void *init, size_t initlen);
 sds sdsnew(const char *init);
 sds sdsempty(void);
 sds sdsdup(const sds s);
+sds sdsnewshared(const void *init, size_t initlen);
+sds sdsshare(sds s);
+sds sdsMakeOwned(sds s);
+unsigned int sdsrefcount(const sds s);
 void sdsfree(sds s);
 sds sdsgrowzero(sds s, size_t len);
 sds sdscatlen(sds s, const void *t, size_t len);
@@ -272,6 +303,7 @@ sds *sdssplitlen(const char *s, ssize_t len, const char *sep, int seplen, int *c
 void sdsfreesplitres(sds *tokens, int count);
 void sdstolower(sds s);
 void sdstoupper(sds s);
+const char *sdsGetCaseKernel(void);
 sds sdsfromlonglong(long long value);
 sds sdscatrepr(sds s, const char *p, size_t len);
 sds *sdssplitargs(const char *line, int *argc);
@@ -286,6 +318,12 @@ sds sdsRemoveFreeSpace(sds s);
 size_t sdsAllocSize(sds s);
 void *sdsAllocPtr(sds s);
 
+/* sdsAllocSize() of an owned string, 0 for a shared one: the part of a
+ * shared string of each holder changes with its references, so a holder
+ * counting its memory as it goes can't charge it. */
+// 非共享字符串的分配大小，共享字符串返回 0
+#define sdsOwnedAllocSize(s) (sdsIsShared(s) ? 0 : sdsAllocSize(s))
+
 /* Export the allocator used by SDS to the program using SDS.
  * Sometimes the program SDS is linked to, may use a different set of
  * allocators, but may want to allocate or free things that SDS will
@@ -58,11 +58,18 @@ typedef long long mstime_t; /* millisecond time type. */
 #include "zmalloc.h" /* total memory usage aware version of malloc/free */
 #include "anet.h"    /* Networking the easy way */
 #include "ziplist.h" /* Compact list data structure */
+#include "listpack.h" /* Compact list without cascade updates */
 #include "intset.h"  /* Compact integer set structure */
+#include "roaring.h" /* Compressed integer set for large sets */
+#include "zbtree.h"  /* Order statistic B+tree for sorted sets */
 #include "version.h" /* Version macro */
 #include "util.h"    /* Misc functions useful in many places */
 #include "latency.h" /* Latency monitor API */
 #include "sparkline.h" /* ASCII graphs API */
+#include "slab.h"    /* Slab allocator for small structures */
+#include "bgfree.h"  /* Background free of large objects */
+#include "evictpool.h" /* Persistent pool of eviction candidates */
+#include "dsstats.h" /* Histograms of the data structures internals */
 #include "quicklist.h"  /* Lists are encoded as linked lists of
                            N-elements flat arrays */
 #include "rax.h"     /* Radix tree */
@@ -594,6 +601,9 @@ typedef struct RedisModuleDigest {
 #define OBJ_ENCODING_EMBSTR 8  /* Embedded sds string encoding */
 #define OBJ_ENCODING_QUICKLIST 9 /* Encoded as linked list of ziplists */
 #define OBJ_ENCODING_STREAM 10 /* Encoded as a radix tree of listpacks */
+#define OBJ_ENCODING_LISTPACK 11 /* Encoded as a listpack */
+#define OBJ_ENCODING_ROARING 12 /* Encoded as a roaring bitmap */
+#define OBJ_ENCODING_BTREE 13  /* Encoded as dict + order statistic B+tree */
 
 #define LRU_BITS 24
 #define LRU_CLOCK_MAX ((1<<LRU_BITS)-1) /* Max value of obj->lru */
@@ -794,11 +804,25 @@ struct sharedObjectsStruct {
 
 /* ZSETs use a specialized version of Skiplists */
 // 跳跃表的节点实现(如果对跳跃表不熟悉，可以先去网上熟悉一下跳跃表的基本概念和原理)
+#define ZSKIPLIST_ELE_PREFIX 7 /* Inline ele bytes in a skiplist node */
 typedef struct zskiplistNode {
-    // 存储的元素
-    sds ele;
     // 权值，排序使用
     double score;
+    /* Number of levels, to know the size of the slab block when the node
+     * is freed. It shares the word after the score with the prefix below:
+     * a node is 32 bytes plus its levels on 64 bit systems, 8 more than the
+     * ele, score and backward pointer alone, and since slab blocks are
+     * exact multiples of SLAB_ALIGN every node pays those 8 bytes. */
+    // 节点的层数，释放节点时用来计算节点的大小；和 prefix一起占用 score后面的一个字，
+    // 每个节点因此比只有 ele、score、backward时多 8个字节
+    unsigned char height;
+    /* The first bytes of ele, zero padded, stored in what would otherwise
+     * be padding: ties on the score are broken comparing the prefixes,
+     * and the sds is only dereferenced when they are the same. */
+    // ele的前 7个字节，分值相同时先比较前缀，不同时不用再去访问 sds
+    unsigned char prefix[ZSKIPLIST_ELE_PREFIX];
+    // 存储的元素
+    sds ele;
     // 后退指针，用于从表尾向表头遍历
     struct zskiplistNode *backward;
     // 柔性数组，动态扩展层级高度
@@ -810,6 +834,11 @@ typedef struct zskiplistNode {
     } level[];
 } zskiplistNode;
 
+/* Skiplist nodes come from the slab allocator, this is the size of the
+ * block of a node with 'level' levels. */
+#define zslNodeSize(level) \
+    (sizeof(zskiplistNode)+(level)*sizeof(struct zskiplistLevel))
+
 // 跳跃表的实现
 typedef struct zskiplist {
     struct zskiplistNode *header, *tail;
@@ -817,11 +846,36 @@ typedef struct zskiplist {
     unsigned long length;
     // 最大的层级
     int level;
+    // 跳表本身、所有节点以及非共享的元素 sds占用的内存
+    size_t bytes;   /* The skiplist, its nodes and their owned elements. */
 } zskiplist;
 
+/* State of a skiplist being bulk loaded from elements given in order, see
+ * zslBulkInit() in t_zset.c. */
+// 批量构建跳表：按顺序给出的元素直接链接到表尾（reverse时链接到表头），不需要查找
+typedef struct zslBulkBuilder {
+    zskiplist *zsl;
+    int reverse;        /* Elements are given from the greatest. */
+    /* For every level, the node linked last (the header, or NULL when
+     * reverse, before the first one) and its position counted from the
+     * start of the list, or from its end when reverse. */
+    // 每一层最近链接的节点以及它的位置，reverse时位置从表尾开始计算
+    struct zskiplistNode *edge[ZSKIPLIST_MAXLEVEL];
+    unsigned long pos[ZSKIPLIST_MAXLEVEL];
+    /* When reverse, the first node linked at every level, that is the
+     * last one of the level once the list is complete. */
+    struct zskiplistNode *far[ZSKIPLIST_MAXLEVEL];
+    unsigned long farpos[ZSKIPLIST_MAXLEVEL];
+} zslBulkBuilder;
+
+/* With OBJ_ENCODING_SKIPLIST the dict values point to the score inside the
+ * skiplist node, and zbt is NULL. With OBJ_ENCODING_BTREE zsl is NULL and
+ * the dict stores the score by value, since B+tree entries move. */
+// 跳表编码时字典的值指向跳表节点中的分值，B+树编码时字典直接保存分值
 typedef struct zset {
     dict *dict;
     zskiplist *zsl;
+    zbtree *zbt;
 } zset;
 
 typedef struct clientBufferLimitsConfig {
@@ -869,6 +923,9 @@ struct redisMemOverhead {
     size_t lua_caches;
     size_t overhead_total;
     size_t dataset;
+    size_t dataset_lists;           /* Part of the dataset held by lists. */
+    size_t dataset_zsets_skiplist;  /* By skiplist sorted sets. */
+    size_t dataset_zsets_btree;     /* By B+tree sorted sets. */
     size_t total_keys;
     size_t bytes_per_key;
     float dataset_perc;
@@ -887,6 +944,10 @@ struct redisMemOverhead {
         size_t overhead_ht_main;
         size_t overhead_ht_expires;
     } *db;
+    // slab分配器中没有被使用的内存，以及每个 pool的使用情况
+    size_t slab_free;
+    size_t num_slab_pools;
+    slabPoolStats slab_pools[SLAB_CLASSES];
 };
 
 /* This structure can be optionally passed to RDB save/load functions in
@@ -1214,6 +1275,7 @@ struct redisServer {
     size_t set_max_intset_entries;
     size_t zset_max_ziplist_entries;
     size_t zset_max_ziplist_value;
+    int zset_btree_encoding;    /* Convert large zsets to btree, not skiplist */
     size_t hll_sparse_max_bytes;
     size_t stream_node_max_bytes;
     int64_t stream_node_max_entries;
@@ -1536,6 +1598,9 @@ void freeListObject(robj *o);
 void freeSetObject(robj *o);
 void freeZsetObject(robj *o);
 void freeHashObject(robj *o);
+size_t objectFreeEffort(robj *o);
+#define OBJ_COMPUTE_SIZE_DEF_SAMPLES 5 /* Default sample size. */
+size_t objectComputeSize(robj *o, size_t sample_size);
 robj *createObject(int type, void *ptr);
 robj *createStringObject(const char *ptr, size_t len);
 robj *createRawStringObject(const char *ptr, size_t len);
@@ -1553,8 +1618,10 @@ robj *createQuicklistObject(void);
 robj *createZiplistObject(void);
 robj *createSetObject(void);
 robj *createIntsetObject(void);
+robj *createRoaringSetObject(void);
 robj *createHashObject(void);
 robj *createZsetObject(void);
+robj *createZsetBtreeObject(void);
 robj *createZsetZiplistObject(void);
 robj *createStreamObject(void);
 robj *createModuleObject(moduleType *mt, void *value);
@@ -1571,6 +1638,7 @@ int compareStringObjects(robj *a, robj *b);
 int collateStringObjects(robj *a, robj *b);
 int equalStringObjects(robj *a, robj *b);
 unsigned long long estimateObjectIdleTime(robj *o);
+unsigned long long objectEvictionScore(void *privdata, dictEntry *de);
 #define sdsEncodedObject(objptr) (objptr->encoding == OBJ_ENCODING_RAW || objptr->encoding == OBJ_ENCODING_EMBSTR)
 
 /* Synchronous I/O with timeout */
@@ -1620,6 +1688,15 @@ int writeCommandsDeniedByDiskError(void);
 
 /* RDB persistence */
 #include "rdb.h"
+
+/* Listpack based object types, numbered after the ones of rdb.h. Saved
+ * quicklists use RDB_TYPE_LIST_QUICKLIST_2, where every node is stored as
+ * a listpack: RDB_TYPE_LIST_QUICKLIST still means ziplist nodes, and is
+ * only loaded, through quicklistAppendZiplist(). rdbIsObjectType() has to
+ * accept both when rdb.h is updated. */
+// 列表和有序集合改用 listpack 后的 RDB 类型，旧的 ziplist 类型只用于加载
+#define RDB_TYPE_ZSET_LISTPACK 17
+#define RDB_TYPE_LIST_QUICKLIST_2 18
 int rdbSaveRio(rio *rdb, int *error, int flags, rdbSaveInfo *rsi);
 
 /* AOF persistence */
@@ -1671,9 +1748,24 @@ typedef struct {
     int minex, maxex; /* are min or max exclusive? */
 } zlexrangespec;
 
+/* The position of a paginated range: the last (score,ele) pair returned by
+ * the previous page, or ele set to NULL to start from the range bounds. */
+// 分页游标，记录上一页最后一个元素，ele为 NULL表示从头开始
+typedef struct {
+    double score;
+    sds ele;
+} zrangeCursor;
+
 zskiplist *zslCreate(void);
 void zslFree(zskiplist *zsl);
+size_t zslTotalBytes(void);
 zskiplistNode *zslInsert(zskiplist *zsl, double score, sds ele);
+void zslBulkInit(zslBulkBuilder *b, zskiplist *zsl, int reverse);
+zskiplistNode *zslBulkAdd(zslBulkBuilder *b, double score, sds ele);
+void zslBulkFinish(zslBulkBuilder *b);
+#ifdef REDIS_TEST
+int zslTest(int argc, char *argv[]);
+#endif
 unsigned char *zzlInsert(unsigned char *zl, sds ele, double score);
 int zslDelete(zskiplist *zsl, double score, sds ele, zskiplistNode **node);
 zskiplistNode *zslFirstInRange(zskiplist *zsl, zrangespec *range);
@@ -1684,15 +1776,18 @@ void zzlPrev(unsigned char *zl, unsigned char **eptr, unsigned char **sptr);
 unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range);
 unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range);
 unsigned long zsetLength(const robj *zobj);
+int zsetLargeEncoding(void);
 void zsetConvert(robj *zobj, int encoding);
 void zsetConvertToZiplistIfNeeded(robj *zobj, size_t maxelelen);
 int zsetScore(robj *zobj, sds member, double *score);
 unsigned long zslGetRank(zskiplist *zsl, double score, sds o);
+zskiplistNode *zslSeekAfter(zskiplist *zsl, double score, sds ele, int reverse);
+zskiplistNode *zslSkip(zskiplist *zsl, zskiplistNode *ln, long offset, int reverse);
 int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore);
 long zsetRank(robj *zobj, sds ele, int reverse);
 int zsetDel(robj *zobj, sds ele);
 void genericZpopCommand(client *c, robj **keyv, int keyc, int where, int emitkey, robj *countarg);
-sds ziplistGetObject(unsigned char *sptr);
+sds lpGetObject(unsigned char *sptr);
 int zslValueGteMin(double value, zrangespec *spec);
 int zslValueLteMax(double value, zrangespec *spec);
 void zslFreeLexRange(zlexrangespec *spec);
@@ -1701,6 +1796,12 @@ unsigned char *zzlFirstInLexRange(unsigned char *zl, zlexrangespec *range);
 unsigned char *zzlLastInLexRange(unsigned char *zl, zlexrangespec *range);
 zskiplistNode *zslFirstInLexRange(zskiplist *zsl, zlexrangespec *range);
 zskiplistNode *zslLastInLexRange(zskiplist *zsl, zlexrangespec *range);
+int zbtFirstInRange(zbtree *zbt, zrangespec *range, zbtCursor *c);
+int zbtLastInRange(zbtree *zbt, zrangespec *range, zbtCursor *c);
+int zbtFirstInLexRange(zbtree *zbt, zlexrangespec *range, zbtCursor *c);
+int zbtLastInLexRange(zbtree *zbt, zlexrangespec *range, zbtCursor *c);
+int zbtSeekAfter(zbtree *zbt, zrangeCursor *cursor, int reverse, zbtCursor *c);
+int zbtSkip(zbtree *zbt, zbtCursor *c, long offset, int reverse);
 int zzlLexValueGteMin(unsigned char *p, zlexrangespec *spec);
 int zzlLexValueLteMax(unsigned char *p, zlexrangespec *spec);
 int zslLexValueGteMin(sds value, zlexrangespec *spec);
@@ -2062,6 +2163,8 @@ void hstrlenCommand(client *c);
 void zremrangebyrankCommand(client *c);
 void zunionstoreCommand(client *c);
 void zinterstoreCommand(client *c);
+void zunionCommand(client *c);
+void zinterCommand(client *c);
 void zscanCommand(client *c);
 void hkeysCommand(client *c);
 void hvalsCommand(client *c);
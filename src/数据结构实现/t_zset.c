@@ -57,8 +57,28 @@
  * from tail to head, useful for ZREVRANGE. */
 
 #include "server.h"
+#include "dicttyped.h"
 #include <math.h>
 
+/* The member dict of the skiplist and btree encodings, with the callbacks
+ * of zsetDictType inlined, see dicttyped.h. Both always hold sds members:
+ * these must hash and compare exactly like dictSdsHash() and
+ * dictSdsKeyCompare(). */
+// zset字典的成员比较和哈希直接内联，不再通过 dictType的函数指针调用
+static inline uint64_t zsetMemberHash(sds ele) {
+    return dictGenHashFunction((unsigned char*)ele,sdslen(ele));
+}
+
+static inline int zsetMemberEqual(sds ele1, sds ele2) {
+    size_t len;
+
+    if (ele1 == ele2) return 1;
+    len = sdslen(ele1);
+    return len == sdslen(ele2) && memcmp(ele1,ele2,len) == 0;
+}
+
+DICT_DEFINE_TYPED(zsetDict, sds, double, d, zsetMemberHash, zsetMemberEqual)
+
 /*-----------------------------------------------------------------------------
  * Skiplist implementation of the low level API
  *----------------------------------------------------------------------------*/
@@ -67,13 +87,59 @@ int zslLexValueGteMin(sds value, zlexrangespec *spec);
 int zslLexValueLteMax(sds value, zlexrangespec *spec);
 
 
+/* Fill 'prefix' with the first ZSKIPLIST_ELE_PREFIX bytes of 'ele', zero
+ * padded. */
+// 取 ele的前缀，长度不够的用 0补齐
+static inline void zslElePrefix(unsigned char *prefix, sds ele) {
+    size_t len = ele ? sdslen(ele) : 0;
+
+    memset(prefix,0,ZSKIPLIST_ELE_PREFIX);
+    if (len) memcpy(prefix,ele,len < ZSKIPLIST_ELE_PREFIX ? len : ZSKIPLIST_ELE_PREFIX);
+}
+
+/* Compare the element of the node 'x' with 'ele', 'prefix' being the prefix
+ * of 'ele'. The sign of the result is the one of sdscmp(x->ele,ele).
+ *
+ * Zero padding keeps the prefix order consistent with sdscmp(): if the
+ * prefixes differ at a byte where one of the strings already ended, the
+ * other one has a non zero byte there, so the shorter string sorts first
+ * in both orders. */
+// 先比较节点中的内联前缀，前缀相同时才比较完整的 sds
+static inline int zslCompareEle(zskiplistNode *x, const unsigned char *prefix, sds ele) {
+    int cmp = memcmp(x->prefix,prefix,ZSKIPLIST_ELE_PREFIX);
+    return cmp ? cmp : sdscmp(x->ele,ele);
+}
+
+/* Memory used by all the skiplists, summing zskiplist->bytes. Sorted sets
+ * can be released by the background free thread, so it is updated with
+ * atomic operations. */
+// 所有跳表占用的内存，MEMORY STATS 使用
+static size_t zsl_total_bytes = 0;
+
+#define zslAddBytes(_zsl, _delta) do { \
+    (_zsl)->bytes += (_delta); \
+    __atomic_add_fetch(&zsl_total_bytes,(_delta),__ATOMIC_RELAXED); \
+} while(0)
+
+size_t zslTotalBytes(void) {
+    return __atomic_load_n(&zsl_total_bytes,__ATOMIC_RELAXED);
+}
+
+/* The height and the prefix share the word after the score, so a node
+ * without levels is two words plus the ele and backward pointers: any other
+ * field would make every node one more word bigger. */
+// height 和前缀共用 score后面的一个字，再增加字段每个节点都会再大一个字
+typedef char zslNodeSizeCheck[sizeof(zskiplistNode) ==
+    2*sizeof(double)+sizeof(sds)+sizeof(zskiplistNode*) ? 1 : -1];
+
 /* 创建一个指定 level层的跳跃表的节点
  */
 zskiplistNode *zslCreateNode(int level, double score, sds ele) {
-    zskiplistNode *zn =
-        zmalloc(sizeof(*zn)+level*sizeof(struct zskiplistLevel));
+    zskiplistNode *zn = slabAlloc(zslNodeSize(level));
     zn->score = score;
     zn->ele = ele;
+    zn->height = level;
+    zslElePrefix(zn->prefix,ele);
     return zn;
 }
 
@@ -94,13 +160,15 @@ zskiplist *zslCreate(void) {
     }
     zsl->header->backward = NULL;
     zsl->tail = NULL;
+    zsl->bytes = 0;
+    zslAddBytes(zsl,sizeof(*zsl)+zslNodeSize(ZSKIPLIST_MAXLEVEL));
     return zsl;
 }
 
 // 释放跳表节点内存，注意 sds是动态分配的内存，需要单独释放
 void zslFreeNode(zskiplistNode *node) {
     sdsfree(node->ele);
-    zfree(node);
+    slabFree(node,zslNodeSize(node->height));
 }
 
 // 释放整个跳表的内存空间每个节点都释放即可
@@ -108,13 +176,14 @@ void zslFree(zskiplist *zsl) {
     zskiplistNode *node = zsl->header->level[0].forward, *next;
 
     // head节点并不属于普通的节点，需要专门释放
-    zfree(zsl->header);
+    slabFree(zsl->header,zslNodeSize(ZSKIPLIST_MAXLEVEL));
     // 每个节点都释放即可
     while(node) {
         next = node->level[0].forward;
         zslFreeNode(node);
         node = next;
     }
+    __atomic_sub_fetch(&zsl_total_bytes,zsl->bytes,__ATOMIC_RELAXED);
     zfree(zsl);
 }
 
@@ -136,9 +205,12 @@ zskiplistNode *zslInsert(zskiplist *zsl, double score, sds ele) {
     zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x;
     // 保存每一层的跨度，rank[0]就应该是元素在链表中的位置
     unsigned int rank[ZSKIPLIST_MAXLEVEL];
+    unsigned char prefix[ZSKIPLIST_ELE_PREFIX];
     int i, level;
+    unsigned long visited = 0;
 
     serverAssert(!isnan(score));
+    zslElePrefix(prefix,ele);
     x = zsl->header;
     // 这个循环结束后，该插入的节点在各个层的跨度就清楚了，同时哪一层该从哪跳转的位置也清楚了
     for (i = zsl->level-1; i >= 0; i--) {
@@ -153,10 +225,11 @@ zskiplistNode *zslInsert(zskiplist *zsl, double score, sds ele) {
         while (x->level[i].forward &&
                 (x->level[i].forward->score < score ||
                     (x->level[i].forward->score == score &&
-                    sdscmp(x->level[i].forward->ele,ele) < 0)))
+                    zslCompareEle(x->level[i].forward,prefix,ele) < 0)))
         {
             rank[i] += x->level[i].span;
             x = x->level[i].forward;
+            visited++;
         }
         update[i] = x;
     }
@@ -175,8 +248,10 @@ zskiplistNode *zslInsert(zskiplist *zsl, double score, sds ele) {
         }
         zsl->level = level;
     }
+    if (dsstatsEnabled()) dsstatsRecord(DSSTATS_ZSL_SEARCH,visited);
     // 创建节点
     x = zslCreateNode(level,score,ele);
+    zslAddBytes(zsl,zslNodeSize(level)+sdsOwnedAllocSize(ele));
     for (i = 0; i < level; i++) {
         // 更新节点指向，和链表的更新一样
         x->level[i].forward = update[i]->level[i].forward;
@@ -202,6 +277,99 @@ zskiplistNode *zslInsert(zskiplist *zsl, double score, sds ele) {
     return x;
 }
 
+/* Bulk loading of a skiplist from elements already in order, as found in a
+ * listpack or in an RDB file. Every element is linked at the end of the
+ * list (at its start when 'reverse', for elements given from the greatest)
+ * in O(1), without the search of zslInsert(). The span of a link is the
+ * difference between the positions of its two nodes, positions that never
+ * change while loading since they are counted from the side the list grows
+ * from, so it is known when the link is made. The links to NULL and, when
+ * reverse, the ones from the header are set by zslBulkFinish().
+ *
+ * The skiplist must be empty, and is only valid after zslBulkFinish(). */
+// 批量构建跳表，元素必须按顺序给出，每个元素 O(1)链接，结束后调用 zslBulkFinish()
+void zslBulkInit(zslBulkBuilder *b, zskiplist *zsl, int reverse) {
+    int i;
+
+    serverAssert(zsl->length == 0);
+    b->zsl = zsl;
+    b->reverse = reverse;
+    for (i = 0; i < ZSKIPLIST_MAXLEVEL; i++) {
+        b->edge[i] = reverse ? NULL : zsl->header;
+        b->pos[i] = 0;
+        b->far[i] = NULL;
+        b->farpos[i] = 0;
+    }
+}
+
+/* Add an element greater than all the ones already added (smaller when
+ * reverse) and return its node, like zslInsert(). */
+zskiplistNode *zslBulkAdd(zslBulkBuilder *b, double score, sds ele) {
+    zskiplist *zsl = b->zsl;
+    zskiplistNode *x, *prev = b->edge[0];
+    unsigned long pos = zsl->length+1;
+    int i, level;
+
+    serverAssert(!isnan(score));
+    if (zsl->length) {
+        int cmp = (prev->score > score) - (prev->score < score);
+        if (cmp == 0) cmp = sdscmp(prev->ele,ele);
+        serverAssert(b->reverse ? cmp > 0 : cmp < 0);
+    }
+
+    level = zslRandomLevel();
+    if (level > zsl->level) zsl->level = level;
+    x = zslCreateNode(level,score,ele);
+    zslAddBytes(zsl,zslNodeSize(level)+sdsOwnedAllocSize(ele));
+    for (i = 0; i < level; i++) {
+        x->level[i].forward = NULL;
+        x->level[i].span = 0;
+        if (!b->reverse) {
+            b->edge[i]->level[i].forward = x;
+            b->edge[i]->level[i].span = pos - b->pos[i];
+        } else if (b->edge[i]) {
+            x->level[i].forward = b->edge[i];
+            x->level[i].span = pos - b->pos[i];
+        } else {
+            b->far[i] = x;
+            b->farpos[i] = pos;
+        }
+        b->edge[i] = x;
+        b->pos[i] = pos;
+    }
+
+    if (!b->reverse) {
+        x->backward = zsl->length ? prev : NULL;
+        zsl->tail = x;
+    } else {
+        x->backward = NULL;
+        if (zsl->length)
+            prev->backward = x;
+        else
+            zsl->tail = x;
+    }
+    zsl->length++;
+    return x;
+}
+
+void zslBulkFinish(zslBulkBuilder *b) {
+    zskiplist *zsl = b->zsl;
+    int i;
+
+    if (zsl->length == 0) return;
+    for (i = 0; i < zsl->level; i++) {
+        if (!b->reverse) {
+            /* A link to NULL spans up to the end of the list. */
+            b->edge[i]->level[i].span = zsl->length - b->pos[i];
+        } else {
+            /* Positions are counted from the end. */
+            zsl->header->level[i].forward = b->edge[i];
+            zsl->header->level[i].span = zsl->length - b->pos[i] + 1;
+            b->far[i]->level[i].span = b->farpos[i] - 1;
+        }
+    }
+}
+
 /* Internal function used by zslDelete, zslDeleteByScore and zslDeleteByRank */
 // 删除节点，作为其他函数内部调用的函数，这是一个很低层次的函数，update保存着每一层跳转的地方
 void zslDeleteNode(zskiplist *zsl, zskiplistNode *x, zskiplistNode **update) {
@@ -227,6 +395,7 @@ void zslDeleteNode(zskiplist *zsl, zskiplistNode *x, zskiplistNode **update) {
     while(zsl->level > 1 && zsl->header->level[zsl->level-1].forward == NULL)
         zsl->level--;
     zsl->length--;
+    zslAddBytes(zsl,-(zslNodeSize(x->height)+sdsOwnedAllocSize(x->ele)));
 }
 
 /* Delete an element with matching score/element from the skiplist.
@@ -240,15 +409,17 @@ void zslDeleteNode(zskiplist *zsl, zskiplistNode *x, zskiplistNode **update) {
 // 删除指定的节点，节点是否删除取决于 node是否为 NULL，如果为 NULL的话就删除，否则将值存到 *node中
 int zslDelete(zskiplist *zsl, double score, sds ele, zskiplistNode **node) {
     zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x;
+    unsigned char prefix[ZSKIPLIST_ELE_PREFIX];
     int i;
 
+    zslElePrefix(prefix,ele);
     x = zsl->header;
     // 定位到每一层需要删除的位置
     for (i = zsl->level-1; i >= 0; i--) {
         while (x->level[i].forward &&
                 (x->level[i].forward->score < score ||
                     (x->level[i].forward->score == score &&
-                     sdscmp(x->level[i].forward->ele,ele) < 0)))
+                     zslCompareEle(x->level[i].forward,prefix,ele) < 0)))
         {
             x = x->level[i].forward;
         }
@@ -258,7 +429,7 @@ int zslDelete(zskiplist *zsl, double score, sds ele, zskiplistNode **node) {
     // 在第一层(也就是完整的链表)中找到要删除的节点位置
     x = x->level[0].forward;
     // 完全相同才进行删除
-    if (x && score == x->score && sdscmp(x->ele,ele) == 0) {
+    if (x && score == x->score && zslCompareEle(x,prefix,ele) == 0) {
         zslDeleteNode(zsl, x, update);
         if (!node)
             zslFreeNode(x);
@@ -284,16 +455,18 @@ int zslDelete(zskiplist *zsl, double score, sds ele, zskiplistNode **node) {
 // 更新节点的分值 score
 zskiplistNode *zslUpdateScore(zskiplist *zsl, double curscore, sds ele, double newscore) {
     zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x;
+    unsigned char prefix[ZSKIPLIST_ELE_PREFIX];
     int i;
 
     /* We need to seek to element to update to start: this is useful anyway,
      * we'll have to update or remove it. */
+    zslElePrefix(prefix,ele);
     x = zsl->header;
     for (i = zsl->level-1; i >= 0; i--) {
         while (x->level[i].forward &&
                 (x->level[i].forward->score < curscore ||
                     (x->level[i].forward->score == curscore &&
-                     sdscmp(x->level[i].forward->ele,ele) < 0)))
+                     zslCompareEle(x->level[i].forward,prefix,ele) < 0)))
         {
             x = x->level[i].forward;
         }
@@ -303,7 +476,7 @@ zskiplistNode *zslUpdateScore(zskiplist *zsl, double curscore, sds ele, double n
     /* Jump to our element: note that this function assumes that the
      * element with the matching score exists. */
     x = x->level[0].forward;
-    serverAssert(x && curscore == x->score && sdscmp(x->ele,ele) == 0);
+    serverAssert(x && curscore == x->score && zslCompareEle(x,prefix,ele) == 0);
 
     /* If the node, after the score update, would be still exactly
      * at the same position, we can just update the score without
@@ -435,7 +608,7 @@ unsigned long zslDeleteRangeByScore(zskiplist *zsl, zrangespec *range, dict *dic
     {
         zskiplistNode *next = x->level[0].forward;
         zslDeleteNode(zsl,x,update);
-        dictDelete(dict,x->ele);
+        zsetDictDelete(dict,x->ele);
         zslFreeNode(x); /* Here is where x->ele is actually released. */
         removed++;
         x = next;
@@ -467,7 +640,7 @@ unsigned long zslDeleteRangeByLex(zskiplist *zsl, zlexrangespec *range, dict *di
     while (x && zslLexValueLteMax(x->ele,range)) {
         zskiplistNode *next = x->level[0].forward;
         zslDeleteNode(zsl,x,update);
-        dictDelete(dict,x->ele);
+        zsetDictDelete(dict,x->ele);
         zslFreeNode(x); /* Here is where x->ele is actually released. */
         removed++;
         x = next;
@@ -498,7 +671,7 @@ unsigned long zslDeleteRangeByRank(zskiplist *zsl, unsigned int start, unsigned
     while (x && traversed <= end) {
         zskiplistNode *next = x->level[0].forward;
         zslDeleteNode(zsl,x,update);
-        dictDelete(dict,x->ele);
+        zsetDictDelete(dict,x->ele);
         zslFreeNode(x);
         removed++;
         traversed++;
@@ -514,32 +687,37 @@ unsigned long zslDeleteRangeByRank(zskiplist *zsl, unsigned int start, unsigned
 // 获取指定分值和元素的节点的下标(从 1开始算)，也就是 rank 
 unsigned long zslGetRank(zskiplist *zsl, double score, sds ele) {
     zskiplistNode *x;
-    unsigned long rank = 0;
+    unsigned long rank = 0, visited = 0;
+    unsigned char prefix[ZSKIPLIST_ELE_PREFIX];
     int i;
 
+    zslElePrefix(prefix,ele);
     x = zsl->header;
     // 已经不需要解释了，前面已经多次出现
     for (i = zsl->level-1; i >= 0; i--) {
         while (x->level[i].forward &&
             (x->level[i].forward->score < score ||
                 (x->level[i].forward->score == score &&
-                sdscmp(x->level[i].forward->ele,ele) <= 0))) {
+                zslCompareEle(x->level[i].forward,prefix,ele) <= 0))) {
             rank += x->level[i].span;
             x = x->level[i].forward;
+            visited++;
         }
 
         /* x might be equal to zsl->header, so test if obj is non-NULL */
-        if (x->ele && sdscmp(x->ele,ele) == 0) {
+        if (x->ele && zslCompareEle(x,prefix,ele) == 0) {
+            if (dsstatsEnabled()) dsstatsRecord(DSSTATS_ZSL_SEARCH,visited);
             return rank;
         }
     }
+    if (dsstatsEnabled()) dsstatsRecord(DSSTATS_ZSL_SEARCH,visited);
     return 0;
 }
 
 // 根据 rank获取节点
 zskiplistNode* zslGetElementByRank(zskiplist *zsl, unsigned long rank) {
     zskiplistNode *x;
-    unsigned long traversed = 0;
+    unsigned long traversed = 0, visited = 0;
     int i;
 
     x = zsl->header;
@@ -549,15 +727,68 @@ zskiplistNode* zslGetElementByRank(zskiplist *zsl, unsigned long rank) {
         {
             traversed += x->level[i].span;
             x = x->level[i].forward;
+            visited++;
         }
         if (traversed == rank) {
+            if (dsstatsEnabled()) dsstatsRecord(DSSTATS_ZSL_SEARCH,visited);
             return x;
         }
     }
+    if (dsstatsEnabled()) dsstatsRecord(DSSTATS_ZSL_SEARCH,visited);
     // 如果 rank的大小超过了跳表的长度就返回 NULL
     return NULL;
 }
 
+/* Find the node that follows the pair (score,ele) in the iteration order:
+ * the first node greater than the pair, or if 'reverse' is true the last
+ * node smaller than it. The pair does not need to be in the skiplist, so a
+ * range can be resumed after its last element was removed. Returns NULL
+ * when there is no such node. */
+// 查找 (score,ele)之后的第一个节点，要求的元素本身可以已经不在跳表中了
+zskiplistNode *zslSeekAfter(zskiplist *zsl, double score, sds ele, int reverse) {
+    zskiplistNode *x, *next;
+    unsigned long visited = 0;
+    unsigned char prefix[ZSKIPLIST_ELE_PREFIX];
+    int i, cmp;
+
+    zslElePrefix(prefix,ele);
+    x = zsl->header;
+    for (i = zsl->level-1; i >= 0; i--) {
+        /* Going forward we stop before the first node greater than the
+         * pair, in reverse before the first one not smaller than it. */
+        while ((next = x->level[i].forward) != NULL) {
+            if (next->score != score)
+                cmp = next->score < score ? -1 : 1;
+            else
+                cmp = zslCompareEle(next,prefix,ele);
+            if (reverse ? cmp >= 0 : cmp > 0) break;
+            x = next;
+            visited++;
+        }
+    }
+    if (dsstatsEnabled()) dsstatsRecord(DSSTATS_ZSL_SEARCH,visited);
+    if (reverse) return x == zsl->header ? NULL : x;
+    return x->level[0].forward;
+}
+
+/* Move 'offset' nodes forward from 'ln', or backward if 'reverse' is true,
+ * with two span based descents instead of walking the nodes one by one.
+ * Returns NULL when the offset goes past the end of the skiplist, which is
+ * also the result of a negative offset. */
+// 借助 rank跳过 offset个节点，复杂度 O(log(N))而不是 O(offset)
+zskiplistNode *zslSkip(zskiplist *zsl, zskiplistNode *ln, long offset, int reverse) {
+    unsigned long rank;
+
+    if (offset < 0) return NULL;
+    if (offset == 0) return ln;
+    rank = zslGetRank(zsl,ln->score,ln->ele);
+    if (reverse)
+        return (unsigned long)offset < rank ?
+               zslGetElementByRank(zsl,rank-offset) : NULL;
+    if ((unsigned long)offset > zsl->length - rank) return NULL;
+    return zslGetElementByRank(zsl,rank+offset);
+}
+
 /* Populate the rangespec according to the objects min and max. */
 static int zslParseRange(robj *min, robj *max, zrangespec *spec) {
     char *eptr;
@@ -759,6 +990,141 @@ zskiplistNode *zslLastInLexRange(zskiplist *zsl, zlexrangespec *range) {
     return x;
 }
 
+/*-----------------------------------------------------------------------------
+ * B+tree-backed sorted set range API
+ *----------------------------------------------------------------------------*/
+
+/* The range lookups of the btree encoding, equivalent to the zsl ones. They
+ * are built on zbtSeekFirstNot() / zbtSeekLast() with monotone predicates on
+ * the range bounds, and return 0 when no element is in range. */
+// B+树编码的范围查找，和跳表的同名函数语义相同，通过单调谓词实现
+
+static int zbtScoreBeforeMin(double score, sds ele, void *privdata) {
+    UNUSED(ele);
+    return !zslValueGteMin(score,privdata);
+}
+
+static int zbtScoreUptoMax(double score, sds ele, void *privdata) {
+    UNUSED(ele);
+    return zslValueLteMax(score,privdata);
+}
+
+static int zbtLexBeforeMin(double score, sds ele, void *privdata) {
+    UNUSED(score);
+    return !zslLexValueGteMin(ele,privdata);
+}
+
+static int zbtLexUptoMax(double score, sds ele, void *privdata) {
+    UNUSED(score);
+    return zslLexValueLteMax(ele,privdata);
+}
+
+static int zslIsEmptyRange(zrangespec *range) {
+    return range->min > range->max ||
+           (range->min == range->max && (range->minex || range->maxex));
+}
+
+static int zslIsEmptyLexRange(zlexrangespec *range) {
+    return sdscmplex(range->min,range->max) > 1 ||
+           (sdscmp(range->min,range->max) == 0 &&
+           (range->minex || range->maxex));
+}
+
+int zbtFirstInRange(zbtree *zbt, zrangespec *range, zbtCursor *c) {
+    if (zslIsEmptyRange(range)) return 0;
+    if (!zbtSeekFirstNot(zbt,zbtScoreBeforeMin,range,c)) return 0;
+    return zslValueLteMax(zbtCursorScore(c),range);
+}
+
+int zbtLastInRange(zbtree *zbt, zrangespec *range, zbtCursor *c) {
+    if (zslIsEmptyRange(range)) return 0;
+    if (!zbtSeekLast(zbt,zbtScoreUptoMax,range,c)) return 0;
+    return zslValueGteMin(zbtCursorScore(c),range);
+}
+
+int zbtFirstInLexRange(zbtree *zbt, zlexrangespec *range, zbtCursor *c) {
+    if (zslIsEmptyLexRange(range)) return 0;
+    if (!zbtSeekFirstNot(zbt,zbtLexBeforeMin,range,c)) return 0;
+    return zslLexValueLteMax(zbtCursorEle(c),range);
+}
+
+int zbtLastInLexRange(zbtree *zbt, zlexrangespec *range, zbtCursor *c) {
+    if (zslIsEmptyLexRange(range)) return 0;
+    if (!zbtSeekLast(zbt,zbtLexUptoMax,range,c)) return 0;
+    return zslLexValueGteMin(zbtCursorEle(c),range);
+}
+
+/* Order of the entry (score,ele) against the pair of a range cursor. */
+static int zsetCursorCompare(double score, sds ele, zrangeCursor *cursor) {
+    if (score != cursor->score) return score < cursor->score ? -1 : 1;
+    return sdscmp(ele,cursor->ele);
+}
+
+static int zbtUptoCursor(double score, sds ele, void *privdata) {
+    return zsetCursorCompare(score,ele,privdata) <= 0;
+}
+
+static int zbtBeforeCursor(double score, sds ele, void *privdata) {
+    return zsetCursorCompare(score,ele,privdata) < 0;
+}
+
+/* Seek the entry that follows the cursor pair in the iteration order, see
+ * zslSeekAfter(). */
+int zbtSeekAfter(zbtree *zbt, zrangeCursor *cursor, int reverse, zbtCursor *c) {
+    if (reverse) return zbtSeekLast(zbt,zbtBeforeCursor,cursor,c);
+    return zbtSeekFirstNot(zbt,zbtUptoCursor,cursor,c);
+}
+
+/* Move the cursor 'offset' entries forward, or backward if 'reverse' is
+ * true, by rank, see zslSkip(). Returns 0 if it goes past the end. */
+int zbtSkip(zbtree *zbt, zbtCursor *c, long offset, int reverse) {
+    unsigned long rank;
+
+    if (offset < 0) return 0;
+    if (offset == 0) return 1;
+    rank = zbtGetRank(zbt,zbtCursorScore(c),zbtCursorEle(c));
+    if (reverse) {
+        if ((unsigned long)offset >= rank) return 0;
+        return zbtGetElementByRank(zbt,rank-offset,c);
+    }
+    if ((unsigned long)offset > zbt->length - rank) return 0;
+    return zbtGetElementByRank(zbt,rank+offset,c);
+}
+
+// 删除 B+树中的元素前先从字典中删除，sds由 B+树释放
+static void zbtDictDeleteCallback(sds ele, void *privdata) {
+    zsetDictDelete((dict*)privdata,ele);
+}
+
+/* Delete the elements between the ranks of the first and the last element
+ * in range, removing them from the dict too. */
+// 找到范围内第一个和最后一个元素的排名，然后按排名批量删除
+static unsigned long zbtDeleteRangeByCursors(zbtree *zbt, zbtCursor *first,
+                                             zbtCursor *last, dict *dict) {
+    unsigned long start, end;
+
+    start = zbtGetRank(zbt,zbtCursorScore(first),zbtCursorEle(first));
+    end = zbtGetRank(zbt,zbtCursorScore(last),zbtCursorEle(last));
+    if (start == 0 || end < start) return 0;
+    return zbtDeleteRangeByRank(zbt,start,end,zbtDictDeleteCallback,dict);
+}
+
+unsigned long zbtDeleteRangeByScore(zbtree *zbt, zrangespec *range, dict *dict) {
+    zbtCursor first, last;
+
+    if (!zbtFirstInRange(zbt,range,&first) ||
+        !zbtLastInRange(zbt,range,&last)) return 0;
+    return zbtDeleteRangeByCursors(zbt,&first,&last,dict);
+}
+
+unsigned long zbtDeleteRangeByLex(zbtree *zbt, zlexrangespec *range, dict *dict) {
+    zbtCursor first, last;
+
+    if (!zbtFirstInLexRange(zbt,range,&first) ||
+        !zbtLastInLexRange(zbt,range,&last)) return 0;
+    return zbtDeleteRangeByCursors(zbt,&first,&last,dict);
+}
+
 /*-----------------------------------------------------------------------------
  * Ziplist-backed sorted set API
  *----------------------------------------------------------------------------*/
@@ -771,7 +1137,7 @@ double zzlGetScore(unsigned char *sptr) {
     double score;
 
     serverAssert(sptr != NULL);
-    serverAssert(ziplistGet(sptr,&vstr,&vlen,&vlong));
+    serverAssert(lpGetValue(sptr,&vstr,&vlen,&vlong));
 
     if (vstr) {
         memcpy(buf,vstr,vlen);
@@ -785,13 +1151,13 @@ double zzlGetScore(unsigned char *sptr) {
 }
 
 /* Return a ziplist element as an SDS string. */
-sds ziplistGetObject(unsigned char *sptr) {
+sds lpGetObject(unsigned char *sptr) {
     unsigned char *vstr;
     unsigned int vlen;
     long long vlong;
 
     serverAssert(sptr != NULL);
-    serverAssert(ziplistGet(sptr,&vstr,&vlen,&vlong));
+    serverAssert(lpGetValue(sptr,&vstr,&vlen,&vlong));
 
     if (vstr) {
         return sdsnewlen((char*)vstr,vlen);
@@ -808,7 +1174,7 @@ int zzlCompareElements(unsigned char *eptr, unsigned char *cstr, unsigned int cl
     unsigned char vbuf[32];
     int minlen, cmp;
 
-    serverAssert(ziplistGet(eptr,&vstr,&vlen,&vlong));
+    serverAssert(lpGetValue(eptr,&vstr,&vlen,&vlong));
     if (vstr == NULL) {
         /* Store string representation of long long in buf. */
         vlen = ll2string((char*)vbuf,sizeof(vbuf),vlong);
@@ -822,7 +1188,7 @@ int zzlCompareElements(unsigned char *eptr, unsigned char *cstr, unsigned int cl
 }
 
 unsigned int zzlLength(unsigned char *zl) {
-    return ziplistLen(zl)/2;
+    return lpLength(zl)/2;
 }
 
 /* Move to next entry based on the values in eptr and sptr. Both are set to
@@ -831,9 +1197,9 @@ void zzlNext(unsigned char *zl, unsigned char **eptr, unsigned char **sptr) {
     unsigned char *_eptr, *_sptr;
     serverAssert(*eptr != NULL && *sptr != NULL);
 
-    _eptr = ziplistNext(zl,*sptr);
+    _eptr = lpNext(zl,*sptr);
     if (_eptr != NULL) {
-        _sptr = ziplistNext(zl,_eptr);
+        _sptr = lpNext(zl,_eptr);
         serverAssert(_sptr != NULL);
     } else {
         /* No next entry. */
@@ -850,9 +1216,9 @@ void zzlPrev(unsigned char *zl, unsigned char **eptr, unsigned char **sptr) {
     unsigned char *_eptr, *_sptr;
     serverAssert(*eptr != NULL && *sptr != NULL);
 
-    _sptr = ziplistPrev(zl,*eptr);
+    _sptr = lpPrev(zl,*eptr);
     if (_sptr != NULL) {
-        _eptr = ziplistPrev(zl,_sptr);
+        _eptr = lpPrev(zl,_sptr);
         serverAssert(_eptr != NULL);
     } else {
         /* No previous entry. */
@@ -874,13 +1240,13 @@ int zzlIsInRange(unsigned char *zl, zrangespec *range) {
             (range->min == range->max && (range->minex || range->maxex)))
         return 0;
 
-    p = ziplistIndex(zl,-1); /* Last score. */
+    p = lpSeek(zl,-1); /* Last score. */
     if (p == NULL) return 0; /* Empty sorted set */
     score = zzlGetScore(p);
     if (!zslValueGteMin(score,range))
         return 0;
 
-    p = ziplistIndex(zl,1); /* First score. */
+    p = lpSeek(zl,1); /* First score. */
     serverAssert(p != NULL);
     score = zzlGetScore(p);
     if (!zslValueLteMax(score,range))
@@ -892,14 +1258,14 @@ int zzlIsInRange(unsigned char *zl, zrangespec *range) {
 /* Find pointer to the first element contained in the specified range.
  * Returns NULL when no element is contained in the range. */
 unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range) {
-    unsigned char *eptr = ziplistIndex(zl,0), *sptr;
+    unsigned char *eptr = lpSeek(zl,0), *sptr;
     double score;
 
     /* If everything is out of range, return early. */
     if (!zzlIsInRange(zl,range)) return NULL;
 
     while (eptr != NULL) {
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
 
         score = zzlGetScore(sptr);
@@ -911,7 +1277,7 @@ unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range) {
         }
 
         /* Move to next element. */
-        eptr = ziplistNext(zl,sptr);
+        eptr = lpNext(zl,sptr);
     }
 
     return NULL;
@@ -920,14 +1286,14 @@ unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range) {
 /* Find pointer to the last element contained in the specified range.
  * Returns NULL when no element is contained in the range. */
 unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range) {
-    unsigned char *eptr = ziplistIndex(zl,-2), *sptr;
+    unsigned char *eptr = lpSeek(zl,-2), *sptr;
     double score;
 
     /* If everything is out of range, return early. */
     if (!zzlIsInRange(zl,range)) return NULL;
 
     while (eptr != NULL) {
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
 
         score = zzlGetScore(sptr);
@@ -940,9 +1306,9 @@ unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range) {
 
         /* Move to previous element by moving to the score of previous element.
          * When this returns NULL, we know there also is no element. */
-        sptr = ziplistPrev(zl,eptr);
+        sptr = lpPrev(zl,eptr);
         if (sptr != NULL)
-            serverAssert((eptr = ziplistPrev(zl,sptr)) != NULL);
+            serverAssert((eptr = lpPrev(zl,sptr)) != NULL);
         else
             eptr = NULL;
     }
@@ -951,14 +1317,14 @@ unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range) {
 }
 
 int zzlLexValueGteMin(unsigned char *p, zlexrangespec *spec) {
-    sds value = ziplistGetObject(p);
+    sds value = lpGetObject(p);
     int res = zslLexValueGteMin(value,spec);
     sdsfree(value);
     return res;
 }
 
 int zzlLexValueLteMax(unsigned char *p, zlexrangespec *spec) {
-    sds value = ziplistGetObject(p);
+    sds value = lpGetObject(p);
     int res = zslLexValueLteMax(value,spec);
     sdsfree(value);
     return res;
@@ -975,12 +1341,12 @@ int zzlIsInLexRange(unsigned char *zl, zlexrangespec *range) {
             (range->minex || range->maxex)))
         return 0;
 
-    p = ziplistIndex(zl,-2); /* Last element. */
+    p = lpSeek(zl,-2); /* Last element. */
     if (p == NULL) return 0;
     if (!zzlLexValueGteMin(p,range))
         return 0;
 
-    p = ziplistIndex(zl,0); /* First element. */
+    p = lpSeek(zl,0); /* First element. */
     serverAssert(p != NULL);
     if (!zzlLexValueLteMax(p,range))
         return 0;
@@ -991,7 +1357,7 @@ int zzlIsInLexRange(unsigned char *zl, zlexrangespec *range) {
 /* Find pointer to the first element contained in the specified lex range.
  * Returns NULL when no element is contained in the range. */
 unsigned char *zzlFirstInLexRange(unsigned char *zl, zlexrangespec *range) {
-    unsigned char *eptr = ziplistIndex(zl,0), *sptr;
+    unsigned char *eptr = lpSeek(zl,0), *sptr;
 
     /* If everything is out of range, return early. */
     if (!zzlIsInLexRange(zl,range)) return NULL;
@@ -1005,9 +1371,9 @@ unsigned char *zzlFirstInLexRange(unsigned char *zl, zlexrangespec *range) {
         }
 
         /* Move to next element. */
-        sptr = ziplistNext(zl,eptr); /* This element score. Skip it. */
+        sptr = lpNext(zl,eptr); /* This element score. Skip it. */
         serverAssert(sptr != NULL);
-        eptr = ziplistNext(zl,sptr); /* Next element. */
+        eptr = lpNext(zl,sptr); /* Next element. */
     }
 
     return NULL;
@@ -1016,7 +1382,7 @@ unsigned char *zzlFirstInLexRange(unsigned char *zl, zlexrangespec *range) {
 /* Find pointer to the last element contained in the specified lex range.
  * Returns NULL when no element is contained in the range. */
 unsigned char *zzlLastInLexRange(unsigned char *zl, zlexrangespec *range) {
-    unsigned char *eptr = ziplistIndex(zl,-2), *sptr;
+    unsigned char *eptr = lpSeek(zl,-2), *sptr;
 
     /* If everything is out of range, return early. */
     if (!zzlIsInLexRange(zl,range)) return NULL;
@@ -1031,9 +1397,9 @@ unsigned char *zzlLastInLexRange(unsigned char *zl, zlexrangespec *range) {
 
         /* Move to previous element by moving to the score of previous element.
          * When this returns NULL, we know there also is no element. */
-        sptr = ziplistPrev(zl,eptr);
+        sptr = lpPrev(zl,eptr);
         if (sptr != NULL)
-            serverAssert((eptr = ziplistPrev(zl,sptr)) != NULL);
+            serverAssert((eptr = lpPrev(zl,sptr)) != NULL);
         else
             eptr = NULL;
     }
@@ -1042,22 +1408,18 @@ unsigned char *zzlLastInLexRange(unsigned char *zl, zlexrangespec *range) {
 }
 
 unsigned char *zzlFind(unsigned char *zl, sds ele, double *score) {
-    unsigned char *eptr = ziplistIndex(zl,0), *sptr;
-
-    while (eptr != NULL) {
-        sptr = ziplistNext(zl,eptr);
-        serverAssert(sptr != NULL);
+    unsigned char *eptr, *sptr;
 
-        if (ziplistCompare(eptr,(unsigned char*)ele,sdslen(ele))) {
-            /* Matching element, pull out score. */
-            if (score != NULL) *score = zzlGetScore(sptr);
-            return eptr;
-        }
+    /* Elements and scores alternate, so only one entry every two is
+     * compared. */
+    eptr = lpFind(zl,lpSeek(zl,0),(unsigned char*)ele,sdslen(ele),1);
+    if (eptr == NULL) return NULL;
 
-        /* Move to next element. */
-        eptr = ziplistNext(zl,sptr);
-    }
-    return NULL;
+    /* Matching element, pull out score. */
+    sptr = lpNext(zl,eptr);
+    serverAssert(sptr != NULL);
+    if (score != NULL) *score = zzlGetScore(sptr);
+    return eptr;
 }
 
 /* Delete (element,score) pair from ziplist. Use local copy of eptr because we
@@ -1065,31 +1427,26 @@ unsigned char *zzlFind(unsigned char *zl, sds ele, double *score) {
 unsigned char *zzlDelete(unsigned char *zl, unsigned char *eptr) {
     unsigned char *p = eptr;
 
-    /* TODO: add function to ziplist API to delete N elements from offset. */
-    zl = ziplistDelete(zl,&p);
-    zl = ziplistDelete(zl,&p);
+    zl = lpDelete(zl,p,&p);
+    zl = lpDelete(zl,p,NULL);
     return zl;
 }
 
 unsigned char *zzlInsertAt(unsigned char *zl, unsigned char *eptr, sds ele, double score) {
-    unsigned char *sptr;
     char scorebuf[128];
     int scorelen;
-    size_t offset;
 
     scorelen = d2string(scorebuf,sizeof(scorebuf),score);
     if (eptr == NULL) {
-        zl = ziplistPush(zl,(unsigned char*)ele,sdslen(ele),ZIPLIST_TAIL);
-        zl = ziplistPush(zl,(unsigned char*)scorebuf,scorelen,ZIPLIST_TAIL);
+        zl = lpAppend(zl,(unsigned char*)ele,sdslen(ele));
+        zl = lpAppend(zl,(unsigned char*)scorebuf,scorelen);
     } else {
-        /* Keep offset relative to zl, as it might be re-allocated. */
-        offset = eptr-zl;
-        zl = ziplistInsert(zl,eptr,(unsigned char*)ele,sdslen(ele));
-        eptr = zl+offset;
+        /* lpInsert() returns the address of the new element, which is
+         * where the score has to go after, even if zl was re-allocated. */
+        zl = lpInsert(zl,(unsigned char*)ele,sdslen(ele),eptr,LP_BEFORE,&eptr);
 
         /* Insert score after the element. */
-        serverAssert((sptr = ziplistNext(zl,eptr)) != NULL);
-        zl = ziplistInsert(zl,sptr,(unsigned char*)scorebuf,scorelen);
+        zl = lpInsert(zl,(unsigned char*)scorebuf,scorelen,eptr,LP_AFTER,NULL);
     }
     return zl;
 }
@@ -1097,11 +1454,11 @@ unsigned char *zzlInsertAt(unsigned char *zl, unsigned char *eptr, sds ele, doub
 /* Insert (element,score) pair in ziplist. This function assumes the element is
  * not yet present in the list. */
 unsigned char *zzlInsert(unsigned char *zl, sds ele, double score) {
-    unsigned char *eptr = ziplistIndex(zl,0), *sptr;
+    unsigned char *eptr = lpSeek(zl,0), *sptr;
     double s;
 
     while (eptr != NULL) {
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
         s = zzlGetScore(sptr);
 
@@ -1120,7 +1477,7 @@ unsigned char *zzlInsert(unsigned char *zl, sds ele, double score) {
         }
 
         /* Move to next element. */
-        eptr = ziplistNext(zl,sptr);
+        eptr = lpNext(zl,sptr);
     }
 
     /* Push on tail of list when it was not yet inserted. */
@@ -1139,14 +1496,14 @@ unsigned char *zzlDeleteRangeByScore(unsigned char *zl, zrangespec *range, unsig
     eptr = zzlFirstInRange(zl,range);
     if (eptr == NULL) return zl;
 
-    /* When the tail of the ziplist is deleted, eptr will point to the sentinel
-     * byte and ziplistNext will return NULL. */
-    while ((sptr = ziplistNext(zl,eptr)) != NULL) {
+    /* When the tail of the listpack is deleted, lpDelete() sets eptr to
+     * NULL. */
+    while (eptr && (sptr = lpNext(zl,eptr)) != NULL) {
         score = zzlGetScore(sptr);
         if (zslValueLteMax(score,range)) {
             /* Delete both the element and the score. */
-            zl = ziplistDelete(zl,&eptr);
-            zl = ziplistDelete(zl,&eptr);
+            zl = lpDelete(zl,eptr,&eptr);
+            zl = lpDelete(zl,eptr,&eptr);
             num++;
         } else {
             /* No longer in range. */
@@ -1167,13 +1524,13 @@ unsigned char *zzlDeleteRangeByLex(unsigned char *zl, zlexrangespec *range, unsi
     eptr = zzlFirstInLexRange(zl,range);
     if (eptr == NULL) return zl;
 
-    /* When the tail of the ziplist is deleted, eptr will point to the sentinel
-     * byte and ziplistNext will return NULL. */
-    while ((sptr = ziplistNext(zl,eptr)) != NULL) {
+    /* When the tail of the listpack is deleted, lpDelete() sets eptr to
+     * NULL. */
+    while (eptr && (sptr = lpNext(zl,eptr)) != NULL) {
         if (zzlLexValueLteMax(eptr,range)) {
             /* Delete both the element and the score. */
-            zl = ziplistDelete(zl,&eptr);
-            zl = ziplistDelete(zl,&eptr);
+            zl = lpDelete(zl,eptr,&eptr);
+            zl = lpDelete(zl,eptr,&eptr);
             num++;
         } else {
             /* No longer in range. */
@@ -1190,7 +1547,7 @@ unsigned char *zzlDeleteRangeByLex(unsigned char *zl, zlexrangespec *range, unsi
 unsigned char *zzlDeleteRangeByRank(unsigned char *zl, unsigned int start, unsigned int end, unsigned long *deleted) {
     unsigned int num = (end-start)+1;
     if (deleted) *deleted = num;
-    zl = ziplistDeleteRange(zl,2*(start-1),2*num);
+    zl = lpDeleteRange(zl,2*(start-1),2*num);
     return zl;
 }
 
@@ -1200,16 +1557,25 @@ unsigned char *zzlDeleteRangeByRank(unsigned char *zl, unsigned int start, unsig
 
 unsigned long zsetLength(const robj *zobj) {
     unsigned long length = 0;
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         length = zzlLength(zobj->ptr);
     } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
         length = ((const zset*)zobj->ptr)->zsl->length;
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        length = ((const zset*)zobj->ptr)->zbt->length;
     } else {
         serverPanic("Unknown sorted set encoding");
     }
     return length;
 }
 
+/* The encoding a listpack sorted set is converted to once it grows too
+ * large, see the zset-btree-encoding config. */
+// 有序集合超出 listpack的限制后转换成的编码
+int zsetLargeEncoding(void) {
+    return server.zset_btree_encoding ? OBJ_ENCODING_BTREE : OBJ_ENCODING_SKIPLIST;
+}
+
 void zsetConvert(robj *zobj, int encoding) {
     zset *zs;
     zskiplistNode *node, *next;
@@ -1217,45 +1583,66 @@ void zsetConvert(robj *zobj, int encoding) {
     double score;
 
     if (zobj->encoding == encoding) return;
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    // 记录转换耗时，见 dsstats.c
+    int up = zobj->encoding == OBJ_ENCODING_LISTPACK;
+    dsstatsTimerStart(start);
+
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
         unsigned int vlen;
         long long vlong;
+        zslBulkBuilder bulk;
+        dictEntry *de;
 
-        if (encoding != OBJ_ENCODING_SKIPLIST)
+        if (encoding != OBJ_ENCODING_SKIPLIST && encoding != OBJ_ENCODING_BTREE)
             serverPanic("Unknown target encoding");
 
         zs = zmalloc(sizeof(*zs));
         zs->dict = dictCreate(&zsetDictType,NULL);
-        zs->zsl = zslCreate();
-
-        eptr = ziplistIndex(zl,0);
+        zs->zsl = encoding == OBJ_ENCODING_SKIPLIST ? zslCreate() : NULL;
+        zs->zbt = encoding == OBJ_ENCODING_BTREE ? zbtCreate() : NULL;
+        dictExpand(zs->dict,zzlLength(zl));
+        /* The listpack is already in order: link the nodes at the end of the
+         * skiplist instead of inserting them one by one. */
+        if (zs->zsl) zslBulkInit(&bulk,zs->zsl,0);
+
+        eptr = lpSeek(zl,0);
         serverAssertWithInfo(NULL,zobj,eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssertWithInfo(NULL,zobj,sptr != NULL);
 
         while (eptr != NULL) {
             score = zzlGetScore(sptr);
-            serverAssertWithInfo(NULL,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
+            serverAssertWithInfo(NULL,zobj,lpGetValue(eptr,&vstr,&vlen,&vlong));
             if (vstr == NULL)
                 ele = sdsfromlonglong(vlong);
             else
                 ele = sdsnewlen((char*)vstr,vlen);
 
-            node = zslInsert(zs->zsl,score,ele);
-            serverAssert(dictAdd(zs->dict,ele,&node->score) == DICT_OK);
+            if (zs->zbt) {
+                zbtInsert(zs->zbt,score,ele);
+                de = zsetDictAddRaw(zs->dict,ele,NULL);
+                serverAssert(de != NULL);
+                dictSetDoubleVal(de,score);
+            } else {
+                node = zslBulkAdd(&bulk,score,ele);
+                de = zsetDictAddRaw(zs->dict,ele,NULL);
+                serverAssert(de != NULL);
+                dictSetVal(zs->dict,de,&node->score);
+            }
             zzlNext(zl,&eptr,&sptr);
         }
+        if (zs->zsl) zslBulkFinish(&bulk);
 
         zfree(zobj->ptr);
         zobj->ptr = zs;
-        zobj->encoding = OBJ_ENCODING_SKIPLIST;
+        zobj->encoding = encoding;
     } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
-        unsigned char *zl = ziplistNew();
+        unsigned char *zl = lpNew();
 
-        if (encoding != OBJ_ENCODING_ZIPLIST)
+        if (encoding != OBJ_ENCODING_LISTPACK)
             serverPanic("Unknown target encoding");
 
         /* Approach similar to zslFree(), since we want to free the skiplist at
@@ -1263,7 +1650,8 @@ void zsetConvert(robj *zobj, int encoding) {
         zs = zobj->ptr;
         dictRelease(zs->dict);
         node = zs->zsl->header->level[0].forward;
-        zfree(zs->zsl->header);
+        slabFree(zs->zsl->header,zslNodeSize(ZSKIPLIST_MAXLEVEL));
+        __atomic_sub_fetch(&zsl_total_bytes,zs->zsl->bytes,__ATOMIC_RELAXED);
         zfree(zs->zsl);
 
         while (node) {
@@ -1275,22 +1663,44 @@ void zsetConvert(robj *zobj, int encoding) {
 
         zfree(zs);
         zobj->ptr = zl;
-        zobj->encoding = OBJ_ENCODING_ZIPLIST;
+        zobj->encoding = OBJ_ENCODING_LISTPACK;
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        unsigned char *zl = lpNew();
+        zbtCursor cur;
+        int valid;
+
+        if (encoding != OBJ_ENCODING_LISTPACK)
+            serverPanic("Unknown target encoding");
+
+        zs = zobj->ptr;
+        dictRelease(zs->dict);
+        valid = zbtFirst(zs->zbt,&cur);
+        while (valid) {
+            zl = zzlInsertAt(zl,NULL,zbtCursorEle(&cur),zbtCursorScore(&cur));
+            valid = zbtNext(&cur);
+        }
+        zbtFree(zs->zbt);
+
+        zfree(zs);
+        zobj->ptr = zl;
+        zobj->encoding = OBJ_ENCODING_LISTPACK;
     } else {
         serverPanic("Unknown sorted set encoding");
     }
+    if (dsstatsEnabled())
+        dsstatsIncr(up ? DSSTATS_ZSET_CONVERT_UP : DSSTATS_ZSET_CONVERT_DOWN,1);
+    dsstatsTimerEnd(DSSTATS_ZSET_CONVERT,start);
 }
 
 /* Convert the sorted set object into a ziplist if it is not already a ziplist
  * and if the number of elements and the maximum element size is within the
  * expected ranges. */
 void zsetConvertToZiplistIfNeeded(robj *zobj, size_t maxelelen) {
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) return;
-    zset *zset = zobj->ptr;
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) return;
 
-    if (zset->zsl->length <= server.zset_max_ziplist_entries &&
+    if (zsetLength(zobj) <= server.zset_max_ziplist_entries &&
         maxelelen <= server.zset_max_ziplist_value)
-            zsetConvert(zobj,OBJ_ENCODING_ZIPLIST);
+            zsetConvert(zobj,OBJ_ENCODING_LISTPACK);
 }
 
 /* Return (by reference) the score of the specified member of the sorted set
@@ -1300,13 +1710,18 @@ void zsetConvertToZiplistIfNeeded(robj *zobj, size_t maxelelen) {
 int zsetScore(robj *zobj, sds member, double *score) {
     if (!zobj || !member) return C_ERR;
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         if (zzlFind(zobj->ptr, member, score) == NULL) return C_ERR;
     } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
         zset *zs = zobj->ptr;
-        dictEntry *de = dictFind(zs->dict, member);
+        dictEntry *de = zsetDictFind(zs->dict, member);
         if (de == NULL) return C_ERR;
         *score = *(double*)dictGetVal(de);
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        zset *zs = zobj->ptr;
+        dictEntry *de = zsetDictFind(zs->dict, member);
+        if (de == NULL) return C_ERR;
+        *score = dictGetDoubleVal(de);
     } else {
         serverPanic("Unknown sorted set encoding");
     }
@@ -1371,7 +1786,7 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
     }
 
     /* Update the sorted set according to its encoding. */
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *eptr;
 
         if ((eptr = zzlFind(zobj->ptr,ele,&curscore)) != NULL) {
@@ -1403,9 +1818,9 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
              * becomes too long *before* executing zzlInsert. */
             zobj->ptr = zzlInsert(zobj->ptr,ele,score);
             if (zzlLength(zobj->ptr) > server.zset_max_ziplist_entries)
-                zsetConvert(zobj,OBJ_ENCODING_SKIPLIST);
+                zsetConvert(zobj,zsetLargeEncoding());
             if (sdslen(ele) > server.zset_max_ziplist_value)
-                zsetConvert(zobj,OBJ_ENCODING_SKIPLIST);
+                zsetConvert(zobj,zsetLargeEncoding());
             if (newscore) *newscore = score;
             *flags |= ZADD_ADDED;
             return 1;
@@ -1418,7 +1833,7 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
         zskiplistNode *znode;
         dictEntry *de;
 
-        de = dictFind(zs->dict,ele);
+        de = zsetDictFind(zs->dict,ele);
         if (de != NULL) {
             /* NX? Return, same element already exists. */
             if (nx) {
@@ -1450,7 +1865,53 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
         } else if (!xx) {
             ele = sdsdup(ele);
             znode = zslInsert(zs->zsl,score,ele);
-            serverAssert(dictAdd(zs->dict,ele,&znode->score) == DICT_OK);
+            de = zsetDictAddRaw(zs->dict,ele,NULL);
+            serverAssert(de != NULL);
+            dictSetVal(zs->dict,de,&znode->score);
+            *flags |= ZADD_ADDED;
+            if (newscore) *newscore = score;
+            return 1;
+        } else {
+            *flags |= ZADD_NOP;
+            return 1;
+        }
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        zset *zs = zobj->ptr;
+        dictEntry *de;
+
+        de = zsetDictFind(zs->dict,ele);
+        if (de != NULL) {
+            /* NX? Return, same element already exists. */
+            if (nx) {
+                *flags |= ZADD_NOP;
+                return 1;
+            }
+            curscore = dictGetDoubleVal(de);
+
+            /* Prepare the score for the increment if needed. */
+            if (incr) {
+                score += curscore;
+                if (isnan(score)) {
+                    *flags |= ZADD_NAN;
+                    return 0;
+                }
+                if (newscore) *newscore = score;
+            }
+
+            /* The dict stores the score by value, update both sides. */
+            // 字典中保存的是分值本身，两边都要更新
+            if (score != curscore) {
+                zbtUpdateScore(zs->zbt,curscore,dictGetKey(de),score);
+                dictSetDoubleVal(de,score);
+                *flags |= ZADD_UPDATED;
+            }
+            return 1;
+        } else if (!xx) {
+            ele = sdsdup(ele);
+            zbtInsert(zs->zbt,score,ele);
+            de = zsetDictAddRaw(zs->dict,ele,NULL);
+            serverAssert(de != NULL);
+            dictSetDoubleVal(de,score);
             *flags |= ZADD_ADDED;
             if (newscore) *newscore = score;
             return 1;
@@ -1467,7 +1928,7 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
 /* Delete the element 'ele' from the sorted set, returning 1 if the element
  * existed and was deleted, 0 otherwise (the element was not there). */
 int zsetDel(robj *zobj, sds ele) {
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *eptr;
 
         if ((eptr = zzlFind(zobj->ptr,ele,NULL)) != NULL) {
@@ -1479,7 +1940,7 @@ int zsetDel(robj *zobj, sds ele) {
         dictEntry *de;
         double score;
 
-        de = dictUnlink(zs->dict,ele);
+        de = zsetDictUnlink(zs->dict,ele);
         if (de != NULL) {
             /* Get the score in order to delete from the skiplist later. */
             score = *(double*)dictGetVal(de);
@@ -1495,6 +1956,22 @@ int zsetDel(robj *zobj, sds ele) {
             int retval = zslDelete(zs->zsl,score,ele,NULL);
             serverAssert(retval);
 
+            if (htNeedsResize(zs->dict)) dictResize(zs->dict);
+            return 1;
+        }
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        zset *zs = zobj->ptr;
+        dictEntry *de;
+        double score;
+
+        de = zsetDictUnlink(zs->dict,ele);
+        if (de != NULL) {
+            /* Same order as above: the B+tree owns the SDS string. */
+            score = dictGetDoubleVal(de);
+            dictFreeUnlinkedEntry(zs->dict,de);
+            int retval = zbtDelete(zs->zbt,score,ele,NULL);
+            serverAssert(retval);
+
             if (htNeedsResize(zs->dict)) dictResize(zs->dict);
             return 1;
         }
@@ -1521,18 +1998,18 @@ long zsetRank(robj *zobj, sds ele, int reverse) {
 
     llen = zsetLength(zobj);
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
 
-        eptr = ziplistIndex(zl,0);
+        eptr = lpSeek(zl,0);
         serverAssert(eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
 
         rank = 1;
         while(eptr != NULL) {
-            if (ziplistCompare(eptr,(unsigned char*)ele,sdslen(ele)))
+            if (lpCompare(eptr,(unsigned char*)ele,sdslen(ele)))
                 break;
             rank++;
             zzlNext(zl,&eptr,&sptr);
@@ -1552,7 +2029,7 @@ long zsetRank(robj *zobj, sds ele, int reverse) {
         dictEntry *de;
         double score;
 
-        de = dictFind(zs->dict,ele);
+        de = zsetDictFind(zs->dict,ele);
         if (de != NULL) {
             score = *(double*)dictGetVal(de);
             rank = zslGetRank(zsl,score,ele);
@@ -1565,6 +2042,21 @@ long zsetRank(robj *zobj, sds ele, int reverse) {
         } else {
             return -1;
         }
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        zset *zs = zobj->ptr;
+        dictEntry *de;
+
+        de = zsetDictFind(zs->dict,ele);
+        if (de != NULL) {
+            rank = zbtGetRank(zs->zbt,dictGetDoubleVal(de),ele);
+            serverAssert(rank != 0);
+            if (reverse)
+                return llen-rank;
+            else
+                return rank-1;
+        } else {
+            return -1;
+        }
     } else {
         serverPanic("Unknown sorted set encoding");
     }
@@ -1648,7 +2140,8 @@ void zaddGenericCommand(client *c, int flags) {
         if (server.zset_max_ziplist_entries == 0 ||
             server.zset_max_ziplist_value < sdslen(c->argv[scoreidx+1]->ptr))
         {
-            zobj = createZsetObject();
+            zobj = server.zset_btree_encoding ? createZsetBtreeObject() :
+                                                createZsetObject();
         } else {
             zobj = createZsetZiplistObject();
         }
@@ -1783,7 +2276,7 @@ void zremrangeGenericCommand(client *c, int rangetype) {
     }
 
     /* Step 3: Perform the range deletion operation. */
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         switch(rangetype) {
         case ZRANGE_RANK:
             zobj->ptr = zzlDeleteRangeByRank(zobj->ptr,start+1,end+1,&deleted);
@@ -1817,6 +2310,25 @@ void zremrangeGenericCommand(client *c, int rangetype) {
             dbDelete(c->db,key);
             keyremoved = 1;
         }
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        zset *zs = zobj->ptr;
+        switch(rangetype) {
+        case ZRANGE_RANK:
+            deleted = zbtDeleteRangeByRank(zs->zbt,start+1,end+1,
+                                           zbtDictDeleteCallback,zs->dict);
+            break;
+        case ZRANGE_SCORE:
+            deleted = zbtDeleteRangeByScore(zs->zbt,&range,zs->dict);
+            break;
+        case ZRANGE_LEX:
+            deleted = zbtDeleteRangeByLex(zs->zbt,&lexrange,zs->dict);
+            break;
+        }
+        if (htNeedsResize(zs->dict)) dictResize(zs->dict);
+        if (dictSize(zs->dict) == 0) {
+            dbDelete(c->db,key);
+            keyremoved = 1;
+        }
     } else {
         serverPanic("Unknown sorted set encoding");
     }
@@ -1878,6 +2390,11 @@ typedef struct {
                 zset *zs;
                 zskiplistNode *node;
             } sl;
+            struct {
+                zset *zs;
+                zbtCursor cur;
+                int valid;
+            } bt;
         } zset;
     } iter;
 } zsetopsrc;
@@ -1925,16 +2442,19 @@ void zuiInitIterator(zsetopsrc *op) {
         }
     } else if (op->type == OBJ_ZSET) {
         iterzset *it = &op->iter.zset;
-        if (op->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (op->encoding == OBJ_ENCODING_LISTPACK) {
             it->zl.zl = op->subject->ptr;
-            it->zl.eptr = ziplistIndex(it->zl.zl,0);
+            it->zl.eptr = lpSeek(it->zl.zl,0);
             if (it->zl.eptr != NULL) {
-                it->zl.sptr = ziplistNext(it->zl.zl,it->zl.eptr);
+                it->zl.sptr = lpNext(it->zl.zl,it->zl.eptr);
                 serverAssert(it->zl.sptr != NULL);
             }
         } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
             it->sl.zs = op->subject->ptr;
             it->sl.node = it->sl.zs->zsl->header->level[0].forward;
+        } else if (op->encoding == OBJ_ENCODING_BTREE) {
+            it->bt.zs = op->subject->ptr;
+            it->bt.valid = zbtFirst(it->bt.zs->zbt,&it->bt.cur);
         } else {
             serverPanic("Unknown sorted set encoding");
         }
@@ -1958,9 +2478,11 @@ void zuiClearIterator(zsetopsrc *op) {
         }
     } else if (op->type == OBJ_ZSET) {
         iterzset *it = &op->iter.zset;
-        if (op->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (op->encoding == OBJ_ENCODING_LISTPACK) {
             UNUSED(it); /* skip */
-        } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
+        } else if (op->encoding == OBJ_ENCODING_SKIPLIST ||
+                   op->encoding == OBJ_ENCODING_BTREE)
+        {
             UNUSED(it); /* skip */
         } else {
             serverPanic("Unknown sorted set encoding");
@@ -1984,11 +2506,14 @@ unsigned long zuiLength(zsetopsrc *op) {
             serverPanic("Unknown set encoding");
         }
     } else if (op->type == OBJ_ZSET) {
-        if (op->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (op->encoding == OBJ_ENCODING_LISTPACK) {
             return zzlLength(op->subject->ptr);
         } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
             zset *zs = op->subject->ptr;
             return zs->zsl->length;
+        } else if (op->encoding == OBJ_ENCODING_BTREE) {
+            zset *zs = op->subject->ptr;
+            return zs->zbt->length;
         } else {
             serverPanic("Unknown sorted set encoding");
         }
@@ -2034,11 +2559,11 @@ int zuiNext(zsetopsrc *op, zsetopval *val) {
         }
     } else if (op->type == OBJ_ZSET) {
         iterzset *it = &op->iter.zset;
-        if (op->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (op->encoding == OBJ_ENCODING_LISTPACK) {
             /* No need to check both, but better be explicit. */
             if (it->zl.eptr == NULL || it->zl.sptr == NULL)
                 return 0;
-            serverAssert(ziplistGet(it->zl.eptr,&val->estr,&val->elen,&val->ell));
+            serverAssert(lpGetValue(it->zl.eptr,&val->estr,&val->elen,&val->ell));
             val->score = zzlGetScore(it->zl.sptr);
 
             /* Move to next element. */
@@ -2051,6 +2576,14 @@ int zuiNext(zsetopsrc *op, zsetopval *val) {
 
             /* Move to next element. */
             it->sl.node = it->sl.node->level[0].forward;
+        } else if (op->encoding == OBJ_ENCODING_BTREE) {
+            if (!it->bt.valid)
+                return 0;
+            val->ele = zbtCursorEle(&it->bt.cur);
+            val->score = zbtCursorScore(&it->bt.cur);
+
+            /* Move to next element. */
+            it->bt.valid = zbtNext(&it->bt.cur);
         } else {
             serverPanic("Unknown sorted set encoding");
         }
@@ -2152,7 +2685,7 @@ int zuiFind(zsetopsrc *op, zsetopval *val, double *score) {
     } else if (op->type == OBJ_ZSET) {
         zuiSdsFromValue(val);
 
-        if (op->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (op->encoding == OBJ_ENCODING_LISTPACK) {
             if (zzlFind(op->subject->ptr,val->ele,score) != NULL) {
                 /* Score is already set by zzlFind. */
                 return 1;
@@ -2162,12 +2695,21 @@ int zuiFind(zsetopsrc *op, zsetopval *val, double *score) {
         } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
             zset *zs = op->subject->ptr;
             dictEntry *de;
-            if ((de = dictFind(zs->dict,val->ele)) != NULL) {
+            if ((de = zsetDictFind(zs->dict,val->ele)) != NULL) {
                 *score = *(double*)dictGetVal(de);
                 return 1;
             } else {
                 return 0;
             }
+        } else if (op->encoding == OBJ_ENCODING_BTREE) {
+            zset *zs = op->subject->ptr;
+            dictEntry *de;
+            if ((de = zsetDictFind(zs->dict,val->ele)) != NULL) {
+                *score = dictGetDoubleVal(de);
+                return 1;
+            } else {
+                return 0;
+            }
         } else {
             serverPanic("Unknown sorted set encoding");
         }
@@ -2176,6 +2718,53 @@ int zuiFind(zsetopsrc *op, zsetopval *val, double *score) {
     }
 }
 
+/* Like zuiFind() for the 'count' values in 'vals' having alive[j] set:
+ * on return value[j] is the score of vals[j] in 'op', or alive[j] is set
+ * to zero if vals[j] is not there. Sources backed by a hash table are
+ * looked up with a single dictFindBatch(). */
+void zuiFindBatch(zsetopsrc *op, zsetopval *vals, int count, int *alive,
+                  double *value)
+{
+    const void *keys[DICT_FIND_BATCH];
+    dictEntry *des[DICT_FIND_BATCH];
+    int idx[DICT_FIND_BATCH];
+    dict *d = NULL;
+    int j, n = 0;
+
+    serverAssert(count <= DICT_FIND_BATCH);
+    if (op->subject != NULL) {
+        if (op->type == OBJ_SET && op->encoding == OBJ_ENCODING_HT)
+            d = op->subject->ptr;
+        else if (op->type == OBJ_ZSET && (op->encoding == OBJ_ENCODING_SKIPLIST ||
+                 op->encoding == OBJ_ENCODING_BTREE))
+            d = ((zset*)op->subject->ptr)->dict;
+    }
+
+    // 不是哈希表实现的，逐个查找
+    if (d == NULL) {
+        for (j = 0; j < count; j++)
+            if (alive[j] && !zuiFind(op,&vals[j],&value[j])) alive[j] = 0;
+        return;
+    }
+
+    for (j = 0; j < count; j++) {
+        if (!alive[j]) continue;
+        keys[n] = zuiSdsFromValue(&vals[j]);
+        idx[n++] = j;
+    }
+    dictFindBatch(d,keys,des,n);
+    for (j = 0; j < n; j++) {
+        if (des[j] == NULL)
+            alive[idx[j]] = 0;
+        else if (op->type == OBJ_SET)
+            value[idx[j]] = 1.0;
+        else if (op->encoding == OBJ_ENCODING_BTREE)
+            value[idx[j]] = dictGetDoubleVal(des[j]);
+        else
+            value[idx[j]] = *(double*)dictGetVal(des[j]);
+    }
+}
+
 int zuiCompareByCardinality(const void *s1, const void *s2) {
     unsigned long first = zuiLength((zsetopsrc*)s1);
     unsigned long second = zuiLength((zsetopsrc*)s2);
@@ -2206,51 +2795,147 @@ inline static void zunionInterAggregate(double *target, double val, int aggregat
     }
 }
 
-uint64_t dictSdsHash(const void *key);
-int dictSdsKeyCompare(void *privdata, const void *key1, const void *key2);
+/* An element of the result of ZUNION/ZINTER, see zunionInterGenericCommand().
+ * The element is either borrowed from the input 'src' it was read from, or
+ * a copy owned by the entry when 'owned' is set. */
+// 并集/交集计算过程中的一个结果元素，元素可以借用输入集合中的 sds
+typedef struct zsetopentry {
+    sds ele;
+    double score;
+    int src;
+    int owned;
+} zsetopentry;
+
+/* Fill 'e' with the element of 'val' read from the input 'src': elements
+ * stored as sds inside the input are borrowed, the others are taken from
+ * 'val' or created. */
+static void zuiEntryFromValue(zsetopentry *e, zsetopval *val, int src) {
+    if (val->ele != NULL && !(val->flags & OPVAL_DIRTY_SDS)) {
+        e->ele = val->ele;
+        e->owned = 0;
+    } else {
+        e->ele = zuiNewSdsFromValue(val);
+        e->owned = 1;
+    }
+    e->src = src;
+}
 
-dictType setAccumulatorDictType = {
-    dictSdsHash,               /* hash function */
-    NULL,                      /* key dup */
-    NULL,                      /* val dup */
-    dictSdsKeyCompare,         /* key compare */
-    NULL,                      /* key destructor */
-    NULL                       /* val destructor */
-};
+/* Order by element, and for the same element by input, so that scores are
+ * aggregated in the order of the inputs. */
+static int zuiEntryCompareByEle(const void *a, const void *b) {
+    const zsetopentry *x = a, *y = b;
+    int cmp = sdscmp(x->ele,y->ele);
 
-void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
-    int i, j;
-    long setnum;
-    int aggregate = REDIS_AGGR_SUM;
-    zsetopsrc *src;
-    zsetopval zval;
-    sds tmp;
-    size_t maxelelen = 0;
-    robj *dstobj;
-    zset *dstzset;
-    zskiplistNode *znode;
-    int touched = 0;
+    if (cmp != 0) return cmp;
+    return x->src - y->src;
+}
 
-    /* expect setnum input keys to be given */
-    if ((getLongFromObjectOrReply(c, c->argv[2], &setnum, NULL) != C_OK))
-        return;
+/* Order by score and then element, that is the order of a sorted set. */
+static int zuiEntryCompareByScore(const void *a, const void *b) {
+    const zsetopentry *x = a, *y = b;
 
-    if (setnum < 1) {
-        addReplyError(c,
-            "at least 1 input key is needed for ZUNIONSTORE/ZINTERSTORE");
-        return;
-    }
+    if (x->score < y->score) return -1;
+    if (x->score > y->score) return 1;
+    return sdscmp(x->ele,y->ele);
+}
 
-    /* test if the expected number of keys would overflow */
-    if (setnum > c->argc-3) {
-        addReply(c,shared.syntaxerr);
-        return;
+/* Create a sorted set from 'count' entries already in sorted set order and
+ * owning their elements, which are moved into the new object. The result
+ * is built directly in the compact encoding when it fits, otherwise the
+ * entries are appended in order to the large encoding, with a bulk load
+ * for the skiplist. */
+// 由已经排好序的元素直接构建有序集合，小的结果直接生成 listpack，不再先建跳表再转换
+robj *zsetCreateFromSortedEntries(zsetopentry *entries, size_t count, size_t maxelelen) {
+    robj *zobj;
+    zset *zs;
+    dictEntry *de;
+    size_t j;
+
+    if (count <= server.zset_max_ziplist_entries &&
+        maxelelen <= server.zset_max_ziplist_value)
+    {
+        unsigned char *zl;
+
+        zobj = createZsetZiplistObject();
+        zl = zobj->ptr;
+        for (j = 0; j < count; j++) {
+            zl = zzlInsertAt(zl,NULL,entries[j].ele,entries[j].score);
+            sdsfree(entries[j].ele);
+        }
+        zobj->ptr = zl;
+    } else if (server.zset_btree_encoding) {
+        zobj = createZsetBtreeObject();
+        zs = zobj->ptr;
+        dictExpand(zs->dict,count);
+        for (j = 0; j < count; j++) {
+            zbtInsert(zs->zbt,entries[j].score,entries[j].ele);
+            de = zsetDictAddRaw(zs->dict,entries[j].ele,NULL);
+            serverAssert(de != NULL);
+            dictSetDoubleVal(de,entries[j].score);
+        }
+    } else {
+        zskiplistNode *znode;
+        zslBulkBuilder bulk;
+
+        zobj = createZsetObject();
+        zs = zobj->ptr;
+        dictExpand(zs->dict,count);
+        zslBulkInit(&bulk,zs->zsl,0);
+        for (j = 0; j < count; j++) {
+            znode = zslBulkAdd(&bulk,entries[j].score,entries[j].ele);
+            de = zsetDictAddRaw(zs->dict,entries[j].ele,NULL);
+            serverAssert(de != NULL);
+            dictSetVal(zs->dict,de,&znode->score);
+        }
+        zslBulkFinish(&bulk);
+    }
+    return zobj;
+}
+
+/* Implementation of ZUNIONSTORE/ZINTERSTORE when 'dstkey' is given, and of
+ * ZUNION/ZINTER, which reply with the result instead, when it is NULL.
+ * 'numkeysIndex' is the argument holding the number of input keys.
+ *
+ * The result is collected in a flat array of entries instead of a
+ * temporary dict and skiplist: the union sorts the elements of all the
+ * inputs by member and merges the runs of the same member, the
+ * intersection streams the smallest input checking it against the others.
+ * The elements are only copied once they are part of the stored result. */
+// 结果保存在数组中：并集按成员排序后合并相同成员，交集遍历最小的集合；最后按分值排序，一次性构建目标集合
+void zunionInterGenericCommand(client *c, robj *dstkey, int numkeysIndex, int op) {
+    int i, j;
+    long setnum;
+    int aggregate = REDIS_AGGR_SUM;
+    int withscores = 0;
+    zsetopsrc *src;
+    zsetopval zval;
+    zsetopentry *entries;
+    size_t count = 0, maxelelen = 0, total = 0, k;
+    robj *dstobj;
+    int touched = 0;
+
+    /* expect setnum input keys to be given */
+    if ((getLongFromObjectOrReply(c, c->argv[numkeysIndex], &setnum, NULL) != C_OK))
+        return;
+
+    if (setnum < 1) {
+        addReplyErrorFormat(c,
+            "at least 1 input key is needed for %s",
+            dstkey ? "ZUNIONSTORE/ZINTERSTORE" : "ZUNION/ZINTER");
+        return;
+    }
+
+    /* test if the expected number of keys would overflow */
+    if (setnum > c->argc-(numkeysIndex+1)) {
+        addReply(c,shared.syntaxerr);
+        return;
     }
 
     /* read keys to be used for input */
     src = zcalloc(sizeof(zsetopsrc) * setnum);
-    for (i = 0, j = 3; i < setnum; i++, j++) {
-        robj *obj = lookupKeyWrite(c->db,c->argv[j]);
+    for (i = 0, j = numkeysIndex+1; i < setnum; i++, j++) {
+        robj *obj = dstkey ? lookupKeyWrite(c->db,c->argv[j]) :
+                             lookupKeyRead(c->db,c->argv[j]);
         if (obj != NULL) {
             if (obj->type != OBJ_ZSET && obj->type != OBJ_SET) {
                 zfree(src);
@@ -2302,6 +2987,11 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
                     return;
                 }
                 j++; remaining--;
+            } else if (dstkey == NULL &&
+                       !strcasecmp(c->argv[j]->ptr,"withscores"))
+            {
+                j++; remaining--;
+                withscores = 1;
             } else {
                 zfree(src);
                 addReply(c,shared.syntaxerr);
@@ -2314,118 +3004,140 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
      * algorithm's performance */
     qsort(src,setnum,sizeof(zsetopsrc),zuiCompareByCardinality);
 
-    dstobj = createZsetObject();
-    dstzset = dstobj->ptr;
+    /* The result can't be larger than the smallest input for the
+     * intersection, or than all the inputs together for the union. */
+    if (op == SET_OP_INTER) {
+        total = zuiLength(&src[0]);
+    } else if (op == SET_OP_UNION) {
+        for (i = 0; i < setnum; i++) total += zuiLength(&src[i]);
+    } else {
+        serverPanic("Unknown operator");
+    }
+    entries = zmalloc(sizeof(zsetopentry) * (total ? total : 1));
     memset(&zval, 0, sizeof(zval));
 
     if (op == SET_OP_INTER) {
         /* Skip everything if the smallest input is empty. */
-        if (zuiLength(&src[0]) > 0) {
+        if (total > 0) {
+            /* The elements of the smallest input are checked against the
+             * other inputs DICT_FIND_BATCH at a time, so that the lookups
+             * into hash tables can overlap their cache misses. */
+            zsetopval zvals[DICT_FIND_BATCH];
+            double scores[DICT_FIND_BATCH], values[DICT_FIND_BATCH];
+            int alive[DICT_FIND_BATCH], n, b;
+
+            memset(zvals, 0, sizeof(zvals));
+
             /* Precondition: as src[0] is non-empty and the inputs are ordered
              * by size, all src[i > 0] are non-empty too. */
             zuiInitIterator(&src[0]);
-            while (zuiNext(&src[0],&zval)) {
-                double score, value;
-
-                score = src[0].weight * zval.score;
-                if (isnan(score)) score = 0;
+            while (1) {
+                for (n = 0; n < DICT_FIND_BATCH; n++)
+                    if (!zuiNext(&src[0],&zvals[n])) break;
+                if (n == 0) break;
+
+                for (b = 0; b < n; b++) {
+                    scores[b] = src[0].weight * zvals[b].score;
+                    if (isnan(scores[b])) scores[b] = 0;
+                    alive[b] = 1;
+                }
 
                 for (j = 1; j < setnum; j++) {
                     /* It is not safe to access the zset we are
                      * iterating, so explicitly check for equal object. */
                     if (src[j].subject == src[0].subject) {
-                        value = zval.score*src[j].weight;
-                        zunionInterAggregate(&score,value,aggregate);
-                    } else if (zuiFind(&src[j],&zval,&value)) {
-                        value *= src[j].weight;
-                        zunionInterAggregate(&score,value,aggregate);
+                        for (b = 0; b < n; b++) values[b] = zvals[b].score;
                     } else {
-                        break;
+                        zuiFindBatch(&src[j],zvals,n,alive,values);
+                    }
+                    for (b = 0; b < n; b++) {
+                        if (!alive[b]) continue;
+                        zunionInterAggregate(&scores[b],
+                            values[b]*src[j].weight,aggregate);
                     }
                 }
 
                 /* Only continue when present in every input. */
-                if (j == setnum) {
-                    tmp = zuiNewSdsFromValue(&zval);
-                    znode = zslInsert(dstzset->zsl,score,tmp);
-                    dictAdd(dstzset->dict,tmp,&znode->score);
-                    if (sdslen(tmp) > maxelelen) maxelelen = sdslen(tmp);
+                for (b = 0; b < n; b++) {
+                    if (!alive[b]) continue;
+                    zuiEntryFromValue(&entries[count],&zvals[b],0);
+                    entries[count].score = scores[b];
+                    count++;
                 }
+                if (n < DICT_FIND_BATCH) break;
             }
+            for (b = 0; b < DICT_FIND_BATCH; b++)
+                if (zvals[b].flags & OPVAL_DIRTY_SDS) sdsfree(zvals[b].ele);
             zuiClearIterator(&src[0]);
         }
-    } else if (op == SET_OP_UNION) {
-        dict *accumulator = dictCreate(&setAccumulatorDictType,NULL);
-        dictIterator *di;
-        dictEntry *de, *existing;
-        double score;
-
-        if (setnum) {
-            /* Our union is at least as large as the largest set.
-             * Resize the dictionary ASAP to avoid useless rehashing. */
-            dictExpand(accumulator,zuiLength(&src[setnum-1]));
-        }
+    } else {
+        size_t run;
 
-        /* Step 1: Create a dictionary of elements -> aggregated-scores
-         * by iterating one sorted set after the other. */
+        /* Step 1: collect the elements of all the inputs with their
+         * weighted scores. */
         for (i = 0; i < setnum; i++) {
             if (zuiLength(&src[i]) == 0) continue;
 
             zuiInitIterator(&src[i]);
             while (zuiNext(&src[i],&zval)) {
-                /* Initialize value */
-                score = src[i].weight * zval.score;
-                if (isnan(score)) score = 0;
-
-                /* Search for this element in the accumulating dictionary. */
-                de = dictAddRaw(accumulator,zuiSdsFromValue(&zval),&existing);
-                /* If we don't have it, we need to create a new entry. */
-                if (!existing) {
-                    tmp = zuiNewSdsFromValue(&zval);
-                    /* Remember the longest single element encountered,
-                     * to understand if it's possible to convert to ziplist
-                     * at the end. */
-                     if (sdslen(tmp) > maxelelen) maxelelen = sdslen(tmp);
-                    /* Update the element with its initial score. */
-                    dictSetKey(accumulator, de, tmp);
-                    dictSetDoubleVal(de,score);
-                } else {
-                    /* Update the score with the score of the new instance
-                     * of the element found in the current sorted set.
-                     *
-                     * Here we access directly the dictEntry double
-                     * value inside the union as it is a big speedup
-                     * compared to using the getDouble/setDouble API. */
-                    zunionInterAggregate(&existing->v.d,score,aggregate);
-                }
+                zuiEntryFromValue(&entries[count],&zval,i);
+                entries[count].score = src[i].weight * zval.score;
+                if (isnan(entries[count].score)) entries[count].score = 0;
+                count++;
             }
             zuiClearIterator(&src[i]);
         }
+        if (zval.flags & OPVAL_DIRTY_SDS) sdsfree(zval.ele);
+
+        /* Step 2: sort by member and merge every run of the same member
+         * into its first entry. */
+        qsort(entries,count,sizeof(zsetopentry),zuiEntryCompareByEle);
+        for (run = 0, k = 0; run < count; k++) {
+            size_t next = run+1;
+
+            entries[k] = entries[run];
+            while (next < count && sdscmp(entries[next].ele,entries[k].ele) == 0) {
+                zunionInterAggregate(&entries[k].score,entries[next].score,
+                                     aggregate);
+                if (entries[next].owned) sdsfree(entries[next].ele);
+                next++;
+            }
+            run = next;
+        }
+        count = k;
+    }
 
-        /* Step 2: convert the dictionary into the final sorted set. */
-        di = dictGetIterator(accumulator);
+    /* Put the result in sorted set order. */
+    qsort(entries,count,sizeof(zsetopentry),zuiEntryCompareByScore);
 
-        /* We now are aware of the final size of the resulting sorted set,
-         * let's resize the dictionary embedded inside the sorted set to the
-         * right size, in order to save rehashing time. */
-        dictExpand(dstzset->dict,dictSize(accumulator));
+    if (dstkey == NULL) {
+        addReplyMultiBulkLen(c, count * (withscores ? 2 : 1));
+        for (k = 0; k < count; k++) {
+            addReplyBulkCBuffer(c,entries[k].ele,sdslen(entries[k].ele));
+            if (withscores) addReplyDouble(c,entries[k].score);
+            if (entries[k].owned) sdsfree(entries[k].ele);
+        }
+        zfree(entries);
+        zfree(src);
+        return;
+    }
 
-        while((de = dictNext(di)) != NULL) {
-            sds ele = dictGetKey(de);
-            score = dictGetDoubleVal(de);
-            znode = zslInsert(dstzset->zsl,score,ele);
-            dictAdd(dstzset->dict,ele,&znode->score);
+    /* The destination may be one of the inputs: take a copy of the borrowed
+     * elements before it gets deleted. */
+    for (k = 0; k < count; k++) {
+        if (!entries[k].owned) {
+            entries[k].ele = sdsdup(entries[k].ele);
+            entries[k].owned = 1;
         }
-        dictReleaseIterator(di);
-        dictRelease(accumulator);
-    } else {
-        serverPanic("Unknown operator");
+        if (sdslen(entries[k].ele) > maxelelen)
+            maxelelen = sdslen(entries[k].ele);
     }
+    dstobj = count ? zsetCreateFromSortedEntries(entries,count,maxelelen) : NULL;
+    zfree(entries);
 
     if (dbDelete(c->db,dstkey))
         touched = 1;
-    if (dstzset->zsl->length) {
-        zsetConvertToZiplistIfNeeded(dstobj,maxelelen);
+    if (dstobj) {
         dbAdd(c->db,dstkey,dstobj);
         addReplyLongLong(c,zsetLength(dstobj));
         signalModifiedKey(c->db,dstkey);
@@ -2434,7 +3146,6 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
             dstkey,c->db->id);
         server.dirty++;
     } else {
-        decrRefCount(dstobj);
         addReply(c,shared.czero);
         if (touched) {
             signalModifiedKey(c->db,dstkey);
@@ -2446,11 +3157,21 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
 }
 
 void zunionstoreCommand(client *c) {
-    zunionInterGenericCommand(c,c->argv[1], SET_OP_UNION);
+    zunionInterGenericCommand(c,c->argv[1],2,SET_OP_UNION);
 }
 
 void zinterstoreCommand(client *c) {
-    zunionInterGenericCommand(c,c->argv[1], SET_OP_INTER);
+    zunionInterGenericCommand(c,c->argv[1],2,SET_OP_INTER);
+}
+
+/* ZUNION numkeys key [key ...] [WEIGHTS ...] [AGGREGATE ...] [WITHSCORES] */
+void zunionCommand(client *c) {
+    zunionInterGenericCommand(c,NULL,1,SET_OP_UNION);
+}
+
+/* ZINTER numkeys key [key ...] [WEIGHTS ...] [AGGREGATE ...] [WITHSCORES] */
+void zinterCommand(client *c) {
+    zunionInterGenericCommand(c,NULL,1,SET_OP_INTER);
 }
 
 void zrangeGenericCommand(client *c, int reverse) {
@@ -2493,7 +3214,7 @@ void zrangeGenericCommand(client *c, int reverse) {
     /* Return the result in form of a multi-bulk reply */
     addReplyMultiBulkLen(c, withscores ? (rangelen*2) : rangelen);
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
@@ -2501,16 +3222,16 @@ void zrangeGenericCommand(client *c, int reverse) {
         long long vlong;
 
         if (reverse)
-            eptr = ziplistIndex(zl,-2-(2*start));
+            eptr = lpSeek(zl,-2-(2*start));
         else
-            eptr = ziplistIndex(zl,2*start);
+            eptr = lpSeek(zl,2*start);
 
         serverAssertWithInfo(c,zobj,eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
 
         while (rangelen--) {
             serverAssertWithInfo(c,zobj,eptr != NULL && sptr != NULL);
-            serverAssertWithInfo(c,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
+            serverAssertWithInfo(c,zobj,lpGetValue(eptr,&vstr,&vlen,&vlong));
             if (vstr == NULL)
                 addReplyBulkLongLong(c,vlong);
             else
@@ -2550,6 +3271,22 @@ void zrangeGenericCommand(client *c, int reverse) {
                 addReplyDouble(c,ln->score);
             ln = reverse ? ln->backward : ln->level[0].forward;
         }
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        zset *zs = zobj->ptr;
+        zbtCursor cur;
+        sds ele;
+        int valid;
+
+        // 按排名定位一次，之后沿着叶子链表移动
+        valid = zbtGetElementByRank(zs->zbt,reverse ? llen-start : start+1,&cur);
+        while(rangelen--) {
+            serverAssertWithInfo(c,zobj,valid);
+            ele = zbtCursorEle(&cur);
+            addReplyBulkCBuffer(c,ele,sdslen(ele));
+            if (withscores)
+                addReplyDouble(c,zbtCursorScore(&cur));
+            valid = reverse ? zbtPrev(&cur) : zbtNext(&cur);
+        }
     } else {
         serverPanic("Unknown sorted set encoding");
     }
@@ -2563,15 +3300,183 @@ void zrevrangeCommand(client *c) {
     zrangeGenericCommand(c,1);
 }
 
+/*-----------------------------------------------------------------------------
+ * Paginated ranges
+ *----------------------------------------------------------------------------*/
+
+/* ZRANGEBYSCORE and ZRANGEBYLEX, with their REV variants, accept a CURSOR
+ * option to iterate a range one page at a time, LIMIT count elements per
+ * page (ZRANGE_CURSOR_DEFAULT_COUNT without LIMIT):
+ *
+ *   ZRANGEBYSCORE key min max CURSOR 0 LIMIT 0 100
+ *   ZRANGEBYSCORE key min max CURSOR <cursor returned before> LIMIT 0 100
+ *
+ * The reply is then, like SCAN, the cursor of the next page followed by the
+ * elements, and the cursor is "0" once the range is over. The cursor is the
+ * last (score,member) pair returned, so every page starts with a single
+ * O(log(N)) seek instead of walking an offset that grows with the pages,
+ * and elements added or removed meanwhile don't make pages skip or repeat
+ * elements. Its format, "<score>:<member>", is not part of the API. */
+// 带 CURSOR选项时分页返回范围中的元素，游标为上一页最后的 (score,member)
+
+#define ZRANGE_CURSOR_DEFAULT_COUNT 10
+
+/* Parse the cursor object. "0" starts a new iteration and leaves
+ * cursor->ele set to NULL, otherwise the member is a new sds string that
+ * the caller must free. */
+static int zrangeParseCursor(robj *o, zrangeCursor *cursor) {
+    char *s = o->ptr, *eptr;
+
+    cursor->score = 0;
+    cursor->ele = NULL;
+    if (!strcmp(s,"0")) return C_OK;
+    errno = 0;
+    cursor->score = strtod(s,&eptr);
+    if (eptr == s || *eptr != ':' || errno == ERANGE || isnan(cursor->score))
+        return C_ERR;
+    eptr++;
+    cursor->ele = sdsnewlen(eptr,sdslen(s)-(eptr-s));
+    return C_OK;
+}
+
+/* All the elements of a lex range have the same score, so resuming a lex
+ * range is just making it exclusive at the cursor member, if the member is
+ * past the bound the range starts from: the usual zslFirstInLexRange() and
+ * friends are then the seek. The range takes the ownership of the member. */
+// 字典序范围中分值都相同，用游标中的元素收紧范围的起点即可
+static void zrangeResumeLexRange(zlexrangespec *range, zrangeCursor *cursor, int reverse) {
+    sds *bound = reverse ? &range->max : &range->min;
+    int *ex = reverse ? &range->maxex : &range->minex;
+
+    if (reverse ? !zslLexValueLteMax(cursor->ele,range) :
+                  !zslLexValueGteMin(cursor->ele,range)) return;
+    if (*bound != shared.minstring && *bound != shared.maxstring)
+        sdsfree(*bound);
+    *bound = cursor->ele;
+    *ex = 1;
+    cursor->ele = NULL;
+}
+
+/* The reply of a range command. Without a cursor the elements are sent as
+ * soon as they are found, with a deferred length. In CURSOR mode they are
+ * kept until the end, since the next cursor, sent first, is the last one. */
+// 范围查询的回复，分页模式下先缓存本页元素，最后一起回复
+typedef struct {
+    client *c;
+    int withscores;
+    int paged;              /* CURSOR option given. */
+    void *replylen;         /* Deferred length without a cursor. */
+    unsigned long len;      /* Number of elements. */
+    unsigned long size;     /* Allocated slots of 'eles' and 'scores'. */
+    sds *eles;
+    double *scores;
+} zrangeReply;
+
+static void zrangeReplyInit(zrangeReply *r, client *c, int withscores, int paged) {
+    r->c = c;
+    r->withscores = withscores;
+    r->paged = paged;
+    r->replylen = NULL;
+    r->len = r->size = 0;
+    r->eles = NULL;
+    r->scores = NULL;
+}
+
+/* Reply to a range with no elements in it. */
+static void zrangeReplyEmpty(zrangeReply *r) {
+    if (r->paged) {
+        addReplyMultiBulkLen(r->c,2);
+        addReplyBulkCBuffer(r->c,"0",1);
+    }
+    addReply(r->c,shared.emptymultibulk);
+}
+
+static void zrangeReplyStart(zrangeReply *r) {
+    /* We don't know in advance how many matching elements there are in the
+     * list, so we push this object that will represent the multi-bulk
+     * length in the output buffer, and will "fix" it later */
+    if (!r->paged) r->replylen = addDeferredMultiBulkLength(r->c);
+}
+
+static void zrangeReplyAdd(zrangeReply *r, sds ele, double score) {
+    if (r->paged) {
+        if (r->len == r->size) {
+            r->size = r->size ? r->size*2 : 16;
+            r->eles = zrealloc(r->eles,sizeof(sds)*r->size);
+            r->scores = zrealloc(r->scores,sizeof(double)*r->size);
+        }
+        r->eles[r->len] = sdsdup(ele);
+        r->scores[r->len] = score;
+    } else {
+        addReplyBulkCBuffer(r->c,ele,sdslen(ele));
+        if (r->withscores) addReplyDouble(r->c,score);
+    }
+    r->len++;
+}
+
+/* Add a listpack entry to the reply, converting it to a string only when
+ * it has to be kept for the page. */
+static void zrangeReplyAddEntry(zrangeReply *r, unsigned char *eptr, double score) {
+    unsigned char *vstr;
+    unsigned int vlen;
+    long long vlong;
+
+    /* We know the element exists, so lpGetValue should always succeed */
+    serverAssert(lpGetValue(eptr,&vstr,&vlen,&vlong));
+    if (r->paged) {
+        sds ele = vstr ? sdsnewlen(vstr,vlen) : sdsfromlonglong(vlong);
+        zrangeReplyAdd(r,ele,score);
+        sdsfree(ele);
+        return;
+    }
+    if (vstr == NULL) {
+        addReplyBulkLongLong(r->c,vlong);
+    } else {
+        addReplyBulkCBuffer(r->c,vstr,vlen);
+    }
+    if (r->withscores) addReplyDouble(r->c,score);
+    r->len++;
+}
+
+/* Send the reply. 'more' tells if elements of the range are left after the
+ * last one added, so that the next cursor is the last element, or "0". */
+static void zrangeReplyEnd(zrangeReply *r, int more) {
+    client *c = r->c;
+    unsigned long j;
+
+    if (!r->paged) {
+        setDeferredMultiBulkLength(c,r->replylen,
+            r->withscores ? r->len*2 : r->len);
+        return;
+    }
+
+    addReplyMultiBulkLen(c,2);
+    if (more && r->len) {
+        sds cursor = sdscatprintf(sdsempty(),"%.17g:",r->scores[r->len-1]);
+        cursor = sdscatsds(cursor,r->eles[r->len-1]);
+        addReplyBulkSds(c,cursor);
+    } else {
+        addReplyBulkCBuffer(c,"0",1);
+    }
+    addReplyMultiBulkLen(c,r->withscores ? r->len*2 : r->len);
+    for (j = 0; j < r->len; j++) {
+        addReplyBulkCBuffer(c,r->eles[j],sdslen(r->eles[j]));
+        if (r->withscores) addReplyDouble(c,r->scores[j]);
+        sdsfree(r->eles[j]);
+    }
+    zfree(r->eles);
+    zfree(r->scores);
+}
+
 /* This command implements ZRANGEBYSCORE, ZREVRANGEBYSCORE. */
 void genericZrangebyscoreCommand(client *c, int reverse) {
     zrangespec range;
     robj *key = c->argv[1];
     robj *zobj;
     long offset = 0, limit = -1;
-    int withscores = 0;
-    unsigned long rangelen = 0;
-    void *replylen = NULL;
+    int withscores = 0, paged = 0, haslimit = 0, more = 0;
+    zrangeCursor cursor = {0, NULL};
+    zrangeReply reply;
     int minidx, maxidx;
 
     /* Parse the range arguments. */
@@ -2604,26 +3509,44 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
                     (getLongFromObjectOrReply(c, c->argv[pos+2], &limit, NULL)
                         != C_OK))
                 {
-                    return;
+                    goto cleanup;
                 }
+                haslimit = 1;
                 pos += 3; remaining -= 3;
+            } else if (remaining >= 2 && !paged &&
+                       !strcasecmp(c->argv[pos]->ptr,"cursor"))
+            {
+                if (zrangeParseCursor(c->argv[pos+1],&cursor) != C_OK) {
+                    addReplyError(c,"invalid cursor");
+                    goto cleanup;
+                }
+                paged = 1;
+                pos += 2; remaining -= 2;
             } else {
                 addReply(c,shared.syntaxerr);
-                return;
+                goto cleanup;
             }
         }
     }
 
+    if (paged && !haslimit) {
+        limit = ZRANGE_CURSOR_DEFAULT_COUNT;
+    } else if (paged && limit == 0) {
+        addReplyError(c,"LIMIT count can't be zero with CURSOR");
+        goto cleanup;
+    }
+
     /* Ok, lookup the key and get the range */
-    if ((zobj = lookupKeyReadOrReply(c,key,shared.emptymultibulk)) == NULL ||
-        checkType(c,zobj,OBJ_ZSET)) return;
+    zrangeReplyInit(&reply,c,withscores,paged);
+    if ((zobj = lookupKeyRead(c->db,key)) == NULL) {
+        zrangeReplyEmpty(&reply);
+        goto cleanup;
+    }
+    if (checkType(c,zobj,OBJ_ZSET)) goto cleanup;
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
-        unsigned char *vstr;
-        unsigned int vlen;
-        long long vlong;
         double score;
 
         /* If reversed, get the last node in range as starting point. */
@@ -2633,20 +3556,37 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
             eptr = zzlFirstInRange(zl,&range);
         }
 
+        /* Skip what the previous pages returned: listpacks are small, so
+         * walking from the start of the range is fine. */
+        while (eptr && cursor.ele) {
+            sptr = lpNext(zl,eptr);
+            score = zzlGetScore(sptr);
+            if (score != cursor.score) {
+                if (reverse ? score < cursor.score : score > cursor.score)
+                    break;
+            } else {
+                int cmp = zzlCompareElements(eptr,(unsigned char*)cursor.ele,
+                                             sdslen(cursor.ele));
+                if (reverse ? cmp < 0 : cmp > 0) break;
+            }
+            if (reverse) {
+                zzlPrev(zl,&eptr,&sptr);
+            } else {
+                zzlNext(zl,&eptr,&sptr);
+            }
+        }
+
         /* No "first" element in the specified interval. */
         if (eptr == NULL) {
-            addReply(c, shared.emptymultibulk);
-            return;
+            zrangeReplyEmpty(&reply);
+            goto cleanup;
         }
 
         /* Get score pointer for the first element. */
         serverAssertWithInfo(c,zobj,eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
 
-        /* We don't know in advance how many matching elements there are in the
-         * list, so we push this object that will represent the multi-bulk
-         * length in the output buffer, and will "fix" it later */
-        replylen = addDeferredMultiBulkLength(c);
+        zrangeReplyStart(&reply);
 
         /* If there is an offset, just traverse the number of elements without
          * checking the score because that is done in the next loop. */
@@ -2668,19 +3608,7 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
                 if (!zslValueLteMax(score,&range)) break;
             }
 
-            /* We know the element exists, so ziplistGet should always succeed */
-            serverAssertWithInfo(c,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
-
-            rangelen++;
-            if (vstr == NULL) {
-                addReplyBulkLongLong(c,vlong);
-            } else {
-                addReplyBulkCBuffer(c,vstr,vlen);
-            }
-
-            if (withscores) {
-                addReplyDouble(c,score);
-            }
+            zrangeReplyAddEntry(&reply,eptr,score);
 
             /* Move to next node */
             if (reverse) {
@@ -2689,6 +3617,12 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
                 zzlNext(zl,&eptr,&sptr);
             }
         }
+
+        if (eptr) {
+            score = zzlGetScore(sptr);
+            more = reverse ? zslValueGteMin(score,&range) :
+                             zslValueLteMax(score,&range);
+        }
     } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
         zset *zs = zobj->ptr;
         zskiplist *zsl = zs->zsl;
@@ -2701,26 +3635,26 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
             ln = zslFirstInRange(zsl,&range);
         }
 
+        /* Resume after the cursor, unless it is before the range. */
+        if (ln && cursor.ele) {
+            zskiplistNode *next = zslSeekAfter(zsl,cursor.score,cursor.ele,reverse);
+
+            if (next == NULL ||
+                (reverse ? zslValueLteMax(next->score,&range) :
+                           zslValueGteMin(next->score,&range))) ln = next;
+        }
+
         /* No "first" element in the specified interval. */
         if (ln == NULL) {
-            addReply(c, shared.emptymultibulk);
-            return;
+            zrangeReplyEmpty(&reply);
+            goto cleanup;
         }
 
-        /* We don't know in advance how many matching elements there are in the
-         * list, so we push this object that will represent the multi-bulk
-         * length in the output buffer, and will "fix" it later */
-        replylen = addDeferredMultiBulkLength(c);
+        zrangeReplyStart(&reply);
 
-        /* If there is an offset, just traverse the number of elements without
+        /* If there is an offset, jump over the skipped elements without
          * checking the score because that is done in the next loop. */
-        while (ln && offset--) {
-            if (reverse) {
-                ln = ln->backward;
-            } else {
-                ln = ln->level[0].forward;
-            }
-        }
+        ln = zslSkip(zsl,ln,offset,reverse);
 
         while (ln && limit--) {
             /* Abort when the node is no longer in range. */
@@ -2730,12 +3664,7 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
                 if (!zslValueLteMax(ln->score,&range)) break;
             }
 
-            rangelen++;
-            addReplyBulkCBuffer(c,ln->ele,sdslen(ln->ele));
-
-            if (withscores) {
-                addReplyDouble(c,ln->score);
-            }
+            zrangeReplyAdd(&reply,ln->ele,ln->score);
 
             /* Move to next node */
             if (reverse) {
@@ -2744,15 +3673,66 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
                 ln = ln->level[0].forward;
             }
         }
+
+        if (ln) more = reverse ? zslValueGteMin(ln->score,&range) :
+                                 zslValueLteMax(ln->score,&range);
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        zset *zs = zobj->ptr;
+        zbtCursor cur, next;
+        int valid;
+
+        if (reverse) {
+            valid = zbtLastInRange(zs->zbt,&range,&cur);
+        } else {
+            valid = zbtFirstInRange(zs->zbt,&range,&cur);
+        }
+
+        /* Resume after the cursor, unless it is before the range. */
+        if (valid && cursor.ele) {
+            if (!zbtSeekAfter(zs->zbt,&cursor,reverse,&next)) {
+                valid = 0;
+            } else if (reverse ? zslValueLteMax(zbtCursorScore(&next),&range) :
+                                 zslValueGteMin(zbtCursorScore(&next),&range))
+            {
+                cur = next;
+            }
+        }
+
+        /* No "first" element in the specified interval. */
+        if (!valid) {
+            zrangeReplyEmpty(&reply);
+            goto cleanup;
+        }
+
+        zrangeReplyStart(&reply);
+
+        valid = zbtSkip(zs->zbt,&cur,offset,reverse);
+
+        while (valid && limit--) {
+            double score = zbtCursorScore(&cur);
+
+            /* Abort when the entry is no longer in range. */
+            if (reverse) {
+                if (!zslValueGteMin(score,&range)) break;
+            } else {
+                if (!zslValueLteMax(score,&range)) break;
+            }
+
+            zrangeReplyAdd(&reply,zbtCursorEle(&cur),score);
+            valid = reverse ? zbtPrev(&cur) : zbtNext(&cur);
+        }
+
+        if (valid) more = reverse ?
+            zslValueGteMin(zbtCursorScore(&cur),&range) :
+            zslValueLteMax(zbtCursorScore(&cur),&range);
     } else {
         serverPanic("Unknown sorted set encoding");
     }
 
-    if (withscores) {
-        rangelen *= 2;
-    }
+    zrangeReplyEnd(&reply,more);
 
-    setDeferredMultiBulkLength(c, replylen, rangelen);
+cleanup:
+    sdsfree(cursor.ele);
 }
 
 void zrangebyscoreCommand(client *c) {
@@ -2779,7 +3759,7 @@ void zcountCommand(client *c) {
     if ((zobj = lookupKeyReadOrReply(c, key, shared.czero)) == NULL ||
         checkType(c, zobj, OBJ_ZSET)) return;
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         double score;
@@ -2794,7 +3774,7 @@ void zcountCommand(client *c) {
         }
 
         /* First element is in range */
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         score = zzlGetScore(sptr);
         serverAssertWithInfo(c,zobj,zslValueLteMax(score,&range));
 
@@ -2833,6 +3813,21 @@ void zcountCommand(client *c) {
                 count -= (zsl->length - rank);
             }
         }
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        zset *zs = zobj->ptr;
+        zbtCursor first, last;
+
+        /* The count is the distance between the ranks of the first and
+         * the last element in range. */
+        if (zbtFirstInRange(zs->zbt,&range,&first) &&
+            zbtLastInRange(zs->zbt,&range,&last))
+        {
+            unsigned long start, end;
+
+            start = zbtGetRank(zs->zbt,zbtCursorScore(&first),zbtCursorEle(&first));
+            end = zbtGetRank(zs->zbt,zbtCursorScore(&last),zbtCursorEle(&last));
+            if (end >= start) count = end-start+1;
+        }
     } else {
         serverPanic("Unknown sorted set encoding");
     }
@@ -2860,7 +3855,7 @@ void zlexcountCommand(client *c) {
         return;
     }
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
 
@@ -2875,7 +3870,7 @@ void zlexcountCommand(client *c) {
         }
 
         /* First element is in range */
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssertWithInfo(c,zobj,zzlLexValueLteMax(eptr,&range));
 
         /* Iterate over elements in range */
@@ -2911,6 +3906,21 @@ void zlexcountCommand(client *c) {
                 count -= (zsl->length - rank);
             }
         }
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        zset *zs = zobj->ptr;
+        zbtCursor first, last;
+
+        /* The count is the distance between the ranks of the first and
+         * the last element in range. */
+        if (zbtFirstInLexRange(zs->zbt,&range,&first) &&
+            zbtLastInLexRange(zs->zbt,&range,&last))
+        {
+            unsigned long start, end;
+
+            start = zbtGetRank(zs->zbt,zbtCursorScore(&first),zbtCursorEle(&first));
+            end = zbtGetRank(zs->zbt,zbtCursorScore(&last),zbtCursorEle(&last));
+            if (end >= start) count = end-start+1;
+        }
     } else {
         serverPanic("Unknown sorted set encoding");
     }
@@ -2925,8 +3935,9 @@ void genericZrangebylexCommand(client *c, int reverse) {
     robj *key = c->argv[1];
     robj *zobj;
     long offset = 0, limit = -1;
-    unsigned long rangelen = 0;
-    void *replylen = NULL;
+    int paged = 0, haslimit = 0, more = 0;
+    zrangeCursor cursor = {0, NULL};
+    zrangeReply reply;
     int minidx, maxidx;
 
     /* Parse the range arguments. */
@@ -2952,30 +3963,45 @@ void genericZrangebylexCommand(client *c, int reverse) {
         while (remaining) {
             if (remaining >= 3 && !strcasecmp(c->argv[pos]->ptr,"limit")) {
                 if ((getLongFromObjectOrReply(c, c->argv[pos+1], &offset, NULL) != C_OK) ||
-                    (getLongFromObjectOrReply(c, c->argv[pos+2], &limit, NULL) != C_OK)) return;
+                    (getLongFromObjectOrReply(c, c->argv[pos+2], &limit, NULL) != C_OK)) goto cleanup;
+                haslimit = 1;
                 pos += 3; remaining -= 3;
+            } else if (remaining >= 2 && !paged &&
+                       !strcasecmp(c->argv[pos]->ptr,"cursor"))
+            {
+                if (zrangeParseCursor(c->argv[pos+1],&cursor) != C_OK) {
+                    addReplyError(c,"invalid cursor");
+                    goto cleanup;
+                }
+                paged = 1;
+                pos += 2; remaining -= 2;
             } else {
-                zslFreeLexRange(&range);
                 addReply(c,shared.syntaxerr);
-                return;
+                goto cleanup;
             }
         }
     }
 
+    if (paged && !haslimit) {
+        limit = ZRANGE_CURSOR_DEFAULT_COUNT;
+    } else if (paged && limit == 0) {
+        addReplyError(c,"LIMIT count can't be zero with CURSOR");
+        goto cleanup;
+    }
+
     /* Ok, lookup the key and get the range */
-    if ((zobj = lookupKeyReadOrReply(c,key,shared.emptymultibulk)) == NULL ||
-        checkType(c,zobj,OBJ_ZSET))
-    {
-        zslFreeLexRange(&range);
-        return;
+    zrangeReplyInit(&reply,c,0,paged);
+    if ((zobj = lookupKeyRead(c->db,key)) == NULL) {
+        zrangeReplyEmpty(&reply);
+        goto cleanup;
     }
+    if (checkType(c,zobj,OBJ_ZSET)) goto cleanup;
+
+    if (cursor.ele) zrangeResumeLexRange(&range,&cursor,reverse);
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
-        unsigned char *vstr;
-        unsigned int vlen;
-        long long vlong;
 
         /* If reversed, get the last node in range as starting point. */
         if (reverse) {
@@ -2986,19 +4012,15 @@ void genericZrangebylexCommand(client *c, int reverse) {
 
         /* No "first" element in the specified interval. */
         if (eptr == NULL) {
-            addReply(c, shared.emptymultibulk);
-            zslFreeLexRange(&range);
-            return;
+            zrangeReplyEmpty(&reply);
+            goto cleanup;
         }
 
         /* Get score pointer for the first element. */
         serverAssertWithInfo(c,zobj,eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
 
-        /* We don't know in advance how many matching elements there are in the
-         * list, so we push this object that will represent the multi-bulk
-         * length in the output buffer, and will "fix" it later */
-        replylen = addDeferredMultiBulkLength(c);
+        zrangeReplyStart(&reply);
 
         /* If there is an offset, just traverse the number of elements without
          * checking the score because that is done in the next loop. */
@@ -3018,16 +4040,8 @@ void genericZrangebylexCommand(client *c, int reverse) {
                 if (!zzlLexValueLteMax(eptr,&range)) break;
             }
 
-            /* We know the element exists, so ziplistGet should always
-             * succeed. */
-            serverAssertWithInfo(c,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
-
-            rangelen++;
-            if (vstr == NULL) {
-                addReplyBulkLongLong(c,vlong);
-            } else {
-                addReplyBulkCBuffer(c,vstr,vlen);
-            }
+            /* The score is only needed by the cursor. */
+            zrangeReplyAddEntry(&reply,eptr,paged ? zzlGetScore(sptr) : 0);
 
             /* Move to next node */
             if (reverse) {
@@ -3036,6 +4050,9 @@ void genericZrangebylexCommand(client *c, int reverse) {
                 zzlNext(zl,&eptr,&sptr);
             }
         }
+
+        if (eptr) more = reverse ? zzlLexValueGteMin(eptr,&range) :
+                                   zzlLexValueLteMax(eptr,&range);
     } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
         zset *zs = zobj->ptr;
         zskiplist *zsl = zs->zsl;
@@ -3050,25 +4067,15 @@ void genericZrangebylexCommand(client *c, int reverse) {
 
         /* No "first" element in the specified interval. */
         if (ln == NULL) {
-            addReply(c, shared.emptymultibulk);
-            zslFreeLexRange(&range);
-            return;
+            zrangeReplyEmpty(&reply);
+            goto cleanup;
         }
 
-        /* We don't know in advance how many matching elements there are in the
-         * list, so we push this object that will represent the multi-bulk
-         * length in the output buffer, and will "fix" it later */
-        replylen = addDeferredMultiBulkLength(c);
+        zrangeReplyStart(&reply);
 
-        /* If there is an offset, just traverse the number of elements without
+        /* If there is an offset, jump over the skipped elements without
          * checking the score because that is done in the next loop. */
-        while (ln && offset--) {
-            if (reverse) {
-                ln = ln->backward;
-            } else {
-                ln = ln->level[0].forward;
-            }
-        }
+        ln = zslSkip(zsl,ln,offset,reverse);
 
         while (ln && limit--) {
             /* Abort when the node is no longer in range. */
@@ -3078,8 +4085,7 @@ void genericZrangebylexCommand(client *c, int reverse) {
                 if (!zslLexValueLteMax(ln->ele,&range)) break;
             }
 
-            rangelen++;
-            addReplyBulkCBuffer(c,ln->ele,sdslen(ln->ele));
+            zrangeReplyAdd(&reply,ln->ele,ln->score);
 
             /* Move to next node */
             if (reverse) {
@@ -3088,12 +4094,56 @@ void genericZrangebylexCommand(client *c, int reverse) {
                 ln = ln->level[0].forward;
             }
         }
+
+        if (ln) more = reverse ? zslLexValueGteMin(ln->ele,&range) :
+                                 zslLexValueLteMax(ln->ele,&range);
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        zset *zs = zobj->ptr;
+        zbtCursor cur;
+        int valid;
+
+        if (reverse) {
+            valid = zbtLastInLexRange(zs->zbt,&range,&cur);
+        } else {
+            valid = zbtFirstInLexRange(zs->zbt,&range,&cur);
+        }
+
+        /* No "first" element in the specified interval. */
+        if (!valid) {
+            zrangeReplyEmpty(&reply);
+            goto cleanup;
+        }
+
+        zrangeReplyStart(&reply);
+
+        valid = zbtSkip(zs->zbt,&cur,offset,reverse);
+
+        while (valid && limit--) {
+            sds ele = zbtCursorEle(&cur);
+
+            /* Abort when the entry is no longer in range. */
+            if (reverse) {
+                if (!zslLexValueGteMin(ele,&range)) break;
+            } else {
+                if (!zslLexValueLteMax(ele,&range)) break;
+            }
+
+            zrangeReplyAdd(&reply,ele,zbtCursorScore(&cur));
+            valid = reverse ? zbtPrev(&cur) : zbtNext(&cur);
+        }
+
+        if (valid) more = reverse ?
+            zslLexValueGteMin(zbtCursorEle(&cur),&range) :
+            zslLexValueLteMax(zbtCursorEle(&cur),&range);
     } else {
         serverPanic("Unknown sorted set encoding");
     }
 
+    zrangeReplyEnd(&reply,more);
+
+cleanup:
     zslFreeLexRange(&range);
-    setDeferredMultiBulkLength(c, replylen, rangelen);
+    sdsfree(cursor.ele);
 }
 
 void zrangebylexCommand(client *c) {
@@ -3213,7 +4263,7 @@ void genericZpopCommand(client *c, robj **keyv, int keyc, int where, int emitkey
 
     /* Remove the element. */
     do {
-        if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
             unsigned char *zl = zobj->ptr;
             unsigned char *eptr, *sptr;
             unsigned char *vstr;
@@ -3221,16 +4271,16 @@ void genericZpopCommand(client *c, robj **keyv, int keyc, int where, int emitkey
             long long vlong;
 
             /* Get the first or last element in the sorted set. */
-            eptr = ziplistIndex(zl,where == ZSET_MAX ? -2 : 0);
+            eptr = lpSeek(zl,where == ZSET_MAX ? -2 : 0);
             serverAssertWithInfo(c,zobj,eptr != NULL);
-            serverAssertWithInfo(c,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
+            serverAssertWithInfo(c,zobj,lpGetValue(eptr,&vstr,&vlen,&vlong));
             if (vstr == NULL)
                 ele = sdsfromlonglong(vlong);
             else
                 ele = sdsnewlen(vstr,vlen);
 
             /* Get the score. */
-            sptr = ziplistNext(zl,eptr);
+            sptr = lpNext(zl,eptr);
             serverAssertWithInfo(c,zobj,sptr != NULL);
             score = zzlGetScore(sptr);
         } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
@@ -3246,6 +4296,19 @@ void genericZpopCommand(client *c, robj **keyv, int keyc, int where, int emitkey
             serverAssertWithInfo(c,zobj,zln != NULL);
             ele = sdsdup(zln->ele);
             score = zln->score;
+        } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+            zset *zs = zobj->ptr;
+            zbtCursor cur;
+            int valid;
+
+            /* Get the first or last element in the sorted set. */
+            valid = (where == ZSET_MAX ? zbtLast(zs->zbt,&cur) :
+                                         zbtFirst(zs->zbt,&cur));
+
+            /* There must be an element in the sorted set. */
+            serverAssertWithInfo(c,zobj,valid);
+            ele = sdsdup(zbtCursorEle(&cur));
+            score = zbtCursorScore(&cur);
         } else {
             serverPanic("Unknown sorted set encoding");
         }
@@ -3344,3 +4407,103 @@ void bzpopminCommand(client *c) {
 void bzpopmaxCommand(client *c) {
     blockingGenericZpopCommand(c,ZSET_MAX);
 }
+
+#ifdef REDIS_TEST
+#include <assert.h>
+
+/* Check the links, spans and backward pointers of 'zsl', whose elements are
+ * "e%08d" strings at rank their number plus one. */
+static void zslTestVerify(zskiplist *zsl) {
+    zskiplistNode *x, *prev = NULL;
+    unsigned long rank = 0;
+    int i;
+
+    for (x = zsl->header->level[0].forward; x; x = x->level[0].forward) {
+        assert(x->backward == prev);
+        assert((unsigned long)atol(x->ele+1)+1 == ++rank);
+        prev = x;
+    }
+    assert(rank == zsl->length && zsl->tail == prev);
+    for (i = 0; i < zsl->level; i++) {
+        rank = 0;
+        x = zsl->header;
+        while (x->level[i].forward) {
+            rank += x->level[i].span;
+            x = x->level[i].forward;
+            assert((unsigned long)atol(x->ele+1)+1 == rank);
+        }
+        assert(x->level[i].span == zsl->length-rank);
+    }
+    for (; i < ZSKIPLIST_MAXLEVEL; i++)
+        assert(zsl->header->level[i].forward == NULL);
+}
+
+int zslTest(int argc, char *argv[]) {
+    long long start, elapsed[2];
+    zslBulkBuilder b;
+    zskiplist *zsl;
+    long n, j, k;
+    int t, reverse;
+
+    UNUSED(argc);
+    UNUSED(argv);
+    srand(1234);
+
+    /* Both directions, with runs of equal scores, then regular updates
+     * on the result. */
+    printf("Bulk loading from both directions: ");
+    for (t = 0; t < 200; t++) {
+        n = t < 100 ? t : rand() % 5000;
+        for (reverse = 0; reverse < 2; reverse++) {
+            zsl = zslCreate();
+            zslBulkInit(&b,zsl,reverse);
+            for (k = 0; k < n; k++) {
+                j = reverse ? n-1-k : k;
+                zslBulkAdd(&b,(double)(j/3),sdscatprintf(sdsempty(),"e%08ld",j));
+            }
+            zslBulkFinish(&b);
+            zslTestVerify(zsl);
+            for (k = 0; k < n; k++) {
+                sds ele = sdscatprintf(sdsempty(),"e%08ld",k);
+                assert(zslGetRank(zsl,(double)(k/3),ele) == (unsigned long)k+1);
+                sdsfree(ele);
+            }
+
+            /* Delete the greatest elements and add them back. */
+            for (k = n-1; k >= 0 && k >= n-50; k--) {
+                sds ele = sdscatprintf(sdsempty(),"e%08ld",k);
+                zskiplistNode *node;
+
+                assert(zslDelete(zsl,(double)(k/3),ele,&node));
+                zslFreeNode(node);
+                sdsfree(ele);
+            }
+            for (k++; k < n; k++)
+                zslInsert(zsl,(double)(k/3),sdscatprintf(sdsempty(),"e%08ld",k));
+            zslTestVerify(zsl);
+            zslFree(zsl);
+        }
+    }
+    printf("OK\n");
+
+    n = 1000000;
+    for (t = 0; t < 2; t++) {
+        zsl = zslCreate();
+        start = ustime();
+        if (t) {
+            for (j = 0; j < n; j++)
+                zslInsert(zsl,(double)j,sdsfromlonglong(j));
+        } else {
+            zslBulkInit(&b,zsl,0);
+            for (j = 0; j < n; j++)
+                zslBulkAdd(&b,(double)j,sdsfromlonglong(j));
+            zslBulkFinish(&b);
+        }
+        elapsed[t] = ustime()-start;
+        zslFree(zsl);
+    }
+    printf("Load %ld sorted elements: zslBulkAdd() %lld usec, "
+           "zslInsert() %lld usec\n", n, elapsed[0], elapsed[1]);
+    return 0;
+}
+#endif
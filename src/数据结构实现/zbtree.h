@@ -0,0 +1,85 @@
+/* zbtree.h - Order statistic B+tree used by the btree sorted set encoding,
+ * see zbtree.c for the details. */
+
+#ifndef __ZBTREE_H
+#define __ZBTREE_H
+
+#include <stddef.h>
+#include "sds.h"
+
+/* Maximum number of entries in a leaf / children of an inner node. Nodes
+ * have room for one more so that an insert can overflow before the split. */
+// 每个叶子节点最多保存的元素个数，也是内部节点最多的孩子个数
+#define ZBT_NODE_MAX 64
+// 低于这个数量时尝试和相邻的节点合并
+#define ZBT_NODE_MIN (ZBT_NODE_MAX/4)
+#define ZBT_MAX_HEIGHT 16
+
+typedef struct zbtNode {
+    unsigned short leaf;    /* 1 for leaves, 0 for inner nodes. */
+    unsigned short n;       /* Entries (leaf) or children (inner node). */
+    /* Leaf: the (score, ele) entries in order, the leaf owns the sds.
+     * Inner: scores/eles[i] is a private copy of a key greater than every
+     * entry under child i-1 and less or equal than every entry under
+     * child i. Slot 0 is unused. */
+    // 叶子节点保存元素，内部节点保存分隔键的拷贝，下标 0不使用
+    double scores[ZBT_NODE_MAX+1];
+    sds eles[ZBT_NODE_MAX+1];
+    union {
+        struct {
+            struct zbtNode *prev, *next;
+        } l;
+        struct {
+            // 每个子树中的元素个数，用来按排名查找
+            unsigned long counts[ZBT_NODE_MAX+1];
+            struct zbtNode *children[ZBT_NODE_MAX+1];
+        } i;
+    } u;
+} zbtNode;
+
+typedef struct zbtree {
+    zbtNode *root;
+    zbtNode *head, *tail;   /* First and last leaf. */
+    unsigned long length;
+    int height;             /* 0 when empty, 1 when the root is a leaf. */
+    size_t bytes;           /* Memory used by the nodes. */
+    size_t ele_bytes;       /* sdsOwnedAllocSize() of the elements. */
+} zbtree;
+
+/* A position inside the tree: entry 'pos' of the leaf 'leaf'. */
+// 游标，指向某个叶子节点中的第 pos个元素
+typedef struct zbtCursor {
+    zbtNode *leaf;
+    int pos;
+} zbtCursor;
+
+#define zbtCursorScore(c) ((c)->leaf->scores[(c)->pos])
+#define zbtCursorEle(c) ((c)->leaf->eles[(c)->pos])
+
+/* A monotone predicate on the entries: true for a (possibly empty) prefix
+ * of the entries in order, and false for all the rest. */
+// 单调的谓词，对前面一段元素返回真，之后的都返回假
+typedef int zbtPredicate(double score, sds ele, void *privdata);
+typedef void zbtEleCallback(sds ele, void *privdata);
+
+zbtree *zbtCreate(void);
+void zbtFree(zbtree *zbt);
+size_t zbtTotalBytes(void);
+void zbtInsert(zbtree *zbt, double score, sds ele);
+int zbtDelete(zbtree *zbt, double score, sds ele, sds *deleted);
+void zbtUpdateScore(zbtree *zbt, double curscore, sds ele, double newscore);
+unsigned long zbtGetRank(zbtree *zbt, double score, sds ele);
+int zbtGetElementByRank(zbtree *zbt, unsigned long rank, zbtCursor *c);
+int zbtSeekFirstNot(zbtree *zbt, zbtPredicate *before, void *privdata, zbtCursor *c);
+int zbtSeekLast(zbtree *zbt, zbtPredicate *upto, void *privdata, zbtCursor *c);
+int zbtFirst(zbtree *zbt, zbtCursor *c);
+int zbtLast(zbtree *zbt, zbtCursor *c);
+int zbtNext(zbtCursor *c);
+int zbtPrev(zbtCursor *c);
+unsigned long zbtDeleteRangeByRank(zbtree *zbt, unsigned long start, unsigned long end, zbtEleCallback *cb, void *privdata);
+
+#ifdef REDIS_TEST
+int zbtreeTest(int argc, char *argv[]);
+#endif
+
+#endif /* __ZBTREE_H */